@@ -0,0 +1,554 @@
+/***********************************************************************
+*
+* acct.c
+*
+* Per-session traffic accounting for pppoe-server.  Every interval, the
+* counters of all interfaces are fetched from the kernel with a single
+* netlink dump (not a query per session) and credited to the sessions
+* that own the ppp interfaces.  The result is written to a stats file,
+* and sessions whose peer has gone quiet are stopped.
+*
+* Copyright (C) 2001-2012 Roaring Penguin Software Inc.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+* LIC: GPL
+*
+***********************************************************************/
+
+#include "config.h"
+
+#ifdef __linux__
+
+#include <sys/socket.h>
+#include <net/if.h>
+#include "pppoe-server.h"
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/if_addr.h>
+
+#ifndef HAVE_LICENSE
+#define realpeerip peerip
+#endif
+
+/* Receive buffer for netlink dumps */
+#define NL_BUFSIZE 65536
+
+/* Keys for the per-poll lookup table.  Sessions whose ppp unit number
+   is known are found by unit; others by the peer's address. */
+#define KEY_UNIT(u) ((((uint64_t) 1) << 32) | (uint32_t) (u))
+#define KEY_PEER(a) ((((uint64_t) 2) << 32) | (uint32_t) (a))
+
+static unsigned int AcctInterval = 0;
+static char *AcctFile = NULL;
+static unsigned int IdleTimeout = 0;
+static int NlSock = -1;
+static unsigned int NlSeq = 0;
+
+/* Idle reaper: a timing wheel with one slot per poll.  A session sits in
+   the slot of the poll at which it would have been idle for IdleTimeout;
+   traffic does not move it, it is simply re-filed when its slot comes up. */
+static ClientSession **IdleWheel = NULL;
+static unsigned int IdleWheelSize = 0;
+static unsigned int IdleTick = 0;
+
+/* Built afresh by each poll */
+static hash_oa_table ByKey;	/* KEY_UNIT/KEY_PEER -> session */
+static hash_oa_table ByIfindex;	/* ifindex -> session */
+
+static void acctPoll(EventSelector *es, int fd, unsigned int flags,
+		     void *data);
+
+/**********************************************************************
+*%FUNCTION: acctInit
+*%ARGUMENTS:
+* arg -- "secs:fname" from the -A option
+*%RETURNS:
+* 0 if OK, -1 if arg is malformed
+*%DESCRIPTION:
+* Records the accounting interval and stats file
+***********************************************************************/
+int
+acctInit(char const *arg)
+{
+    char *colon;
+    long secs = strtol(arg, &colon, 10);
+
+    if (colon == arg || *colon != ':' || !colon[1] || secs < 1) {
+	return -1;
+    }
+    AcctInterval = (unsigned int) secs;
+    AcctFile = strdup(colon+1);
+    if (!AcctFile) return -1;
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: acctSetIdleTimeout
+*%ARGUMENTS:
+* arg -- seconds, from the -E option
+*%RETURNS:
+* 0 if OK, -1 if arg is malformed
+*%DESCRIPTION:
+* Enables stopping of sessions that receive nothing for arg seconds
+***********************************************************************/
+int
+acctSetIdleTimeout(char const *arg)
+{
+    char *end;
+    long secs = strtol(arg, &end, 10);
+
+    if (end == arg || *end || secs < 1) return -1;
+    IdleTimeout = (unsigned int) secs;
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: acctStart
+*%ARGUMENTS:
+* es -- event selector
+*%RETURNS:
+* Nothing; exits on error
+*%DESCRIPTION:
+* Opens the netlink socket and schedules the first poll, if accounting
+* or the idle reaper was enabled
+***********************************************************************/
+void
+acctStart(EventSelector *es)
+{
+    struct sockaddr_nl sa;
+    struct timeval t;
+
+    if (!AcctFile && !IdleTimeout) return;
+    if (!AcctInterval) AcctInterval = DEFAULT_ACCT_INTERVAL;
+
+    if (IdleTimeout) {
+	/* Every deadline must fall within one turn of the wheel */
+	IdleWheelSize = (IdleTimeout + AcctInterval - 1) / AcctInterval + 2;
+	IdleWheel = calloc(IdleWheelSize, sizeof(ClientSession *));
+	if (!IdleWheel) {
+	    rp_fatal("Cannot allocate memory for idle timer wheel");
+	}
+    }
+
+    NlSock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (NlSock < 0) {
+	fatalSys("socket(AF_NETLINK)");
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    if (bind(NlSock, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+	fatalSys("bind(AF_NETLINK)");
+    }
+
+    t.tv_sec = AcctInterval;
+    t.tv_usec = 0;
+    if (!Event_AddTimerHandler(es, t, acctPoll, NULL)) {
+	rp_fatal("Unable to schedule session accounting");
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: nlDump
+*%ARGUMENTS:
+* req -- request, starting with a struct nlmsghdr
+* len -- length of request
+* func -- called for each message in the reply
+*%RETURNS:
+* 0 if OK, -1 on error
+*%DESCRIPTION:
+* Sends a dump request to the kernel and feeds every reply to func
+***********************************************************************/
+static int
+nlDump(struct nlmsghdr *req, size_t len, void (*func)(struct nlmsghdr *))
+{
+    static char buf[NL_BUFSIZE];
+    struct nlmsghdr *nh;
+    int n;
+
+    req->nlmsg_len = len;
+    req->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req->nlmsg_seq = ++NlSeq;
+    req->nlmsg_pid = 0;
+    if (send(NlSock, req, len, 0) < 0) return -1;
+
+    for (;;) {
+	n = recv(NlSock, buf, sizeof(buf), 0);
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    return -1;
+	}
+	for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, n);
+	     nh = NLMSG_NEXT(nh, n)) {
+	    /* Leftovers from an earlier, abandoned dump */
+	    if (nh->nlmsg_seq != NlSeq) continue;
+	    if (nh->nlmsg_type == NLMSG_DONE) return 0;
+	    if (nh->nlmsg_type == NLMSG_ERROR) {
+		struct nlmsgerr *err = NLMSG_DATA(nh);
+		errno = -err->error;
+		return -1;
+	    }
+	    func(nh);
+	}
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: gotAddr
+*%ARGUMENTS:
+* nh -- RTM_NEWADDR message
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Maps the interface of a point-to-point address to the session that
+* owns it: by unit number if the interface is pppN, else by peer address
+***********************************************************************/
+static void
+gotAddr(struct nlmsghdr *nh)
+{
+    struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+    struct rtattr *rta = IFA_RTA(ifa);
+    int len = IFA_PAYLOAD(nh);
+    uint32_t local = 0, peer = 0;
+    char const *label = NULL;
+    ClientSession *ses = NULL;
+    int unit;
+
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+	switch(rta->rta_type) {
+	case IFA_LOCAL:
+	    memcpy(&local, RTA_DATA(rta), sizeof(local));
+	    break;
+	case IFA_ADDRESS:
+	    memcpy(&peer, RTA_DATA(rta), sizeof(peer));
+	    break;
+	case IFA_LABEL:
+	    label = RTA_DATA(rta);
+	    break;
+	}
+    }
+    if (!local || !peer || local == peer) return;
+
+    if (label && sscanf(label, "ppp%d", &unit) == 1) {
+	ses = hash_oa_find(&ByKey, KEY_UNIT(unit));
+    }
+    if (!ses) {
+	ses = hash_oa_find(&ByKey, KEY_PEER(peer));
+    }
+    if (!ses) return;
+
+    hash_oa_insert(&ByIfindex, ifa->ifa_index, ses);
+    if (label) {
+	strncpy(SESSION_INFO(ses)->pppIfName, label, IFNAMSIZ);
+	SESSION_INFO(ses)->pppIfName[IFNAMSIZ] = 0;
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: gotStats
+*%ARGUMENTS:
+* nh -- RTM_NEWSTATS message
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Credits an interface's counters to its session, if it has one
+***********************************************************************/
+static void
+gotStats(struct nlmsghdr *nh)
+{
+    struct if_stats_msg *ifsm = NLMSG_DATA(nh);
+    struct rtattr *rta = (struct rtattr *)
+	(((char *) ifsm) + NLMSG_ALIGN(sizeof(*ifsm)));
+    int len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifsm));
+    struct rtnl_link_stats64 st;
+    ClientSession *ses;
+    ClientSessionInfo *info;
+
+    ses = hash_oa_find(&ByIfindex, ifsm->ifindex);
+    if (!ses) return;
+    info = SESSION_INFO(ses);
+
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+	if (rta->rta_type != IFLA_STATS_LINK_64) continue;
+	/* Older kernels send a shorter structure */
+	memset(&st, 0, sizeof(st));
+	memcpy(&st, RTA_DATA(rta), (RTA_PAYLOAD(rta) < sizeof(st)) ?
+	       RTA_PAYLOAD(rta) : sizeof(st));
+	/* Only traffic from the peer shows it is still there */
+	if (st.rx_packets != info->rxPackets) {
+	    info->lastActive = time(NULL);
+	}
+	info->rxBytes = st.rx_bytes;
+	info->rxPackets = st.rx_packets;
+	info->txBytes = st.tx_bytes;
+	info->txPackets = st.tx_packets;
+	return;
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: sessionUnit
+*%ARGUMENTS:
+* ses -- a session
+*%RETURNS:
+* The session's ppp unit number, or -1 if it cannot be known in advance
+***********************************************************************/
+static int
+sessionUnit(ClientSession *ses)
+{
+#ifdef HAVE_LINUX_IF_PPPOX_H
+    if (ses->ppp) return pppEngineUnit(ses);
+#endif
+    if (PassUnitOptionToPPPD) return ntohs(ses->sess) - 1;
+    return -1;
+}
+
+/**********************************************************************
+*%FUNCTION: writeStats
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Replaces the stats file with a line per active session
+***********************************************************************/
+static void
+writeStats(void)
+{
+    char tmp[1024];
+    FILE *fp;
+    ClientSession *ses;
+    ClientSessionInfo *info;
+    time_t now = time(NULL);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", AcctFile);
+    fp = fopen(tmp, "w");
+    if (!fp) {
+	syslog(LOG_ERR, "Cannot write %s: %m", tmp);
+	return;
+    }
+    fprintf(fp, "# session mac interface peer ppp rx-bytes rx-packets tx-bytes tx-packets idle\n");
+    for (ses = BusySessions; ses; ses = ses->next) {
+	info = SESSION_INFO(ses);
+	fprintf(fp, "%u %02x:%02x:%02x:%02x:%02x:%02x %s %d.%d.%d.%d %s %llu %llu %llu %llu %ld\n",
+		(unsigned int) ntohs(ses->sess),
+		ses->eth[0], ses->eth[1], ses->eth[2],
+		ses->eth[3], ses->eth[4], ses->eth[5],
+		sessionInterfaceName(ses),
+		info->realpeerip[0], info->realpeerip[1],
+		info->realpeerip[2], info->realpeerip[3],
+		info->pppIfName[0] ? info->pppIfName : "-",
+		(unsigned long long) info->rxBytes,
+		(unsigned long long) info->rxPackets,
+		(unsigned long long) info->txBytes,
+		(unsigned long long) info->txPackets,
+		(long) (now - info->lastActive));
+    }
+    if (fclose(fp) == EOF || rename(tmp, AcctFile) < 0) {
+	syslog(LOG_ERR, "Cannot write %s: %m", AcctFile);
+	unlink(tmp);
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: idleFile
+*%ARGUMENTS:
+* ses -- a session not on the wheel
+* since -- when ses was last seen to be active
+* now -- current time
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Puts ses in the wheel slot of the first poll at which it will have
+* been idle for IdleTimeout
+***********************************************************************/
+static void
+idleFile(ClientSession *ses, time_t since, time_t now)
+{
+    ClientSessionInfo *info = SESSION_INFO(ses);
+    long left = (long) (since + IdleTimeout - now);
+    unsigned int ticks = 1;
+    unsigned int slot;
+
+    if (left > 0) ticks = (left + AcctInterval - 1) / AcctInterval;
+    slot = (IdleTick + ticks) % IdleWheelSize;
+
+    info->idleSlot = slot;
+    info->idlePrev = NULL;
+    info->idleNext = IdleWheel[slot];
+    if (IdleWheel[slot]) SESSION_INFO(IdleWheel[slot])->idlePrev = ses;
+    IdleWheel[slot] = ses;
+}
+
+/**********************************************************************
+*%FUNCTION: acctSessionStarted
+*%ARGUMENTS:
+* ses -- newly-allocated session
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Starts watching ses for idleness, if the reaper is enabled
+***********************************************************************/
+void
+acctSessionStarted(ClientSession *ses)
+{
+    SESSION_INFO(ses)->idleSlot = -1;
+    if (!IdleWheel) return;
+    idleFile(ses, SESSION_INFO(ses)->lastActive, time(NULL));
+}
+
+/**********************************************************************
+*%FUNCTION: acctSessionEnded
+*%ARGUMENTS:
+* ses -- session being freed
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Takes ses off the idle wheel
+***********************************************************************/
+void
+acctSessionEnded(ClientSession *ses)
+{
+    ClientSessionInfo *info = SESSION_INFO(ses);
+
+    if (info->idleSlot < 0) return;
+    if (info->idlePrev) {
+	SESSION_INFO(info->idlePrev)->idleNext = info->idleNext;
+    } else {
+	IdleWheel[info->idleSlot] = info->idleNext;
+    }
+    if (info->idleNext) {
+	SESSION_INFO(info->idleNext)->idlePrev = info->idlePrev;
+    }
+    info->idleSlot = -1;
+}
+
+/**********************************************************************
+*%FUNCTION: idleReap
+*%ARGUMENTS:
+* now -- current time
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Advances the wheel one slot.  Sessions in the slot that have received
+* nothing for IdleTimeout are stopped (which sends a PADT); the rest are
+* re-filed.  Sessions accounting has not tied to an interface are left
+* alone, since their idleness is unknown.
+***********************************************************************/
+static void
+idleReap(time_t now)
+{
+    ClientSession *ses, *next;
+    ClientSessionInfo *info;
+    unsigned int slot;
+
+    IdleTick++;
+    slot = IdleTick % IdleWheelSize;
+    next = IdleWheel[slot];
+    IdleWheel[slot] = NULL;
+
+    while ((ses = next) != NULL) {
+	info = SESSION_INFO(ses);
+	next = info->idleNext;
+	info->idleSlot = -1;
+
+	if (ses->flags & FLAG_SENT_PADT) {
+	    /* Already on its way out */
+	    continue;
+	}
+	if (!info->pppIfName[0]) {
+	    idleFile(ses, now, now);
+	    continue;
+	}
+	if (now - info->lastActive < IdleTimeout) {
+	    idleFile(ses, info->lastActive, now);
+	    continue;
+	}
+	syslog(LOG_INFO, "Session %u: nothing received for %ld seconds; stopping",
+	       (unsigned int) ntohs(ses->sess), (long) (now - info->lastActive));
+	ses->funcs->stop(ses, "RP-PPPoE: Session idle");
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: acctPoll
+*%ARGUMENTS:
+* es -- event selector
+* fd, flags, data -- ignored
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Collects counters for all sessions with two netlink dumps (addresses,
+* to find each session's interface, and link statistics), writes the
+* stats file, runs the idle reaper and re-arms itself
+***********************************************************************/
+static void
+acctPoll(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    struct {
+	struct nlmsghdr nh;
+	struct ifaddrmsg ifa;
+    } addrReq;
+    struct {
+	struct nlmsghdr nh;
+	struct if_stats_msg ifsm;
+    } statsReq;
+    ClientSession *ses;
+    ClientSessionInfo *info;
+    struct timeval t;
+    uint32_t peer;
+    int unit;
+
+    if (hash_oa_init(&ByKey, NumActiveSessions) < 0 ||
+	hash_oa_init(&ByIfindex, NumActiveSessions) < 0) {
+	syslog(LOG_ERR, "Session accounting: out of memory");
+	goto rearm;
+    }
+    for (ses = BusySessions; ses; ses = ses->next) {
+	info = SESSION_INFO(ses);
+	unit = sessionUnit(ses);
+	if (unit >= 0) {
+	    hash_oa_insert(&ByKey, KEY_UNIT(unit), ses);
+	} else {
+	    memcpy(&peer, info->realpeerip, sizeof(peer));
+	    hash_oa_insert(&ByKey, KEY_PEER(peer), ses);
+	}
+    }
+
+    memset(&addrReq, 0, sizeof(addrReq));
+    addrReq.nh.nlmsg_type = RTM_GETADDR;
+    addrReq.ifa.ifa_family = AF_INET;
+    memset(&statsReq, 0, sizeof(statsReq));
+    statsReq.nh.nlmsg_type = RTM_GETSTATS;
+    statsReq.ifsm.family = AF_UNSPEC;
+    statsReq.ifsm.filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+
+    if (nlDump(&addrReq.nh, sizeof(addrReq), gotAddr) < 0 ||
+	nlDump(&statsReq.nh, sizeof(statsReq), gotStats) < 0) {
+	syslog(LOG_ERR, "Session accounting: netlink dump failed: %m");
+    } else {
+	if (AcctFile) writeStats();
+	if (IdleWheel) idleReap(time(NULL));
+    }
+
+  rearm:
+    hash_oa_free(&ByKey);
+    hash_oa_free(&ByIfindex);
+    t.tv_sec = AcctInterval;
+    t.tv_usec = 0;
+    if (!Event_AddTimerHandler(es, t, acctPoll, NULL)) {
+	syslog(LOG_ERR, "Unable to re-arm session accounting");
+    }
+}
+
+#endif /* __linux__ */
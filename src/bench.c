@@ -0,0 +1,754 @@
+/***********************************************************************
+*
+* bench.c
+*
+* Microbenchmarks for the discovery and session hot paths.  Built and
+* run by "make bench"; not installed.
+*
+* The server code is compiled into this program (with its main()
+* renamed) so that static functions such as buildPADO can be timed
+* exactly as the server runs them.
+*
+* Copyright (C) 2001-2012 Roaring Penguin Software Inc.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+* LIC: GPL
+*
+***********************************************************************/
+
+#define main pppoe_server_main
+#include "pppoe-server.c"
+#undef main
+
+#include "bench.h"
+
+
+static Interface BenchIf;
+static PPPoEPacket Padi;
+static PPPoEPacket Padr;
+static PPPoEPacket SynTemplate;
+static PPPoEPacket Syn;
+static unsigned char FcsData[1500];
+static unsigned char PeerMac[ETH_ALEN] = {0x02, 0x00, 0x5e, 0x10, 0x20, 0x30};
+
+/* pppFCS16 is in ppp.o, which also wants the client's session sender */
+void
+sendSessionPacket(PPPoEConnection *conn, PPPoEPacket *packet, int len)
+{
+}
+
+
+/**********************************************************************
+*%FUNCTION: addBenchTag
+*%ARGUMENTS:
+* packet -- packet being built
+* type -- tag type
+* data, len -- tag payload
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Appends a tag to a discovery packet
+***********************************************************************/
+static void
+addBenchTag(PPPoEPacket *packet, UINT16_t type, void const *data, UINT16_t len)
+{
+    UINT16_t plen = ntohs(packet->length);
+    unsigned char *cursor = packet->payload + plen;
+
+    cursor[0] = type >> 8;
+    cursor[1] = type & 0xFF;
+    cursor[2] = len >> 8;
+    cursor[3] = len & 0xFF;
+    memcpy(cursor + TAG_HDR_SIZE, data, len);
+    packet->length = htons(plen + TAG_HDR_SIZE + len);
+}
+
+/**********************************************************************
+*%FUNCTION: initDiscovery
+*%ARGUMENTS:
+* pkt -- packet to initialize
+* code -- discovery code
+* dest -- destination MAC
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+initDiscovery(PPPoEPacket *pkt, unsigned char code, unsigned char const *dest)
+{
+    memset(pkt, 0, sizeof(*pkt));
+    memcpy(pkt->ethHdr.h_dest, dest, ETH_ALEN);
+    memcpy(pkt->ethHdr.h_source, PeerMac, ETH_ALEN);
+    pkt->ethHdr.h_proto = htons(Eth_PPPOE_Discovery);
+    pkt->ver = 1;
+    pkt->type = 1;
+    pkt->code = code;
+}
+
+/**********************************************************************
+*%FUNCTION: setupPackets
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Builds the server state and synthetic packets the benchmarks use:
+* a PADI and PADR as a typical CPE sends them, and a TCP SYN with an
+* MSS option inside a PPPoE session frame.
+***********************************************************************/
+static void
+setupPackets(void)
+{
+    static unsigned char const bcast[ETH_ALEN] =
+	{0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    unsigned char hostUniqData[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    unsigned char relayData[12] = {0};
+    unsigned char *ip, *tcp;
+    UINT16_t csum;
+    int i;
+
+    for (i=0; i<SEED_LEN; i++) CookieSeed[i] = (unsigned char) (i * 37);
+    ACName = "bench-ac";
+    addServiceName(&GlobalServices, "internet");
+    addServiceName(&GlobalServices, "voip");
+    addServiceName(&GlobalServices, "iptv");
+    buildServiceCatalog(&GlobalServices);
+
+    strcpy(BenchIf.name, "bench0");
+    BenchIf.sock = -1;
+    memcpy(BenchIf.mac, "\x02\x00\x5e\x00\x00\x01", ETH_ALEN);
+    BenchIf.mtu = 1500;
+    BenchIf.services = &GlobalServices;
+
+    initDiscovery(&Padi, CODE_PADI, bcast);
+    addBenchTag(&Padi, TAG_SERVICE_NAME, "", 0);
+    addBenchTag(&Padi, TAG_HOST_UNIQ, hostUniqData, sizeof(hostUniqData));
+    addBenchTag(&Padi, TAG_RELAY_SESSION_ID, relayData, sizeof(relayData));
+
+    initDiscovery(&Padr, CODE_PADR, BenchIf.mac);
+    addBenchTag(&Padr, TAG_SERVICE_NAME, "internet", 8);
+    addBenchTag(&Padr, TAG_AC_NAME, "bench-ac", 8);
+    addBenchTag(&Padr, TAG_RELAY_SESSION_ID, relayData, sizeof(relayData));
+    {
+	unsigned char cookie[COOKIE_LEN];
+	genCookie(PeerMac, BenchIf.mac, CookieSeed, cookie);
+	addBenchTag(&Padr, TAG_AC_COOKIE, cookie, COOKIE_LEN);
+    }
+    addBenchTag(&Padr, TAG_HOST_UNIQ, hostUniqData, sizeof(hostUniqData));
+
+    /* PPP protocol 0x0021, 20-byte IP header, 24-byte TCP header with
+       MSS 1460 */
+    memset(&SynTemplate, 0, sizeof(SynTemplate));
+    SynTemplate.ethHdr.h_proto = htons(Eth_PPPOE_Session);
+    SynTemplate.ver = 1;
+    SynTemplate.type = 1;
+    SynTemplate.session = htons(1);
+    SynTemplate.payload[1] = 0x21;
+    ip = SynTemplate.payload + 2;
+    ip[0] = 0x45;
+    ip[3] = 44;
+    ip[8] = 64;
+    ip[9] = 6;
+    memcpy(ip + 12, "\x0a\x43\x0f\x01\xc0\x00\x02\x01", 8);
+    tcp = ip + 20;
+    tcp[0] = 0xc3; tcp[1] = 0x50;
+    tcp[3] = 80;
+    tcp[12] = 6 << 4;
+    tcp[13] = 0x02;
+    tcp[14] = 0xff; tcp[15] = 0xff;
+    tcp[20] = 2; tcp[21] = 4; tcp[22] = 1460 >> 8; tcp[23] = 1460 & 0xFF;
+    csum = computeTCPChecksum(ip, tcp);
+    memcpy(tcp + 16, &csum, sizeof(csum));
+    SynTemplate.length = htons(2 + 44);
+
+    for (i=0; i<(int) sizeof(FcsData); i++) FcsData[i] = (unsigned char) i;
+}
+
+static void
+countTag(UINT16_t type, UINT16_t len, unsigned char *data, void *extra)
+{
+    (*(unsigned long *) extra) += len;
+}
+
+static void
+benchParsePacket(unsigned long iters)
+{
+    unsigned long total = 0;
+
+    while (iters--) {
+	parsePacket(&Padr, countTag, &total);
+    }
+    Sink = total;
+}
+
+static void
+benchFindTag(unsigned long iters)
+{
+    PPPoETag tag;
+    unsigned long total = 0;
+
+    /* Host-Uniq is the last tag, so this walks the whole packet */
+    while (iters--) {
+	if (findTag(&Padr, TAG_HOST_UNIQ, &tag)) total++;
+    }
+    Sink = total;
+}
+
+static void
+benchIndexTags(unsigned long iters)
+{
+    PPPoETagIndex idx;
+    unsigned long total = 0;
+
+    while (iters--) {
+	indexTags(&Padr, &idx);
+	total += idx.numTags;
+    }
+    Sink = total;
+}
+
+/* Three lookups per packet, as a relay or client makes: one re-parse
+   and copy each with findTag, against one index and three lookups */
+static void
+benchFindTag3(unsigned long iters)
+{
+    PPPoETag tag;
+    unsigned long total = 0;
+
+    while (iters--) {
+	if (findTag(&Padr, TAG_RELAY_SESSION_ID, &tag)) total++;
+	if (findTag(&Padr, TAG_AC_COOKIE, &tag)) total++;
+	if (findTag(&Padr, TAG_HOST_UNIQ, &tag)) total++;
+    }
+    Sink = total;
+}
+
+static void
+benchLookupTag3(unsigned long iters)
+{
+    PPPoETagIndex idx;
+    unsigned long total = 0;
+
+    while (iters--) {
+	indexTags(&Padr, &idx);
+	if (lookupTag(&idx, TAG_RELAY_SESSION_ID)) total++;
+	if (lookupTag(&idx, TAG_AC_COOKIE)) total++;
+	if (lookupTag(&idx, TAG_HOST_UNIQ)) total++;
+    }
+    Sink = total;
+}
+
+static void
+benchGenCookie(unsigned long iters)
+{
+    unsigned char cookie[COOKIE_LEN];
+
+    while (iters--) {
+	genCookie(PeerMac, BenchIf.mac, CookieSeed, cookie);
+	PeerMac[5]++;
+    }
+    Sink = cookie[0];
+}
+
+static void
+benchBuildPADO(unsigned long iters)
+{
+    DiscoveryContext ctx;
+    PPPoEPacket pado;
+    int size = 0;
+
+    /* Parsing the tags is part of the work, as in the server */
+    while (iters--) {
+	initDiscoveryContext(&ctx, &BenchIf, &Padi, HDR_SIZE + ntohs(Padi.length), 0);
+	buildPADO(&ctx, &pado, &size);
+    }
+    Sink = size;
+}
+
+static void
+benchClampMSS(unsigned long iters)
+{
+    /* Restore the SYN each time so that every call rewrites the MSS */
+    while (iters--) {
+	memcpy(&Syn, &SynTemplate, HDR_SIZE + 2 + 44);
+	clampMSS(&Syn, "incoming", 1412);
+    }
+    Sink = Syn.payload[2 + 20 + 22];
+}
+
+static void
+benchTCPChecksum(unsigned long iters)
+{
+    unsigned long total = 0;
+    unsigned char *ip = SynTemplate.payload + 2;
+
+    while (iters--) {
+	total += computeTCPChecksum(ip, ip + 20);
+    }
+    Sink = total;
+}
+
+static void
+benchFCS16(unsigned long iters)
+{
+    UINT16_t fcs = 0;
+
+    while (iters--) {
+	fcs = pppFCS16(PPPINITFCS16, FcsData, sizeof(FcsData));
+    }
+    Sink = fcs;
+}
+
+/* Hash table comparison at BENCH_HASH_ENTRIES random 64-bit keys:
+   libevent's old fixed 67-bucket chained table (reproduced here), the
+   growing chained table with incremental rehash (hash_*), and open
+   addressing (hash_oa_*).  Each benchmark times one phase -- insert
+   all, look up all in another order, remove all -- over a fresh table. */
+#define BENCH_HASH_ENTRIES 100000
+#define FIXED_HASH_SIZE    67
+
+enum { HASH_FIXED, HASH_GROWING, HASH_OA };
+enum { PHASE_INSERT, PHASE_FIND, PHASE_REMOVE };
+
+typedef struct {
+    hash_bucket hash;
+    uint64_t key;
+} HashItem;
+
+static HashItem *HashItems;
+static int *HashOrder;		/* Lookup/removal order */
+static hash_bucket *FixedBuckets[FIXED_HASH_SIZE];
+static hash_table GrowingTable;
+static hash_oa_table OATable;
+
+static unsigned int
+hashItemHash(void *data)
+{
+    uint64_t key = ((HashItem *) data)->key;
+    return (unsigned int) (key ^ (key >> 32));
+}
+
+static int
+hashItemCompare(void *item1, void *item2)
+{
+    return ((HashItem *) item1)->key != ((HashItem *) item2)->key;
+}
+
+/**********************************************************************
+*%FUNCTION: setupHashItems
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Makes BENCH_HASH_ENTRIES items with distinct random keys, and a
+* shuffled order to look them up and remove them in
+***********************************************************************/
+static void
+setupHashItems(void)
+{
+    int i, j, t;
+
+    HashItems = calloc(BENCH_HASH_ENTRIES, sizeof(HashItem));
+    HashOrder = malloc(BENCH_HASH_ENTRIES * sizeof(int));
+    if (!HashItems || !HashOrder) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    srandom(1);
+    for (i=0; i<BENCH_HASH_ENTRIES; i++) {
+	/* The low bits hold the index, which keeps the keys distinct */
+	HashItems[i].key = ((uint64_t) random() << 40) ^
+	    ((uint64_t) random() << 17) ^ (uint64_t) i;
+	HashOrder[i] = i;
+    }
+    for (i=BENCH_HASH_ENTRIES-1; i>0; i--) {
+	j = random() % (i + 1);
+	t = HashOrder[i];
+	HashOrder[i] = HashOrder[j];
+	HashOrder[j] = t;
+    }
+}
+
+/* The pre-3.14 libevent table: fixed buckets, new items at the head */
+static void
+fixedInsert(HashItem *item)
+{
+    hash_bucket *b = &item->hash;
+    unsigned int val = hashItemHash(item);
+
+    b->hashval = val;
+    val %= FIXED_HASH_SIZE;
+    b->prev = NULL;
+    b->next = FixedBuckets[val];
+    if (b->next) b->next->prev = b;
+    FixedBuckets[val] = b;
+}
+
+static void *
+fixedFind(HashItem *item)
+{
+    hash_bucket *b;
+
+    for (b = FixedBuckets[hashItemHash(item) % FIXED_HASH_SIZE]; b; b = b->next) {
+	if (!hashItemCompare(item, b)) return b;
+    }
+    return NULL;
+}
+
+static void
+fixedRemove(HashItem *item)
+{
+    hash_bucket *b = &item->hash;
+
+    if (b->prev) {
+	b->prev->next = b->next;
+    } else {
+	FixedBuckets[b->hashval % FIXED_HASH_SIZE] = b->next;
+    }
+    if (b->next) b->next->prev = b->prev;
+}
+
+/**********************************************************************
+*%FUNCTION: hashPhase
+*%ARGUMENTS:
+* kind -- HASH_FIXED, HASH_GROWING or HASH_OA
+* phase -- PHASE_INSERT, PHASE_FIND or PHASE_REMOVE
+*%RETURNS:
+* ns per item for the timed phase
+*%DESCRIPTION:
+* Builds an empty table, runs all three phases over every item and
+* times only the one asked for.
+***********************************************************************/
+static double
+hashPhase(int kind, int phase)
+{
+    unsigned long long start = 0, elapsed = 0;
+    unsigned long found = 0;
+    HashItem *item;
+    int p, i;
+
+    switch (kind) {
+    case HASH_FIXED:
+	memset(FixedBuckets, 0, sizeof(FixedBuckets));
+	break;
+    case HASH_GROWING:
+	hash_init(&GrowingTable, offsetof(HashItem, hash),
+		  hashItemHash, hashItemCompare);
+	break;
+    case HASH_OA:
+	/* Start small, so growth counts towards insert as it does above */
+	if (hash_oa_init(&OATable, 0) < 0) {
+	    fprintf(stderr, "Out of memory\n");
+	    exit(1);
+	}
+	break;
+    }
+
+    for (p = PHASE_INSERT; p <= PHASE_REMOVE; p++) {
+	if (p == phase) start = nowNs();
+	for (i=0; i<BENCH_HASH_ENTRIES; i++) {
+	    item = &HashItems[p == PHASE_INSERT ? i : HashOrder[i]];
+	    switch (kind * 3 + p) {
+	    case HASH_FIXED * 3 + PHASE_INSERT: fixedInsert(item); break;
+	    case HASH_FIXED * 3 + PHASE_FIND: found += !!fixedFind(item); break;
+	    case HASH_FIXED * 3 + PHASE_REMOVE: fixedRemove(item); break;
+	    case HASH_GROWING * 3 + PHASE_INSERT: hash_insert(&GrowingTable, item); break;
+	    case HASH_GROWING * 3 + PHASE_FIND: found += !!hash_find(&GrowingTable, item); break;
+	    case HASH_GROWING * 3 + PHASE_REMOVE: hash_remove(&GrowingTable, item); break;
+	    case HASH_OA * 3 + PHASE_INSERT: hash_oa_insert(&OATable, item->key, item); break;
+	    case HASH_OA * 3 + PHASE_FIND: found += !!hash_oa_find(&OATable, item->key); break;
+	    case HASH_OA * 3 + PHASE_REMOVE: hash_oa_remove(&OATable, item->key); break;
+	    }
+	}
+	if (p == phase) elapsed = nowNs() - start;
+    }
+
+    if (kind == HASH_GROWING) hash_free(&GrowingTable);
+    if (kind == HASH_OA) hash_oa_free(&OATable);
+    Sink = found;
+    return (double) elapsed / BENCH_HASH_ENTRIES;
+}
+
+static double benchFixedInsert(void) { return hashPhase(HASH_FIXED, PHASE_INSERT); }
+static double benchFixedFind(void) { return hashPhase(HASH_FIXED, PHASE_FIND); }
+static double benchFixedRemove(void) { return hashPhase(HASH_FIXED, PHASE_REMOVE); }
+static double benchGrowingInsert(void) { return hashPhase(HASH_GROWING, PHASE_INSERT); }
+static double benchGrowingFind(void) { return hashPhase(HASH_GROWING, PHASE_FIND); }
+static double benchGrowingRemove(void) { return hashPhase(HASH_GROWING, PHASE_REMOVE); }
+static double benchOAInsert(void) { return hashPhase(HASH_OA, PHASE_INSERT); }
+static double benchOAFind(void) { return hashPhase(HASH_OA, PHASE_FIND); }
+static double benchOARemove(void) { return hashPhase(HASH_OA, PHASE_REMOVE); }
+
+/* The fork/exec pppd path costs at least a process per session.
+   pppd cannot run in every build environment, so small stand-ins are
+   timed and measured instead: these are lower bounds for pppd. */
+#define SPAWN_PATH     "/bin/true"
+#define SPAWN_IDLE     "/bin/cat"
+#define SPAWNS_PER_REP 200
+
+/**********************************************************************
+*%FUNCTION: benchSpawn
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* ns per child to fork, exec SPAWN_PATH and reap it
+*%DESCRIPTION:
+* Forks from this process, which like pppoe-server carries the session
+* tables, so the fork cost is comparable.
+***********************************************************************/
+static double
+benchSpawn(void)
+{
+    unsigned long long start = nowNs();
+    int i, status;
+    pid_t pid;
+
+    for (i=0; i<SPAWNS_PER_REP; i++) {
+	pid = fork();
+	if (pid < 0) {
+	    perror("fork");
+	    exit(1);
+	}
+	if (!pid) {
+	    execl(SPAWN_PATH, SPAWN_PATH, (char *) NULL);
+	    _exit(127);
+	}
+	waitpid(pid, &status, 0);
+    }
+    return (double) (nowNs() - start) / SPAWNS_PER_REP;
+}
+
+/**********************************************************************
+*%FUNCTION: idleChildKB
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Proportional set size (kB) of an idle exec'd SPAWN_IDLE, or -1
+*%DESCRIPTION:
+* Starts SPAWN_IDLE blocked on a pipe and reads its Pss from
+* /proc/PID/smaps_rollup.  Kernel memory (task, stacks, page tables)
+* is not included.
+***********************************************************************/
+static long
+idleChildKB(void)
+{
+    int in[2];
+    char path[64], line[256];
+    FILE *fp;
+    long kb = -1;
+    pid_t pid;
+
+    if (pipe(in) < 0) return -1;
+    pid = fork();
+    if (pid < 0) return -1;
+    if (!pid) {
+	dup2(in[0], 0);
+	close(in[1]);
+	execl(SPAWN_IDLE, SPAWN_IDLE, (char *) NULL);
+	_exit(127);
+    }
+    close(in[0]);
+
+    /* Let it get as far as its first read */
+    usleep(200000);
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int) pid);
+    fp = fopen(path, "r");
+    if (fp) {
+	while (fgets(line, sizeof(line), fp)) {
+	    if (sscanf(line, "Pss: %ld kB", &kb) == 1) break;
+	}
+	fclose(fp);
+    }
+    close(in[1]);
+    waitpid(pid, NULL, 0);
+    return kb;
+}
+
+/* Session-list scans over BENCH_SESSIONS busy sessions, linked in
+   shuffled slot order as a long-running server's list ends up.  The
+   hot array (ClientSession) is compared with the same fields kept in
+   one struct per slot, as before ClientSessionInfo was split off. */
+#define BENCH_SESSIONS 65534
+
+typedef struct {
+    ClientSession hot;		/* First, so list links work unchanged */
+    ClientSessionInfo cold;
+} UnsplitSession;
+
+static ClientSession *HotList;
+static ClientSession *UnsplitList;
+static UnsplitSession *Unsplit;
+static unsigned char ScanMac[ETH_ALEN];
+static long HotKB, ColdKB, UnsplitKB;
+
+/**********************************************************************
+*%FUNCTION: rssKB
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* This process's resident set size in kB, or 0 if unknown
+***********************************************************************/
+static long
+rssKB(void)
+{
+    FILE *fp = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = 0;
+
+    if (!fp) return 0;
+    while (fgets(line, sizeof(line), fp)) {
+	if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) break;
+    }
+    fclose(fp);
+    return kb;
+}
+
+/**********************************************************************
+*%FUNCTION: setupSessionScan
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Fills Sessions/SessionInfo and an unsplit copy with BENCH_SESSIONS
+* busy sessions from distinct MACs, linking both lists in the same
+* shuffled order.  Records how much each array added to the RSS.
+***********************************************************************/
+static void
+setupSessionScan(void)
+{
+    int *order;
+    long kb;
+    int i, j, t;
+
+    order = malloc(BENCH_SESSIONS * sizeof(int));
+    if (!order) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    for (i=0; i<BENCH_SESSIONS; i++) order[i] = i;
+    for (i=BENCH_SESSIONS-1; i>0; i--) {
+	j = random() % (i + 1);
+	t = order[i];
+	order[i] = order[j];
+	order[j] = t;
+    }
+
+    /* Every slot is written, as the server does when it assigns
+       addresses at startup, so the pages are resident */
+    kb = rssKB();
+    Sessions = calloc(BENCH_SESSIONS, sizeof(ClientSession));
+    if (!Sessions) goto oom;
+    for (i=0; i<BENCH_SESSIONS; i++) {
+	Sessions[i].sess = htons(i + 1);
+	Sessions[i].eth[0] = 0x02;
+	Sessions[i].eth[4] = i >> 8;
+	Sessions[i].eth[5] = i & 0xFF;
+    }
+    HotKB = rssKB() - kb;
+
+    kb = rssKB();
+    SessionInfo = calloc(BENCH_SESSIONS, sizeof(ClientSessionInfo));
+    if (!SessionInfo) goto oom;
+    for (i=0; i<BENCH_SESSIONS; i++) {
+	SessionInfo[i].peerip[3] = i & 0xFF;
+	SessionInfo[i].idleSlot = -1;
+    }
+    ColdKB = rssKB() - kb;
+
+    kb = rssKB();
+    Unsplit = calloc(BENCH_SESSIONS, sizeof(UnsplitSession));
+    if (!Unsplit) goto oom;
+    for (i=0; i<BENCH_SESSIONS; i++) {
+	Unsplit[i].hot = Sessions[i];
+	Unsplit[i].cold = SessionInfo[i];
+    }
+    UnsplitKB = rssKB() - kb;
+
+    for (i=BENCH_SESSIONS-1; i>=0; i--) {
+	Sessions[order[i]].next = HotList;
+	HotList = &Sessions[order[i]];
+	Unsplit[order[i]].hot.next = UnsplitList;
+	UnsplitList = &Unsplit[order[i]].hot;
+    }
+    free(order);
+
+    /* A MAC with one session, as for a PADI from a live client */
+    memcpy(ScanMac, Sessions[BENCH_SESSIONS / 2].eth, ETH_ALEN);
+    return;
+
+  oom:
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+}
+
+static void
+benchScanHot(unsigned long iters)
+{
+    unsigned long total = 0;
+
+    BusySessions = HotList;
+    while (iters--) {
+	total += count_sessions_from_mac(ScanMac);
+    }
+    Sink = total;
+}
+
+static void
+benchScanUnsplit(unsigned long iters)
+{
+    unsigned long total = 0;
+
+    BusySessions = UnsplitList;
+    while (iters--) {
+	total += count_sessions_from_mac(ScanMac);
+    }
+    Sink = total;
+}
+
+static Benchmark Benchmarks[] = {
+    { "parsePacket (PADR, 5 tags)", benchParsePacket },
+    { "findTag (last of 5)", benchFindTag },
+    { "indexTags (PADR, 5 tags)", benchIndexTags },
+    { "findTag x3", benchFindTag3 },
+    { "indexTags + lookupTag x3", benchLookupTag3 },
+    { "genCookie", benchGenCookie },
+    { "buildPADO (PADI, 3 services)", benchBuildPADO },
+    { "clampMSS (SYN, rewrite)", benchClampMSS },
+    { "computeTCPChecksum (SYN)", benchTCPChecksum },
+    { "pppFCS16 (1500 bytes)", benchFCS16 },
+    { "hash 100k fixed 67: insert", NULL, benchFixedInsert },
+    { "hash 100k fixed 67: find", NULL, benchFixedFind },
+    { "hash 100k fixed 67: remove", NULL, benchFixedRemove },
+    { "hash 100k growing: insert", NULL, benchGrowingInsert },
+    { "hash 100k growing: find", NULL, benchGrowingFind },
+    { "hash 100k growing: remove", NULL, benchGrowingRemove },
+    { "hash 100k open addr: insert", NULL, benchOAInsert },
+    { "hash 100k open addr: find", NULL, benchOAFind },
+    { "hash 100k open addr: remove", NULL, benchOARemove },
+    { "scan 65534 sessions (hot array)", benchScanHot },
+    { "scan 65534 sessions (unsplit)", benchScanUnsplit },
+    { "fork+exec+reap " SPAWN_PATH, NULL, benchSpawn },
+    { NULL, NULL }
+};
+
+int
+main(int argc, char *argv[])
+{
+    openlog("pppoe-bench", LOG_PID, LOG_DAEMON);
+    setupPackets();
+    setupHashItems();
+    setupSessionScan();
+    runBenchmarks(Benchmarks, argc, argv);
+
+    /* Memory is not a timing; report it after a full run */
+    if (argc <= 1) {
+	printf("%-32s %10ld kB\n", "65534 sessions: hot array", HotKB);
+	printf("%-32s %10ld kB\n", "65534 sessions: cold table", ColdKB);
+	printf("%-32s %10ld kB\n", "65534 sessions: unsplit", UnsplitKB);
+	printf("%-32s %10ld kB\n", "idle " SPAWN_IDLE " (Pss)", idleChildKB());
+    }
+    return 0;
+}
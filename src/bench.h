@@ -0,0 +1,154 @@
+/***********************************************************************
+*
+* bench.h
+*
+* Timing harness shared by the microbenchmark programs (bench.c,
+* relay-bench.c).  Include it once, after the code being timed.
+*
+* Copyright (C) 2001-2012 Roaring Penguin Software Inc.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+* LIC: GPL
+*
+***********************************************************************/
+
+#include <time.h>
+
+/* Each benchmark is warmed up for BENCH_WARMUP_NS, then run BENCH_REPS
+   times with an iteration count that makes one repetition last about
+   BENCH_REP_NS.  The median repetition is reported.  A benchmark too
+   costly to calibrate times itself instead ("once"), and is run
+   BENCH_ONCE_REPS times. */
+#define BENCH_WARMUP_NS 100000000ULL
+#define BENCH_REP_NS    50000000ULL
+#define BENCH_REPS      9
+#define BENCH_ONCE_REPS 5
+
+typedef struct {
+    char const *name;
+    void (*func)(unsigned long iters);
+    double (*once)(void);	/* Returns ns/op of one repetition */
+} Benchmark;
+
+/* Results land here so the compiler cannot discard the work */
+static volatile unsigned long Sink;
+
+/**********************************************************************
+*%FUNCTION: nowNs
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Monotonic time in nanoseconds
+***********************************************************************/
+static unsigned long long
+nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+compareDouble(void const *a, void const *b)
+{
+    double x = *(double const *) a, y = *(double const *) b;
+    return (x > y) - (x < y);
+}
+
+/**********************************************************************
+*%FUNCTION: printResult
+*%ARGUMENTS:
+* name -- benchmark name
+* ns -- ns/op of each repetition (sorted in place)
+* reps -- number of repetitions
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Prints median and minimum ns/op and the median rate
+***********************************************************************/
+static void
+printResult(char const *name, double *ns, int reps)
+{
+    qsort(ns, reps, sizeof(double), compareDouble);
+    printf("%-32s %10.1f %10.1f %14.0f\n", name,
+	   ns[reps / 2], ns[0], 1e9 / ns[reps / 2]);
+}
+
+/**********************************************************************
+*%FUNCTION: runBenchmark
+*%ARGUMENTS:
+* b -- benchmark to run
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Warms up, calibrates and times one benchmark (or runs a "once"
+* benchmark); prints median and minimum ns/op and the median rate
+***********************************************************************/
+static void
+runBenchmark(Benchmark const *b)
+{
+    double ns[BENCH_REPS];
+    unsigned long long start, elapsed;
+    unsigned long iters = 1;
+    int i;
+
+    if (b->once) {
+	for (i=0; i<BENCH_ONCE_REPS; i++) {
+	    ns[i] = b->once();
+	}
+	printResult(b->name, ns, BENCH_ONCE_REPS);
+	return;
+    }
+
+    /* Warm up, doubling the count until one batch is long enough to
+       calibrate against */
+    start = nowNs();
+    for (;;) {
+	unsigned long long t0 = nowNs();
+	b->func(iters);
+	elapsed = nowNs() - t0;
+	if (nowNs() - start >= BENCH_WARMUP_NS && elapsed >= BENCH_REP_NS / 10) {
+	    break;
+	}
+	iters *= 2;
+    }
+    iters = (unsigned long) ((double) iters * BENCH_REP_NS / elapsed) + 1;
+
+    for (i=0; i<BENCH_REPS; i++) {
+	start = nowNs();
+	b->func(iters);
+	ns[i] = (double) (nowNs() - start) / iters;
+    }
+    printResult(b->name, ns, BENCH_REPS);
+}
+
+/**********************************************************************
+*%FUNCTION: runBenchmarks
+*%ARGUMENTS:
+* benchmarks -- table ending with a NULL name
+* argc, argv -- command line; optional arguments select benchmarks by
+*               name prefix
+*%RETURNS:
+* Exit status for main()
+***********************************************************************/
+static int
+runBenchmarks(Benchmark const *benchmarks, int argc, char *argv[])
+{
+    Benchmark const *b;
+    int i;
+
+    printf("%-32s %10s %10s %14s\n", "benchmark", "ns/op", "min ns/op", "ops/sec");
+    for (b = benchmarks; b->name; b++) {
+	if (argc > 1) {
+	    for (i=1; i<argc; i++) {
+		if (!strncmp(b->name, argv[i], strlen(argv[i]))) break;
+	    }
+	    if (i == argc) continue;
+	}
+	runBenchmark(b);
+    }
+    return 0;
+}
@@ -0,0 +1,162 @@
+/***********************************************************************
+*
+* child-bench.c
+*
+* Benchmark for reaping exited children in the event loop, as
+* pppoe-server does for its pppd processes.  Built and run by
+* "make bench"; not installed.
+*
+* The child-exit code is compiled into this program so that the pidfd
+* path and the SIGCHLD fallback can both be timed.
+*
+* Copyright (C) 2001-2012 Roaring Penguin Software Inc.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+* LIC: GPL
+*
+***********************************************************************/
+
+#include "libevent/event_sig.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+
+/* Children per repetition, all exiting at once */
+#define BENCH_CHILDREN 10000
+#define CHILD_REPS     5
+
+static EventSelector *BenchSelector;
+static int Reaped;
+
+static void
+childExited(pid_t pid, int status, void *data)
+{
+    Reaped++;
+}
+
+/**********************************************************************
+*%FUNCTION: reapChildren
+*%ARGUMENTS:
+* es -- event selector
+* n -- number of children
+*%RETURNS:
+* ns per child spent in the event loop reaping, or -1 on error
+*%DESCRIPTION:
+* Forks n children which block until a gate pipe closes, registers
+* each with Event_HandleChildExit, then releases them all.  Once every
+* child has exited, times the event loop until every handler has run.
+* The children close the descriptors they inherit, as exec'ing pppd
+* does: a child which died holding its siblings' pidfds is far slower
+* to reap.
+***********************************************************************/
+static double
+reapChildren(EventSelector *es, int n)
+{
+    int gate[2];
+    pid_t *pids;
+    siginfo_t info;
+    unsigned long long start;
+    char c;
+    int i;
+
+    pids = malloc(n * sizeof(pid_t));
+    if (!pids || pipe(gate) < 0) {
+	perror("reapChildren");
+	exit(1);
+    }
+    for (i=0; i<n; i++) {
+	pids[i] = fork();
+	if (pids[i] < 0) {
+	    perror("fork");
+	    exit(1);
+	}
+	if (!pids[i]) {
+	    dup2(gate[0], 0);
+#ifdef SYS_close_range
+	    syscall(SYS_close_range, 3, ~0U, 0);
+#else
+	    close(gate[0]);
+	    close(gate[1]);
+#endif
+	    if (read(0, &c, 1) < 0) _exit(1);
+	    _exit(0);
+	}
+	if (Event_HandleChildExit(es, pids[i], childExited, NULL) < 0) {
+	    perror("Event_HandleChildExit");
+	    exit(1);
+	}
+    }
+
+    /* Release the children and wait (without reaping) until all are
+       gone, so only the event loop's work is timed */
+    close(gate[0]);
+    close(gate[1]);
+    for (i=0; i<n; i++) {
+	waitid(P_PID, pids[i], &info, WEXITED | WNOWAIT);
+    }
+    free(pids);
+
+    Reaped = 0;
+    start = nowNs();
+    while (Reaped < n) {
+	if (Event_HandleEvent(es) < 0) return -1;
+    }
+    return (double) (nowNs() - start) / n;
+}
+
+#ifdef USE_PIDFD
+static double
+benchReapPidfd(void)
+{
+    return reapChildren(BenchSelector, BENCH_CHILDREN);
+}
+#endif
+
+static double
+benchReapSigchld(void)
+{
+#ifdef USE_PIDFD
+    /* Drop the pidfd set so that new children fall back to SIGCHLD */
+    if (ChildEpollFD >= 0) {
+	Event_DelHandler(BenchSelector, ChildEpollHandler);
+	close(ChildEpollFD);
+	ChildEpollFD = -1;
+    }
+    PidfdUsable = 0;
+#endif
+    return reapChildren(BenchSelector, BENCH_CHILDREN);
+}
+
+/* The SIGCHLD run must come last: it turns the pidfd path off */
+static Benchmark Benchmarks[] = {
+#ifdef USE_PIDFD
+    { "reap 10000 children (pidfd)", NULL, benchReapPidfd },
+#endif
+    { "reap 10000 children (SIGCHLD)", NULL, benchReapSigchld },
+    { NULL, NULL, NULL }
+};
+
+int
+main(int argc, char *argv[])
+{
+    struct rlimit rl;
+
+    BenchSelector = Event_CreateSelector();
+    if (!BenchSelector) {
+	fprintf(stderr, "Event_CreateSelector failed\n");
+	return 1;
+    }
+
+    /* Every child holds a pidfd until it is reaped */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    return runBenchmarks(Benchmarks, argc, argv);
+}
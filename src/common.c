@@ -45,23 +45,28 @@ static uid_t saved_uid = (uid_t) -2;
 static uid_t saved_gid = (uid_t) -2;
 
 /**********************************************************************
-*%FUNCTION: parsePacket
+*%FUNCTION: indexTags
 *%ARGUMENTS:
 * packet -- the PPPoE discovery packet to parse
-* func -- function called for each tag in the packet
-* extra -- an opaque data pointer supplied to parsing function
+* idx -- filled in with the location of each tag in the packet
 *%RETURNS:
 * 0 if everything went well; -1 if there was an error
 *%DESCRIPTION:
-* Parses a PPPoE discovery packet, calling "func" for each tag in the packet.
-* "func" is passed the additional argument "extra".
+* Checks the header and tag lengths of a discovery packet and records
+* the type, length and offset of each tag, in order, up to any
+* End-Of-List tag.  Consumers look tags up in the index instead of
+* walking (and copying out of) the packet again.
 ***********************************************************************/
 int
-parsePacket(PPPoEPacket *packet, ParseFunc *func, void *extra)
+indexTags(PPPoEPacket *packet, PPPoETagIndex *idx)
 {
     UINT16_t len = ntohs(packet->length);
     unsigned char *curTag;
     UINT16_t tagType, tagLen;
+    PPPoETagRef *ref;
+
+    idx->packet = packet;
+    idx->numTags = 0;
 
     if (packet->ver != 1) {
 	syslog(LOG_ERR, "Invalid PPPoE version (%d)", (int) packet->ver);
@@ -78,8 +83,10 @@ parsePacket(PPPoEPacket *packet, ParseFunc *func, void *extra)
 	return -1;
     }
 
-    /* Step through the tags */
+    /* Step through the tags.  Every tag is at least TAG_HDR_SIZE bytes,
+       so MAX_TAGS entries are always enough. */
     curTag = packet->payload;
+    ref = idx->tags;
     while(curTag - packet->payload < len) {
 	/* Alignment is not guaranteed, so do this by hand... */
 	tagType = (((UINT16_t) curTag[0]) << 8) +
@@ -87,18 +94,89 @@ parsePacket(PPPoEPacket *packet, ParseFunc *func, void *extra)
 	tagLen = (((UINT16_t) curTag[2]) << 8) +
 	    (UINT16_t) curTag[3];
 	if (tagType == TAG_END_OF_LIST) {
-	    return 0;
+	    break;
 	}
 	if ((curTag - packet->payload) + tagLen + TAG_HDR_SIZE > len) {
 	    syslog(LOG_ERR, "Invalid PPPoE tag length (%u)", tagLen);
+	    idx->numTags = ref - idx->tags;
 	    return -1;
 	}
-	func(tagType, tagLen, curTag+TAG_HDR_SIZE, extra);
+	ref->type = tagType;
+	ref->length = tagLen;
+	ref->offset = (UINT16_t) (curTag - packet->payload);
+	ref++;
 	curTag = curTag + TAG_HDR_SIZE + tagLen;
     }
+    idx->numTags = ref - idx->tags;
     return 0;
 }
 
+/**********************************************************************
+*%FUNCTION: lookupTag
+*%ARGUMENTS:
+* idx -- index built by indexTags
+* type -- the type of the tag to look for
+*%RETURNS:
+* The first tag of the given type, or NULL if there is none.  Use
+* TAG_REF_HDR and TAG_REF_DATA to get at it in the packet.
+***********************************************************************/
+PPPoETagRef const *
+lookupTag(PPPoETagIndex const *idx, UINT16_t type)
+{
+    PPPoETagRef const *ref = idx->tags;
+    PPPoETagRef const *end = idx->tags + idx->numTags;
+
+    for (; ref < end; ref++) {
+	if (ref->type == type) return ref;
+    }
+    return NULL;
+}
+
+/**********************************************************************
+*%FUNCTION: walkTags
+*%ARGUMENTS:
+* idx -- index built by indexTags
+* func -- function called for each tag in the packet
+* extra -- an opaque data pointer supplied to parsing function
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Calls "func" for each indexed tag, in packet order.
+***********************************************************************/
+void
+walkTags(PPPoETagIndex const *idx, ParseFunc *func, void *extra)
+{
+    PPPoETagRef const *ref = idx->tags;
+    PPPoETagRef const *end = idx->tags + idx->numTags;
+
+    for (; ref < end; ref++) {
+	func(ref->type, ref->length, TAG_REF_DATA(idx, ref), extra);
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: parsePacket
+*%ARGUMENTS:
+* packet -- the PPPoE discovery packet to parse
+* func -- function called for each tag in the packet
+* extra -- an opaque data pointer supplied to parsing function
+*%RETURNS:
+* 0 if everything went well; -1 if there was an error
+*%DESCRIPTION:
+* Parses a PPPoE discovery packet, calling "func" for each tag in the packet.
+* "func" is passed the additional argument "extra".  Tags preceding a
+* bad tag length are still passed to "func".
+***********************************************************************/
+int
+parsePacket(PPPoEPacket *packet, ParseFunc *func, void *extra)
+{
+    PPPoETagIndex idx;
+    int r = indexTags(packet, &idx);
+
+    walkTags(&idx, func, extra);
+    return r;
+}
+
 /**********************************************************************
 *%FUNCTION: findTag
 *%ARGUMENTS:
@@ -109,7 +187,8 @@ parsePacket(PPPoEPacket *packet, ParseFunc *func, void *extra)
 * A pointer to the tag if one of the specified type is found; NULL
 * otherwise.
 *%DESCRIPTION:
-* Looks for a specific tag type.
+* Looks for a specific tag type.  Each call walks the packet and copies
+* the tag out; to look up several tags, use indexTags and lookupTag.
 ***********************************************************************/
 unsigned char *
 findTag(PPPoEPacket *packet, UINT16_t type, PPPoETag *tag)
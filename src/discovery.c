@@ -50,42 +50,12 @@
 int persist = 0;
 #endif
 
-/* Structure used by parseForHostUniq */
-struct HostUniqInfo {
-    char *hostUniq;
-    int forMe;
-};
-
-/**********************************************************************
-*%FUNCTION: parseForHostUniq
-*%ARGUMENTS:
-* type -- tag type
-* len -- tag length
-* data -- tag data.
-* extra -- user-supplied pointer.  This is assumed to be a pointer to a
-*          HostUniqInfo structure
-*%RETURNS:
-* Nothing
-*%DESCRIPTION:
-* If a HostUnique tag is found which matches our PID, sets *extra to 1.
-***********************************************************************/
-static void
-parseForHostUniq(UINT16_t type, UINT16_t len, unsigned char *data,
-		 void *extra)
-{
-    struct HostUniqInfo *hi = (struct HostUniqInfo *) extra;
-    if (!hi->hostUniq) return;
-
-    if (type == TAG_HOST_UNIQ && len == strlen(hi->hostUniq) && !memcmp(data, hi->hostUniq, len)) {
-	hi->forMe = 1;
-    }
-}
-
 /**********************************************************************
 *%FUNCTION: packetIsForMe
 *%ARGUMENTS:
 * conn -- PPPoE connection info
 * packet -- a received PPPoE packet
+* tags -- index of the packet's tags
 *%RETURNS:
 * 1 if packet is for this PPPoE daemon; 0 otherwise.
 *%DESCRIPTION:
@@ -93,9 +63,11 @@ parseForHostUniq(UINT16_t type, UINT16_t len, unsigned char *data,
 * our unique identifier.
 ***********************************************************************/
 static int
-packetIsForMe(PPPoEConnection *conn, PPPoEPacket *packet)
+packetIsForMe(PPPoEConnection *conn, PPPoEPacket *packet,
+	      PPPoETagIndex const *tags)
 {
-    struct HostUniqInfo hi;
+    PPPoETagRef const *ref;
+    size_t len;
 
     /* If packet is not directed to our MAC address, forget it */
     if (memcmp(packet->ethHdr.h_dest, conn->myEth, ETH_ALEN)) return 0;
@@ -103,10 +75,14 @@ packetIsForMe(PPPoEConnection *conn, PPPoEPacket *packet)
     /* If we're not using the Host-Unique tag, then accept the packet */
     if (!conn->hostUniq) return 1;
 
-    hi.hostUniq = conn->hostUniq;
-    hi.forMe = 0;
-    parsePacket(packet, parseForHostUniq, &hi);
-    return hi.forMe;
+    len = strlen(conn->hostUniq);
+    for (ref = tags->tags; ref < tags->tags + tags->numTags; ref++) {
+	if (ref->type == TAG_HOST_UNIQ && ref->length == len &&
+	    !memcmp(TAG_REF_DATA(tags, ref), conn->hostUniq, len)) {
+	    return 1;
+	}
+    }
+    return 0;
 }
 
 /**********************************************************************
@@ -394,6 +370,7 @@ waitForPADO(PPPoEConnection *conn, int timeout)
     struct timeval now;
 
     PPPoEPacket packet;
+    PPPoETagIndex tags;
     int len;
 
     struct PacketCriteria pc;
@@ -467,7 +444,8 @@ waitForPADO(PPPoEConnection *conn, int timeout)
 	}
 #endif
 	/* If it's not for us, loop again */
-	if (!packetIsForMe(conn, &packet)) continue;
+	indexTags(&packet, &tags);
+	if (!packetIsForMe(conn, &packet, &tags)) continue;
 
 	if (packet.code == CODE_PADO) {
 	    if (BROADCAST(packet.ethHdr.h_source)) {
@@ -486,7 +464,7 @@ waitForPADO(PPPoEConnection *conn, int timeout)
 	    pc.seenServiceName = 0;
 	    pc.acNameOK      = (conn->acName)      ? 0 : 1;
 	    pc.serviceNameOK = (conn->serviceName) ? 0 : 1;
-	    parsePacket(&packet, parsePADOTags, &pc);
+	    walkTags(&tags, parsePADOTags, &pc);
 	    if (pc.gotError) {
 		printErr("Error in PADO packet");
 		continue;
@@ -638,6 +616,7 @@ waitForPADS(PPPoEConnection *conn, int timeout)
     struct timeval now;
 
     PPPoEPacket packet;
+    PPPoETagIndex tags;
     int len;
 
     if (gettimeofday(&expire_at, NULL) < 0) {
@@ -707,13 +686,14 @@ waitForPADS(PPPoEConnection *conn, int timeout)
 	if (memcmp(packet.ethHdr.h_source, conn->peerEth, ETH_ALEN)) continue;
 
 	/* If it's not for us, loop again */
-	if (!packetIsForMe(conn, &packet)) continue;
+	indexTags(&packet, &tags);
+	if (!packetIsForMe(conn, &packet, &tags)) continue;
 
 	/* Is it PADS?  */
 	if (packet.code == CODE_PADS) {
 	    /* Parse for goodies */
 	    conn->PADSHadError = 0;
-	    parsePacket(&packet, parsePADSTags, conn);
+	    walkTags(&tags, parsePADSTags, conn);
 	    if (!conn->PADSHadError) {
 		conn->discoveryState = STATE_SESSION;
 		break;
@@ -56,6 +56,45 @@
 #include <net/if_arp.h>
 #endif
 
+#ifdef USE_LINUX_PACKET
+#include <sys/uio.h>
+#include <asm/socket.h>		/* SO_ATTACH_FILTER, hidden by _POSIX_SOURCE */
+#include <linux/filter.h>
+
+/* glibc's <netpacket/packet.h> has PACKET_AUXDATA but not the structure
+   it returns; this is fixed kernel ABI. */
+#if defined(PACKET_AUXDATA) && !defined(TP_STATUS_VLAN_VALID)
+struct tpacket_auxdata {
+    UINT32_t tp_status;
+    UINT32_t tp_len;
+    UINT32_t tp_snaplen;
+    UINT16_t tp_mac;
+    UINT16_t tp_net;
+    UINT16_t tp_vlan_tci;
+    UINT16_t tp_vlan_tpid;
+};
+#define TP_STATUS_VLAN_VALID (1 << 4)
+#endif
+#endif
+
+#ifndef BPF_MOD
+#define BPF_MOD 0x90
+#endif
+
+/* Kernel ABI; older C libraries lack it */
+#if defined(PACKET_FANOUT_DATA) && !defined(PACKET_FANOUT_CBPF)
+#define PACKET_FANOUT_CBPF 6
+#endif
+#if defined(PACKET_FANOUT_DATA) && !defined(PACKET_FANOUT_FLAG_UNIQUEID)
+#define PACKET_FANOUT_FLAG_UNIQUEID 0x2000
+#endif
+
+/* IDs tried for a new fanout group where the kernel cannot pick one */
+#define FANOUT_ID_TRIES 64
+
+/* Multiplier for macPartition(); also used by the socket filter */
+#define MAC_PARTITION_MULT 0x9E3779B1U
+
 #ifdef USE_DLPI
 
 #include <limits.h>
@@ -515,8 +554,336 @@ openInterface(char const *ifname, UINT16_t type, unsigned char *hwaddr, UINT16_t
     return fd;
 }
 
+/**********************************************************************
+*%FUNCTION: setDiscoveryFilter
+*%ARGUMENTS:
+* fd -- socket from openInterface or openTrunkInterface
+* type -- Ethernet frame type of discovery frames
+* trunk -- if true, fd is bound to ETH_P_ALL: drop outgoing frames and
+*          frames not of the given type
+* index, count -- if count > 1, keep only frames whose source MAC
+*                 address hashes to partition index (see macPartition)
+*%RETURNS:
+* 0 on success; -1 on failure (errno is set)
+*%DESCRIPTION:
+* Attaches a socket filter, replacing any previous one, then discards
+* whatever was queued before the filter took effect.
+***********************************************************************/
+int
+setDiscoveryFilter(int fd, UINT16_t type, int trunk,
+		   unsigned int index, unsigned int count)
+{
+#ifdef SO_ATTACH_FILTER
+    struct sock_filter code[16];
+    struct sock_fprog prog;
+    unsigned char junk;
+    int len = 2 + (trunk ? 4 : 0) + (count > 1 ? 8 : 0);
+    int accept = len - 2;
+    int drop = len - 1;
+    int n = 0;
+
+    if (trunk) {
+	/* Drop frames we sent */
+	code[n] = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE); n++;
+	code[n] = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PACKET_OUTGOING, drop-n-1, 0); n++;
+	/* Keep frames of the right type, tagged or not */
+	code[n] = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL); n++;
+	code[n] = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, type, 0, drop-n-1); n++;
+    }
+    if (count > 1) {
+	/* Same arithmetic as macPartition() */
+	code[n++] = (struct sock_filter) BPF_STMT(BPF_LD|BPF_H|BPF_ABS, ETH_ALEN);
+	code[n++] = (struct sock_filter) BPF_STMT(BPF_MISC|BPF_TAX, 0);
+	code[n++] = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_ABS, ETH_ALEN + 2);
+	code[n++] = (struct sock_filter) BPF_STMT(BPF_ALU|BPF_ADD|BPF_X, 0);
+	code[n++] = (struct sock_filter) BPF_STMT(BPF_ALU|BPF_MUL|BPF_K, MAC_PARTITION_MULT);
+	code[n++] = (struct sock_filter) BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 16);
+	code[n++] = (struct sock_filter) BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, count);
+	code[n] = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, index, accept-n-1, drop-n-1); n++;
+    }
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, 0xFFFF);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, 0);
+
+    prog.len = n;
+    prog.filter = code;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+	return -1;
+    }
+
+    /* Throw away anything queued before the filter was attached */
+    while (recv(fd, &junk, sizeof(junk), MSG_DONTWAIT) >= 0) {
+	/* Nothing */
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**********************************************************************
+*%FUNCTION: openTrunkInterface
+*%ARGUMENTS:
+* ifname -- name of VLAN trunk interface
+* type -- Ethernet frame type of discovery frames
+* hwaddr -- if non-NULL, set to the hardware address
+* mtu    -- if non-NULL, set to the MTU
+*%RETURNS:
+* A raw socket which receives discovery frames from every VLAN on
+* ifname.  Exits on error.
+*%DESCRIPTION:
+* The kernel clears a frame's VLAN tag before handing it to sockets
+* bound to a particular protocol, so this socket is bound to ETH_P_ALL
+* (where the tag is still reported via PACKET_AUXDATA) and a socket
+* filter keeps only incoming frames of the requested type.  Use
+* receivePacketVlan to read from it.
+***********************************************************************/
+int
+openTrunkInterface(char const *ifname, UINT16_t type, unsigned char *hwaddr, UINT16_t *mtu)
+{
+#if defined(PACKET_AUXDATA) && defined(SO_ATTACH_FILTER)
+    int optval = 1;
+    int fd = openInterface(ifname, ETH_P_ALL, hwaddr, mtu);
+
+    if (setDiscoveryFilter(fd, type, 1, 0, 1) < 0) {
+	fatalSys("setsockopt(SO_ATTACH_FILTER)");
+    }
+    if (setsockopt(fd, SOL_PACKET, PACKET_AUXDATA, &optval, sizeof(optval)) < 0) {
+	fatalSys("setsockopt(PACKET_AUXDATA)");
+    }
+    return fd;
+#else
+    rp_fatal("VLAN trunk mode is not supported on this system");
+    return -1;
+#endif
+}
+
+/***********************************************************************
+*%FUNCTION: receivePacketVlan
+*%ARGUMENTS:
+* sock -- socket from openTrunkInterface
+* pkt -- place to store the received packet (untagged)
+* size -- set to size of packet in bytes
+* vlan -- set to VLAN ID the packet arrived on, or 0 if untagged
+*%RETURNS:
+* >= 0 if all OK; < 0 if error
+*%DESCRIPTION:
+* Receives a packet and its VLAN ID
+***********************************************************************/
+int
+receivePacketVlan(int sock, PPPoEPacket *pkt, int *size, UINT16_t *vlan)
+{
+#ifdef PACKET_AUXDATA
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+	struct cmsghdr cmsg;
+	char buf[VLAN_CMSG_SPACE];
+    } control;
+
+    iov.iov_base = pkt;
+    iov.iov_len = sizeof(PPPoEPacket);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control;
+    msg.msg_controllen = sizeof(control);
+
+    if ((*size = recvmsg(sock, &msg, 0)) < 0) {
+	sysErr("recvmsg (receivePacketVlan)");
+	return -1;
+    }
+    *vlan = packetVlan(&msg);
+    return 0;
+#else
+    *vlan = 0;
+    return receivePacket(sock, pkt, size);
+#endif
+}
+
+/***********************************************************************
+*%FUNCTION: packetVlan
+*%ARGUMENTS:
+* msg -- a message received from a socket from openTrunkInterface,
+*        with room for control data of VLAN_CMSG_SPACE bytes
+*%RETURNS:
+* The VLAN ID the frame arrived on, or 0 if it was untagged
+***********************************************************************/
+UINT16_t
+packetVlan(struct msghdr *msg)
+{
+#ifdef PACKET_AUXDATA
+    struct cmsghdr *cmsg;
+    struct tpacket_auxdata aux;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+	if (cmsg->cmsg_level != SOL_PACKET ||
+	    cmsg->cmsg_type != PACKET_AUXDATA ||
+	    cmsg->cmsg_len < CMSG_LEN(sizeof(aux))) {
+	    continue;
+	}
+	memcpy(&aux, CMSG_DATA(cmsg), sizeof(aux));
+	/* Old kernels don't set TP_STATUS_VLAN_VALID */
+	if ((aux.tp_status & TP_STATUS_VLAN_VALID) || aux.tp_vlan_tci) {
+	    return aux.tp_vlan_tci & VLAN_VID_MASK;
+	}
+    }
+#endif
+    return 0;
+}
+
+#if defined(PACKET_FANOUT_DATA) && defined(SKF_NET_OFF)
+/***********************************************************************
+*%FUNCTION: newFanoutGroup (static)
+*%ARGUMENTS:
+* fd -- socket from openInterface
+* group -- set to the ID of the new group
+*%RETURNS:
+* 0 on success; -1 on failure (errno is set)
+*%DESCRIPTION:
+* Creates a PACKET_FANOUT_CBPF group with fd as its first member.  The
+* kernel picks an unused ID (Linux 4.14 and later).  Older kernels
+* reject that with EINVAL; then we pick one ourselves, moving on while
+* the ID is taken by a group of another type or interface.
+***********************************************************************/
+static int
+newFanoutGroup(int fd, int *group)
+{
+    int arg = (PACKET_FANOUT_CBPF | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+    socklen_t len = sizeof(arg);
+    int i, id;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) == 0) {
+	if (getsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, &len) < 0) {
+	    return -1;
+	}
+	*group = arg & 0xFFFF;
+	return 0;
+    }
+    if (errno != EINVAL) return -1;
+
+    id = (int) getpid();
+    for (i=0; i<FANOUT_ID_TRIES; i++) {
+	arg = ((id + i) & 0xFFFF) | (PACKET_FANOUT_CBPF << 16);
+	if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) == 0) {
+	    *group = arg & 0xFFFF;
+	    return 0;
+	}
+	if (errno != EINVAL) return -1;
+    }
+    return -1;
+}
+#endif
+
+/***********************************************************************
+*%FUNCTION: joinSessionFanout
+*%ARGUMENTS:
+* fd -- socket from openInterface
+* group -- fanout group ID, the same for all sockets sharing the frames;
+*          -1 to start a new group, whose ID is then stored here
+* count -- number of sockets that will join the group
+*%RETURNS:
+* 0 on success; -1 on failure (errno is set)
+*%DESCRIPTION:
+* Adds fd to a PACKET_FANOUT group in which each frame goes to the
+* socket numbered sessionPartition() of its source MAC address and
+* session ID.  Sockets are numbered in the order they join.
+***********************************************************************/
+int
+joinSessionFanout(int fd, int *group, unsigned int count)
+{
+#if defined(PACKET_FANOUT_DATA) && defined(SKF_NET_OFF)
+    struct sock_filter code[16];
+    struct sock_fprog prog;
+    int arg;
+    int n = 0;
+
+    /* Same arithmetic as sessionPartition().  The program runs with the
+       network (PPPoE) header at offset 0. */
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_LD|BPF_H|BPF_ABS, SKF_LL_OFF + ETH_ALEN);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_MISC|BPF_TAX, 0);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_LL_OFF + ETH_ALEN + 2);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_ALU|BPF_ADD|BPF_X, 0);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_MISC|BPF_TAX, 0);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_LD|BPF_H|BPF_ABS, SKF_NET_OFF + 2);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_ALU|BPF_ADD|BPF_X, 0);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_ALU|BPF_MUL|BPF_K, MAC_PARTITION_MULT);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 16);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, count);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_RET|BPF_A, 0);
+
+    if (*group < 0) {
+	if (newFanoutGroup(fd, group) < 0) return -1;
+    } else {
+	arg = *group | (PACKET_FANOUT_CBPF << 16);
+	if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+	    return -1;
+	}
+    }
+    prog.len = n;
+    prog.filter = code;
+    if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT_DATA, &prog, sizeof(prog)) < 0) {
+	return -1;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 #endif /* USE_LINUX */
 
+/***********************************************************************
+*%FUNCTION: macPartition
+*%ARGUMENTS:
+* mac -- an Ethernet address
+* count -- number of partitions
+*%RETURNS:
+* Partition (0 to count-1) that mac belongs to
+*%DESCRIPTION:
+* Deterministic hash used to split clients between server instances.
+* setDiscoveryFilter() computes the same thing in the kernel.
+***********************************************************************/
+unsigned int
+macPartition(unsigned char const *mac, unsigned int count)
+{
+    UINT32_t h;
+
+    h = (((UINT32_t) mac[0] << 8) | mac[1]) +
+	(((UINT32_t) mac[2] << 24) | ((UINT32_t) mac[3] << 16) |
+	 ((UINT32_t) mac[4] << 8) | mac[5]);
+    h *= MAC_PARTITION_MULT;
+    return (unsigned int) ((h & 0xFFFFFFFFU) >> 16) % count;
+}
+
+/***********************************************************************
+*%FUNCTION: sessionPartition
+*%ARGUMENTS:
+* mac -- an Ethernet address
+* session -- a PPPoE session ID (network byte order)
+* count -- number of partitions
+*%RETURNS:
+* Partition (0 to count-1) that frames of this session belong to
+*%DESCRIPTION:
+* Like macPartition, but mixes in the session ID so that one peer's
+* sessions are spread too.  joinSessionFanout() computes the same
+* thing in the kernel.
+***********************************************************************/
+unsigned int
+sessionPartition(unsigned char const *mac, UINT16_t session,
+		 unsigned int count)
+{
+    UINT32_t h;
+
+    h = (((UINT32_t) mac[0] << 8) | mac[1]) +
+	(((UINT32_t) mac[2] << 24) | ((UINT32_t) mac[3] << 16) |
+	 ((UINT32_t) mac[4] << 8) | mac[5]) +
+	ntohs(session);
+    h *= MAC_PARTITION_MULT;
+    return (unsigned int) ((h & 0xFFFFFFFFU) >> 16) % count;
+}
+
 /***********************************************************************
 *%FUNCTION: sendPacket
 *%ARGUMENTS:
@@ -531,6 +898,9 @@ openInterface(char const *ifname, UINT16_t type, unsigned char *hwaddr, UINT16_t
 int
 sendPacket(PPPoEConnection *conn, int sock, PPPoEPacket *pkt, int size)
 {
+    if (conn && conn->vlan) {
+	return sendPacketVlan(NULL, sock, pkt, size, conn->vlan);
+    }
 #if defined(USE_BPF)
     if (write(sock, pkt, size) < 0) {
 	sysErr("write (sendPacket)");
@@ -595,6 +965,44 @@ sendPacket(PPPoEConnection *conn, int sock, PPPoEPacket *pkt, int size)
     return 0;
 }
 
+/***********************************************************************
+*%FUNCTION: sendPacketVlan
+*%ARGUMENTS:
+* conn -- connection (may be NULL)
+* sock -- socket to send to
+* pkt -- the packet to transmit (untagged)
+* size -- size of packet (in bytes)
+* vlan -- VLAN ID to tag packet with; 0 means send untagged
+*%RETURNS:
+* 0 on success; -1 on failure
+*%DESCRIPTION:
+* Transmits a packet with an 802.1Q header inserted after the MAC
+* addresses.
+***********************************************************************/
+int
+sendPacketVlan(PPPoEConnection *conn, int sock, PPPoEPacket *pkt, int size,
+	       UINT16_t vlan)
+{
+    unsigned char frame[sizeof(PPPoEPacket) + VLAN_TAG_LEN];
+    UINT16_t tag[2];
+
+    if (!vlan) {
+	return sendPacket(conn, sock, pkt, size);
+    }
+    if (size < 2 * ETH_ALEN || size > (int) sizeof(PPPoEPacket)) {
+	syslog(LOG_ERR, "sendPacketVlan: bad packet size %d", size);
+	return -1;
+    }
+
+    tag[0] = htons(ETH_VLAN_TPID);
+    tag[1] = htons(vlan & VLAN_VID_MASK);
+    memcpy(frame, pkt, 2 * ETH_ALEN);
+    memcpy(frame + 2 * ETH_ALEN, tag, VLAN_TAG_LEN);
+    memcpy(frame + 2 * ETH_ALEN + VLAN_TAG_LEN, ((unsigned char *) pkt) + 2 * ETH_ALEN,
+	   size - 2 * ETH_ALEN);
+    return sendPacket(NULL, sock, (PPPoEPacket *) frame, size + VLAN_TAG_LEN);
+}
+
 #ifdef USE_BPF
 /***********************************************************************
 *%FUNCTION: clearPacketHeader
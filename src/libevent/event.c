@@ -245,8 +245,8 @@ Event_AddHandler(EventSelector *es,
     /* Specifically disable timer and deleted flags */
     flags &= (~(EVENT_TIMER_BITS | EVENT_FLAG_DELETED));
 
-    /* Bad file descriptor */
-    if (fd < 0) {
+    /* Bad file descriptor, or one select() cannot watch */
+    if (fd < 0 || fd >= FD_SETSIZE) {
 	errno = EBADF;
 	return NULL;
     }
@@ -301,8 +301,8 @@ Event_AddHandlerWithTimeout(EventSelector *es,
     flags &= (~(EVENT_FLAG_TIMER | EVENT_FLAG_DELETED));
     flags |= EVENT_FLAG_TIMEOUT;
 
-    /* Bad file descriptor? */
-    if (fd < 0) {
+    /* Bad file descriptor, or one select() cannot watch? */
+    if (fd < 0 || fd >= FD_SETSIZE) {
 	errno = EBADF;
 	return NULL;
     }
@@ -87,6 +87,10 @@ extern void Event_SetCallbackAndData(EventHandler *eh,
 int Event_HandleSignal(EventSelector *es, int sig, void (*handler)(int sig));
 
 /* Reap children synchronously in event loop */
+/* Status passed to the handler when the child was reaped elsewhere.
+   waitpid() never reports it for an exited child. */
+#define EVENT_CHILD_STATUS_UNKNOWN (-1)
+
 int Event_HandleChildExit(EventSelector *es, pid_t pid,
 			  void (*handler)(pid_t, int, void *), void *data);
 
@@ -15,6 +15,7 @@
 ***********************************************************************/
 
 #define _POSIX_SOURCE 1 /* For sigaction defines */
+#define _GNU_SOURCE 1 /* For syscall() */
 
 #include <signal.h>
 #include <sys/types.h>
@@ -26,6 +27,17 @@
 #include "event.h"
 #include "hash.h"
 
+/* On Linux 5.3 and newer, each child can be watched through a pidfd.
+   The pidfds live in a private epoll set, and that epoll descriptor is
+   the only thing the (select-based) event loop has to watch. */
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#ifdef SYS_pidfd_open
+#define USE_PIDFD 1
+#endif
+#endif
+
 /* Kludge for figuring out NSIG */
 #ifdef NSIG
 #define MAX_SIGNALS NSIG
@@ -46,6 +58,7 @@ struct ChildEntry {
     hash_bucket hash;
     void (*handler)(pid_t pid, int status, void *data);
     pid_t pid;
+    int pidfd;			/* -1 if child is tracked via SIGCHLD */
     void *data;
 };
 
@@ -56,6 +69,17 @@ static pid_t MyPid = (pid_t) -1;
 static EventHandler *PipeHandler = NULL;
 static hash_table child_process_table;
 
+#ifdef USE_PIDFD
+/* Max. number of exited children handled per wakeup */
+#define CHILD_EVENT_BATCH 64
+
+static int ChildEpollFD = -1;
+static EventHandler *ChildEpollHandler = NULL;
+static int PidfdUsable = 1;
+
+static int SetupPipes(EventSelector *es);
+#endif
+
 static unsigned int child_hash(void *data)
 {
     return (unsigned int) ((struct ChildEntry *) data)->pid;
@@ -163,6 +187,35 @@ child_handler(int sig)
     int pid;
     struct ChildEntry *ce;
     struct ChildEntry candidate;
+    void *cursor;
+
+#ifdef USE_PIDFD
+    /* If some children are tracked by pidfd, we must not steal their
+       exit status with waitpid(-1, ...).  Only reap the children which
+       fell back to the SIGCHLD table. */
+    if (ChildEpollFD >= 0) {
+	ce = hash_start(&child_process_table, &cursor);
+	while (ce) {
+	    pid = waitpid(ce->pid, &status, WNOHANG);
+	    if (pid < 0 && errno == ECHILD) {
+		/* Someone else reaped it; exit status is lost */
+		pid = ce->pid;
+		status = EVENT_CHILD_STATUS_UNKNOWN;
+	    }
+	    if (pid == ce->pid) {
+		hash_remove(&child_process_table, ce);
+		if (ce->handler) {
+		    ce->handler(ce->pid, status, ce->data);
+		}
+		free(ce);
+	    }
+	    ce = hash_next(&child_process_table, &cursor);
+	}
+	return;
+    }
+#else
+    (void) cursor;
+#endif
 
     while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
 	candidate.pid = (pid_t) pid;
@@ -178,6 +231,115 @@ child_handler(int sig)
     }
 }
 
+#ifdef USE_PIDFD
+/**********************************************************************
+* %FUNCTION: DoChildEpoll
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- the readable child epoll descriptor
+*  flags -- flags from event system
+*  data -- ignored
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Called when one or more pidfd-tracked children have exited.  Each
+*  epoll event carries its ChildEntry, so no table lookup is needed.
+***********************************************************************/
+static void
+DoChildEpoll(EventSelector *es,
+	     int fd,
+	     unsigned int flags,
+	     void *data)
+{
+    struct epoll_event events[CHILD_EVENT_BATCH];
+    struct ChildEntry *ce;
+    int n, i;
+    int status;
+    pid_t pid;
+
+    n = epoll_wait(fd, events, CHILD_EVENT_BATCH, 0);
+    for (i=0; i<n; i++) {
+	ce = (struct ChildEntry *) events[i].data.ptr;
+	pid = waitpid(ce->pid, &status, WNOHANG);
+	if (pid == 0) {
+	    /* Spurious wakeup -- child still running */
+	    continue;
+	}
+	if (pid < 0) {
+	    /* Someone else reaped it; exit status is lost */
+	    status = EVENT_CHILD_STATUS_UNKNOWN;
+	}
+	epoll_ctl(fd, EPOLL_CTL_DEL, ce->pidfd, NULL);
+	close(ce->pidfd);
+	if (ce->handler) {
+	    ce->handler(ce->pid, status, ce->data);
+	}
+	free(ce);
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: AddChildPidfd (static)
+* %ARGUMENTS:
+*  es -- event selector
+*  ce -- child entry to watch
+* %RETURNS:
+*  0 if child is now watched through a pidfd; -1 if caller should fall
+*  back to SIGCHLD.
+* %DESCRIPTION:
+*  Opens a pidfd for ce->pid and adds it to the child epoll set, creating
+*  the set (and its event handler) on first use.
+***********************************************************************/
+static int
+AddChildPidfd(EventSelector *es, struct ChildEntry *ce)
+{
+    struct epoll_event ev;
+
+    if (!PidfdUsable) return -1;
+
+    if (ChildEpollFD < 0) {
+	/* Create the SIGCHLD pipe up front, so that falling back later
+	   (typically because pidfds exhausted RLIMIT_NOFILE) does not
+	   itself need new descriptors */
+	if (SetupPipes(es) < 0) {
+	    PidfdUsable = 0;
+	    return -1;
+	}
+	ChildEpollFD = epoll_create1(EPOLL_CLOEXEC);
+	if (ChildEpollFD < 0) {
+	    PidfdUsable = 0;
+	    return -1;
+	}
+	ChildEpollHandler = Event_AddHandler(es, ChildEpollFD,
+					     EVENT_FLAG_READABLE,
+					     DoChildEpoll, NULL);
+	if (!ChildEpollHandler) {
+	    close(ChildEpollFD);
+	    ChildEpollFD = -1;
+	    PidfdUsable = 0;
+	    return -1;
+	}
+    }
+
+    /* pidfds are always close-on-exec */
+    ce->pidfd = (int) syscall(SYS_pidfd_open, ce->pid, 0);
+    if (ce->pidfd < 0) {
+	/* Kernel too old?  Then don't bother trying again */
+	if (errno == ENOSYS) PidfdUsable = 0;
+	return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = ce;
+    if (epoll_ctl(ChildEpollFD, EPOLL_CTL_ADD, ce->pidfd, &ev) < 0) {
+	close(ce->pidfd);
+	ce->pidfd = -1;
+	return -1;
+    }
+    return 0;
+}
+#endif
+
 /**********************************************************************
 * %FUNCTION: SetupPipes (static)
 * %ARGUMENTS:
@@ -283,7 +445,10 @@ Event_HandleSignal(EventSelector *es,
 * %DESCRIPTION:
 *  Sets things up so that when a child exits, handler() will be called
 *  with the pid of the child and "data" as arguments.  The call will
-*  be synchronous (part of the normal event loop on es).
+*  be synchronous (part of the normal event loop on es).  Where the
+*  kernel supports it, the child is watched through a pidfd; otherwise
+*  we fall back to reaping on SIGCHLD.  If something else reaped the
+*  child first, handler() gets EVENT_CHILD_STATUS_UNKNOWN as the status.
 ***********************************************************************/
 int
 Event_HandleChildExit(EventSelector *es,
@@ -294,13 +459,22 @@ Event_HandleChildExit(EventSelector *es,
     struct ChildEntry *ce;
     sigset_t set;
 
-    if (Event_HandleSignal(es, SIGCHLD, child_handler) < 0) return -1;
     ce = malloc(sizeof(struct ChildEntry));
     if (!ce) return -1;
     ce->pid = pid;
+    ce->pidfd = -1;
     ce->data = data;
     ce->handler = handler;
 
+#ifdef USE_PIDFD
+    if (AddChildPidfd(es, ce) == 0) return 0;
+#endif
+
+    if (Event_HandleSignal(es, SIGCHLD, child_handler) < 0) {
+	free(ce);
+	return -1;
+    }
+
     /* Critical section: Don't let SIGCHLD mess hash_insert */
     sigemptyset(&set);
     sigaddset(&set, SIGCHLD);
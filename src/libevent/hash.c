@@ -26,8 +26,129 @@
 
 #define GET_ITEM(tab, bucket) ((void *) (((char *) (void *) bucket) - (tab)->hash_offset))
 
+/* Keep open-addressing tables at most 3/4 full */
+#define OA_MIN_SIZE 16
+#define OA_FULL(size, n) ((n) * 4 >= (size) * 3)
+
+/* Slot arrays start on a cache line, so each line holds four whole
+   slots and short probe runs stay within one or two lines */
+#define OA_ALIGN 64
+
 static void *hash_next_cursor(hash_table *tab, hash_bucket *b);
 
+/**********************************************************************
+* %FUNCTION: hash_mix (static)
+* %ARGUMENTS:
+*  h -- hash value from the table's compute function
+* %RETURNS:
+*  h with its bits mixed so the low bits are usable as a bucket index
+* %DESCRIPTION:
+*  Bucket counts are powers of two, so weak hash functions (a pid, say)
+*  would otherwise leave most buckets unused.
+***********************************************************************/
+static unsigned int
+hash_mix(unsigned int h)
+{
+    h ^= h >> 16;
+    h *= 0x7feb352dU;
+    h ^= h >> 15;
+    h *= 0x846ca68bU;
+    h ^= h >> 16;
+    return h;
+}
+
+/**********************************************************************
+* %FUNCTION: hash_chain (static)
+* %ARGUMENTS:
+*  tab -- hash table
+*  val -- mixed hash value
+* %RETURNS:
+*  A pointer to the head of the chain which holds items hashing to val
+* %DESCRIPTION:
+*  During a resize, buckets below rehash_pos have already been moved
+*  to the new array; the rest are still in the old one.
+***********************************************************************/
+static hash_bucket **
+hash_chain(hash_table *tab, unsigned int val)
+{
+    size_t i;
+
+    if (tab->old_buckets) {
+	i = val & (tab->old_size - 1);
+	if (i >= tab->rehash_pos) return &tab->old_buckets[i];
+    }
+    return &tab->buckets[val & (tab->size - 1)];
+}
+
+/**********************************************************************
+* %FUNCTION: hash_rehash_step (static)
+* %ARGUMENTS:
+*  tab -- hash table
+*  n -- maximum number of old buckets to migrate
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Moves up to n chains from the old bucket array to the new one.  Frees
+*  the old array once it is empty.
+***********************************************************************/
+static void
+hash_rehash_step(hash_table *tab, size_t n)
+{
+    hash_bucket *b, *next, **head;
+
+    while (tab->old_buckets && n--) {
+	b = tab->old_buckets[tab->rehash_pos];
+	tab->old_buckets[tab->rehash_pos] = NULL;
+	tab->rehash_pos++;
+	while (b) {
+	    next = b->next;
+	    head = &tab->buckets[b->hashval & (tab->size - 1)];
+	    b->prev = NULL;
+	    b->next = *head;
+	    if (b->next) {
+		b->next->prev = b;
+	    }
+	    *head = b;
+	    b = next;
+	}
+	if (tab->rehash_pos == tab->old_size) {
+	    if (tab->old_buckets != tab->initial) {
+		free(tab->old_buckets);
+	    }
+	    tab->old_buckets = NULL;
+	    tab->old_size = 0;
+	    tab->rehash_pos = 0;
+	}
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: hash_grow (static)
+* %ARGUMENTS:
+*  tab -- hash table
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Starts doubling the number of buckets.  If memory is short, the table
+*  simply keeps its current size and chains get longer.
+***********************************************************************/
+static void
+hash_grow(hash_table *tab)
+{
+    hash_bucket **nb;
+
+    if (tab->old_buckets) return;
+
+    nb = calloc(tab->size * 2, sizeof(hash_bucket *));
+    if (!nb) return;
+
+    tab->old_buckets = tab->buckets;
+    tab->old_size = tab->size;
+    tab->rehash_pos = 0;
+    tab->buckets = nb;
+    tab->size *= 2;
+}
+
 /**********************************************************************
 * %FUNCTION: hash_init
 * %ARGUMENTS:
@@ -39,7 +160,8 @@ static void *hash_next_cursor(hash_table *tab, hash_bucket *b);
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Initializes a hash table.
+*  Initializes a hash table.  The table starts with HASH_MIN_SIZE buckets
+*  held in the table itself, so it must not be copied by value.
 ***********************************************************************/
 void
 hash_init(hash_table *tab,
@@ -52,12 +174,39 @@ hash_init(hash_table *tab,
     tab->hash_offset = hash_offset;
     tab->compute_hash = compute;
     tab->compare = compare;
-    for (i=0; i<HASHTAB_SIZE; i++) {
-	tab->buckets[i] = NULL;
+    for (i=0; i<HASH_MIN_SIZE; i++) {
+	tab->initial[i] = NULL;
     }
+    tab->buckets = tab->initial;
+    tab->size = HASH_MIN_SIZE;
+    tab->old_buckets = NULL;
+    tab->old_size = 0;
+    tab->rehash_pos = 0;
     tab->num_entries = 0;
 }
 
+/**********************************************************************
+* %FUNCTION: hash_free
+* %ARGUMENTS:
+*  tab -- hash table
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Frees the bucket arrays and leaves the table empty.  Does not free
+*  the items themselves.
+***********************************************************************/
+void
+hash_free(hash_table *tab)
+{
+    if (tab->buckets != tab->initial) {
+	free(tab->buckets);
+    }
+    if (tab->old_buckets && tab->old_buckets != tab->initial) {
+	free(tab->old_buckets);
+    }
+    hash_init(tab, tab->hash_offset, tab->compute_hash, tab->compare);
+}
+
 /**********************************************************************
 * %FUNCTION: hash_insert
 * %ARGUMENTS:
@@ -67,22 +216,28 @@ hash_init(hash_table *tab,
 *  Nothing
 * %DESCRIPTION:
 *  Inserts an item into the hash table.  It must not currently be in any
-*  hash table.
+*  hash table.  Also does a little of any pending resize.
 ***********************************************************************/
 void
 hash_insert(hash_table *tab,
 	    void *item)
 {
     hash_bucket *b = GET_BUCKET(tab, item);
-    unsigned int val = tab->compute_hash(item);
-    b->hashval = val;
-    val %= HASHTAB_SIZE;
+    hash_bucket **head;
+
+    if (!tab->old_buckets && tab->num_entries >= tab->size) {
+	hash_grow(tab);
+    }
+    hash_rehash_step(tab, HASH_REHASH_STEP);
+
+    b->hashval = hash_mix(tab->compute_hash(item));
+    head = hash_chain(tab, b->hashval);
     b->prev = NULL;
-    b->next = tab->buckets[val];
+    b->next = *head;
     if (b->next) {
 	b->next->prev = b;
     }
-    tab->buckets[val] = b;
+    *head = b;
     tab->num_entries++;
 }
 
@@ -101,12 +256,11 @@ hash_remove(hash_table *tab,
 	    void *item)
 {
     hash_bucket *b = GET_BUCKET(tab, item);
-    unsigned int val = b->hashval % HASHTAB_SIZE;
 
     if (b->prev) {
 	b->prev->next = b->next;
     } else {
-	tab->buckets[val] = b->next;
+	*hash_chain(tab, b->hashval) = b->next;
     }
     if (b->next) {
 	b->next->prev = b->prev;
@@ -128,10 +282,12 @@ void *
 hash_find(hash_table *tab,
 	  void *item)
 {
-    unsigned int val = tab->compute_hash(item) % HASHTAB_SIZE;
+    unsigned int val = hash_mix(tab->compute_hash(item));
     hash_bucket *b;
-    for (b = tab->buckets[val]; b; b = b->next) {
-	void *item2 = GET_ITEM(tab, b);
+    for (b = *hash_chain(tab, val); b; b = b->next) {
+	void *item2;
+	if (b->hashval != val) continue;
+	item2 = GET_ITEM(tab, b);
 	if (!tab->compare(item, item2)) return item2;
     }
     return NULL;
@@ -168,12 +324,17 @@ hash_find_next(hash_table *tab,
 *  "first" entry in hash table, or NULL if table is empty
 * %DESCRIPTION:
 *  Starts an iterator -- sets cursor so hash_next will return next entry.
+*  Finishes any resize in progress first.  Removing the current item
+*  while iterating is safe; inserting may start a resize, after which
+*  items may be skipped or seen twice.
 ***********************************************************************/
 void *
 hash_start(hash_table *tab, void **cursor)
 {
-    int i;
-    for (i=0; i<HASHTAB_SIZE; i++) {
+    size_t i;
+
+    hash_rehash_step(tab, tab->old_size);
+    for (i=0; i<tab->size; i++) {
 	if (tab->buckets[i]) {
 	    /* Point cursor to NEXT item so it is valid
 	       even if current item is free'd */
@@ -213,17 +374,27 @@ hash_next(hash_table *tab, void **cursor)
 *  tab -- a hash table
 *  b -- a hash bucket
 * %RETURNS:
-*  Cursor value for bucket following b in hash table.
+*  Cursor value for bucket following b in hash table.  If a resize is
+*  in progress, the old bucket array is walked before the new one.
 ***********************************************************************/
 static void *
 hash_next_cursor(hash_table *tab, hash_bucket *b)
 {
-    unsigned int i;
+    size_t i;
     if (!b) return NULL;
     if (b->next) return b->next;
 
-    i = b->hashval % HASHTAB_SIZE;
-    for (++i; i<HASHTAB_SIZE; ++i) {
+    if (tab->old_buckets &&
+	(i = b->hashval & (tab->old_size - 1)) >= tab->rehash_pos) {
+	/* b is still in the old array */
+	for (++i; i<tab->old_size; ++i) {
+	    if (tab->old_buckets[i]) return tab->old_buckets[i];
+	}
+	i = 0;
+    } else {
+	i = (b->hashval & (tab->size - 1)) + 1;
+    }
+    for (; i<tab->size; ++i) {
 	if (tab->buckets[i]) return tab->buckets[i];
     }
     return NULL;
@@ -235,6 +406,237 @@ hash_num_entries(hash_table *tab)
     return tab->num_entries;
 }
 
+/**********************************************************************
+* %FUNCTION: hash_oa_index (static)
+* %ARGUMENTS:
+*  tab -- open-addressing table
+*  key -- a key
+* %RETURNS:
+*  Home slot for key
+***********************************************************************/
+static size_t
+hash_oa_index(hash_oa_table const *tab, uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return (size_t) key & (tab->size - 1);
+}
+
+/**********************************************************************
+* %FUNCTION: hash_oa_alloc (static)
+* %ARGUMENTS:
+*  size -- number of slots
+*  mem -- set to the block to free() later
+* %RETURNS:
+*  Zeroed, OA_ALIGN-aligned array of size slots, or NULL
+***********************************************************************/
+static hash_oa_slot *
+hash_oa_alloc(size_t size, void **mem)
+{
+    *mem = calloc(size * sizeof(hash_oa_slot) + OA_ALIGN - 1, 1);
+    if (!*mem) return NULL;
+    return (hash_oa_slot *)
+	(((uintptr_t) *mem + OA_ALIGN - 1) & ~(uintptr_t) (OA_ALIGN - 1));
+}
+
+/**********************************************************************
+* %FUNCTION: hash_oa_init
+* %ARGUMENTS:
+*  tab -- open-addressing table
+*  expected -- number of entries expected; sizes the table so it does
+*              not need to grow until that many are present
+* %RETURNS:
+*  0 on success, -1 if out of memory
+* %DESCRIPTION:
+*  Initializes an open-addressing hash table with linear probing.
+***********************************************************************/
+int
+hash_oa_init(hash_oa_table *tab, size_t expected)
+{
+    size_t size = OA_MIN_SIZE;
+
+    while (OA_FULL(size, expected + 1)) {
+	size *= 2;
+    }
+    tab->slots = hash_oa_alloc(size, &tab->mem);
+    tab->num_entries = 0;
+    if (!tab->slots) {
+	tab->size = 0;
+	return -1;
+    }
+    tab->size = size;
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: hash_oa_free
+* %ARGUMENTS:
+*  tab -- open-addressing table
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Frees the slot array.  Does not free the values.
+***********************************************************************/
+void
+hash_oa_free(hash_oa_table *tab)
+{
+    free(tab->mem);
+    tab->mem = NULL;
+    tab->slots = NULL;
+    tab->size = 0;
+    tab->num_entries = 0;
+}
+
+/**********************************************************************
+* %FUNCTION: hash_oa_grow (static)
+* %ARGUMENTS:
+*  tab -- open-addressing table
+* %RETURNS:
+*  0 on success, -1 if out of memory (table is unchanged)
+* %DESCRIPTION:
+*  Doubles the number of slots and re-inserts every entry.
+***********************************************************************/
+static int
+hash_oa_grow(hash_oa_table *tab)
+{
+    hash_oa_slot *old = tab->slots;
+    void *old_mem = tab->mem;
+    size_t old_size = tab->size;
+    size_t i, j;
+
+    tab->slots = hash_oa_alloc(old_size ? old_size * 2 : OA_MIN_SIZE,
+			       &tab->mem);
+    if (!tab->slots) {
+	tab->slots = old;
+	tab->mem = old_mem;
+	return -1;
+    }
+    tab->size = old_size ? old_size * 2 : OA_MIN_SIZE;
+    for (i=0; i<old_size; i++) {
+	if (!old[i].value) continue;
+	j = hash_oa_index(tab, old[i].key);
+	while (tab->slots[j].value) {
+	    j = (j + 1) & (tab->size - 1);
+	}
+	tab->slots[j] = old[i];
+    }
+    free(old_mem);
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: hash_oa_insert
+* %ARGUMENTS:
+*  tab -- open-addressing table
+*  key -- key
+*  value -- value to store; must not be NULL
+* %RETURNS:
+*  0 on success, -1 on failure
+* %DESCRIPTION:
+*  Stores value under key, replacing any existing value for key.
+***********************************************************************/
+int
+hash_oa_insert(hash_oa_table *tab, uint64_t key, void *value)
+{
+    size_t i;
+
+    if (!value) return -1;
+    if (OA_FULL(tab->size, tab->num_entries + 1)) {
+	/* If we can't grow, carry on as long as there is a free slot */
+	if (hash_oa_grow(tab) < 0 && tab->num_entries + 1 >= tab->size) {
+	    return -1;
+	}
+    }
+
+    i = hash_oa_index(tab, key);
+    while (tab->slots[i].value) {
+	if (tab->slots[i].key == key) {
+	    tab->slots[i].value = value;
+	    return 0;
+	}
+	i = (i + 1) & (tab->size - 1);
+    }
+    tab->slots[i].key = key;
+    tab->slots[i].value = value;
+    tab->num_entries++;
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: hash_oa_find
+* %ARGUMENTS:
+*  tab -- open-addressing table
+*  key -- key to look up
+* %RETURNS:
+*  Value stored under key, or NULL
+***********************************************************************/
+void *
+hash_oa_find(hash_oa_table const *tab, uint64_t key)
+{
+    size_t i;
+
+    if (!tab->size) return NULL;
+    i = hash_oa_index(tab, key);
+    while (tab->slots[i].value) {
+	if (tab->slots[i].key == key) return tab->slots[i].value;
+	i = (i + 1) & (tab->size - 1);
+    }
+    return NULL;
+}
+
+/**********************************************************************
+* %FUNCTION: hash_oa_remove
+* %ARGUMENTS:
+*  tab -- open-addressing table
+*  key -- key to remove
+* %RETURNS:
+*  The value which was stored under key, or NULL if there was none
+* %DESCRIPTION:
+*  Removes key.  Following entries in the probe run are shifted back,
+*  so no tombstones are left behind.
+***********************************************************************/
+void *
+hash_oa_remove(hash_oa_table *tab, uint64_t key)
+{
+    size_t i, j, k;
+    size_t mask = tab->size - 1;
+    void *value;
+
+    if (!tab->size) return NULL;
+    i = hash_oa_index(tab, key);
+    while (tab->slots[i].value) {
+	if (tab->slots[i].key == key) break;
+	i = (i + 1) & mask;
+    }
+    value = tab->slots[i].value;
+    if (!value) return NULL;
+
+    j = i;
+    for (;;) {
+	j = (j + 1) & mask;
+	if (!tab->slots[j].value) break;
+	k = hash_oa_index(tab, tab->slots[j].key);
+	/* Entry at j may fill the hole at i unless its home slot k
+	   lies cyclically in (i, j] */
+	if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+	    tab->slots[i] = tab->slots[j];
+	    i = j;
+	}
+    }
+    tab->slots[i].value = NULL;
+    tab->num_entries--;
+    return value;
+}
+
+size_t
+hash_oa_num_entries(hash_oa_table const *tab)
+{
+    return tab->num_entries;
+}
+
 /**********************************************************************
 * %FUNCTION: hash_pjw
 * %ARGUMENTS:
@@ -14,8 +14,15 @@
 #define HASH_H
 
 #include <stdlib.h>
-/* Fixed-size hash tables for now */
-#define HASHTAB_SIZE 67
+#include <stdint.h>
+
+/* Initial number of buckets (must be a power of two).  Tables double
+   in size when the load factor passes 1; the rehash is spread over
+   subsequent inserts so no single insert stalls. */
+#define HASH_MIN_SIZE 64
+
+/* Number of old buckets migrated per insert while a resize is running */
+#define HASH_REHASH_STEP 4
 
 /* A hash bucket */
 typedef struct hash_bucket_t {
@@ -24,15 +31,35 @@ typedef struct hash_bucket_t {
     unsigned int hashval;
 } hash_bucket;
 
-/* A hash table */
+/* A hash table.  While a resize is in progress, an item lives in
+   old_buckets if its old index is >= rehash_pos, and in buckets otherwise. */
 typedef struct hash_table_t {
-    hash_bucket *buckets[HASHTAB_SIZE];
+    hash_bucket **buckets;	/* Current bucket array */
+    size_t size;		/* Number of buckets; power of two */
+    hash_bucket **old_buckets;	/* Array being migrated, or NULL */
+    size_t old_size;		/* Number of buckets in old_buckets */
+    size_t rehash_pos;		/* Next old bucket to migrate */
+    hash_bucket *initial[HASH_MIN_SIZE]; /* Buckets before first resize */
     size_t hash_offset;
     unsigned int (*compute_hash)(void *data);
     int (*compare)(void *item1, void *item2);
     size_t num_entries;
 } hash_table;
 
+/* An open-addressing table for small fixed-size keys.  Keys are packed
+   into 64 bits by the caller; values must be non-NULL. */
+typedef struct hash_oa_slot_t {
+    uint64_t key;
+    void *value;		/* NULL means slot is empty */
+} hash_oa_slot;
+
+typedef struct hash_oa_table_t {
+    hash_oa_slot *slots;	/* Cache-line aligned */
+    void *mem;			/* Allocation slots lie in */
+    size_t size;		/* Number of slots; power of two */
+    size_t num_entries;
+} hash_oa_table;
+
 /* Functions */
 void hash_init(hash_table *tab,
 	       size_t hash_offset,
@@ -43,11 +70,20 @@ void hash_remove(hash_table *tab, void *item);
 void *hash_find(hash_table *tab, void *item);
 void *hash_find_next(hash_table *tab, void *item);
 size_t hash_num_entries(hash_table *tab);
+void hash_free(hash_table *tab);
 
 /* Iteration functions */
 void *hash_start(hash_table *tab, void **cursor);
 void *hash_next(hash_table *tab, void **cursor);
 
+/* Open-addressing tables */
+int hash_oa_init(hash_oa_table *tab, size_t expected);
+void hash_oa_free(hash_oa_table *tab);
+int hash_oa_insert(hash_oa_table *tab, uint64_t key, void *value);
+void *hash_oa_find(hash_oa_table const *tab, uint64_t key);
+void *hash_oa_remove(hash_oa_table *tab, uint64_t key);
+size_t hash_oa_num_entries(hash_oa_table const *tab);
+
 /* Utility function: hashpjw for strings */
 unsigned int hash_pjw(char const *str);
 
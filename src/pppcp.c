@@ -0,0 +1,1540 @@
+/***********************************************************************
+*
+* pppcp.c
+*
+* In-process PPP control plane for pppoe-server.  Negotiates LCP,
+* PAP or CHAP and IPCP for each session over a kernel PPPoE channel
+* and hands the data path to a kernel ppp unit, so that one server
+* process terminates many sessions without a pppd per session.
+*
+* Copyright (C) 2001-2012 Roaring Penguin Software Inc.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+* LIC: GPL
+*
+***********************************************************************/
+
+#include "config.h"
+
+#ifdef HAVE_LINUX_IF_PPPOX_H
+
+#include <sys/socket.h>
+#include <net/if.h>
+#include "pppoe-server.h"
+#include "md5.h"
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <linux/ppp_defs.h>
+#include <linux/ppp-ioctl.h>
+#include <linux/if_pppox.h>
+
+#ifndef PAP_SECRETS_FILE
+#define PAP_SECRETS_FILE "/etc/ppp/pap-secrets"
+#endif
+#ifndef CHAP_SECRETS_FILE
+#define CHAP_SECRETS_FILE "/etc/ppp/chap-secrets"
+#endif
+
+/* Control protocol codes (RFC 1661) */
+#define CP_CONFREQ  1
+#define CP_CONFACK  2
+#define CP_CONFNAK  3
+#define CP_CONFREJ  4
+#define CP_TERMREQ  5
+#define CP_TERMACK  6
+#define CP_CODEREJ  7
+#define CP_PROTREJ  8
+#define CP_ECHOREQ  9
+#define CP_ECHOREP  10
+#define CP_DISCREQ  11
+
+#define CP_HDR_LEN  4
+
+/* LCP and IPCP options we understand */
+#define LCP_OPT_MRU   1
+#define LCP_OPT_ACCM  2
+#define LCP_OPT_AUTH  3
+#define LCP_OPT_MAGIC 5
+#define IPCP_OPT_ADDR 3
+
+/* PAP and CHAP codes */
+#define PAP_AUTHREQ  1
+#define PAP_AUTHACK  2
+#define PAP_AUTHNAK  3
+#define CHAP_CHALLENGE 1
+#define CHAP_RESPONSE  2
+#define CHAP_SUCCESS   3
+#define CHAP_FAILURE   4
+#define CHAP_MD5       5
+#define CHAP_CHALLENGE_LEN 16
+
+/* Control protocol states.  We are always the active end, so the
+   Initial/Starting/Closed/Stopped states of RFC 1661 never arise. */
+#define CP_REQSENT  0
+#define CP_ACKRCVD  1
+#define CP_ACKSENT  2
+#define CP_OPENED   3
+
+/* Link phases */
+#define PHASE_ESTABLISH    0
+#define PHASE_AUTHENTICATE 1
+#define PHASE_NETWORK      2
+#define PHASE_TERMINATE    3
+
+/* Timers and counters, as pppd's defaults */
+#define PPP_RESTART_TIME   3	/* Seconds between retransmissions */
+#define PPP_MAX_CONFIGURE  10	/* Configure-Requests before giving up */
+#define PPP_MAX_TERMINATE  2	/* Terminate-Requests before giving up */
+#define PPP_MAX_FAILURE    10	/* Naks sent or received before giving up */
+
+#define PPP_MIN_MRU        128
+#define PPP_PPPOE_MRU      1492
+#define PPP_FRAME_LEN      (ETH_JUMBO_LEN + 2)
+#define MAX_PEER_NAME      64
+
+/* Per-protocol state for LCP and IPCP */
+typedef struct {
+    int state;
+    unsigned char id;		/* Identifier of our last request */
+    int retries;		/* Retransmissions of current request */
+    int failures;		/* Naks exchanged without converging */
+} CPState;
+
+/* Everything the engine keeps for one session */
+typedef struct PPPEngineStruct {
+    ClientSession *ses;
+    int pppoxSock;		/* AF_PPPOX socket; owns the channel */
+    int chanFd;			/* /dev/ppp attached to channel: LCP, auth */
+    int unitFd;			/* /dev/ppp unit: NCPs */
+    int unit;			/* ppp unit number */
+    EventHandler *chanHandler;
+    EventHandler *unitHandler;
+    EventHandler *timer;
+    int phase;
+    CPState lcp;
+    CPState ipcp;
+    UINT32_t myMagic;
+    UINT16_t myMRU;
+    UINT16_t peerMRU;
+    unsigned char reqMRU;	/* Still asking for myMRU */
+    unsigned char reqMagic;	/* Still asking for myMagic */
+    unsigned char reqAddr;	/* Still asking for our IP address */
+    unsigned char chapId;
+    unsigned char challenge[CHAP_CHALLENGE_LEN];
+    char peerName[MAX_PEER_NAME+1];
+    char const *closeReason;	/* PADT reason once LCP is closing */
+} PPPEngine;
+
+/* Protocol-specific parts of the option negotiation automaton */
+typedef struct {
+    UINT16_t proto;
+    char const *name;
+    void (*sendConfReq)(PPPEngine *e);
+    int (*checkConfReq)(PPPEngine *e, unsigned char const *opts, int len,
+			unsigned char *reply, int *replyLen);
+    int (*gotNakOrRej)(PPPEngine *e, int code,
+		       unsigned char const *opts, int len);
+    void (*up)(PPPEngine *e);
+} CPHandler;
+
+/* A PAP or CHAP secret */
+typedef struct {
+    hash_bucket hash;
+    char *client;
+    char *server;
+    char *secret;
+} PPPSecret;
+
+static void lcpSendConfReq(PPPEngine *e);
+static int lcpCheckConfReq(PPPEngine *e, unsigned char const *opts, int len,
+			   unsigned char *reply, int *replyLen);
+static int lcpGotNakOrRej(PPPEngine *e, int code,
+			  unsigned char const *opts, int len);
+static void lcpUp(PPPEngine *e);
+static void ipcpSendConfReq(PPPEngine *e);
+static int ipcpCheckConfReq(PPPEngine *e, unsigned char const *opts, int len,
+			    unsigned char *reply, int *replyLen);
+static int ipcpGotNakOrRej(PPPEngine *e, int code,
+			   unsigned char const *opts, int len);
+static void ipcpUp(PPPEngine *e);
+
+static void BuiltinStopSession(ClientSession *ses, char const *reason);
+static int BuiltinSessionIsActive(ClientSession *ses);
+
+static CPHandler const LCPHandler = {
+    PPP_LCP, "LCP",
+    lcpSendConfReq, lcpCheckConfReq, lcpGotNakOrRej, lcpUp
+};
+
+static CPHandler const IPCPHandler = {
+    PPP_IPCP, "IPCP",
+    ipcpSendConfReq, ipcpCheckConfReq, ipcpGotNakOrRej, ipcpUp
+};
+
+PppoeSessionFunctionTable BuiltinSessionFunctionTable = {
+    BuiltinStopSession,
+    BuiltinSessionIsActive,
+    NULL
+};
+
+/* Authentication protocol we demand: 0, PPP_PAP or PPP_CHAP */
+static UINT16_t AuthProto = 0;
+
+/* Secrets, keyed by client name; "*" clients are kept aside */
+static hash_table Secrets;
+static PPPSecret *WildcardSecret = NULL;
+
+/* Socket used for interface ioctls */
+static int IfSock = -1;
+
+/* /dev/urandom, for CHAP challenges */
+static int RandomFD = -1;
+
+#define GET16(p) ((UINT16_t) (((p)[0] << 8) | (p)[1]))
+#define PUT16(p, v) do { (p)[0] = ((v) >> 8) & 0xFF; (p)[1] = (v) & 0xFF; } while(0)
+#define PUT32(p, v) do { PUT16(p, (v) >> 16); PUT16((p)+2, (v) & 0xFFFF); } while(0)
+
+/**********************************************************************
+*%FUNCTION: secretHash, secretCompare
+*%DESCRIPTION:
+* Hash-table callbacks for the secrets table
+***********************************************************************/
+static unsigned int
+secretHash(void *data)
+{
+    return hash_pjw(((PPPSecret *) data)->client);
+}
+
+static int
+secretCompare(void *d1, void *d2)
+{
+    return strcmp(((PPPSecret *) d1)->client, ((PPPSecret *) d2)->client);
+}
+
+/**********************************************************************
+*%FUNCTION: nextToken
+*%ARGUMENTS:
+* cursor -- pointer into a line; advanced past the token
+*%RETURNS:
+* The next whitespace-separated, optionally double-quoted token
+* (terminated in place), or NULL at end of line or start of a comment.
+***********************************************************************/
+static char *
+nextToken(char **cursor)
+{
+    char *s = *cursor;
+    char *tok;
+
+    while (*s == ' ' || *s == '\t') s++;
+    if (!*s || *s == '\n' || *s == '#') return NULL;
+    if (*s == '"') {
+	tok = ++s;
+	while (*s && *s != '"') s++;
+    } else {
+	tok = s;
+	while (*s && *s != ' ' && *s != '\t' && *s != '\n') s++;
+    }
+    if (*s) *s++ = 0;
+    *cursor = s;
+    return tok;
+}
+
+/**********************************************************************
+*%FUNCTION: loadSecrets
+*%ARGUMENTS:
+* fname -- a pppd-style secrets file
+*%RETURNS:
+* Nothing; exits on error
+*%DESCRIPTION:
+* Reads "client server secret" lines.  Further fields (IP address
+* lists) are ignored; addresses come from the server's pool.
+***********************************************************************/
+static void
+loadSecrets(char const *fname)
+{
+    char line[1024];
+    char *cursor, *client, *server, *secret;
+    PPPSecret *s;
+    FILE *fp = fopen(fname, "r");
+
+    if (!fp) fatalSys(fname);
+
+    hash_init(&Secrets, offsetof(PPPSecret, hash), secretHash, secretCompare);
+    while (fgets(line, sizeof(line), fp)) {
+	cursor = line;
+	client = nextToken(&cursor);
+	server = nextToken(&cursor);
+	secret = nextToken(&cursor);
+	if (!client || !server || !secret) continue;
+
+	s = malloc(sizeof(PPPSecret));
+	if (!s) rp_fatal("Out of memory");
+	s->client = strdup(client);
+	s->server = strdup(server);
+	s->secret = strdup(secret);
+	if (!s->client || !s->server || !s->secret) rp_fatal("Out of memory");
+	if (!strcmp(client, "*")) {
+	    if (!WildcardSecret) WildcardSecret = s;
+	    continue;
+	}
+	if (hash_find(&Secrets, s)) {
+	    /* First entry wins, as in pppd */
+	    continue;
+	}
+	hash_insert(&Secrets, s);
+    }
+    fclose(fp);
+}
+
+/**********************************************************************
+*%FUNCTION: findSecret
+*%ARGUMENTS:
+* client -- peer's name
+*%RETURNS:
+* The secret for client, or NULL if there is none for this server
+***********************************************************************/
+static char const *
+findSecret(char const *client)
+{
+    PPPSecret key, *s;
+
+    key.client = (char *) client;
+    s = hash_find(&Secrets, &key);
+    if (!s) s = WildcardSecret;
+    if (!s) return NULL;
+    if (strcmp(s->server, "*") && strcmp(s->server, ACName)) return NULL;
+    return s->secret;
+}
+
+/**********************************************************************
+*%FUNCTION: pppEngineInit
+*%ARGUMENTS:
+* auth -- "none", "pap" or "chap"
+*%RETURNS:
+* 0 if OK, -1 if auth is not recognized
+*%DESCRIPTION:
+* Selects the authentication protocol and loads its secrets.
+***********************************************************************/
+int
+pppEngineInit(char const *auth)
+{
+    if (!strcmp(auth, "none")) {
+	AuthProto = 0;
+    } else if (!strcmp(auth, "pap")) {
+	AuthProto = PPP_PAP;
+	loadSecrets(PAP_SECRETS_FILE);
+    } else if (!strcmp(auth, "chap")) {
+	AuthProto = PPP_CHAP;
+	loadSecrets(CHAP_SECRETS_FILE);
+	RandomFD = open("/dev/urandom", O_RDONLY);
+	if (RandomFD < 0) fatalSys("open(/dev/urandom)");
+	fcntl(RandomFD, F_SETFD, FD_CLOEXEC);
+    } else {
+	return -1;
+    }
+
+    IfSock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (IfSock < 0) fatalSys("socket");
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: sendCP
+*%ARGUMENTS:
+* e -- engine
+* proto -- PPP protocol
+* code, id -- packet code and identifier
+* data, len -- packet data
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Sends a control packet.  Link-level protocols go on the channel,
+* network control protocols on the unit, as ppp_generic expects.
+***********************************************************************/
+static void
+sendCP(PPPEngine *e, UINT16_t proto, unsigned char code, unsigned char id,
+       unsigned char const *data, int len)
+{
+    unsigned char buf[PPP_FRAME_LEN];
+    int fd = (proto >= 0xC000) ? e->chanFd : e->unitFd;
+
+    if (len + 2 + CP_HDR_LEN > (int) sizeof(buf)) return;
+    PUT16(buf, proto);
+    buf[2] = code;
+    buf[3] = id;
+    PUT16(buf+4, len + CP_HDR_LEN);
+    if (len) memcpy(buf+6, data, len);
+    if (write(fd, buf, len + 2 + CP_HDR_LEN) < 0) {
+	syslog(LOG_DEBUG, "Session %u: write: %m",
+	       (unsigned int) ntohs(e->ses->sess));
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: setTimer
+*%ARGUMENTS:
+* e -- engine
+* secs -- timeout, or 0 to cancel
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* (Re)arms the engine's single retransmission timer
+***********************************************************************/
+static void engineTimeout(EventSelector *es, int fd, unsigned int flags,
+			  void *data);
+
+static void
+setTimer(PPPEngine *e, int secs)
+{
+    struct timeval t;
+
+    if (e->timer) {
+	Event_DelHandler(event_selector, e->timer);
+	e->timer = NULL;
+    }
+    if (!secs) return;
+    t.tv_sec = secs;
+    t.tv_usec = 0;
+    e->timer = Event_AddTimerHandler(event_selector, t, engineTimeout, e);
+    if (!e->timer) {
+	syslog(LOG_ERR, "Session %u: unable to add timer",
+	       (unsigned int) ntohs(e->ses->sess));
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: engineClose
+*%ARGUMENTS:
+* e -- engine
+* reason -- reason sent in the PADT
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Tears down the channel and unit immediately and releases the session.
+***********************************************************************/
+static void
+engineClose(PPPEngine *e, char const *reason)
+{
+    ClientSession *ses = e->ses;
+
+    setTimer(e, 0);
+    if (e->chanHandler) Event_DelHandler(event_selector, e->chanHandler);
+    if (e->unitHandler) Event_DelHandler(event_selector, e->unitHandler);
+    if (e->unitFd >= 0) close(e->unitFd);
+    if (e->chanFd >= 0) close(e->chanFd);
+    if (e->pppoxSock >= 0) close(e->pppoxSock);
+    free(e);
+
+    ses->ppp = NULL;
+    pppoe_session_closed(ses, reason);
+}
+
+/**********************************************************************
+*%FUNCTION: lcpClose
+*%ARGUMENTS:
+* e -- engine
+* reason -- reason sent in the PADT
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Starts an orderly LCP shutdown.  The session is released when the
+* peer acknowledges or the Terminate-Requests time out.
+***********************************************************************/
+static void
+lcpClose(PPPEngine *e, char const *reason)
+{
+    static unsigned char const msg[] = "Goodbye";
+
+    if (e->phase == PHASE_TERMINATE) return;
+    e->phase = PHASE_TERMINATE;
+    e->closeReason = reason;
+    e->lcp.retries = 0;
+    sendCP(e, PPP_LCP, CP_TERMREQ, ++e->lcp.id, msg, sizeof(msg)-1);
+    setTimer(e, PPP_RESTART_TIME);
+}
+
+/**********************************************************************
+*%FUNCTION: cpUp
+*%ARGUMENTS:
+* e -- engine
+* cp -- protocol state
+* h -- protocol handler
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Both directions of cp are acknowledged; move to Opened.
+***********************************************************************/
+static void
+cpUp(PPPEngine *e, CPState *cp, CPHandler const *h)
+{
+    cp->state = CP_OPENED;
+    cp->retries = 0;
+    cp->failures = 0;
+    setTimer(e, 0);
+    h->up(e);
+}
+
+/**********************************************************************
+*%FUNCTION: cpInput
+*%ARGUMENTS:
+* e -- engine
+* cp -- protocol state
+* h -- protocol handler
+* pkt, len -- control packet, starting at the code field
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Runs the RFC 1661 option-negotiation automaton for LCP or IPCP
+***********************************************************************/
+static void
+cpInput(PPPEngine *e, CPState *cp, CPHandler const *h,
+	unsigned char const *pkt, int len)
+{
+    unsigned char reply[PPP_FRAME_LEN];
+    int replyLen;
+    int code = pkt[0];
+    unsigned char id = pkt[1];
+    unsigned char const *data = pkt + CP_HDR_LEN;
+    int dlen = len - CP_HDR_LEN;
+
+    switch(code) {
+    case CP_CONFREQ:
+	if (cp->state == CP_OPENED) {
+	    if (h == &LCPHandler) {
+		/* Would tear down authentication and IPCP; the peer
+		   can reconnect instead */
+		engineClose(e, "RP-PPPoE: LCP renegotiation not supported");
+		return;
+	    }
+	    cp->state = CP_REQSENT;
+	    cp->retries = 0;
+	    h->sendConfReq(e);
+	    setTimer(e, PPP_RESTART_TIME);
+	}
+	code = h->checkConfReq(e, data, dlen, reply, &replyLen);
+	if (code < 0) return;
+	if (code != CP_CONFACK && ++cp->failures > PPP_MAX_FAILURE) {
+	    lcpClose(e, "RP-PPPoE: PPP negotiation failed");
+	    return;
+	}
+	sendCP(e, h->proto, code, id, reply, replyLen);
+	if (code == CP_CONFACK) {
+	    if (cp->state == CP_ACKRCVD) {
+		cpUp(e, cp, h);
+	    } else {
+		cp->state = CP_ACKSENT;
+	    }
+	} else if (cp->state == CP_ACKSENT) {
+	    cp->state = CP_REQSENT;
+	}
+	break;
+
+    case CP_CONFACK:
+	if (id != cp->id) break;
+	if (cp->state == CP_REQSENT) {
+	    cp->state = CP_ACKRCVD;
+	    cp->retries = 0;
+	} else if (cp->state == CP_ACKSENT) {
+	    cpUp(e, cp, h);
+	}
+	break;
+
+    case CP_CONFNAK:
+    case CP_CONFREJ:
+	if (id != cp->id) break;
+	if (cp->state != CP_REQSENT && cp->state != CP_ACKSENT) break;
+	if (++cp->failures > PPP_MAX_FAILURE) {
+	    lcpClose(e, "RP-PPPoE: PPP negotiation failed");
+	    return;
+	}
+	if (h->gotNakOrRej(e, code, data, dlen) < 0) return;
+	h->sendConfReq(e);
+	setTimer(e, PPP_RESTART_TIME);
+	break;
+
+    case CP_TERMREQ:
+	sendCP(e, h->proto, CP_TERMACK, id, NULL, 0);
+	engineClose(e, "RP-PPPoE: Peer terminated PPP session");
+	break;
+
+    case CP_TERMACK:
+	if (h == &LCPHandler && e->phase == PHASE_TERMINATE) {
+	    engineClose(e, e->closeReason);
+	}
+	break;
+
+    case CP_CODEREJ:
+	syslog(LOG_WARNING, "Session %u: peer sent %s Code-Reject",
+	       (unsigned int) ntohs(e->ses->sess), h->name);
+	break;
+
+    default:
+	sendCP(e, h->proto, CP_CODEREJ, ++cp->id, pkt, len);
+	break;
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: cpTimeout
+*%ARGUMENTS:
+* e -- engine
+* cp -- protocol state
+* h -- protocol handler
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Retransmits our Configure-Request, giving up after PPP_MAX_CONFIGURE
+***********************************************************************/
+static void
+cpTimeout(PPPEngine *e, CPState *cp, CPHandler const *h)
+{
+    if (++cp->retries > PPP_MAX_CONFIGURE) {
+	syslog(LOG_INFO, "Session %u: %s negotiation timed out",
+	       (unsigned int) ntohs(e->ses->sess), h->name);
+	engineClose(e, "RP-PPPoE: PPP negotiation timed out");
+	return;
+    }
+    if (cp->state == CP_ACKRCVD) cp->state = CP_REQSENT;
+    h->sendConfReq(e);
+    setTimer(e, PPP_RESTART_TIME);
+}
+
+/**********************************************************************
+*%FUNCTION: lcpSendConfReq
+*%ARGUMENTS:
+* e -- engine
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Asks for the PPPoE MRU, our authentication protocol and a magic number
+***********************************************************************/
+static void
+lcpSendConfReq(PPPEngine *e)
+{
+    unsigned char opts[32];
+    int n = 0;
+
+    if (e->reqMRU) {
+	opts[n++] = LCP_OPT_MRU;
+	opts[n++] = 4;
+	PUT16(opts+n, e->myMRU);
+	n += 2;
+    }
+    if (AuthProto == PPP_PAP) {
+	opts[n++] = LCP_OPT_AUTH;
+	opts[n++] = 4;
+	PUT16(opts+n, PPP_PAP);
+	n += 2;
+    } else if (AuthProto == PPP_CHAP) {
+	opts[n++] = LCP_OPT_AUTH;
+	opts[n++] = 5;
+	PUT16(opts+n, PPP_CHAP);
+	n += 2;
+	opts[n++] = CHAP_MD5;
+    }
+    if (e->reqMagic) {
+	opts[n++] = LCP_OPT_MAGIC;
+	opts[n++] = 6;
+	PUT32(opts+n, e->myMagic);
+	n += 4;
+    }
+    sendCP(e, PPP_LCP, CP_CONFREQ, ++e->lcp.id, opts, n);
+}
+
+/**********************************************************************
+*%FUNCTION: lcpCheckConfReq
+*%ARGUMENTS:
+* e -- engine
+* opts, len -- options in the peer's Configure-Request
+* reply, replyLen -- set to the options for our reply
+*%RETURNS:
+* CP_CONFACK, CP_CONFNAK or CP_CONFREJ, or -1 if the request is malformed
+*%DESCRIPTION:
+* We accept MRU, ACCM and magic number; everything else (including a
+* request that we authenticate ourselves) is rejected.
+***********************************************************************/
+static int
+lcpCheckConfReq(PPPEngine *e, unsigned char const *opts, int len,
+		unsigned char *reply, int *replyLen)
+{
+    unsigned char nak[PPP_FRAME_LEN], rej[PPP_FRAME_LEN];
+    int nakLen = 0, rejLen = 0;
+    unsigned char const *p = opts;
+    UINT16_t mru = PPP_MRU;
+    UINT32_t magic;
+    int olen;
+
+    while (len > 0) {
+	if (len < 2 || p[1] < 2 || p[1] > len) return -1;
+	olen = p[1];
+	switch(p[0]) {
+	case LCP_OPT_MRU:
+	    if (olen != 4) goto reject;
+	    mru = GET16(p+2);
+	    if (mru < PPP_MIN_MRU) {
+		nak[nakLen++] = LCP_OPT_MRU;
+		nak[nakLen++] = 4;
+		PUT16(nak+nakLen, PPP_MIN_MRU);
+		nakLen += 2;
+	    }
+	    break;
+	case LCP_OPT_ACCM:
+	    /* Meaningless on a synchronous channel, but harmless */
+	    if (olen != 6) goto reject;
+	    break;
+	case LCP_OPT_MAGIC:
+	    if (olen != 6) goto reject;
+	    magic = ((UINT32_t) GET16(p+2) << 16) | GET16(p+4);
+	    if (!magic || (e->reqMagic && magic == e->myMagic)) {
+		/* Looped back, or invalid: suggest another */
+		magic = ((UINT32_t) rand() << 16) ^ (UINT32_t) rand();
+		if (!magic) magic = 1;
+		nak[nakLen++] = LCP_OPT_MAGIC;
+		nak[nakLen++] = 6;
+		PUT32(nak+nakLen, magic);
+		nakLen += 4;
+	    }
+	    break;
+	default:
+	reject:
+	    memcpy(rej+rejLen, p, olen);
+	    rejLen += olen;
+	    break;
+	}
+	p += olen;
+	len -= olen;
+    }
+
+    if (rejLen) {
+	memcpy(reply, rej, rejLen);
+	*replyLen = rejLen;
+	return CP_CONFREJ;
+    }
+    if (nakLen) {
+	memcpy(reply, nak, nakLen);
+	*replyLen = nakLen;
+	return CP_CONFNAK;
+    }
+    e->peerMRU = mru;
+    *replyLen = p - opts;
+    memcpy(reply, opts, *replyLen);
+    return CP_CONFACK;
+}
+
+/**********************************************************************
+*%FUNCTION: lcpGotNakOrRej
+*%ARGUMENTS:
+* e -- engine
+* code -- CP_CONFNAK or CP_CONFREJ
+* opts, len -- options from the peer
+*%RETURNS:
+* 0 to send a revised request, -1 if the link is being closed
+***********************************************************************/
+static int
+lcpGotNakOrRej(PPPEngine *e, int code, unsigned char const *opts, int len)
+{
+    UINT16_t mru;
+
+    while (len >= 2 && opts[1] >= 2 && opts[1] <= len) {
+	switch(opts[0]) {
+	case LCP_OPT_MRU:
+	    if (code == CP_CONFREJ) {
+		e->reqMRU = 0;
+	    } else if (opts[1] == 4) {
+		mru = GET16(opts+2);
+		if (mru >= PPP_MIN_MRU && mru < e->myMRU) e->myMRU = mru;
+	    }
+	    break;
+	case LCP_OPT_AUTH:
+	    syslog(LOG_INFO, "Session %u: peer refused to authenticate",
+		   (unsigned int) ntohs(e->ses->sess));
+	    lcpClose(e, "RP-PPPoE: Peer refused to authenticate");
+	    return -1;
+	case LCP_OPT_MAGIC:
+	    if (code == CP_CONFREJ) {
+		e->reqMagic = 0;
+	    } else {
+		e->myMagic = ((UINT32_t) rand() << 16) ^ (UINT32_t) rand();
+		if (!e->myMagic) e->myMagic = 1;
+	    }
+	    break;
+	}
+	len -= opts[1];
+	opts += opts[1];
+    }
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: networkPhase
+*%ARGUMENTS:
+* e -- engine
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Authentication (if any) is done; start IPCP
+***********************************************************************/
+static void
+networkPhase(PPPEngine *e)
+{
+    e->phase = PHASE_NETWORK;
+    e->ipcp.state = CP_REQSENT;
+    e->ipcp.retries = 0;
+    ipcpSendConfReq(e);
+    setTimer(e, PPP_RESTART_TIME);
+}
+
+/**********************************************************************
+*%FUNCTION: chapSendChallenge
+*%ARGUMENTS:
+* e -- engine
+*%RETURNS:
+* 0 if OK, -1 if no random challenge could be read
+*%DESCRIPTION:
+* Sends a fresh CHAP-MD5 challenge
+***********************************************************************/
+static int
+chapSendChallenge(PPPEngine *e)
+{
+    unsigned char buf[1 + CHAP_CHALLENGE_LEN + 256];
+    size_t nlen = strlen(ACName);
+
+    if (nlen > 255) nlen = 255;
+    if (read(RandomFD, e->challenge, CHAP_CHALLENGE_LEN) != CHAP_CHALLENGE_LEN) {
+	syslog(LOG_ERR, "Session %u: cannot read CHAP challenge: %m",
+	       (unsigned int) ntohs(e->ses->sess));
+	return -1;
+    }
+    buf[0] = CHAP_CHALLENGE_LEN;
+    memcpy(buf+1, e->challenge, CHAP_CHALLENGE_LEN);
+    memcpy(buf+1+CHAP_CHALLENGE_LEN, ACName, nlen);
+    sendCP(e, PPP_CHAP, CHAP_CHALLENGE, ++e->chapId, buf,
+	   (int) (1 + CHAP_CHALLENGE_LEN + nlen));
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: lcpUp
+*%ARGUMENTS:
+* e -- engine
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* LCP is open: authenticate the peer or go straight to IPCP
+***********************************************************************/
+static void
+lcpUp(PPPEngine *e)
+{
+    e->lcp.retries = 0;
+    if (!AuthProto) {
+	networkPhase(e);
+	return;
+    }
+    e->phase = PHASE_AUTHENTICATE;
+    if (AuthProto == PPP_CHAP && chapSendChallenge(e) < 0) {
+	lcpClose(e, "RP-PPPoE: Cannot generate CHAP challenge");
+	return;
+    }
+    setTimer(e, PPP_RESTART_TIME);
+}
+
+/**********************************************************************
+*%FUNCTION: authDone
+*%ARGUMENTS:
+* e -- engine
+* name, nlen -- peer's name
+* ok -- true if the peer authenticated
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+authDone(PPPEngine *e, unsigned char const *name, int nlen, int ok)
+{
+    if (nlen > MAX_PEER_NAME) nlen = MAX_PEER_NAME;
+    memcpy(e->peerName, name, nlen);
+    e->peerName[nlen] = 0;
+
+    if (!ok) {
+	syslog(LOG_WARNING, "Session %u: authentication failed for '%s'",
+	       (unsigned int) ntohs(e->ses->sess), e->peerName);
+	lcpClose(e, "RP-PPPoE: Authentication failed");
+	return;
+    }
+    syslog(LOG_INFO, "Session %u: user '%s' authenticated",
+	   (unsigned int) ntohs(e->ses->sess), e->peerName);
+#ifdef HAVE_LICENSE
+    strncpy(SESSION_INFO(e->ses)->user, e->peerName, MAX_USERNAME_LEN);
+#endif
+    networkPhase(e);
+}
+
+/**********************************************************************
+*%FUNCTION: papInput
+*%ARGUMENTS:
+* e -- engine
+* pkt, len -- PAP packet, starting at the code field
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+papInput(PPPEngine *e, unsigned char const *pkt, int len)
+{
+    static unsigned char const okMsg[] = "\010Login ok";
+    static unsigned char const badMsg[] = "\017Login incorrect";
+    char user[256], pass[256];
+    unsigned char const *data = pkt + CP_HDR_LEN;
+    int dlen = len - CP_HDR_LEN;
+    int ulen, plen;
+    char const *secret;
+    int ok;
+
+    if (pkt[0] != PAP_AUTHREQ || AuthProto != PPP_PAP) return;
+
+    if (e->phase == PHASE_NETWORK) {
+	/* Our Ack was lost */
+	sendCP(e, PPP_PAP, PAP_AUTHACK, pkt[1], okMsg, sizeof(okMsg)-1);
+	return;
+    }
+    if (e->phase != PHASE_AUTHENTICATE) return;
+
+    if (dlen < 1) return;
+    ulen = data[0];
+    if (dlen < 1 + ulen + 1) return;
+    plen = data[1 + ulen];
+    if (dlen < 2 + ulen + plen) return;
+    memcpy(user, data+1, ulen);
+    user[ulen] = 0;
+    memcpy(pass, data+2+ulen, plen);
+    pass[plen] = 0;
+
+    secret = findSecret(user);
+    ok = (secret && !strcmp(secret, pass));
+    if (ok) {
+	sendCP(e, PPP_PAP, PAP_AUTHACK, pkt[1], okMsg, sizeof(okMsg)-1);
+    } else {
+	sendCP(e, PPP_PAP, PAP_AUTHNAK, pkt[1], badMsg, sizeof(badMsg)-1);
+    }
+    memset(pass, 0, sizeof(pass));
+    authDone(e, data+1, ulen, ok);
+}
+
+/**********************************************************************
+*%FUNCTION: chapInput
+*%ARGUMENTS:
+* e -- engine
+* pkt, len -- CHAP packet, starting at the code field
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+chapInput(PPPEngine *e, unsigned char const *pkt, int len)
+{
+    static unsigned char const okMsg[] = "Welcome";
+    static unsigned char const badMsg[] = "Access denied";
+    unsigned char const *data = pkt + CP_HDR_LEN;
+    int dlen = len - CP_HDR_LEN;
+    unsigned char digest[16];
+    char user[256];
+    char const *secret;
+    MD5_CTX ctx;
+    int vlen, ulen, ok;
+
+    if (pkt[0] != CHAP_RESPONSE || AuthProto != PPP_CHAP) return;
+    if (pkt[1] != e->chapId) return;
+
+    if (e->phase == PHASE_NETWORK) {
+	/* Our Success was lost */
+	sendCP(e, PPP_CHAP, CHAP_SUCCESS, pkt[1], okMsg, sizeof(okMsg)-1);
+	return;
+    }
+    if (e->phase != PHASE_AUTHENTICATE) return;
+
+    if (dlen < 1) return;
+    vlen = data[0];
+    if (dlen < 1 + vlen) return;
+    ulen = dlen - 1 - vlen;
+    if (ulen > 255) ulen = 255;
+    memcpy(user, data+1+vlen, ulen);
+    user[ulen] = 0;
+
+    ok = 0;
+    secret = findSecret(user);
+    if (secret && vlen == sizeof(digest)) {
+	MD5Init(&ctx);
+	MD5Update(&ctx, &pkt[1], 1);
+	MD5Update(&ctx, (unsigned char const *) secret, strlen(secret));
+	MD5Update(&ctx, e->challenge, CHAP_CHALLENGE_LEN);
+	MD5Final(digest, &ctx);
+	ok = !memcmp(digest, data+1, sizeof(digest));
+    }
+    if (ok) {
+	sendCP(e, PPP_CHAP, CHAP_SUCCESS, pkt[1], okMsg, sizeof(okMsg)-1);
+    } else {
+	sendCP(e, PPP_CHAP, CHAP_FAILURE, pkt[1], badMsg, sizeof(badMsg)-1);
+    }
+    authDone(e, data+1+vlen, ulen, ok);
+}
+
+/**********************************************************************
+*%FUNCTION: ipcpSendConfReq
+*%ARGUMENTS:
+* e -- engine
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Tells the peer our (local) IP address
+***********************************************************************/
+static void
+ipcpSendConfReq(PPPEngine *e)
+{
+    unsigned char opts[6];
+    int n = 0;
+
+    if (e->reqAddr) {
+	opts[n++] = IPCP_OPT_ADDR;
+	opts[n++] = 6;
+	memcpy(opts+n, SESSION_INFO(e->ses)->myip, IPV4ALEN);
+	n += IPV4ALEN;
+    }
+    sendCP(e, PPP_IPCP, CP_CONFREQ, ++e->ipcp.id, opts, n);
+}
+
+/**********************************************************************
+*%FUNCTION: ipcpCheckConfReq
+*%ARGUMENTS:
+* e -- engine
+* opts, len -- options in the peer's Configure-Request
+* reply, replyLen -- set to the options for our reply
+*%RETURNS:
+* CP_CONFACK, CP_CONFNAK or CP_CONFREJ, or -1 if the request is malformed
+*%DESCRIPTION:
+* The peer gets the address allocated to its session slot; anything
+* else (compression, DNS, old-style address pairs) is rejected.
+***********************************************************************/
+static int
+ipcpCheckConfReq(PPPEngine *e, unsigned char const *opts, int len,
+		 unsigned char *reply, int *replyLen)
+{
+    unsigned char rej[PPP_FRAME_LEN];
+    int rejLen = 0;
+    int sawAddr = 0, badAddr = 0;
+    unsigned char const *p = opts;
+    int olen;
+
+    while (len > 0) {
+	if (len < 2 || p[1] < 2 || p[1] > len) return -1;
+	olen = p[1];
+	if (p[0] == IPCP_OPT_ADDR && olen == 6) {
+	    sawAddr = 1;
+	    if (memcmp(p+2, SESSION_INFO(e->ses)->peerip, IPV4ALEN)) badAddr = 1;
+	} else {
+	    memcpy(rej+rejLen, p, olen);
+	    rejLen += olen;
+	}
+	p += olen;
+	len -= olen;
+    }
+
+    if (rejLen) {
+	memcpy(reply, rej, rejLen);
+	*replyLen = rejLen;
+	return CP_CONFREJ;
+    }
+    if (badAddr || !sawAddr) {
+	/* Hint the address even if the peer did not ask, as pppd does */
+	reply[0] = IPCP_OPT_ADDR;
+	reply[1] = 6;
+	memcpy(reply+2, SESSION_INFO(e->ses)->peerip, IPV4ALEN);
+	*replyLen = 6;
+	return CP_CONFNAK;
+    }
+    *replyLen = p - opts;
+    memcpy(reply, opts, *replyLen);
+    return CP_CONFACK;
+}
+
+/**********************************************************************
+*%FUNCTION: ipcpGotNakOrRej
+*%ARGUMENTS:
+* e -- engine
+* code -- CP_CONFNAK or CP_CONFREJ
+* opts, len -- options from the peer
+*%RETURNS:
+* 0
+*%DESCRIPTION:
+* Our address is not negotiable; a Nak just makes us ask again, a
+* Reject makes us stop asking.
+***********************************************************************/
+static int
+ipcpGotNakOrRej(PPPEngine *e, int code, unsigned char const *opts, int len)
+{
+    while (len >= 2 && opts[1] >= 2 && opts[1] <= len) {
+	if (opts[0] == IPCP_OPT_ADDR && code == CP_CONFREJ) e->reqAddr = 0;
+	len -= opts[1];
+	opts += opts[1];
+    }
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: setAddr
+*%ARGUMENTS:
+* ifr -- interface request
+* ip -- IPv4 address
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+setAddr(struct ifreq *ifr, unsigned char const *ip)
+{
+    struct sockaddr_in sin;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    memcpy(&sin.sin_addr, ip, IPV4ALEN);
+    memcpy(&ifr->ifr_addr, &sin, sizeof(sin));
+}
+
+/**********************************************************************
+*%FUNCTION: configureUnit
+*%ARGUMENTS:
+* e -- engine
+*%RETURNS:
+* 0 if OK, -1 on error
+*%DESCRIPTION:
+* Addresses the ppp interface, brings it up and lets IP through
+***********************************************************************/
+static int
+configureUnit(PPPEngine *e)
+{
+    ClientSession *ses = e->ses;
+    ClientSessionInfo *info = SESSION_INFO(ses);
+    struct ifreq ifr;
+    struct npioctl npi;
+    int mtu = (info->requested_mtu > PPP_PPPOE_MRU) ?
+	info->requested_mtu : PPP_PPPOE_MRU;
+
+    if (e->peerMRU < mtu) mtu = e->peerMRU;
+
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "ppp%d", e->unit);
+
+    ifr.ifr_mtu = mtu;
+    if (ioctl(IfSock, SIOCSIFMTU, &ifr) < 0) return -1;
+    setAddr(&ifr, info->myip);
+    if (ioctl(IfSock, SIOCSIFADDR, &ifr) < 0) return -1;
+    setAddr(&ifr, info->peerip);
+    if (ioctl(IfSock, SIOCSIFDSTADDR, &ifr) < 0) return -1;
+    if (ioctl(IfSock, SIOCGIFFLAGS, &ifr) < 0) return -1;
+    ifr.ifr_flags |= IFF_UP | IFF_POINTOPOINT;
+    if (ioctl(IfSock, SIOCSIFFLAGS, &ifr) < 0) return -1;
+
+    npi.protocol = PPP_IP;
+    npi.mode = NPMODE_PASS;
+    if (ioctl(e->unitFd, PPPIOCSNPMODE, &npi) < 0) return -1;
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: ipcpUp
+*%ARGUMENTS:
+* e -- engine
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* IPCP is open: configure the interface; the kernel does the rest
+***********************************************************************/
+static void
+ipcpUp(PPPEngine *e)
+{
+    ClientSession *ses = e->ses;
+    ClientSessionInfo *info = SESSION_INFO(ses);
+
+    if (configureUnit(e) < 0) {
+	syslog(LOG_ERR, "Session %u: unable to configure ppp%d: %m",
+	       (unsigned int) ntohs(ses->sess), e->unit);
+	lcpClose(e, "RP-PPPoE: Unable to configure interface");
+	return;
+    }
+    syslog(LOG_INFO, "Session %u: ppp%d up, %d.%d.%d.%d <-> %d.%d.%d.%d",
+	   (unsigned int) ntohs(ses->sess), e->unit,
+	   (int) info->myip[0], (int) info->myip[1],
+	   (int) info->myip[2], (int) info->myip[3],
+	   (int) info->peerip[0], (int) info->peerip[1],
+	   (int) info->peerip[2], (int) info->peerip[3]);
+}
+
+/**********************************************************************
+*%FUNCTION: lcpInput
+*%ARGUMENTS:
+* e -- engine
+* pkt, len -- LCP packet, starting at the code field
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Handles the LCP-only codes, then defers to the generic automaton
+***********************************************************************/
+static void
+lcpInput(PPPEngine *e, unsigned char const *pkt, int len)
+{
+    unsigned char reply[PPP_FRAME_LEN];
+
+    switch(pkt[0]) {
+    case CP_ECHOREQ:
+	if (e->lcp.state != CP_OPENED || len < CP_HDR_LEN + 4) return;
+	memcpy(reply, pkt + CP_HDR_LEN, len - CP_HDR_LEN);
+	if (e->reqMagic) {
+	    PUT32(reply, e->myMagic);
+	} else {
+	    memset(reply, 0, 4);
+	}
+	sendCP(e, PPP_LCP, CP_ECHOREP, pkt[1], reply, len - CP_HDR_LEN);
+	return;
+    case CP_ECHOREP:
+    case CP_DISCREQ:
+	return;
+    case CP_PROTREJ:
+	if (len >= CP_HDR_LEN + 2 &&
+	    GET16(pkt + CP_HDR_LEN) == PPP_IPCP) {
+	    lcpClose(e, "RP-PPPoE: Peer rejected IPCP");
+	}
+	return;
+    }
+    cpInput(e, &e->lcp, &LCPHandler, pkt, len);
+}
+
+/**********************************************************************
+*%FUNCTION: engineInput
+*%ARGUMENTS:
+* e -- engine
+* frame, len -- PPP frame, starting at the protocol field
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Dispatches a control frame by protocol and phase
+***********************************************************************/
+static void
+engineInput(PPPEngine *e, unsigned char const *frame, int len)
+{
+    UINT16_t proto;
+    unsigned char const *pkt;
+    int plen;
+
+    if (len < 2 + CP_HDR_LEN) return;
+    proto = GET16(frame);
+    pkt = frame + 2;
+    plen = GET16(pkt+2);
+    if (plen < CP_HDR_LEN || plen > len - 2) return;
+
+    if (proto == PPP_LCP) {
+	lcpInput(e, pkt, plen);
+	return;
+    }
+    /* Nothing but LCP until the link is established (RFC 1661 3.4) */
+    if (e->phase == PHASE_ESTABLISH || e->phase == PHASE_TERMINATE) return;
+
+    switch(proto) {
+    case PPP_PAP:
+	papInput(e, pkt, plen);
+	return;
+    case PPP_CHAP:
+	chapInput(e, pkt, plen);
+	return;
+    case PPP_IPCP:
+	if (e->phase == PHASE_NETWORK) {
+	    cpInput(e, &e->ipcp, &IPCPHandler, pkt, plen);
+	}
+	return;
+    }
+
+    /* Unknown or unsupported protocol (IPv6CP, CCP...) */
+    if (len > PPP_FRAME_LEN - 2 - CP_HDR_LEN) {
+	len = PPP_FRAME_LEN - 2 - CP_HDR_LEN;
+    }
+    sendCP(e, PPP_LCP, CP_PROTREJ, ++e->lcp.id, frame, len);
+}
+
+/**********************************************************************
+*%FUNCTION: engineReadable
+*%ARGUMENTS:
+* es -- event selector
+* fd -- channel or unit descriptor
+* flags -- ignored
+* data -- the engine
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Reads one control frame
+***********************************************************************/
+static void
+engineReadable(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    PPPEngine *e = data;
+    unsigned char frame[PPP_FRAME_LEN];
+    int len;
+
+    len = read(fd, frame, sizeof(frame));
+    if (len < 0) {
+	if (errno == EAGAIN || errno == EINTR) return;
+	/* The channel goes away with the Ethernet device */
+	syslog(LOG_INFO, "Session %u: read: %m",
+	       (unsigned int) ntohs(e->ses->sess));
+	engineClose(e, "RP-PPPoE: PPP channel closed");
+	return;
+    }
+    engineInput(e, frame, len);
+}
+
+/**********************************************************************
+*%FUNCTION: engineTimeout
+*%ARGUMENTS:
+* es -- event selector
+* fd, flags -- ignored
+* data -- the engine
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Retransmits whatever the current phase is waiting on
+***********************************************************************/
+static void
+engineTimeout(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    static unsigned char const msg[] = "Goodbye";
+    PPPEngine *e = data;
+
+    /* Timer handlers are one-shot */
+    e->timer = NULL;
+
+    switch(e->phase) {
+    case PHASE_ESTABLISH:
+	cpTimeout(e, &e->lcp, &LCPHandler);
+	break;
+    case PHASE_AUTHENTICATE:
+	if (++e->lcp.retries > PPP_MAX_CONFIGURE) {
+	    lcpClose(e, "RP-PPPoE: Authentication timed out");
+	    break;
+	}
+	if (AuthProto == PPP_CHAP && chapSendChallenge(e) < 0) {
+	    lcpClose(e, "RP-PPPoE: Cannot generate CHAP challenge");
+	    break;
+	}
+	setTimer(e, PPP_RESTART_TIME);
+	break;
+    case PHASE_NETWORK:
+	if (e->ipcp.state != CP_OPENED) cpTimeout(e, &e->ipcp, &IPCPHandler);
+	break;
+    case PHASE_TERMINATE:
+	if (++e->lcp.retries >= PPP_MAX_TERMINATE) {
+	    engineClose(e, e->closeReason);
+	    break;
+	}
+	sendCP(e, PPP_LCP, CP_TERMREQ, ++e->lcp.id, msg, sizeof(msg)-1);
+	setTimer(e, PPP_RESTART_TIME);
+	break;
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: openChannel
+*%ARGUMENTS:
+* e -- engine
+*%RETURNS:
+* 0 if OK, -1 on error (descriptors opened so far are left in e)
+*%DESCRIPTION:
+* Connects a PPPoE socket for the session, attaches a /dev/ppp
+* descriptor to its channel and connects the channel to a new unit.
+***********************************************************************/
+static int
+openChannel(PPPEngine *e)
+{
+    ClientSession *ses = e->ses;
+    union {
+	struct sockaddr_pppox pppox;
+	struct sockaddr sa;
+    } addr;
+    struct sockaddr_pppox *sp = &addr.pppox;
+    int chindex;
+    int mru = e->myMRU;
+
+    e->pppoxSock = socket(AF_PPPOX, SOCK_STREAM, PX_PROTO_OE);
+    if (e->pppoxSock < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    sp->sa_family = AF_PPPOX;
+    sp->sa_protocol = PX_PROTO_OE;
+    sp->sa_addr.pppoe.sid = ses->sess;
+    memcpy(sp->sa_addr.pppoe.remote, ses->eth, ETH_ALEN);
+    strncpy(sp->sa_addr.pppoe.dev, sessionInterfaceName(ses),
+	    sizeof(sp->sa_addr.pppoe.dev) - 1);
+    if (connect(e->pppoxSock, &addr.sa, sizeof(struct sockaddr_pppox)) < 0) {
+	return -1;
+    }
+    if (ioctl(e->pppoxSock, PPPIOCGCHAN, &chindex) < 0) return -1;
+
+    e->chanFd = open("/dev/ppp", O_RDWR | O_NONBLOCK);
+    if (e->chanFd < 0) return -1;
+    if (ioctl(e->chanFd, PPPIOCATTCHAN, &chindex) < 0) return -1;
+
+    e->unitFd = open("/dev/ppp", O_RDWR | O_NONBLOCK);
+    if (e->unitFd < 0) return -1;
+    e->unit = -1;
+    if (ioctl(e->unitFd, PPPIOCNEWUNIT, &e->unit) < 0) return -1;
+    if (ioctl(e->chanFd, PPPIOCCONNECT, &e->unit) < 0) return -1;
+    if (ioctl(e->unitFd, PPPIOCSMRU, &mru) < 0) return -1;
+
+    fcntl(e->pppoxSock, F_SETFD, FD_CLOEXEC);
+    fcntl(e->chanFd, F_SETFD, FD_CLOEXEC);
+    fcntl(e->unitFd, F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: pppEngineStart
+*%ARGUMENTS:
+* ses -- session whose PADS is about to be sent
+*%RETURNS:
+* 0 if OK, -1 on error
+*%DESCRIPTION:
+* Creates the kernel channel and unit for a session.  This is done
+* before the PADS goes out so the peer's first LCP frame is not lost.
+***********************************************************************/
+int
+pppEngineStart(ClientSession *ses)
+{
+    ClientSessionInfo *info = SESSION_INFO(ses);
+    PPPEngine *e = calloc(1, sizeof(PPPEngine));
+
+    if (!e) {
+	syslog(LOG_ERR, "Out of memory for session %u",
+	       (unsigned int) ntohs(ses->sess));
+	return -1;
+    }
+    e->ses = ses;
+    e->pppoxSock = e->chanFd = e->unitFd = -1;
+    e->myMRU = (info->requested_mtu > PPP_PPPOE_MRU) ?
+	info->requested_mtu : PPP_PPPOE_MRU;
+    e->peerMRU = PPP_MRU;
+    e->reqMRU = 1;
+    e->reqMagic = 1;
+    e->reqAddr = 1;
+    e->myMagic = ((UINT32_t) rand() << 16) ^ (UINT32_t) rand();
+    if (!e->myMagic) e->myMagic = 1;
+
+    if (openChannel(e) < 0) {
+	syslog(LOG_ERR, "Session %u: unable to create PPP channel: %m",
+	       (unsigned int) ntohs(ses->sess));
+	goto fail;
+    }
+    e->chanHandler = Event_AddHandler(event_selector, e->chanFd,
+				      EVENT_FLAG_READABLE, engineReadable, e);
+    e->unitHandler = Event_AddHandler(event_selector, e->unitFd,
+				      EVENT_FLAG_READABLE, engineReadable, e);
+    if (!e->chanHandler || !e->unitHandler) {
+	syslog(LOG_ERR, "Session %u: unable to add event handlers",
+	       (unsigned int) ntohs(ses->sess));
+	goto fail;
+    }
+    ses->ppp = e;
+    ses->funcs = &BuiltinSessionFunctionTable;
+    return 0;
+
+  fail:
+    if (e->chanHandler) Event_DelHandler(event_selector, e->chanHandler);
+    if (e->unitHandler) Event_DelHandler(event_selector, e->unitHandler);
+    if (e->unitFd >= 0) close(e->unitFd);
+    if (e->chanFd >= 0) close(e->chanFd);
+    if (e->pppoxSock >= 0) close(e->pppoxSock);
+    free(e);
+    return -1;
+}
+
+/**********************************************************************
+*%FUNCTION: pppEngineOpen
+*%ARGUMENTS:
+* ses -- session whose PADS has been sent
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Starts LCP negotiation
+***********************************************************************/
+void
+pppEngineOpen(ClientSession *ses)
+{
+    PPPEngine *e = ses->ppp;
+    ClientSessionInfo *info = SESSION_INFO(ses);
+
+    syslog(LOG_INFO,
+	   "Session %u created for client %02x:%02x:%02x:%02x:%02x:%02x (%d.%d.%d.%d) on %s using Service-Name '%s' (ppp%d)",
+	   (unsigned int) ntohs(ses->sess),
+	   ses->eth[0], ses->eth[1], ses->eth[2],
+	   ses->eth[3], ses->eth[4], ses->eth[5],
+	   (int) info->peerip[0], (int) info->peerip[1],
+	   (int) info->peerip[2], (int) info->peerip[3],
+	   sessionInterfaceName(ses), info->serviceName, e->unit);
+    e->phase = PHASE_ESTABLISH;
+    e->lcp.state = CP_REQSENT;
+    lcpSendConfReq(e);
+    setTimer(e, PPP_RESTART_TIME);
+}
+
+/**********************************************************************
+*%FUNCTION: pppEngineUnit
+*%ARGUMENTS:
+* ses -- session run by the engine
+*%RETURNS:
+* The session's ppp unit number
+***********************************************************************/
+int
+pppEngineUnit(ClientSession *ses)
+{
+    return ses->ppp->unit;
+}
+
+/**********************************************************************
+* %FUNCTION: BuiltinStopSession
+* %ARGUMENTS:
+*  ses -- the session
+*  reason -- reason session is being stopped.
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Sends a parting LCP Terminate-Request (unless the peer has already
+*  gone) and releases the session at once.
+***********************************************************************/
+static void
+BuiltinStopSession(ClientSession *ses, char const *reason)
+{
+    static unsigned char const msg[] = "Goodbye";
+    PPPEngine *e = ses->ppp;
+
+    if (!e) return;
+    if (!(ses->flags & FLAG_RECVD_PADT) && e->lcp.state == CP_OPENED) {
+	sendCP(e, PPP_LCP, CP_TERMREQ, ++e->lcp.id, msg, sizeof(msg)-1);
+    }
+    engineClose(e, reason);
+}
+
+/**********************************************************************
+* %FUNCTION: BuiltinSessionIsActive
+* %ARGUMENTS:
+*  ses -- the session
+* %RETURNS:
+*  True if session is active, false if not.
+***********************************************************************/
+static int
+BuiltinSessionIsActive(ClientSession *ses)
+{
+    return (ses->ppp != NULL);
+}
+
+#endif /* HAVE_LINUX_IF_PPPOX_H */
@@ -0,0 +1,807 @@
+/***********************************************************************
+*
+* pppoe-loadgen.c
+*
+* Discovery load generator.  Emulates many PPPoE clients, each with its
+* own MAC address, running PADI -> PADO -> PADR -> PADS (and PADT)
+* against a server or relay, and reports the rates achieved, latency
+* percentiles and reasons for failure.  Meant for a veth pair with the
+* server on the other end.
+*
+* To test without PPP, run the server with this program as its pppd:
+*
+*   PPPOE_LOADGEN_STUB=1 pppoe-server -I veth0 -q /path/to/pppoe-loadgen
+*
+* With PPPOE_LOADGEN_STUB set, pppoe-loadgen just waits to be killed,
+* which is all the server needs of a pppd.
+*
+* Copyright (C) 2001-2012 Roaring Penguin Software Inc.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+* LIC: GPL
+*
+***********************************************************************/
+
+/* Before pppoe.h, which defines _POSIX_SOURCE */
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "pppoe.h"
+
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+/* Default interface if no -I option given */
+#define DEFAULT_IF "eth0"
+
+/* Client MAC addresses are LOADGEN_OUI:index (locally administered) */
+#define LOADGEN_OUI0 0x02
+#define LOADGEN_OUI1 0x4c
+#define LOADGEN_OUI2 0x47
+#define MAX_CLIENTS  (1 << 24)
+
+/* Longest AC-Cookie / Relay-Session-Id we will echo */
+#define MAX_ECHO_TAG 64
+
+/* Distinct PADS error reasons we keep count of */
+#define MAX_REASONS 16
+
+/* Client states */
+#define ST_IDLE      0
+#define ST_PADI_SENT 1
+#define ST_PADR_SENT 2
+#define ST_UP        3		/* Waiting out the hold time */
+#define ST_DONE      4
+
+/* Outcomes */
+#define OK_PADT      0		/* Session set up and torn down by us */
+#define OK_SERVER    1		/* Session set up; server sent PADT */
+#define FAIL_NO_PADO 2
+#define FAIL_NO_PADS 3
+#define FAIL_PADS    4		/* PADS with an error tag or session 0 */
+#define FAIL_BAD_PADO 5		/* PADO without a usable cookie */
+#define NUM_OUTCOMES 6
+
+static char const *OutcomeNames[NUM_OUTCOMES] = {
+    "completed",
+    "completed (server sent PADT)",
+    "no PADO",
+    "no PADS",
+    "error PADS",
+    "unusable PADO"
+};
+
+typedef struct {
+    unsigned char state;
+    unsigned char tries;	/* Transmissions of current request */
+    unsigned char cookieLen;
+    unsigned char relayIdLen;
+    unsigned char cookie[MAX_ECHO_TAG];
+    unsigned char relayId[MAX_ECHO_TAG];
+    unsigned char ac[ETH_ALEN];	/* AC's MAC, from PADO */
+    UINT16_t session;
+    int active;			/* Index in Active[], or -1 */
+    unsigned long long start;	/* First PADI */
+    unsigned long long sent;	/* Last transmission */
+    unsigned long long deadline; /* Retransmit, give up, or send PADT */
+} Client;
+
+/* Options */
+static char *IfName = NULL;
+static char *ServiceName = NULL;
+static unsigned int NumClients = 1000;
+static unsigned int Window = 64;
+static double Rate = 0;		/* New clients per second; 0 = unpaced */
+static unsigned long long Timeout = 1000000; /* usec per try */
+static unsigned int Tries = 3;
+static unsigned long long Hold = 0; /* usec between PADS and PADT */
+
+static int Sock;
+static unsigned char MyMac[ETH_ALEN];
+static Client *Clients;
+
+/* Clients with something outstanding; swap-removed */
+static unsigned int *Active;
+static unsigned int NumActive = 0;
+static unsigned int InFlight = 0; /* Active clients awaiting PADO/PADS */
+
+static unsigned int Outcomes[NUM_OUTCOMES];
+static char Reasons[MAX_REASONS][128];
+static unsigned int ReasonCount[MAX_REASONS];
+static unsigned int NumReasons = 0;
+static unsigned int Retransmits = 0;
+static unsigned int Stray = 0;
+
+/* Latencies in usec */
+static double *PadoLat, *PadsLat, *SetupLat;
+static unsigned int NumPado = 0, NumPads = 0, NumSetup = 0;
+
+/**********************************************************************
+*%FUNCTION: fatalSys
+*%ARGUMENTS:
+* str -- error message
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Prints a message plus the errno value to stderr and exits.
+***********************************************************************/
+void
+fatalSys(char const *str)
+{
+    char buf[1024];
+    sprintf(buf, "%.256s: %.256s", str, strerror(errno));
+    printErr(buf);
+    exit(1);
+}
+
+/**********************************************************************
+*%FUNCTION: rp_fatal
+*%ARGUMENTS:
+* str -- error message
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Prints a message to stderr and syslog and exits.
+***********************************************************************/
+void
+rp_fatal(char const *str)
+{
+    printErr(str);
+    exit(1);
+}
+
+/**********************************************************************
+*%FUNCTION: sysErr
+*%ARGUMENTS:
+* str -- error message
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Prints a message plus the errno value to syslog.  The socket is
+* non-blocking, so "no more packets" is not worth reporting.
+***********************************************************************/
+void
+sysErr(char const *str)
+{
+    char buf[1024];
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+    sprintf(buf, "%.256s: %.256s", str, strerror(errno));
+    printErr(buf);
+}
+
+/**********************************************************************
+*%FUNCTION: usage
+*%ARGUMENTS:
+* argv0 -- program name
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Prints usage information and exits.
+***********************************************************************/
+void
+usage(char const *argv0)
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv0);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "   -I if_name     -- Specify interface (default %s.)\n",
+	    DEFAULT_IF);
+    fprintf(stderr, "   -n clients     -- Number of clients to emulate (default 1000).\n");
+    fprintf(stderr, "   -w window      -- Max. clients awaiting PADO/PADS (default 64).\n");
+    fprintf(stderr, "   -r rate        -- Start 'rate' clients per second (default: no limit).\n");
+    fprintf(stderr, "   -t ms          -- Retransmit timeout (default 1000).\n");
+    fprintf(stderr, "   -a tries       -- Transmissions of PADI/PADR before giving up (default 3).\n");
+    fprintf(stderr, "   -H ms          -- Hold each session this long before PADT (default 0).\n");
+    fprintf(stderr, "   -S name        -- Request this Service-Name.\n");
+    fprintf(stderr, "   -V             -- Print version and exit.\n");
+    fprintf(stderr, "\nWith PPPOE_LOADGEN_STUB set in the environment, waits to be killed;\n");
+    fprintf(stderr, "use it as the server's pppd (-q) to test discovery without PPP.\n");
+    fprintf(stderr, "\nPPPoE Version %s, Copyright (C) 2000 Roaring Penguin Software Inc.\n", VERSION);
+    fprintf(stderr, "PPPoE comes with ABSOLUTELY NO WARRANTY.\n");
+    fprintf(stderr, "This is free software, and you are welcome to redistribute it under the terms\n");
+    fprintf(stderr, "of the GNU General Public License, version 2 or any later version.\n");
+    fprintf(stderr, "http://www.roaringpenguin.com\n");
+    exit(0);
+}
+
+#if !defined(USE_LINUX_PACKET)
+
+int
+main()
+{
+    fprintf(stderr, "Sorry, pppoe-loadgen works only on Linux.\n");
+    return 1;
+}
+
+#else
+
+/**********************************************************************
+*%FUNCTION: nowUs
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Monotonic time in microseconds
+***********************************************************************/
+static unsigned long long
+nowUs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**********************************************************************
+*%FUNCTION: clientMac
+*%ARGUMENTS:
+* idx -- client index
+* mac -- set to the client's MAC address
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+clientMac(unsigned int idx, unsigned char *mac)
+{
+    mac[0] = LOADGEN_OUI0;
+    mac[1] = LOADGEN_OUI1;
+    mac[2] = LOADGEN_OUI2;
+    mac[3] = (idx >> 16) & 0xFF;
+    mac[4] = (idx >> 8) & 0xFF;
+    mac[5] = idx & 0xFF;
+}
+
+/**********************************************************************
+*%FUNCTION: macClient
+*%ARGUMENTS:
+* mac -- a MAC address
+*%RETURNS:
+* Index of the client with that MAC, or -1 if it is not one of ours
+***********************************************************************/
+static int
+macClient(unsigned char const *mac)
+{
+    unsigned int idx;
+
+    if (mac[0] != LOADGEN_OUI0 || mac[1] != LOADGEN_OUI1 ||
+	mac[2] != LOADGEN_OUI2) {
+	return -1;
+    }
+    idx = (mac[3] << 16) | (mac[4] << 8) | mac[5];
+    return (idx < NumClients) ? (int) idx : -1;
+}
+
+/**********************************************************************
+*%FUNCTION: addTag
+*%ARGUMENTS:
+* pkt -- packet being built
+* type -- tag type
+* data, len -- tag payload
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+addTag(PPPoEPacket *pkt, UINT16_t type, void const *data, UINT16_t len)
+{
+    UINT16_t plen = ntohs(pkt->length);
+    PPPoETag tag;
+
+    tag.type = htons(type);
+    tag.length = htons(len);
+    memcpy(tag.payload, data, len);
+    memcpy(pkt->payload + plen, &tag, TAG_HDR_SIZE + len);
+    pkt->length = htons(plen + TAG_HDR_SIZE + len);
+}
+
+/**********************************************************************
+*%FUNCTION: sendDiscovery
+*%ARGUMENTS:
+* idx -- client index
+* code -- CODE_PADI, CODE_PADR or CODE_PADT
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Builds and sends a discovery packet for a client
+***********************************************************************/
+static void
+sendDiscovery(unsigned int idx, unsigned char code)
+{
+    static unsigned char const bcast[ETH_ALEN] =
+	{0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    Client *c = &Clients[idx];
+    PPPoEPacket pkt;
+    UINT32_t hostUniq = htonl(idx);
+
+    memcpy(pkt.ethHdr.h_dest, (code == CODE_PADI) ? bcast : c->ac, ETH_ALEN);
+    clientMac(idx, pkt.ethHdr.h_source);
+    pkt.ethHdr.h_proto = htons(Eth_PPPOE_Discovery);
+    pkt.ver = 1;
+    pkt.type = 1;
+    pkt.code = code;
+    pkt.session = (code == CODE_PADT) ? c->session : 0;
+    pkt.length = 0;
+
+    if (code != CODE_PADT) {
+	addTag(&pkt, TAG_SERVICE_NAME, ServiceName, strlen(ServiceName));
+    }
+    addTag(&pkt, TAG_HOST_UNIQ, &hostUniq, sizeof(hostUniq));
+    if (code == CODE_PADR) {
+	addTag(&pkt, TAG_AC_COOKIE, c->cookie, c->cookieLen);
+	if (c->relayIdLen) {
+	    addTag(&pkt, TAG_RELAY_SESSION_ID, c->relayId, c->relayIdLen);
+	}
+    }
+    sendPacket(NULL, Sock, &pkt, (int) (ntohs(pkt.length) + HDR_SIZE));
+    c->sent = nowUs();
+}
+
+/**********************************************************************
+*%FUNCTION: activate / deactivate
+*%ARGUMENTS:
+* idx -- client index
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Add a client to, or remove it from, the set checked for deadlines
+***********************************************************************/
+static void
+activate(unsigned int idx)
+{
+    Clients[idx].active = NumActive;
+    Active[NumActive++] = idx;
+}
+
+static void
+deactivate(unsigned int idx)
+{
+    Client *c = &Clients[idx];
+    unsigned int last = Active[--NumActive];
+
+    Active[c->active] = last;
+    Clients[last].active = c->active;
+    c->active = -1;
+}
+
+/**********************************************************************
+*%FUNCTION: finish
+*%ARGUMENTS:
+* idx -- client index
+* outcome -- how it ended
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+finish(unsigned int idx, int outcome)
+{
+    Client *c = &Clients[idx];
+
+    if (c->state == ST_PADI_SENT || c->state == ST_PADR_SENT) InFlight--;
+    if (c->active >= 0) deactivate(idx);
+    c->state = ST_DONE;
+    Outcomes[outcome]++;
+}
+
+/**********************************************************************
+*%FUNCTION: startClient
+*%ARGUMENTS:
+* idx -- client index
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+startClient(unsigned int idx)
+{
+    Client *c = &Clients[idx];
+
+    c->state = ST_PADI_SENT;
+    c->tries = 1;
+    sendDiscovery(idx, CODE_PADI);
+    c->start = c->sent;
+    c->deadline = c->sent + Timeout;
+    InFlight++;
+    activate(idx);
+}
+
+/**********************************************************************
+*%FUNCTION: sessionUp
+*%ARGUMENTS:
+* idx -- client index
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Called on a good PADS: tears down now or after the hold time
+***********************************************************************/
+static void
+sessionUp(unsigned int idx)
+{
+    Client *c = &Clients[idx];
+
+    InFlight--;
+    if (!Hold) {
+	sendDiscovery(idx, CODE_PADT);
+	c->state = ST_UP;	/* So finish() doesn't touch InFlight */
+	finish(idx, OK_PADT);
+	return;
+    }
+    c->state = ST_UP;
+    c->deadline = nowUs() + Hold;
+}
+
+/**********************************************************************
+*%FUNCTION: noteReason
+*%ARGUMENTS:
+* reason -- text of an error tag
+* len -- its length
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+noteReason(char const *reason, int len)
+{
+    unsigned int i;
+    char buf[128];
+
+    if (len > (int) sizeof(buf) - 1) len = sizeof(buf) - 1;
+    memcpy(buf, reason, len);
+    buf[len] = 0;
+    for (i=0; i<NumReasons; i++) {
+	if (!strcmp(Reasons[i], buf)) break;
+    }
+    if (i == NumReasons) {
+	if (NumReasons == MAX_REASONS) return;
+	strcpy(Reasons[NumReasons++], buf);
+    }
+    ReasonCount[i]++;
+}
+
+/**********************************************************************
+*%FUNCTION: gotPADO
+*%ARGUMENTS:
+* idx -- client index
+* pkt -- PADO
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+gotPADO(unsigned int idx, PPPoEPacket *pkt)
+{
+    Client *c = &Clients[idx];
+    PPPoETagIndex tags;
+    PPPoETagRef const *ref;
+    unsigned long long now = nowUs();
+
+    if (c->state != ST_PADI_SENT) return;	/* Duplicate or from a 2nd AC */
+    PadoLat[NumPado++] = (double) (now - c->sent);
+
+    if (indexTags(pkt, &tags) < 0 ||
+	!(ref = lookupTag(&tags, TAG_AC_COOKIE)) ||
+	ref->length > MAX_ECHO_TAG) {
+	finish(idx, FAIL_BAD_PADO);
+	return;
+    }
+    c->cookieLen = ref->length;
+    memcpy(c->cookie, TAG_REF_DATA(&tags, ref), c->cookieLen);
+    c->relayIdLen = 0;
+    if ((ref = lookupTag(&tags, TAG_RELAY_SESSION_ID)) != NULL &&
+	ref->length <= MAX_ECHO_TAG) {
+	c->relayIdLen = ref->length;
+	memcpy(c->relayId, TAG_REF_DATA(&tags, ref), c->relayIdLen);
+    }
+    memcpy(c->ac, pkt->ethHdr.h_source, ETH_ALEN);
+
+    c->state = ST_PADR_SENT;
+    c->tries = 1;
+    sendDiscovery(idx, CODE_PADR);
+    c->deadline = c->sent + Timeout;
+}
+
+/**********************************************************************
+*%FUNCTION: gotPADS
+*%ARGUMENTS:
+* idx -- client index
+* pkt -- PADS
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+gotPADS(unsigned int idx, PPPoEPacket *pkt)
+{
+    Client *c = &Clients[idx];
+    PPPoETagIndex tags;
+    PPPoETagRef const *ref;
+    unsigned long long now = nowUs();
+
+    if (c->state != ST_PADR_SENT) return;
+    if (memcmp(pkt->ethHdr.h_source, c->ac, ETH_ALEN)) return;
+    PadsLat[NumPads++] = (double) (now - c->sent);
+
+    indexTags(pkt, &tags);
+    if ((ref = lookupTag(&tags, TAG_SERVICE_NAME_ERROR)) != NULL ||
+	(ref = lookupTag(&tags, TAG_AC_SYSTEM_ERROR)) != NULL ||
+	(ref = lookupTag(&tags, TAG_GENERIC_ERROR)) != NULL) {
+	noteReason((char const *) TAG_REF_DATA(&tags, ref), ref->length);
+	finish(idx, FAIL_PADS);
+	return;
+    }
+    if (!pkt->session) {
+	noteReason("session 0 without error tag", 27);
+	finish(idx, FAIL_PADS);
+	return;
+    }
+    SetupLat[NumSetup++] = (double) (now - c->start);
+    c->session = pkt->session;
+    sessionUp(idx);
+}
+
+/**********************************************************************
+*%FUNCTION: gotPADT
+*%ARGUMENTS:
+* idx -- client index
+* pkt -- PADT
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+gotPADT(unsigned int idx, PPPoEPacket *pkt)
+{
+    Client *c = &Clients[idx];
+
+    /* Our own PADTs come back to us on the packet socket */
+    if (c->state != ST_UP || memcmp(pkt->ethHdr.h_source, c->ac, ETH_ALEN) ||
+	pkt->session != c->session) {
+	return;
+    }
+    finish(idx, OK_SERVER);
+}
+
+/**********************************************************************
+*%FUNCTION: readPackets
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Handles every packet waiting on the socket
+***********************************************************************/
+static void
+readPackets(void)
+{
+    PPPoEPacket pkt;
+    int size, idx;
+
+    while (receivePacket(Sock, &pkt, &size) >= 0) {
+	if (size < HDR_SIZE || ntohs(pkt.length) + HDR_SIZE > size ||
+	    pkt.ver != 1 || pkt.type != 1) {
+	    continue;
+	}
+	/* Ignore what we sent ourselves */
+	if (pkt.code == CODE_PADI || pkt.code == CODE_PADR) continue;
+
+	idx = macClient(pkt.ethHdr.h_dest);
+	if (idx < 0) {
+	    Stray++;
+	    continue;
+	}
+	switch(pkt.code) {
+	case CODE_PADO: gotPADO(idx, &pkt); break;
+	case CODE_PADS: gotPADS(idx, &pkt); break;
+	case CODE_PADT: gotPADT(idx, &pkt); break;
+	default: Stray++; break;
+	}
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: checkDeadlines
+*%ARGUMENTS:
+* now -- current time
+*%RETURNS:
+* The earliest remaining deadline
+*%DESCRIPTION:
+* Retransmits, gives up on, or tears down clients whose deadline passed
+***********************************************************************/
+static unsigned long long
+checkDeadlines(unsigned long long now)
+{
+    unsigned long long next = now + Timeout;
+    unsigned int i = 0, idx;
+    Client *c;
+
+    while (i < NumActive) {
+	idx = Active[i];
+	c = &Clients[idx];
+	if (c->deadline > now) {
+	    if (c->deadline < next) next = c->deadline;
+	    i++;
+	    continue;
+	}
+	if (c->state == ST_UP) {
+	    sendDiscovery(idx, CODE_PADT);
+	    finish(idx, OK_PADT);
+	    continue;		/* Active[i] is now another client */
+	}
+	if (c->tries >= Tries) {
+	    finish(idx, (c->state == ST_PADI_SENT) ? FAIL_NO_PADO : FAIL_NO_PADS);
+	    continue;
+	}
+	c->tries++;
+	Retransmits++;
+	sendDiscovery(idx, (c->state == ST_PADI_SENT) ? CODE_PADI : CODE_PADR);
+	c->deadline = c->sent + Timeout;
+	if (c->deadline < next) next = c->deadline;
+	i++;
+    }
+    return next;
+}
+
+static int
+compareDouble(void const *a, void const *b)
+{
+    double x = *(double const *) a, y = *(double const *) b;
+    return (x > y) - (x < y);
+}
+
+/**********************************************************************
+*%FUNCTION: printLatency
+*%ARGUMENTS:
+* name -- what was measured
+* lat, n -- samples in usec
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+printLatency(char const *name, double *lat, unsigned int n)
+{
+    if (!n) {
+	printf("%-14s %8s\n", name, "-");
+	return;
+    }
+    qsort(lat, n, sizeof(double), compareDouble);
+    printf("%-14s %8u %9.3f %9.3f %9.3f %9.3f\n", name, n,
+	   lat[n / 2] / 1000.0, lat[n * 90 / 100] / 1000.0,
+	   lat[n * 99 / 100] / 1000.0, lat[n - 1] / 1000.0);
+}
+
+/**********************************************************************
+*%FUNCTION: main
+*%ARGUMENTS:
+* argc, argv -- count and values of command-line arguments
+*%RETURNS:
+* Exit status: 0 if every client completed, 1 otherwise
+***********************************************************************/
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    unsigned int next = 0, done, i;
+    unsigned long long t0, now, deadline, elapsed;
+    struct pollfd pfd;
+    int bufsize = 1 << 22;
+
+    /* Stand-in for pppd: the server will kill us */
+    if (getenv("PPPOE_LOADGEN_STUB")) {
+	for (;;) pause();
+    }
+
+    while((opt = getopt(argc, argv, "I:n:w:r:t:a:H:S:Vh")) != -1) {
+	switch(opt) {
+	case 'I':
+	    SET_STRING(IfName, optarg);
+	    break;
+	case 'n':
+	    NumClients = (unsigned int) strtoul(optarg, NULL, 10);
+	    break;
+	case 'w':
+	    Window = (unsigned int) strtoul(optarg, NULL, 10);
+	    break;
+	case 'r':
+	    Rate = strtod(optarg, NULL);
+	    break;
+	case 't':
+	    Timeout = strtoull(optarg, NULL, 10) * 1000;
+	    break;
+	case 'a':
+	    Tries = (unsigned int) strtoul(optarg, NULL, 10);
+	    break;
+	case 'H':
+	    Hold = strtoull(optarg, NULL, 10) * 1000;
+	    break;
+	case 'S':
+	    SET_STRING(ServiceName, optarg);
+	    break;
+	case 'V':
+	    printf("pppoe-loadgen: Roaring Penguin PPPoE Version %s\n", VERSION);
+	    exit(0);
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (!NumClients || NumClients > MAX_CLIENTS || !Window || !Tries ||
+	!Timeout || Rate < 0) {
+	usage(argv[0]);
+    }
+    if (!IfName) {
+	IfName = DEFAULT_IF;
+    }
+    if (!ServiceName) {
+	ServiceName = "";
+    }
+
+    Clients = calloc(NumClients, sizeof(Client));
+    Active = calloc(NumClients, sizeof(unsigned int));
+    PadoLat = calloc(NumClients, sizeof(double));
+    PadsLat = calloc(NumClients, sizeof(double));
+    SetupLat = calloc(NumClients, sizeof(double));
+    if (!Clients || !Active || !PadoLat || !PadsLat || !SetupLat) {
+	rp_fatal("Out of memory");
+    }
+    for (i=0; i<NumClients; i++) Clients[i].active = -1;
+
+    Sock = openInterface(IfName, Eth_PPPOE_Discovery, MyMac, NULL);
+    if (fcntl(Sock, F_SETFL, fcntl(Sock, F_GETFL) | O_NONBLOCK) < 0) {
+	fatalSys("fcntl");
+    }
+    /* Replies to a burst of PADIs arrive in a burst */
+    setsockopt(Sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+    pfd.fd = Sock;
+    pfd.events = POLLIN;
+    t0 = nowUs();
+    deadline = t0;
+    for (;;) {
+	now = nowUs();
+	done = 0;
+	for (i=0; i<NUM_OUTCOMES; i++) done += Outcomes[i];
+	if (done == NumClients) break;
+
+	/* Start clients as the window and rate allow */
+	while (next < NumClients && InFlight < Window &&
+	       (!Rate || next < (now - t0) * Rate / 1e6 + 1)) {
+	    startClient(next++);
+	}
+
+	if (now >= deadline) {
+	    deadline = checkDeadlines(now);
+	}
+
+	{
+	    long long wait = (long long) (deadline - now) / 1000;
+	    if (Rate && next < NumClients && InFlight < Window) wait = 1;
+	    if (wait < 0) wait = 0;
+	    if (wait > 100) wait = 100;
+	    if (poll(&pfd, 1, (int) wait) > 0) readPackets();
+	}
+    }
+    elapsed = nowUs() - t0;
+
+    printf("%u clients on %s in %.3f s: %.0f setups/s, %.0f PADO/s\n",
+	   NumClients, IfName, elapsed / 1e6,
+	   (Outcomes[OK_PADT] + Outcomes[OK_SERVER]) / (elapsed / 1e6),
+	   NumPado / (elapsed / 1e6));
+    printf("retransmissions %u, stray packets %u\n\n", Retransmits, Stray);
+    printf("%-14s %8s %9s %9s %9s %9s\n", "latency (ms)", "count",
+	   "p50", "p90", "p99", "max");
+    printLatency("PADI->PADO", PadoLat, NumPado);
+    printLatency("PADR->PADS", PadsLat, NumPads);
+    printLatency("setup", SetupLat, NumSetup);
+    printf("\n");
+    for (i=0; i<NUM_OUTCOMES; i++) {
+	if (Outcomes[i]) printf("%-30s %u\n", OutcomeNames[i], Outcomes[i]);
+    }
+    for (i=0; i<NumReasons; i++) {
+	printf("  %s: %u\n", Reasons[i], ReasonCount[i]);
+    }
+    return (Outcomes[OK_PADT] + Outcomes[OK_SERVER] == NumClients) ? 0 : 1;
+}
+
+#endif
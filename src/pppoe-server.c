@@ -38,6 +38,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <sys/file.h>
 
@@ -82,7 +83,7 @@ extern void pppoe_to_l2tp_add_interface(EventSelector *es,
 static void InterfaceHandler(EventSelector *es,
 			int fd, unsigned int flags, void *data);
 static void startPPPD(ClientSession *sess);
-static void sendErrorPADS(int sock, unsigned char *source, unsigned char *dest,
+static void sendErrorPADS(DiscoveryContext const *ctx,
 			  int errorTag, char *errorMsg);
 
 #define CHECK_ROOM(cursor, start, len) \
@@ -95,11 +96,15 @@ do {\
 
 static void PppoeStopSession(ClientSession *ses, char const *reason);
 static int PppoeSessionIsActive(ClientSession *ses);
+#ifdef HAVE_LICENSE
+static void memSampler(EventSelector *es, int fd, unsigned int flags,
+		       void *data);
+#endif
 
-/* Service-Names we advertise */
-#define MAX_SERVICE_NAMES 64
-static int NumServiceNames = 0;
-static char const *ServiceNames[MAX_SERVICE_NAMES];
+/* Service-Names we advertise.  -S adds to GlobalServices; an interface
+   named in a -j option uses its own catalogue instead. */
+static ServiceCatalog GlobalServices;
+static ServiceCatalog *InterfaceServices = NULL;
 
 PppoeSessionFunctionTable DefaultSessionFunctionTable = {
     PppoeStopSession,
@@ -109,6 +114,7 @@ PppoeSessionFunctionTable DefaultSessionFunctionTable = {
 
 /* An array of client sessions */
 ClientSession *Sessions = NULL;
+ClientSessionInfo *SessionInfo = NULL;
 ClientSession *FreeSessions = NULL;
 ClientSession *LastFreeSession = NULL;
 ClientSession *BusySessions = NULL;
@@ -129,14 +135,25 @@ size_t NumActiveSessions = 0;
 /* Offset of first session */
 size_t SessOffset = 0;
 
+/* Multi-instance mode: we are instance InstanceIndex of NumInstances,
+   and only serve clients whose MAC address hashes to us */
+static unsigned int InstanceIndex = 0;
+static unsigned int NumInstances = 1;
+
 /* Event Selector */
 EventSelector *event_selector;
 
 /* Use Linux kernel-mode PPPoE? */
 static int UseLinuxKernelModePPPoE = 0;
+static int UseBuiltinPPP = 0;
 
-/* Requested max_ppp_payload */
-static UINT16_t max_ppp_payload = 0;
+#ifdef HAVE_LICENSE
+/* Free memory (kB) and PSI "full avg10" memory stall (hundredths of a
+   percent, -1 without PSI), refreshed by memSampler() so that PADR
+   handling never has to read /proc */
+static int CachedFreeMem = -1;
+static int MemPressure = -1;
+#endif
 
 /* File with PPPD options */
 static char *pppoptfile = NULL;
@@ -187,11 +204,6 @@ int RandomizeSessionNumbers = 0;
 /* Do we pass the "unit" option to pppd?  (2.4 or greater) */
 int PassUnitOptionToPPPD = 0;
 
-static PPPoETag hostUniq;
-static PPPoETag relayId;
-static PPPoETag receivedCookie;
-static PPPoETag requestedService;
-
 #define HOSTNAMELEN 256
 
 static int
@@ -206,6 +218,227 @@ count_sessions_from_mac(unsigned char *eth)
     return n;
 }
 
+/* A PADS we sent recently.  Clients retransmit PADR when a PADS is lost
+   or slow, and each retransmission would otherwise cost a session slot
+   and a pppd.  Entries are keyed by interface, VLAN, peer MAC, Host-Uniq
+   and Relay-Session-Id (every client behind a relay has the relay's MAC),
+   and are kept oldest-first so expiry is a walk from the head. */
+typedef struct PADRCacheEntryStruct {
+    hash_bucket hash;		/* Link in PADRCache */
+    struct PADRCacheEntryStruct *next; /* Next-newer entry */
+    struct PADRCacheEntryStruct *prev; /* Next-older entry */
+    ClientSession *ses;		/* Session the PADS set up */
+    Interface const *ethif;	/* Interface PADR arrived on */
+    UINT16_t vlan;		/* VLAN PADR arrived on */
+    unsigned char mac[ETH_ALEN]; /* Peer's MAC address */
+    time_t expires;		/* When to forget the entry */
+    unsigned char const *hostUniq; /* Host-Uniq payload (may be empty) */
+    UINT16_t hostUniqLen;	/* Length of hostUniq */
+    unsigned char const *relayId; /* Relay-Session-Id payload (may be empty) */
+    UINT16_t relayIdLen;	/* Length of relayId */
+    unsigned char const *pads;	/* The PADS, as sent */
+    int padsLen;		/* Length of pads */
+} PADRCacheEntry;
+
+static hash_table PADRCache;
+static PADRCacheEntry *PADRCacheOldest = NULL;
+static PADRCacheEntry *PADRCacheNewest = NULL;
+
+/**********************************************************************
+*%FUNCTION: padrCacheHash
+*%ARGUMENTS:
+* data -- a PADRCacheEntry
+*%RETURNS:
+* FNV-1a hash of the entry's key
+***********************************************************************/
+static unsigned int
+padrCacheHash(void *data)
+{
+    PADRCacheEntry const *e = (PADRCacheEntry const *) data;
+    unsigned int h = 2166136261U;
+    int i;
+
+    for (i=0; i<ETH_ALEN; i++) {
+	h ^= e->mac[i];
+	h *= 16777619U;
+    }
+    for (i=0; i<e->hostUniqLen; i++) {
+	h ^= e->hostUniq[i];
+	h *= 16777619U;
+    }
+    for (i=0; i<e->relayIdLen; i++) {
+	h ^= e->relayId[i];
+	h *= 16777619U;
+    }
+    h ^= e->vlan;
+    h *= 16777619U;
+    return h ^ (unsigned int) (((unsigned long) e->ethif) >> 4);
+}
+
+/**********************************************************************
+*%FUNCTION: padrCacheCompare
+*%ARGUMENTS:
+* item1, item2 -- PADRCacheEntries
+*%RETURNS:
+* 0 if the entries have the same key; non-zero otherwise
+***********************************************************************/
+static int
+padrCacheCompare(void *item1, void *item2)
+{
+    PADRCacheEntry const *a = (PADRCacheEntry const *) item1;
+    PADRCacheEntry const *b = (PADRCacheEntry const *) item2;
+
+    return (a->ethif != b->ethif ||
+	    a->vlan != b->vlan ||
+	    memcmp(a->mac, b->mac, ETH_ALEN) ||
+	    a->hostUniqLen != b->hostUniqLen ||
+	    memcmp(a->hostUniq, b->hostUniq, a->hostUniqLen) ||
+	    a->relayIdLen != b->relayIdLen ||
+	    memcmp(a->relayId, b->relayId, a->relayIdLen));
+}
+
+/**********************************************************************
+*%FUNCTION: dropPADRCache
+*%ARGUMENTS:
+* e -- entry to remove
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Removes a PADR cache entry and frees it.
+***********************************************************************/
+static void
+dropPADRCache(PADRCacheEntry *e)
+{
+    hash_remove(&PADRCache, e);
+    if (e->prev) e->prev->next = e->next;
+    else PADRCacheOldest = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else PADRCacheNewest = e->prev;
+    SESSION_INFO(e->ses)->padrCache = NULL;
+    free(e);
+}
+
+/**********************************************************************
+*%FUNCTION: expirePADRCache
+*%ARGUMENTS:
+* now -- current time
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Drops entries whose retransmission window has passed.  All entries
+* live for PADR_CACHE_TIME, so the expired ones are at the head.
+***********************************************************************/
+static void
+expirePADRCache(time_t now)
+{
+    while (PADRCacheOldest && PADRCacheOldest->expires <= now) {
+	dropPADRCache(PADRCacheOldest);
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: addPADRCache
+*%ARGUMENTS:
+* ctx -- the PADR that set it up
+* ses -- session just set up
+* pads -- the PADS sent for it
+* len -- length of pads
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Remembers the PADS for ses under the key of the PADR.  Failure to
+* allocate just means retransmissions are not recognised.
+***********************************************************************/
+static void
+addPADRCache(DiscoveryContext const *ctx, ClientSession *ses,
+	     PPPoEPacket const *pads, int len)
+{
+    PADRCacheEntry *e;
+    UINT16_t huLen = ctx->hostUniq.length;
+    UINT16_t riLen = ctx->relayId.length;
+    unsigned char *data;
+    time_t now = time(NULL);
+
+    expirePADRCache(now);
+    e = malloc(sizeof(PADRCacheEntry) + len + huLen + riLen);
+    if (!e) return;
+    data = (unsigned char *) (e + 1);
+
+    e->ses = ses;
+    e->ethif = ses->ethif;
+    e->vlan = ses->vlan;
+    memcpy(e->mac, ses->eth, ETH_ALEN);
+    e->expires = now + PADR_CACHE_TIME;
+    memcpy(data, pads, len);
+    e->pads = data;
+    e->padsLen = len;
+    memcpy(data + len, TAG_REF_DATA(ctx, &ctx->hostUniq), huLen);
+    e->hostUniq = data + len;
+    e->hostUniqLen = huLen;
+    memcpy(data + len + huLen, TAG_REF_DATA(ctx, &ctx->relayId), riLen);
+    e->relayId = data + len + huLen;
+    e->relayIdLen = riLen;
+
+    /* A new session with the same key replaces any older one */
+    {
+	PADRCacheEntry *old = hash_find(&PADRCache, e);
+	if (old) dropPADRCache(old);
+    }
+    hash_insert(&PADRCache, e);
+    e->next = NULL;
+    e->prev = PADRCacheNewest;
+    if (PADRCacheNewest) PADRCacheNewest->next = e;
+    else PADRCacheOldest = e;
+    PADRCacheNewest = e;
+    SESSION_INFO(ses)->padrCache = e;
+}
+
+/**********************************************************************
+*%FUNCTION: findPADRCache
+*%ARGUMENTS:
+* ctx -- a PADR
+*%RETURNS:
+* The live cache entry for this PADR (same interface, VLAN, source MAC,
+* Host-Uniq and Relay-Session-Id), or NULL
+***********************************************************************/
+static PADRCacheEntry *
+findPADRCache(DiscoveryContext const *ctx)
+{
+    PADRCacheEntry key;
+
+    expirePADRCache(time(NULL));
+    if (!PADRCacheOldest) return NULL;
+
+    key.ethif = ctx->ethif;
+    key.vlan = ctx->vlan;
+    memcpy(key.mac, ctx->packet->ethHdr.h_source, ETH_ALEN);
+    key.hostUniq = TAG_REF_DATA(ctx, &ctx->hostUniq);
+    key.hostUniqLen = ctx->hostUniq.length;
+    key.relayId = TAG_REF_DATA(ctx, &ctx->relayId);
+    key.relayIdLen = ctx->relayId.length;
+    return (PADRCacheEntry *) hash_find(&PADRCache, &key);
+}
+
+/**********************************************************************
+*%FUNCTION: sessionInterfaceName
+*%ARGUMENTS:
+* ses -- a session
+*%RETURNS:
+* Name of the interface carrying the session.  For a session on a VLAN
+* trunk, this is the VLAN subinterface "trunk.vid".
+***********************************************************************/
+char const *
+sessionInterfaceName(ClientSession const *ses)
+{
+    /* Room for ".4095"; don't silently truncate to a different name */
+    static char name[IFNAMSIZ+1+6];
+
+    if (!ses->vlan) return ses->ethif->name;
+    snprintf(name, sizeof(name), "%s.%u", ses->ethif->name,
+	     (unsigned int) ses->vlan);
+    return name;
+}
+
 /**********************************************************************
 *%FUNCTION: childHandler
 *%ARGUMENTS:
@@ -222,9 +455,6 @@ childHandler(pid_t pid, int status, void *s)
 {
     ClientSession *session = s;
 
-    /* Temporary structure for sending PADT's. */
-    PPPoEConnection conn;
-
 #ifdef HAVE_L2TP
     /* We're acting as LAC, so when child exits, become a PPPoE <-> L2TP
        relay */
@@ -234,13 +464,33 @@ childHandler(pid_t pid, int status, void *s)
 	       (unsigned int) ntohs(session->sess),
 	       session->eth[0], session->eth[1], session->eth[2],
 	       session->eth[3], session->eth[4], session->eth[5],
-	       inet_ntoa(session->tunnel_endpoint.sin_addr));
+	       inet_ntoa(SESSION_INFO(session)->tunnel_endpoint.sin_addr));
 	session->pid = 0;
 	session->funcs = &L2TPSessionFunctionTable;
 	return;
     }
 #endif
 
+    pppoe_session_closed(session, "RP-PPPoE: Child pppd process terminated");
+}
+
+/**********************************************************************
+*%FUNCTION: pppoe_session_closed
+*%ARGUMENTS:
+* session -- session whose PPP side has gone away
+* reason -- reason to send in the PADT
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Sends a PADT (unless one has gone already) and frees the session.
+***********************************************************************/
+void
+pppoe_session_closed(ClientSession *session, char const *reason)
+{
+    ClientSessionInfo *info = SESSION_INFO(session);
+    /* Temporary structure for sending PADT's. */
+    PPPoEConnection conn;
+
     memset(&conn, 0, sizeof(conn));
     conn.hostUniq = NULL;
 
@@ -250,23 +500,24 @@ childHandler(pid_t pid, int status, void *s)
 	   (unsigned int) ntohs(session->sess),
 	   session->eth[0], session->eth[1], session->eth[2],
 	   session->eth[3], session->eth[4], session->eth[5],
-	   (int) session->realpeerip[0], (int) session->realpeerip[1],
-	   (int) session->realpeerip[2], (int) session->realpeerip[3],
-	   session->ethif->name);
+	   (int) info->realpeerip[0], (int) info->realpeerip[1],
+	   (int) info->realpeerip[2], (int) info->realpeerip[3],
+	   sessionInterfaceName(session));
     memcpy(conn.myEth, session->ethif->mac, ETH_ALEN);
     conn.discoverySocket = session->ethif->sock;
     conn.session = session->sess;
+    conn.vlan = session->vlan;
     memcpy(conn.peerEth, session->eth, ETH_ALEN);
     if (!(session->flags & FLAG_SENT_PADT)) {
 	if (session->flags & FLAG_RECVD_PADT) {
 	    sendPADT(&conn, "RP-PPPoE: Received PADT from peer");
 	} else {
-	    sendPADT(&conn, "RP-PPPoE: Child pppd process terminated");
+	    sendPADT(&conn, reason);
 	}
 	session->flags |= FLAG_SENT_PADT;
     }
 
-    session->serviceName = "";
+    info->serviceName = "";
     control_session_terminated(session);
     if (pppoe_free_session(session) < 0) {
 	return;
@@ -311,9 +562,12 @@ void
 killAllSessions(void)
 {
     ClientSession *sess = BusySessions;
+    ClientSession *next;
     while(sess) {
+	/* Built-in PPP sessions are freed by stop() */
+	next = sess->next;
 	sess->funcs->stop(sess, "Shutting Down");
-	sess = sess->next;
+	sess = next;
     }
 #ifdef HAVE_L2TP
     pppoe_close_l2tp_tunnels();
@@ -355,17 +609,17 @@ parseAddressPool(char const *fname, int install)
 
 	    /* Both specified (local:remote) */
 	    if (install) {
-		Sessions[numAddrs].myip[0] = (unsigned char) a;
-		Sessions[numAddrs].myip[1] = (unsigned char) b;
-		Sessions[numAddrs].myip[2] = (unsigned char) c;
-		Sessions[numAddrs].myip[3] = (unsigned char) d;
-		Sessions[numAddrs].peerip[0] = (unsigned char) e;
-		Sessions[numAddrs].peerip[1] = (unsigned char) f;
-		Sessions[numAddrs].peerip[2] = (unsigned char) g;
-		Sessions[numAddrs].peerip[3] = (unsigned char) h;
+		SessionInfo[numAddrs].myip[0] = (unsigned char) a;
+		SessionInfo[numAddrs].myip[1] = (unsigned char) b;
+		SessionInfo[numAddrs].myip[2] = (unsigned char) c;
+		SessionInfo[numAddrs].myip[3] = (unsigned char) d;
+		SessionInfo[numAddrs].peerip[0] = (unsigned char) e;
+		SessionInfo[numAddrs].peerip[1] = (unsigned char) f;
+		SessionInfo[numAddrs].peerip[2] = (unsigned char) g;
+		SessionInfo[numAddrs].peerip[3] = (unsigned char) h;
 #ifdef HAVE_LICENSE
-		memcpy(Sessions[numAddrs].realpeerip,
-		       Sessions[numAddrs].peerip, IPV4ALEN);
+		memcpy(SessionInfo[numAddrs].realpeerip,
+		       SessionInfo[numAddrs].peerip, IPV4ALEN);
 #endif
 	    }
 	    numAddrs++;
@@ -381,13 +635,13 @@ parseAddressPool(char const *fname, int install)
 	    }
 	    if (install) {
 		while (d <= e) {
-		    Sessions[numAddrs].peerip[0] = (unsigned char) a;
-		    Sessions[numAddrs].peerip[1] = (unsigned char) b;
-		    Sessions[numAddrs].peerip[2] = (unsigned char) c;
-		    Sessions[numAddrs].peerip[3] = (unsigned char) d;
+		    SessionInfo[numAddrs].peerip[0] = (unsigned char) a;
+		    SessionInfo[numAddrs].peerip[1] = (unsigned char) b;
+		    SessionInfo[numAddrs].peerip[2] = (unsigned char) c;
+		    SessionInfo[numAddrs].peerip[3] = (unsigned char) d;
 #ifdef HAVE_LICENSE
-		    memcpy(Sessions[numAddrs].realpeerip,
-			   Sessions[numAddrs].peerip, IPV4ALEN);
+		    memcpy(SessionInfo[numAddrs].realpeerip,
+			   SessionInfo[numAddrs].peerip, IPV4ALEN);
 #endif
 		d++;
 		numAddrs++;
@@ -399,13 +653,13 @@ parseAddressPool(char const *fname, int install)
 		   a < 256 && b < 256 && c < 256 && d < 256) {
 	    /* Only remote specified */
 	    if (install) {
-		Sessions[numAddrs].peerip[0] = (unsigned char) a;
-		Sessions[numAddrs].peerip[1] = (unsigned char) b;
-		Sessions[numAddrs].peerip[2] = (unsigned char) c;
-		Sessions[numAddrs].peerip[3] = (unsigned char) d;
+		SessionInfo[numAddrs].peerip[0] = (unsigned char) a;
+		SessionInfo[numAddrs].peerip[1] = (unsigned char) b;
+		SessionInfo[numAddrs].peerip[2] = (unsigned char) c;
+		SessionInfo[numAddrs].peerip[3] = (unsigned char) d;
 #ifdef HAVE_LICENSE
-		memcpy(Sessions[numAddrs].realpeerip,
-		       Sessions[numAddrs].peerip, IPV4ALEN);
+		memcpy(SessionInfo[numAddrs].realpeerip,
+		       SessionInfo[numAddrs].peerip, IPV4ALEN);
 #endif
 	    }
 	    numAddrs++;
@@ -419,97 +673,96 @@ parseAddressPool(char const *fname, int install)
 }
 
 /**********************************************************************
-*%FUNCTION: parsePADITags
+*%FUNCTION: parseDiscoveryTags
 *%ARGUMENTS:
 * type -- tag type
 * len -- tag length
 * data -- tag data
-* extra -- extra user data.
+* extra -- the DiscoveryContext being filled in
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Picks interesting tags out of a PADI packet
+* Notes where the interesting tags of a PADI or PADR are
 ***********************************************************************/
-void
-parsePADITags(UINT16_t type, UINT16_t len, unsigned char *data,
-	      void *extra)
+static void
+parseDiscoveryTags(UINT16_t type, UINT16_t len, unsigned char *data,
+		   void *extra)
 {
+    DiscoveryContext *ctx = (DiscoveryContext *) extra;
+    PPPoETagRef *ref;
+    UINT16_t mru;
+
     switch(type) {
     case TAG_PPP_MAX_PAYLOAD:
-	if (len == sizeof(max_ppp_payload)) {
-	    memcpy(&max_ppp_payload, data, sizeof(max_ppp_payload));
-	    max_ppp_payload = ntohs(max_ppp_payload);
-	    if (max_ppp_payload <= ETH_PPPOE_MTU) {
-		max_ppp_payload = 0;
-	    }
+	if (len == sizeof(mru)) {
+	    memcpy(&mru, data, sizeof(mru));
+	    mru = ntohs(mru);
+	    ctx->maxPayload = (mru > ETH_PPPOE_MTU) ? mru : 0;
 	}
-	break;
+	return;
     case TAG_SERVICE_NAME:
-	/* Copy requested service name */
-	requestedService.type = htons(type);
-	requestedService.length = htons(len);
-	memcpy(requestedService.payload, data, len);
+	ref = &ctx->service;
 	break;
     case TAG_RELAY_SESSION_ID:
-	relayId.type = htons(type);
-	relayId.length = htons(len);
-	memcpy(relayId.payload, data, len);
+	ref = &ctx->relayId;
 	break;
     case TAG_HOST_UNIQ:
-	hostUniq.type = htons(type);
-	hostUniq.length = htons(len);
-	memcpy(hostUniq.payload, data, len);
+	ref = &ctx->hostUniq;
+	break;
+    case TAG_AC_COOKIE:
+	ref = &ctx->cookie;
 	break;
+    default:
+	return;
     }
+    ref->type = type;
+    ref->length = len;
+    ref->offset = (UINT16_t) (data - TAG_HDR_SIZE - ctx->packet->payload);
 }
 
 /**********************************************************************
-*%FUNCTION: parsePADRTags
+*%FUNCTION: initDiscoveryContext
 *%ARGUMENTS:
-* type -- tag type
-* len -- tag length
-* data -- tag data
-* extra -- extra user data.
+* ctx -- context to initialize
+* ethif -- interface packet arrived on
+* packet -- a discovery packet
+* len -- length received
+* vlan -- VLAN it arrived on, or 0
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Picks interesting tags out of a PADR packet
+* Sets up ctx to describe packet, parsing its tags
 ***********************************************************************/
 void
-parsePADRTags(UINT16_t type, UINT16_t len, unsigned char *data,
-	      void *extra)
+initDiscoveryContext(DiscoveryContext *ctx, Interface *ethif,
+		     PPPoEPacket *packet, int len, UINT16_t vlan)
 {
-    switch(type) {
-    case TAG_PPP_MAX_PAYLOAD:
-	if (len == sizeof(max_ppp_payload)) {
-	    memcpy(&max_ppp_payload, data, sizeof(max_ppp_payload));
-	    max_ppp_payload = ntohs(max_ppp_payload);
-	    if (max_ppp_payload <= ETH_PPPOE_MTU) {
-		max_ppp_payload = 0;
-	    }
-	}
-	break;
-    case TAG_RELAY_SESSION_ID:
-	relayId.type = htons(type);
-	relayId.length = htons(len);
-	memcpy(relayId.payload, data, len);
-	break;
-    case TAG_HOST_UNIQ:
-	hostUniq.type = htons(type);
-	hostUniq.length = htons(len);
-	memcpy(hostUniq.payload, data, len);
-	break;
-    case TAG_AC_COOKIE:
-	receivedCookie.type = htons(type);
-	receivedCookie.length = htons(len);
-	memcpy(receivedCookie.payload, data, len);
-	break;
-    case TAG_SERVICE_NAME:
-	requestedService.type = htons(type);
-	requestedService.length = htons(len);
-	memcpy(requestedService.payload, data, len);
-	break;
-    }
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->ethif = ethif;
+    ctx->packet = packet;
+    ctx->len = len;
+    ctx->vlan = vlan;
+    parsePacket(packet, parseDiscoveryTags, ctx);
+}
+
+/**********************************************************************
+*%FUNCTION: copyTagRef
+*%ARGUMENTS:
+* ctx -- discovery context
+* ref -- one of its tags
+* cursor -- where to copy the tag to
+*%RETURNS:
+* Number of bytes copied (0 if the tag is absent)
+*%DESCRIPTION:
+* Copies a tag of the received packet, header and all, into a reply
+***********************************************************************/
+static int
+copyTagRef(DiscoveryContext const *ctx, PPPoETagRef const *ref,
+	   unsigned char *cursor)
+{
+    if (!ref->type) return 0;
+    memcpy(cursor, TAG_REF_HDR(ctx, ref), ref->length + TAG_HDR_SIZE);
+    return ref->length + TAG_HDR_SIZE;
 }
 
 /**********************************************************************
@@ -597,83 +850,234 @@ genCookie(unsigned char const *peerEthAddr,
 }
 
 /**********************************************************************
-*%FUNCTION: processPADI
+*%FUNCTION: serviceNameHash
+*%ARGUMENTS:
+* data -- a ServiceName
+*%RETURNS:
+* FNV-1a hash of the name's bytes
+***********************************************************************/
+static unsigned int
+serviceNameHash(void *data)
+{
+    ServiceName const *sn = (ServiceName const *) data;
+    unsigned int h = 2166136261U;
+    int i;
+
+    for (i=0; i<sn->len; i++) {
+	h ^= (unsigned char) sn->name[i];
+	h *= 16777619U;
+    }
+    return h;
+}
+
+/**********************************************************************
+*%FUNCTION: serviceNameCompare
+*%ARGUMENTS:
+* item1, item2 -- ServiceNames
+*%RETURNS:
+* 0 if the names are identical; non-zero otherwise
+***********************************************************************/
+static int
+serviceNameCompare(void *item1, void *item2)
+{
+    ServiceName const *a = (ServiceName const *) item1;
+    ServiceName const *b = (ServiceName const *) item2;
+
+    return (a->len != b->len || memcmp(a->name, b->name, a->len));
+}
+
+/**********************************************************************
+*%FUNCTION: addServiceName
+*%ARGUMENTS:
+* cat -- catalogue
+* name -- Service-Name to add
+*%RETURNS:
+* Nothing; exits on error
+*%DESCRIPTION:
+* Appends a name to a catalogue.  Only called while parsing options;
+* buildServiceCatalog must be called once all names are in.
+***********************************************************************/
+static void
+addServiceName(ServiceCatalog *cat, char const *name)
+{
+    size_t len = strlen(name);
+
+    if (len > MAX_PPPOE_PAYLOAD - TAG_HDR_SIZE) {
+	fprintf(stderr, "Service-Name '%s' is too long\n", name);
+	exit(EXIT_FAILURE);
+    }
+    if (cat->num == cat->alloc) {
+	int n = cat->alloc ? cat->alloc * 2 : 16;
+	ServiceName *names = realloc(cat->names, n * sizeof(ServiceName));
+	if (!names) {
+	    fprintf(stderr, "Out of memory");
+	    exit(1);
+	}
+	cat->names = names;
+	cat->alloc = n;
+    }
+    cat->names[cat->num].name = strdup(name);
+    if (!cat->names[cat->num].name) {
+	fprintf(stderr, "Out of memory");
+	exit(1);
+    }
+    cat->names[cat->num].len = (UINT16_t) len;
+    cat->num++;
+}
+
+/**********************************************************************
+*%FUNCTION: getInterfaceServices
 *%ARGUMENTS:
-* ethif -- Interface
-* packet -- PPPoE PADI packet
-* len -- length of received packet
+* ifname -- interface name
+*%RETURNS:
+* The per-interface catalogue for ifname, creating it if necessary
+***********************************************************************/
+static ServiceCatalog *
+getInterfaceServices(char const *ifname)
+{
+    ServiceCatalog *cat;
+
+    for (cat = InterfaceServices; cat; cat = cat->next) {
+	if (!strncmp(cat->ifname, ifname, IFNAMSIZ)) return cat;
+    }
+    cat = calloc(1, sizeof(ServiceCatalog));
+    if (!cat) {
+	fprintf(stderr, "Out of memory");
+	exit(1);
+    }
+    strncpy(cat->ifname, ifname, IFNAMSIZ);
+    cat->next = InterfaceServices;
+    InterfaceServices = cat;
+    return cat;
+}
+
+/**********************************************************************
+*%FUNCTION: buildServiceCatalog
+*%ARGUMENTS:
+* cat -- catalogue
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Sends a PADO packet back to client
+* Builds the hash set and the preformatted PADO Service-Name tags.  An
+* empty catalogue advertises a single zero-length Service-Name.
 ***********************************************************************/
-void
-processPADI(Interface *ethif, PPPoEPacket *packet, int len)
+static void
+buildServiceCatalog(ServiceCatalog *cat)
 {
-    PPPoEPacket pado;
+    unsigned char *cursor;
+    PPPoETag tag;
+    int i;
+
+    hash_init(&cat->set, offsetof(ServiceName, hash),
+	      serviceNameHash, serviceNameCompare);
+
+    cat->padoTagsLen = cat->num ? 0 : TAG_HDR_SIZE;
+    for (i=0; i<cat->num; i++) {
+	hash_insert(&cat->set, &cat->names[i]);
+	cat->padoTagsLen += TAG_HDR_SIZE + cat->names[i].len;
+    }
+    cat->padoTags = malloc(cat->padoTagsLen);
+    if (!cat->padoTags) {
+	rp_fatal("Out of memory");
+    }
+
+    tag.type = htons(TAG_SERVICE_NAME);
+    tag.length = 0;
+    cursor = cat->padoTags;
+    if (!cat->num) {
+	memcpy(cursor, &tag, TAG_HDR_SIZE);
+    }
+    for (i=0; i<cat->num; i++) {
+	tag.length = htons(cat->names[i].len);
+	memcpy(cursor, &tag, TAG_HDR_SIZE);
+	memcpy(cursor+TAG_HDR_SIZE, cat->names[i].name, cat->names[i].len);
+	cursor += TAG_HDR_SIZE + cat->names[i].len;
+    }
+
+    if (cat->padoTagsLen > MAX_PPPOE_PAYLOAD - TAG_HDR_SIZE - COOKIE_LEN) {
+	syslog(LOG_WARNING, "Service-Names for %s do not fit in a PADO; only the requested or default service will be advertised",
+	       cat->ifname[0] ? cat->ifname : "all interfaces");
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: interfaceServices
+*%ARGUMENTS:
+* ethif -- interface
+*%RETURNS:
+* The Service-Name catalogue in effect on ethif
+***********************************************************************/
+static ServiceCatalog *
+interfaceServices(Interface const *ethif)
+{
+    return ethif->services ? ethif->services : &GlobalServices;
+}
+
+/**********************************************************************
+*%FUNCTION: findServiceName
+*%ARGUMENTS:
+* cat -- catalogue
+* name -- Service-Name (not zero-terminated)
+* len -- length of name
+*%RETURNS:
+* The matching ServiceName, or NULL if we do not offer it
+***********************************************************************/
+static ServiceName *
+findServiceName(ServiceCatalog *cat, unsigned char const *name, int len)
+{
+    ServiceName key;
+
+    if (!cat->num) return NULL;
+    key.name = (char const *) name;
+    key.len = (UINT16_t) len;
+    return (ServiceName *) hash_find(&cat->set, &key);
+}
+
+/**********************************************************************
+*%FUNCTION: buildPADO
+*%ARGUMENTS:
+* ctx -- the PADI
+* pado -- buffer for the reply
+* size -- set to the length of the PADO, or 0 if none should be sent
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Constructs the PADO that answers a PADI
+***********************************************************************/
+static void
+buildPADO(DiscoveryContext const *ctx, PPPoEPacket *pado, int *size)
+{
+    Interface *ethif = ctx->ethif;
+    PPPoEPacket *packet = ctx->packet;
     PPPoETag acname;
     PPPoETag servname;
     PPPoETag cookie;
     size_t acname_len;
-    unsigned char *cursor = pado.payload;
+    unsigned char *cursor = pado->payload;
     UINT16_t plen;
+    int r;
 
-    int sock = ethif->sock;
-    int i;
     int ok = 0;
     unsigned char *myAddr = ethif->mac;
+    ServiceCatalog *services = interfaceServices(ethif);
+    ServiceName *sn = NULL;
+    size_t tail;
+    UINT16_t maxPayload = ctx->maxPayload;
 
-    /* Ignore PADI's which don't come from a unicast address */
-    if (NOT_UNICAST(packet->ethHdr.h_source)) {
-	syslog(LOG_ERR, "PADI packet from non-unicast source address");
-	return;
-    }
-
-    /* If no free sessions and "-i" flag given, ignore */
-    if (IgnorePADIIfNoFreeSessions && !FreeSessions) {
-	syslog(LOG_INFO, "PADI ignored - No free session slots available");
-	return;
-    }
-
-    /* If number of sessions per MAC is limited, check here and don't
-       send PADO if already max number of sessions. */
-    if (MaxSessionsPerMac) {
-	if (count_sessions_from_mac(packet->ethHdr.h_source) >= MaxSessionsPerMac) {
-	    syslog(LOG_INFO, "PADI: Client %02x:%02x:%02x:%02x:%02x:%02x attempted to create more than %d session(s)",
-		   packet->ethHdr.h_source[0],
-		   packet->ethHdr.h_source[1],
-		   packet->ethHdr.h_source[2],
-		   packet->ethHdr.h_source[3],
-		   packet->ethHdr.h_source[4],
-		   packet->ethHdr.h_source[5],
-		   MaxSessionsPerMac);
-	    return;
-	}
-    }
-
+    *size = 0;
     acname.type = htons(TAG_AC_NAME);
     acname_len = strlen(ACName);
     acname.length = htons(acname_len);
     memcpy(acname.payload, ACName, acname_len);
 
-    relayId.type = 0;
-    hostUniq.type = 0;
-    requestedService.type = 0;
-    max_ppp_payload = 0;
-
-    parsePacket(packet, parsePADITags, NULL);
-
     /* If PADI specified non-default service name, and we do not offer
        that service, DO NOT send PADO */
-    if (requestedService.type) {
-	int slen = ntohs(requestedService.length);
+    if (ctx->service.type) {
+	int slen = ctx->service.length;
 	if (slen) {
-	    for (i=0; i<NumServiceNames; i++) {
-		if (slen == strlen(ServiceNames[i]) &&
-		    !memcmp(ServiceNames[i], &requestedService.payload, slen)) {
-		    ok = 1;
-		    break;
-		}
+	    sn = findServiceName(services, TAG_REF_DATA(ctx, &ctx->service), slen);
+	    if (sn) {
+		ok = 1;
 	    }
 	} else {
 	    ok = 1;		/* Default service requested */
@@ -693,99 +1097,147 @@ processPADI(Interface *ethif, PPPoEPacket *packet, int len)
     genCookie(packet->ethHdr.h_source, myAddr, CookieSeed, cookie.payload);
 
     /* Construct a PADO packet */
-    memcpy(pado.ethHdr.h_dest, packet->ethHdr.h_source, ETH_ALEN);
-    memcpy(pado.ethHdr.h_source, myAddr, ETH_ALEN);
-    pado.ethHdr.h_proto = htons(Eth_PPPOE_Discovery);
-    pado.ver = 1;
-    pado.type = 1;
-    pado.code = CODE_PADO;
-    pado.session = 0;
+    memcpy(pado->ethHdr.h_dest, packet->ethHdr.h_source, ETH_ALEN);
+    memcpy(pado->ethHdr.h_source, myAddr, ETH_ALEN);
+    pado->ethHdr.h_proto = htons(Eth_PPPOE_Discovery);
+    pado->ver = 1;
+    pado->type = 1;
+    pado->code = CODE_PADO;
+    pado->session = 0;
     plen = TAG_HDR_SIZE + acname_len;
 
-    CHECK_ROOM(cursor, pado.payload, acname_len+TAG_HDR_SIZE);
+    CHECK_ROOM(cursor, pado->payload, acname_len+TAG_HDR_SIZE);
     memcpy(cursor, &acname, acname_len + TAG_HDR_SIZE);
     cursor += acname_len + TAG_HDR_SIZE;
 
     /* If we asked for an MTU, handle it */
-    if (max_ppp_payload > ETH_PPPOE_MTU && ethif->mtu > 0) {
+    if (maxPayload > ETH_PPPOE_MTU && ethif->mtu > 0) {
 	/* Shrink payload to fit */
-	if (max_ppp_payload > ethif->mtu - TOTAL_OVERHEAD) {
-	    max_ppp_payload = ethif->mtu - TOTAL_OVERHEAD;
+	if (maxPayload > ethif->mtu - TOTAL_OVERHEAD) {
+	    maxPayload = ethif->mtu - TOTAL_OVERHEAD;
 	}
-	if (max_ppp_payload > ETH_JUMBO_LEN - TOTAL_OVERHEAD) {
-	    max_ppp_payload = ETH_JUMBO_LEN - TOTAL_OVERHEAD;
+	if (maxPayload > ETH_JUMBO_LEN - TOTAL_OVERHEAD) {
+	    maxPayload = ETH_JUMBO_LEN - TOTAL_OVERHEAD;
 	}
-	if (max_ppp_payload > ETH_PPPOE_MTU) {
-	    PPPoETag maxPayload;
-	    UINT16_t mru = htons(max_ppp_payload);
-	    maxPayload.type = htons(TAG_PPP_MAX_PAYLOAD);
-	    maxPayload.length = htons(sizeof(mru));
-	    memcpy(maxPayload.payload, &mru, sizeof(mru));
-	    CHECK_ROOM(cursor, pado.payload, sizeof(mru) + TAG_HDR_SIZE);
-	    memcpy(cursor, &maxPayload, sizeof(mru) + TAG_HDR_SIZE);
+	if (maxPayload > ETH_PPPOE_MTU) {
+	    PPPoETag mruTag;
+	    UINT16_t mru = htons(maxPayload);
+	    mruTag.type = htons(TAG_PPP_MAX_PAYLOAD);
+	    mruTag.length = htons(sizeof(mru));
+	    memcpy(mruTag.payload, &mru, sizeof(mru));
+	    CHECK_ROOM(cursor, pado->payload, sizeof(mru) + TAG_HDR_SIZE);
+	    memcpy(cursor, &mruTag, sizeof(mru) + TAG_HDR_SIZE);
 	    cursor += sizeof(mru) + TAG_HDR_SIZE;
 	    plen += sizeof(mru) + TAG_HDR_SIZE;
 	}
     }
-    /* If no service-names specified on command-line, just send default
-       zero-length name.  Otherwise, add all service-name tags */
-    servname.type = htons(TAG_SERVICE_NAME);
-    if (!NumServiceNames) {
-	servname.length = 0;
-	CHECK_ROOM(cursor, pado.payload, TAG_HDR_SIZE);
-	memcpy(cursor, &servname, TAG_HDR_SIZE);
-	cursor += TAG_HDR_SIZE;
-	plen += TAG_HDR_SIZE;
+    /* Add the catalogue's preformatted service-name tags (just the default
+       zero-length name if none were specified).  If they won't all fit,
+       offer only the requested service, or the default one. */
+    tail = TAG_HDR_SIZE + COOKIE_LEN;
+    if (ctx->relayId.type) tail += ctx->relayId.length + TAG_HDR_SIZE;
+    if (ctx->hostUniq.type) tail += ctx->hostUniq.length + TAG_HDR_SIZE;
+    if ((cursor - pado->payload) + services->padoTagsLen + tail <= MAX_PPPOE_PAYLOAD) {
+	memcpy(cursor, services->padoTags, services->padoTagsLen);
+	cursor += services->padoTagsLen;
+	plen += services->padoTagsLen;
     } else {
-	for (i=0; i<NumServiceNames; i++) {
-	    int slen = strlen(ServiceNames[i]);
-	    servname.length = htons(slen);
-	    CHECK_ROOM(cursor, pado.payload, TAG_HDR_SIZE+slen);
-	    memcpy(cursor, &servname, TAG_HDR_SIZE);
-	    memcpy(cursor+TAG_HDR_SIZE, ServiceNames[i], slen);
-	    cursor += TAG_HDR_SIZE+slen;
-	    plen += TAG_HDR_SIZE+slen;
-	}
+	if (!sn) sn = &services->names[0];
+	servname.type = htons(TAG_SERVICE_NAME);
+	servname.length = htons(sn->len);
+	CHECK_ROOM(cursor, pado->payload, TAG_HDR_SIZE+sn->len);
+	memcpy(cursor, &servname, TAG_HDR_SIZE);
+	memcpy(cursor+TAG_HDR_SIZE, sn->name, sn->len);
+	cursor += TAG_HDR_SIZE+sn->len;
+	plen += TAG_HDR_SIZE+sn->len;
+    }
+
+    CHECK_ROOM(cursor, pado->payload, TAG_HDR_SIZE + COOKIE_LEN);
+    memcpy(cursor, &cookie, TAG_HDR_SIZE + COOKIE_LEN);
+    cursor += TAG_HDR_SIZE + COOKIE_LEN;
+    plen += TAG_HDR_SIZE + COOKIE_LEN;
+
+    if (ctx->relayId.type) {
+	CHECK_ROOM(cursor, pado->payload, ctx->relayId.length + TAG_HDR_SIZE);
+	r = copyTagRef(ctx, &ctx->relayId, cursor);
+	cursor += r;
+	plen += r;
+    }
+    if (ctx->hostUniq.type) {
+	CHECK_ROOM(cursor, pado->payload, ctx->hostUniq.length + TAG_HDR_SIZE);
+	r = copyTagRef(ctx, &ctx->hostUniq, cursor);
+	cursor += r;
+	plen += r;
+    }
+    pado->length = htons(plen);
+    *size = (int) (plen + HDR_SIZE);
+}
+
+/**********************************************************************
+*%FUNCTION: processPADI
+*%ARGUMENTS:
+* ctx -- PPPoE PADI packet
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Sends a PADO packet back to client
+***********************************************************************/
+void
+processPADI(DiscoveryContext *ctx)
+{
+    PPPoEPacket *packet = ctx->packet;
+    PPPoEPacket pado;
+    int size;
+
+    /* Ignore PADI's which don't come from a unicast address */
+    if (NOT_UNICAST(packet->ethHdr.h_source)) {
+	syslog(LOG_ERR, "PADI packet from non-unicast source address");
+	return;
     }
 
-    CHECK_ROOM(cursor, pado.payload, TAG_HDR_SIZE + COOKIE_LEN);
-    memcpy(cursor, &cookie, TAG_HDR_SIZE + COOKIE_LEN);
-    cursor += TAG_HDR_SIZE + COOKIE_LEN;
-    plen += TAG_HDR_SIZE + COOKIE_LEN;
+    /* If no free sessions and "-i" flag given, ignore */
+    if (IgnorePADIIfNoFreeSessions && !FreeSessions) {
+	syslog(LOG_INFO, "PADI ignored - No free session slots available");
+	return;
+    }
 
-    if (relayId.type) {
-	CHECK_ROOM(cursor, pado.payload, ntohs(relayId.length) + TAG_HDR_SIZE);
-	memcpy(cursor, &relayId, ntohs(relayId.length) + TAG_HDR_SIZE);
-	cursor += ntohs(relayId.length) + TAG_HDR_SIZE;
-	plen += ntohs(relayId.length) + TAG_HDR_SIZE;
+    /* If number of sessions per MAC is limited, check here and don't
+       send PADO if already max number of sessions. */
+    if (MaxSessionsPerMac) {
+	if (count_sessions_from_mac(packet->ethHdr.h_source) >= MaxSessionsPerMac) {
+	    syslog(LOG_INFO, "PADI: Client %02x:%02x:%02x:%02x:%02x:%02x attempted to create more than %d session(s)",
+		   packet->ethHdr.h_source[0],
+		   packet->ethHdr.h_source[1],
+		   packet->ethHdr.h_source[2],
+		   packet->ethHdr.h_source[3],
+		   packet->ethHdr.h_source[4],
+		   packet->ethHdr.h_source[5],
+		   MaxSessionsPerMac);
+	    return;
+	}
     }
-    if (hostUniq.type) {
-	CHECK_ROOM(cursor, pado.payload, ntohs(hostUniq.length)+TAG_HDR_SIZE);
-	memcpy(cursor, &hostUniq, ntohs(hostUniq.length) + TAG_HDR_SIZE);
-	cursor += ntohs(hostUniq.length) + TAG_HDR_SIZE;
-	plen += ntohs(hostUniq.length) + TAG_HDR_SIZE;
+
+    buildPADO(ctx, &pado, &size);
+    if (size) {
+	sendPacketVlan(NULL, ctx->ethif->sock, &pado, size, ctx->vlan);
     }
-    pado.length = htons(plen);
-    sendPacket(NULL, sock, &pado, (int) (plen + HDR_SIZE));
 }
 
 /**********************************************************************
 *%FUNCTION: processPADT
 *%ARGUMENTS:
-* ethif -- interface
-* packet -- PPPoE PADT packet
-* len -- length of received packet
+* ctx -- PPPoE PADT packet
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
 * Kills session whose session-ID is in PADT packet.
 ***********************************************************************/
 void
-processPADT(Interface *ethif, PPPoEPacket *packet, int len)
+processPADT(DiscoveryContext *ctx)
 {
     size_t i;
-
-    unsigned char *myAddr = ethif->mac;
+    PPPoEPacket *packet = ctx->packet;
+    unsigned char *myAddr = ctx->ethif->mac;
 
     /* Ignore PADT's not directed at us */
     if (memcmp(packet->ethHdr.h_dest, myAddr, ETH_ALEN)) return;
@@ -820,6 +1272,13 @@ processPADT(Interface *ethif, PPPoEPacket *packet, int len)
 	       Sessions[i].eth[5]);
 	return;
     }
+    if (Sessions[i].vlan != ctx->vlan) {
+	syslog(LOG_WARNING, "PADT for session %u received on VLAN %u; should be on VLAN %u",
+	       (unsigned int) ntohs(packet->session),
+	       (unsigned int) ctx->vlan,
+	       (unsigned int) Sessions[i].vlan);
+	return;
+    }
     Sessions[i].flags |= FLAG_RECVD_PADT;
     parsePacket(packet, parseLogErrs, NULL);
     Sessions[i].funcs->stop(&Sessions[i], "Received PADT");
@@ -828,9 +1287,7 @@ processPADT(Interface *ethif, PPPoEPacket *packet, int len)
 /**********************************************************************
 *%FUNCTION: processPADR
 *%ARGUMENTS:
-* ethif -- Ethernet interface
-* packet -- PPPoE PADR packet
-* len -- length of received packet
+* ctx -- PPPoE PADR packet
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
@@ -838,29 +1295,26 @@ processPADT(Interface *ethif, PPPoEPacket *packet, int len)
 * packet is OK.
 ***********************************************************************/
 void
-processPADR(Interface *ethif, PPPoEPacket *packet, int len)
+processPADR(DiscoveryContext *ctx)
 {
+    Interface *ethif = ctx->ethif;
+    PPPoEPacket *packet = ctx->packet;
     unsigned char cookieBuffer[COOKIE_LEN];
     ClientSession *cliSession;
     pid_t child;
     PPPoEPacket pads;
     unsigned char *cursor = pads.payload;
     UINT16_t plen;
+    UINT16_t requestedMtu = 0;
+    PADRCacheEntry *cached;
     int i;
     int sock = ethif->sock;
     unsigned char *myAddr = ethif->mac;
     int slen = 0;
     char const *serviceName = NULL;
-
-#ifdef HAVE_LICENSE
-    int freemem;
-#endif
-
-    /* Initialize some globals */
-    relayId.type = 0;
-    hostUniq.type = 0;
-    receivedCookie.type = 0;
-    requestedService.type = 0;
+    ServiceCatalog *services = interfaceServices(ethif);
+    ServiceName *sn;
+    UINT16_t maxPayload = ctx->maxPayload;
 
     /* Ignore PADR's not directed at us */
     if (memcmp(packet->ethHdr.h_dest, myAddr, ETH_ALEN)) return;
@@ -871,6 +1325,33 @@ processPADR(Interface *ethif, PPPoEPacket *packet, int len)
 	return;
     }
 
+    /* Check that everything's cool */
+    if (!ctx->cookie.type) {
+	/* Drop it -- do not send error PADS */
+	return;
+    }
+
+    /* Is cookie kosher? */
+    if (ctx->cookie.length != COOKIE_LEN) {
+	/* Drop it -- do not send error PADS */
+	return;
+    }
+
+    genCookie(packet->ethHdr.h_source, myAddr, CookieSeed, cookieBuffer);
+    if (memcmp(TAG_REF_DATA(ctx, &ctx->cookie), cookieBuffer, COOKIE_LEN)) {
+	/* Drop it -- do not send error PADS */
+	return;
+    }
+
+    /* A retransmission of a PADR we have already answered?  Send the
+       same PADS again rather than setting up another session. */
+    cached = findPADRCache(ctx);
+    if (cached) {
+	sendPacketVlan(NULL, sock, (PPPoEPacket *) cached->pads,
+		       cached->padsLen, cached->vlan);
+	return;
+    }
+
     /* If number of sessions per MAC is limited, check here and don't
        send PADS if already max number of sessions. */
     if (MaxSessionsPerMac) {
@@ -887,49 +1368,25 @@ processPADR(Interface *ethif, PPPoEPacket *packet, int len)
 	}
     }
 
-    max_ppp_payload = 0;
-    parsePacket(packet, parsePADRTags, NULL);
-
-    /* Check that everything's cool */
-    if (!receivedCookie.type) {
-	/* Drop it -- do not send error PADS */
-	return;
-    }
-
-    /* Is cookie kosher? */
-    if (receivedCookie.length != htons(COOKIE_LEN)) {
-	/* Drop it -- do not send error PADS */
-	return;
-    }
-
-    genCookie(packet->ethHdr.h_source, myAddr, CookieSeed, cookieBuffer);
-    if (memcmp(receivedCookie.payload, cookieBuffer, COOKIE_LEN)) {
-	/* Drop it -- do not send error PADS */
-	return;
-    }
-
     /* Check service name */
-    if (!requestedService.type) {
+    if (!ctx->service.type) {
 	syslog(LOG_ERR, "Received PADR packet with no SERVICE_NAME tag");
-	sendErrorPADS(sock, myAddr, packet->ethHdr.h_source,
+	sendErrorPADS(ctx,
 		      TAG_SERVICE_NAME_ERROR, "RP-PPPoE: Server: No service name tag");
 	return;
     }
 
-    slen = ntohs(requestedService.length);
+    slen = ctx->service.length;
     if (slen) {
 	/* Check supported services */
-	for(i=0; i<NumServiceNames; i++) {
-	    if (slen == strlen(ServiceNames[i]) &&
-		!memcmp(ServiceNames[i], &requestedService.payload, slen)) {
-		serviceName = ServiceNames[i];
-		break;
-	    }
+	sn = findServiceName(services, TAG_REF_DATA(ctx, &ctx->service), slen);
+	if (sn) {
+	    serviceName = sn->name;
 	}
 
 	if (!serviceName) {
-	    syslog(LOG_ERR, "Received PADR packet asking for unsupported service %.*s", (int) ntohs(requestedService.length), requestedService.payload);
-	    sendErrorPADS(sock, myAddr, packet->ethHdr.h_source,
+	    syslog(LOG_ERR, "Received PADR packet asking for unsupported service %.*s", slen, TAG_REF_DATA(ctx, &ctx->service));
+	    sendErrorPADS(ctx,
 			  TAG_SERVICE_NAME_ERROR, "RP-PPPoE: Server: Invalid service name tag");
 	    return;
 	}
@@ -948,23 +1405,87 @@ processPADR(Interface *ethif, PPPoEPacket *packet, int len)
 	       (unsigned int) packet->ethHdr.h_source[3],
 	       (unsigned int) packet->ethHdr.h_source[4],
 	       (unsigned int) packet->ethHdr.h_source[5]);
-	sendErrorPADS(sock, myAddr, packet->ethHdr.h_source,
+	sendErrorPADS(ctx,
 		      TAG_AC_SYSTEM_ERROR, "RP-PPPoE: Server: No session licenses available");
 	return;
     }
 #endif
-    /* Enough free memory? */
+    /* Enough free memory?  Uses the values memSampler() last read */
 #ifdef HAVE_LICENSE
-    freemem = getFreeMem();
-    if (freemem < MIN_FREE_MEMORY) {
+    if (CachedFreeMem < MIN_FREE_MEMORY) {
 	syslog(LOG_WARNING,
 	       "Insufficient free memory to create session: Want %d, have %d",
-	       MIN_FREE_MEMORY, freemem);
-	sendErrorPADS(sock, myAddr, packet->ethHdr.h_source,
+	       MIN_FREE_MEMORY, CachedFreeMem);
+	sendErrorPADS(ctx,
 		      TAG_AC_SYSTEM_ERROR, "RP-PPPoE: Insufficient free RAM");
 	return;
     }
+    if (MemPressure > MAX_MEM_PRESSURE) {
+	syslog(LOG_WARNING,
+	       "Memory pressure too high to create session: %d.%02d%% stalled",
+	       MemPressure / 100, MemPressure % 100);
+	sendErrorPADS(ctx,
+		      TAG_AC_SYSTEM_ERROR, "RP-PPPoE: Server under memory pressure");
+	return;
+    }
 #endif
+    /* Build the PADS before taking a slot; the PADR cache keeps a copy */
+    memcpy(pads.ethHdr.h_dest, packet->ethHdr.h_source, ETH_ALEN);
+    memcpy(pads.ethHdr.h_source, myAddr, ETH_ALEN);
+    pads.ethHdr.h_proto = htons(Eth_PPPOE_Discovery);
+    pads.ver = 1;
+    pads.type = 1;
+    pads.code = CODE_PADS;
+
+    plen = 0;
+
+    /* Copy requested service name tag back in.  If requested-service name
+       length is zero, and we have non-zero services, use first service-name
+       as default */
+    if (!slen && services->num) {
+	PPPoETag servname;
+	slen = services->names[0].len;
+	servname.type = htons(TAG_SERVICE_NAME);
+	servname.length = htons(slen);
+	memcpy(cursor, &servname, TAG_HDR_SIZE);
+	memcpy(cursor+TAG_HDR_SIZE, services->names[0].name, slen);
+    } else {
+	copyTagRef(ctx, &ctx->service, cursor);
+    }
+    cursor += TAG_HDR_SIZE+slen;
+    plen += TAG_HDR_SIZE+slen;
+
+    /* If we asked for an MTU, handle it */
+    if (maxPayload > ETH_PPPOE_MTU && ethif->mtu > 0) {
+	/* Shrink payload to fit */
+	if (maxPayload > ethif->mtu - TOTAL_OVERHEAD) {
+	    maxPayload = ethif->mtu - TOTAL_OVERHEAD;
+	}
+	if (maxPayload > ETH_JUMBO_LEN - TOTAL_OVERHEAD) {
+	    maxPayload = ETH_JUMBO_LEN - TOTAL_OVERHEAD;
+	}
+	if (maxPayload > ETH_PPPOE_MTU) {
+	    PPPoETag mruTag;
+	    UINT16_t mru = htons(maxPayload);
+	    mruTag.type = htons(TAG_PPP_MAX_PAYLOAD);
+	    mruTag.length = htons(sizeof(mru));
+	    memcpy(mruTag.payload, &mru, sizeof(mru));
+	    CHECK_ROOM(cursor, pads.payload, sizeof(mru) + TAG_HDR_SIZE);
+	    memcpy(cursor, &mruTag, sizeof(mru) + TAG_HDR_SIZE);
+	    cursor += sizeof(mru) + TAG_HDR_SIZE;
+	    plen += sizeof(mru) + TAG_HDR_SIZE;
+	    requestedMtu = maxPayload;
+	}
+    }
+
+    i = copyTagRef(ctx, &ctx->relayId, cursor);
+    cursor += i;
+    plen += i;
+    i = copyTagRef(ctx, &ctx->hostUniq, cursor);
+    cursor += i;
+    plen += i;
+    pads.length = htons(plen);
+
     /* Looks cool... find a slot for the session */
     cliSession = pppoe_alloc_session();
     if (!cliSession) {
@@ -975,7 +1496,7 @@ processPADR(Interface *ethif, PPPoEPacket *packet, int len)
 	       (unsigned int) packet->ethHdr.h_source[3],
 	       (unsigned int) packet->ethHdr.h_source[4],
 	       (unsigned int) packet->ethHdr.h_source[5]);
-	sendErrorPADS(sock, myAddr, packet->ethHdr.h_source,
+	sendErrorPADS(ctx,
 		      TAG_AC_SYSTEM_ERROR, "RP-PPPoE: Server: No client slots available");
 	return;
     }
@@ -983,15 +1504,36 @@ processPADR(Interface *ethif, PPPoEPacket *packet, int len)
     /* Set up client session peer Ethernet address */
     memcpy(cliSession->eth, packet->ethHdr.h_source, ETH_ALEN);
     cliSession->ethif = ethif;
+    cliSession->vlan = ctx->vlan;
     cliSession->flags = 0;
     cliSession->funcs = &DefaultSessionFunctionTable;
-    cliSession->startTime = time(NULL);
-    cliSession->serviceName = serviceName;
+    SESSION_INFO(cliSession)->startTime = time(NULL);
+    SESSION_INFO(cliSession)->serviceName = serviceName;
+    SESSION_INFO(cliSession)->requested_mtu = requestedMtu;
+    pads.session = cliSession->sess;
+
+#ifdef HAVE_LINUX_IF_PPPOX_H
+    if (UseBuiltinPPP) {
+	/* Terminate PPP in this process; the channel must exist before
+	   the PADS goes out */
+	if (pppEngineStart(cliSession) < 0) {
+	    sendErrorPADS(ctx,
+			  TAG_AC_SYSTEM_ERROR, "RP-PPPoE: Server: Unable to start session");
+	    pppoe_free_session(cliSession);
+	    return;
+	}
+	control_session_started(cliSession);
+	sendPacketVlan(NULL, sock, &pads, (int) (plen + HDR_SIZE), cliSession->vlan);
+	addPADRCache(ctx, cliSession, &pads, (int) (plen + HDR_SIZE));
+	pppEngineOpen(cliSession);
+	return;
+    }
+#endif
 
     /* Create child process, send PADS packet back */
     child = fork();
     if (child < 0) {
-	sendErrorPADS(sock, myAddr, packet->ethHdr.h_source,
+	sendErrorPADS(ctx,
 		      TAG_AC_SYSTEM_ERROR, "RP-PPPoE: Server: Unable to start session process");
 	pppoe_free_session(cliSession);
 	return;
@@ -1002,6 +1544,7 @@ processPADR(Interface *ethif, PPPoEPacket *packet, int len)
 	Event_HandleChildExit(event_selector, child,
 			      childHandler, cliSession);
 	control_session_started(cliSession);
+	addPADRCache(ctx, cliSession, &pads, (int) (plen + HDR_SIZE));
 	return;
     }
 
@@ -1026,63 +1569,7 @@ processPADR(Interface *ethif, PPPoEPacket *packet, int len)
     setsid();
 
     /* Send PADS and Start pppd */
-    memcpy(pads.ethHdr.h_dest, packet->ethHdr.h_source, ETH_ALEN);
-    memcpy(pads.ethHdr.h_source, myAddr, ETH_ALEN);
-    pads.ethHdr.h_proto = htons(Eth_PPPOE_Discovery);
-    pads.ver = 1;
-    pads.type = 1;
-    pads.code = CODE_PADS;
-
-    pads.session = cliSession->sess;
-    plen = 0;
-
-    /* Copy requested service name tag back in.  If requested-service name
-       length is zero, and we have non-zero services, use first service-name
-       as default */
-    if (!slen && NumServiceNames) {
-	slen = strlen(ServiceNames[0]);
-	memcpy(&requestedService.payload, ServiceNames[0], slen);
-	requestedService.length = htons(slen);
-    }
-    memcpy(cursor, &requestedService, TAG_HDR_SIZE+slen);
-    cursor += TAG_HDR_SIZE+slen;
-    plen += TAG_HDR_SIZE+slen;
-
-    /* If we asked for an MTU, handle it */
-    if (max_ppp_payload > ETH_PPPOE_MTU && ethif->mtu > 0) {
-	/* Shrink payload to fit */
-	if (max_ppp_payload > ethif->mtu - TOTAL_OVERHEAD) {
-	    max_ppp_payload = ethif->mtu - TOTAL_OVERHEAD;
-	}
-	if (max_ppp_payload > ETH_JUMBO_LEN - TOTAL_OVERHEAD) {
-	    max_ppp_payload = ETH_JUMBO_LEN - TOTAL_OVERHEAD;
-	}
-	if (max_ppp_payload > ETH_PPPOE_MTU) {
-	    PPPoETag maxPayload;
-	    UINT16_t mru = htons(max_ppp_payload);
-	    maxPayload.type = htons(TAG_PPP_MAX_PAYLOAD);
-	    maxPayload.length = htons(sizeof(mru));
-	    memcpy(maxPayload.payload, &mru, sizeof(mru));
-	    CHECK_ROOM(cursor, pads.payload, sizeof(mru) + TAG_HDR_SIZE);
-	    memcpy(cursor, &maxPayload, sizeof(mru) + TAG_HDR_SIZE);
-	    cursor += sizeof(mru) + TAG_HDR_SIZE;
-	    plen += sizeof(mru) + TAG_HDR_SIZE;
-	    cliSession->requested_mtu = max_ppp_payload;
-	}
-    }
-
-    if (relayId.type) {
-	memcpy(cursor, &relayId, ntohs(relayId.length) + TAG_HDR_SIZE);
-	cursor += ntohs(relayId.length) + TAG_HDR_SIZE;
-	plen += ntohs(relayId.length) + TAG_HDR_SIZE;
-    }
-    if (hostUniq.type) {
-	memcpy(cursor, &hostUniq, ntohs(hostUniq.length) + TAG_HDR_SIZE);
-	cursor += ntohs(hostUniq.length) + TAG_HDR_SIZE;
-	plen += ntohs(hostUniq.length) + TAG_HDR_SIZE;
-    }
-    pads.length = htons(plen);
-    sendPacket(NULL, sock, &pads, (int) (plen + HDR_SIZE));
+    sendPacketVlan(NULL, sock, &pads, (int) (plen + HDR_SIZE), cliSession->vlan);
 
     /* Close sock; don't need it any more */
     close(sock);
@@ -1129,6 +1616,9 @@ usage(char const *argv0)
 #else
     fprintf(stderr, "   -I if_name     -- Specify interface (default %s.)\n",
 	    DEFAULT_IF);
+#endif
+#ifdef USE_LINUX_PACKET
+    fprintf(stderr, "   -V if_name     -- Serve all VLANs on trunk interface.\n");
 #endif
     fprintf(stderr, "   -T timeout     -- Specify inactivity timeout in seconds.\n");
     fprintf(stderr, "   -C name        -- Set access concentrator name.\n");
@@ -1137,11 +1627,13 @@ usage(char const *argv0)
     fprintf(stderr, "   -l             -- Increment local IP address for each session.\n");
     fprintf(stderr, "   -R ip          -- Set start address of remote IP pool.\n");
     fprintf(stderr, "   -S name        -- Advertise specified service-name.\n");
+    fprintf(stderr, "   -j if:name     -- Advertise service-name on interface 'if' only.\n");
     fprintf(stderr, "   -O fname       -- Use PPPD options from specified file\n");
     fprintf(stderr, "                     (default %s).\n", PPPOE_SERVER_OPTIONS);
     fprintf(stderr, "   -p fname       -- Optain IP address pool from specified file.\n");
     fprintf(stderr, "   -N num         -- Allow 'num' concurrent sessions.\n");
     fprintf(stderr, "   -o offset      -- Assign session numbers starting at offset+1.\n");
+    fprintf(stderr, "   -M idx:count   -- Run as instance 'idx' of 'count' on the same interfaces.\n");
     fprintf(stderr, "   -f disc:sess   -- Set Ethernet frame types (hex).\n");
     fprintf(stderr, "   -s             -- Use synchronous PPP mode.\n");
     fprintf(stderr, "   -X pidfile     -- Write PID and lock pidfile.\n");
@@ -1149,6 +1641,13 @@ usage(char const *argv0)
     fprintf(stderr, "   -Q /path/pppoe -- Specify full path to pppoe.\n");
 #ifdef HAVE_LINUX_KERNEL_PPPOE
     fprintf(stderr, "   -k             -- Use kernel-mode PPPoE.\n");
+#endif
+#ifdef HAVE_LINUX_IF_PPPOX_H
+    fprintf(stderr, "   -b auth        -- Run PPP in-process; auth is none, pap or chap.\n");
+#endif
+#ifdef __linux__
+    fprintf(stderr, "   -A secs:fname  -- Write per-session traffic to 'fname' every 'secs'.\n");
+    fprintf(stderr, "   -E secs        -- Stop sessions that receive nothing for 'secs'.\n");
 #endif
     fprintf(stderr, "   -u             -- Pass 'unit' option to pppd.\n");
     fprintf(stderr, "   -r             -- Randomize session numbers.\n");
@@ -1196,15 +1695,16 @@ main(int argc, char **argv)
     char *addressPoolFname = NULL;
     char *pidfile = NULL;
     char c;
+    ServiceCatalog *cat;
 
 #ifdef HAVE_LICENSE
     int use_clustering = 0;
 #endif
 
 #ifndef HAVE_LINUX_KERNEL_PPPOE
-    char *options = "X:ix:hI:C:L:R:T:m:FN:f:O:o:sp:lrudPc:S:1q:Q:";
+    char *options = "X:ix:hI:V:M:C:L:R:T:m:FN:f:O:o:sp:lrudPc:S:j:1q:Q:b:A:E:";
 #else
-    char *options = "X:ix:hI:C:L:R:T:m:FN:f:O:o:skp:lrudPc:S:1q:Q:";
+    char *options = "X:ix:hI:V:M:C:L:R:T:m:FN:f:O:o:skp:lrudPc:S:j:1q:Q:b:A:E:";
 #endif
 
     if (getuid() != geteuid() ||
@@ -1244,18 +1744,55 @@ main(int argc, char **argv)
 	    UseLinuxKernelModePPPoE = 1;
 	    break;
 #endif
-	case 'S':
-	    if (NumServiceNames == MAX_SERVICE_NAMES) {
-		fprintf(stderr, "Too many '-S' options (%d max)",
-			MAX_SERVICE_NAMES);
-		exit(1);
+	case 'b':
+#ifdef HAVE_LINUX_IF_PPPOX_H
+	    if (pppEngineInit(optarg) < 0) {
+		fprintf(stderr, "-b: Authentication must be none, pap or chap\n");
+		exit(EXIT_FAILURE);
 	    }
-	    ServiceNames[NumServiceNames] = strdup(optarg);
-	    if (!ServiceNames[NumServiceNames]) {
-		fprintf(stderr, "Out of memory");
-		exit(1);
+	    UseBuiltinPPP = 1;
+#else
+	    fprintf(stderr, "-b: Built-in PPP is only supported on Linux\n");
+	    exit(EXIT_FAILURE);
+#endif
+	    break;
+	case 'A':
+#ifdef __linux__
+	    if (acctInit(optarg) < 0) {
+		fprintf(stderr, "-A: Expecting secs:filename\n");
+		exit(EXIT_FAILURE);
+	    }
+#else
+	    fprintf(stderr, "-A: Session accounting is only supported on Linux\n");
+	    exit(EXIT_FAILURE);
+#endif
+	    break;
+	case 'E':
+#ifdef __linux__
+	    if (acctSetIdleTimeout(optarg) < 0) {
+		fprintf(stderr, "-E: Expecting a number of seconds\n");
+		exit(EXIT_FAILURE);
+	    }
+#else
+	    fprintf(stderr, "-E: Idle detection is only supported on Linux\n");
+	    exit(EXIT_FAILURE);
+#endif
+	    break;
+	case 'S':
+	    addServiceName(&GlobalServices, optarg);
+	    break;
+	case 'j':
+	    /* if_name:service_name */
+	    {
+		char *colon = strchr(optarg, ':');
+		if (!colon || colon == optarg || colon - optarg > IFNAMSIZ) {
+		    usage(argv[0]);
+		    exit(EXIT_FAILURE);
+		}
+		*colon = 0;
+		addServiceName(getInterfaceServices(optarg), colon+1);
+		*colon = ':';
 	    }
-	    NumServiceNames++;
 	    break;
 	case 'q':
 	    pppd_path = strdup(optarg);
@@ -1360,6 +1897,24 @@ main(int argc, char **argv)
 	    SessOffset = (size_t) opt;
 	    break;
 
+	case 'M':
+	    if (sscanf(optarg, "%u:%u", &InstanceIndex, &NumInstances) != 2) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	    }
+	    if (NumInstances < 1 || NumInstances > 65534 ||
+		InstanceIndex >= NumInstances) {
+		fprintf(stderr, "-M: need 0 <= index < count <= 65534\n");
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+
+	case 'V':
+#ifndef USE_LINUX_PACKET
+	    fprintf(stderr, "VLAN trunk mode not available.\n");
+	    exit(1);
+#endif
+	    /* Fall through */
 	case 'I':
 	    if (NumInterfaces >= MAX_INTERFACES) {
 		fprintf(stderr, "Too many -I options (max %d)\n",
@@ -1375,7 +1930,10 @@ main(int argc, char **argv)
 	    }
 	    if (!found) {
 		strncpy(interfaces[NumInterfaces].name, optarg, IFNAMSIZ);
-		NumInterfaces++;
+		i = NumInterfaces++;
+	    }
+	    if (opt == 'V') {
+		interfaces[i].trunk = 1;
 	    }
 	    break;
 
@@ -1453,6 +2011,28 @@ main(int argc, char **argv)
 	NumInterfaces = 1;
     }
 
+    /* Build Service-Name catalogues and attach them to interfaces */
+    buildServiceCatalog(&GlobalServices);
+    for (i=0; i<NumInterfaces; i++) {
+	interfaces[i].services = &GlobalServices;
+    }
+    for (cat = InterfaceServices; cat; cat = cat->next) {
+	found = 0;
+	for (i=0; i<NumInterfaces; i++) {
+	    if (!strncmp(interfaces[i].name, cat->ifname, IFNAMSIZ)) {
+		interfaces[i].services = cat;
+		found = 1;
+		break;
+	    }
+	}
+	if (!found) {
+	    fprintf(stderr, "-j %s:...: interface %s not given with -I\n",
+		    cat->ifname, cat->ifname);
+	    exit(EXIT_FAILURE);
+	}
+	buildServiceCatalog(cat);
+    }
+
     if (!ACName) {
 	ACName = malloc(HOSTNAMELEN);
 	if (gethostname(ACName, HOSTNAMELEN) < 0) {
@@ -1469,6 +2049,22 @@ main(int argc, char **argv)
 	}
     }
 
+    /* In multi-instance mode, each instance owns an equal share of the
+       session-number space */
+    if (NumInstances > 1) {
+	size_t share = 65534 / NumInstances;
+	if (SessOffset) {
+	    fprintf(stderr, "-o cannot be used with -M\n");
+	    exit(EXIT_FAILURE);
+	}
+	if (NumSessionSlots > share) {
+	    fprintf(stderr, "With -M %u:%u, -N can be at most %lu\n",
+		    InstanceIndex, NumInstances, (unsigned long) share);
+	    exit(EXIT_FAILURE);
+	}
+	SessOffset = InstanceIndex * share;
+    }
+
     /* Max 65534 - SessOffset sessions */
     if (NumSessionSlots + SessOffset > 65534) {
 	fprintf(stderr, "-N and -o options must add up to at most 65534\n");
@@ -1477,13 +2073,16 @@ main(int argc, char **argv)
 
     /* Allocate memory for sessions */
     Sessions = calloc(NumSessionSlots, sizeof(ClientSession));
-    if (!Sessions) {
+    SessionInfo = calloc(NumSessionSlots, sizeof(ClientSessionInfo));
+    if (!Sessions || !SessionInfo) {
 	rp_fatal("Cannot allocate memory for session slots");
     }
+    hash_init(&PADRCache, offsetof(PADRCacheEntry, hash),
+	      padrCacheHash, padrCacheCompare);
 
     /* Fill in local addresses first (let pool file override later */
     for (i=0; i<NumSessionSlots; i++) {
-	memcpy(Sessions[i].myip, LocalIP, sizeof(LocalIP));
+	memcpy(SessionInfo[i].myip, LocalIP, sizeof(LocalIP));
 	if (IncrLocalIP) {
 	    incrementIPAddress(LocalIP);
 	}
@@ -1501,9 +2100,9 @@ main(int argc, char **argv)
 	Sessions[i].sess = htons(i+1+SessOffset);
 
 	if (!addressPoolFname) {
-	    memcpy(Sessions[i].peerip, RemoteIP, sizeof(RemoteIP));
+	    memcpy(SessionInfo[i].peerip, RemoteIP, sizeof(RemoteIP));
 #ifdef HAVE_LICENSE
-	    memcpy(Sessions[i].realpeerip, RemoteIP, sizeof(RemoteIP));
+	    memcpy(SessionInfo[i].realpeerip, RemoteIP, sizeof(RemoteIP));
 #endif
 	    incrementIPAddress(RemoteIP);
 	}
@@ -1567,13 +2166,15 @@ main(int argc, char **argv)
     if (Debug) {
 	/* Dump session array and exit */
 	ClientSession *ses = FreeSessions;
+	ClientSessionInfo *info;
 	while(ses) {
+	    info = SESSION_INFO(ses);
 	    printf("Session %u local %d.%d.%d.%d remote %d.%d.%d.%d\n",
 		   (unsigned int) (ntohs(ses->sess)),
-		   ses->myip[0], ses->myip[1],
-		   ses->myip[2], ses->myip[3],
-		   ses->peerip[0], ses->peerip[1],
-		   ses->peerip[2], ses->peerip[3]);
+		   info->myip[0], info->myip[1],
+		   info->myip[2], info->myip[3],
+		   info->peerip[0], info->peerip[1],
+		   info->peerip[2], info->peerip[3]);
 	    ses = ses->next;
 	}
 	exit(0);
@@ -1582,9 +2183,29 @@ main(int argc, char **argv)
     /* Open all the interfaces */
     for (i=0; i<NumInterfaces; i++) {
 	interfaces[i].mtu = 0;
+#ifdef USE_LINUX_PACKET
+	if (interfaces[i].trunk) {
+	    interfaces[i].sock = openTrunkInterface(interfaces[i].name, Eth_PPPOE_Discovery, interfaces[i].mac, &interfaces[i].mtu);
+	    continue;
+	}
+#endif
 	interfaces[i].sock = openInterface(interfaces[i].name, Eth_PPPOE_Discovery, interfaces[i].mac, &interfaces[i].mtu);
     }
 
+#ifdef USE_LINUX_PACKET
+    /* Have the kernel drop other instances' clients */
+    if (NumInstances > 1) {
+	for (i=0; i<NumInterfaces; i++) {
+	    if (setDiscoveryFilter(interfaces[i].sock, Eth_PPPOE_Discovery,
+				   interfaces[i].trunk,
+				   InstanceIndex, NumInstances) < 0) {
+		syslog(LOG_WARNING, "Could not attach partition filter on %s: %m; filtering in user space",
+		       interfaces[i].name);
+	    }
+	}
+    }
+#endif
+
     /* Ignore SIGPIPE */
     signal(SIGPIPE, SIG_IGN);
 
@@ -1594,6 +2215,16 @@ main(int argc, char **argv)
 	rp_fatal("Could not create EventSelector -- probably out of memory");
     }
 
+#ifdef HAVE_LICENSE
+    /* Sample memory once now, then periodically */
+    memSampler(event_selector, -1, 0, NULL);
+#endif
+
+#ifdef __linux__
+    /* Per-session traffic accounting and idle reaper, if -A or -E given */
+    acctStart(event_selector);
+#endif
+
     /* Control channel */
 #ifdef HAVE_LICENSE
     if (control_init(argc, argv, event_selector)) {
@@ -1772,9 +2403,18 @@ serverProcessPacket(Interface *i)
 {
     int len;
     PPPoEPacket packet;
+    DiscoveryContext ctx;
+    UINT16_t vlan = 0;
     int sock = i->sock;
+    int r;
 
-    if (receivePacket(sock, &packet, &len) < 0) {
+#ifdef USE_LINUX_PACKET
+    if (i->trunk) {
+	r = receivePacketVlan(sock, &packet, &len, &vlan);
+    } else
+#endif
+    r = receivePacket(sock, &packet, &len);
+    if (r < 0) {
 	return;
     }
 
@@ -1796,16 +2436,26 @@ serverProcessPacket(Interface *i)
 	return;
     }
 
+    /* In multi-instance mode, leave other instances' clients alone.
+       Normally the socket filter has already done this. */
+    if (NumInstances > 1 &&
+	macPartition(packet.ethHdr.h_source, NumInstances) != InstanceIndex) {
+	return;
+    }
+
     switch(packet.code) {
     case CODE_PADI:
-	processPADI(i, &packet, len);
+	initDiscoveryContext(&ctx, i, &packet, len, vlan);
+	processPADI(&ctx);
 	break;
     case CODE_PADR:
-	processPADR(i, &packet, len);
+	initDiscoveryContext(&ctx, i, &packet, len, vlan);
+	processPADR(&ctx);
 	break;
     case CODE_PADT:
 	/* Kill the child */
-	processPADT(i, &packet, len);
+	initDiscoveryContext(&ctx, i, &packet, len, vlan);
+	processPADT(&ctx);
 	break;
     case CODE_SESS:
 	/* Ignore SESS -- children will handle them */
@@ -1823,20 +2473,17 @@ serverProcessPacket(Interface *i)
 /**********************************************************************
 *%FUNCTION: sendErrorPADS
 *%ARGUMENTS:
-* sock -- socket to write to
-* source -- source Ethernet address
-* dest -- destination Ethernet address
+* ctx -- the PADR being refused
 * errorTag -- error tag
 * errorMsg -- error message
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Sends a PADS packet with an error message
+* Sends a PADS packet with an error message, echoing the PADR's
+* Relay-Session-Id and Host-Uniq
 ***********************************************************************/
 void
-sendErrorPADS(int sock,
-	      unsigned char *source,
-	      unsigned char *dest,
+sendErrorPADS(DiscoveryContext const *ctx,
 	      int errorTag,
 	      char *errorMsg)
 {
@@ -1846,8 +2493,8 @@ sendErrorPADS(int sock,
     PPPoETag err;
     int elen = strlen(errorMsg);
 
-    memcpy(pads.ethHdr.h_dest, dest, ETH_ALEN);
-    memcpy(pads.ethHdr.h_source, source, ETH_ALEN);
+    memcpy(pads.ethHdr.h_dest, ctx->packet->ethHdr.h_source, ETH_ALEN);
+    memcpy(pads.ethHdr.h_source, ctx->ethif->mac, ETH_ALEN);
     pads.ethHdr.h_proto = htons(Eth_PPPOE_Discovery);
     pads.ver = 1;
     pads.type = 1;
@@ -1864,18 +2511,15 @@ sendErrorPADS(int sock,
     cursor += TAG_HDR_SIZE + elen;
     plen += TAG_HDR_SIZE + elen;
 
-    if (relayId.type) {
-	memcpy(cursor, &relayId, ntohs(relayId.length) + TAG_HDR_SIZE);
-	cursor += ntohs(relayId.length) + TAG_HDR_SIZE;
-	plen += ntohs(relayId.length) + TAG_HDR_SIZE;
-    }
-    if (hostUniq.type) {
-	memcpy(cursor, &hostUniq, ntohs(hostUniq.length) + TAG_HDR_SIZE);
-	cursor += ntohs(hostUniq.length) + TAG_HDR_SIZE;
-	plen += ntohs(hostUniq.length) + TAG_HDR_SIZE;
-    }
+    elen = copyTagRef(ctx, &ctx->relayId, cursor);
+    cursor += elen;
+    plen += elen;
+    elen = copyTagRef(ctx, &ctx->hostUniq, cursor);
+    cursor += elen;
+    plen += elen;
     pads.length = htons(plen);
-    sendPacket(NULL, sock, &pads, (int) (plen + HDR_SIZE));
+    sendPacketVlan(NULL, ctx->ethif->sock, &pads, (int) (plen + HDR_SIZE),
+		   ctx->vlan);
 }
 
 
@@ -1891,6 +2535,7 @@ sendErrorPADS(int sock,
 void
 startPPPDUserMode(ClientSession *session)
 {
+    ClientSessionInfo *info = SESSION_INFO(session);
     /* Leave some room */
     char *argv[64];
 
@@ -1903,11 +2548,11 @@ startPPPDUserMode(ClientSession *session)
 
     /* Let's hope service-name does not have ' in it... */
     snprintf(buffer, SMALLBUF, "%s -n -I %s -e %u:%02x:%02x:%02x:%02x:%02x:%02x%s -S '%s'",
-	     pppoe_path, session->ethif->name,
+	     pppoe_path, sessionInterfaceName(session),
 	     (unsigned int) ntohs(session->sess),
 	     session->eth[0], session->eth[1], session->eth[2],
 	     session->eth[3], session->eth[4], session->eth[5],
-	     PppoeOptions, session->serviceName);
+	     PppoeOptions, info->serviceName);
     argv[c++] = strdup(buffer);
     if (!argv[c-1]) {
 	/* TODO: Send a PADT */
@@ -1918,19 +2563,19 @@ startPPPDUserMode(ClientSession *session)
     argv[c++] = pppoptfile;
 
     snprintf(buffer, SMALLBUF, "%d.%d.%d.%d:%d.%d.%d.%d",
-	    (int) session->myip[0], (int) session->myip[1],
-	    (int) session->myip[2], (int) session->myip[3],
-	    (int) session->peerip[0], (int) session->peerip[1],
-	    (int) session->peerip[2], (int) session->peerip[3]);
+	    (int) info->myip[0], (int) info->myip[1],
+	    (int) info->myip[2], (int) info->myip[3],
+	    (int) info->peerip[0], (int) info->peerip[1],
+	    (int) info->peerip[2], (int) info->peerip[3]);
     syslog(LOG_INFO,
 	   "Session %u created for client %02x:%02x:%02x:%02x:%02x:%02x (%d.%d.%d.%d) on %s using Service-Name '%s'",
 	   (unsigned int) ntohs(session->sess),
 	   session->eth[0], session->eth[1], session->eth[2],
 	   session->eth[3], session->eth[4], session->eth[5],
-	   (int) session->peerip[0], (int) session->peerip[1],
-	   (int) session->peerip[2], (int) session->peerip[3],
-	   session->ethif->name,
-	   session->serviceName);
+	   (int) info->peerip[0], (int) info->peerip[1],
+	   (int) info->peerip[2], (int) info->peerip[3],
+	   sessionInterfaceName(session),
+	   info->serviceName);
     argv[c++] = strdup(buffer);
     if (!argv[c-1]) {
 	/* TODO: Send a PADT */
@@ -1948,8 +2593,8 @@ startPPPDUserMode(ClientSession *session)
 	sprintf(buffer, "%u", (unsigned int) (ntohs(session->sess) - 1));
 	argv[c++] = buffer;
     }
-    if (session->requested_mtu > 1492) {
-	sprintf(buffer, "%u", (unsigned int) session->requested_mtu);
+    if (info->requested_mtu > 1492) {
+	sprintf(buffer, "%u", (unsigned int) info->requested_mtu);
 	argv[c++] = "mru";
 	argv[c++] = buffer;
 	argv[c++] = "mtu";
@@ -1979,6 +2624,7 @@ startPPPDUserMode(ClientSession *session)
 void
 startPPPDLinuxKernelMode(ClientSession *session)
 {
+    ClientSessionInfo *info = SESSION_INFO(session);
     /* Leave some room */
     char *argv[32];
 
@@ -1991,7 +2637,7 @@ startPPPDLinuxKernelMode(ClientSession *session)
     argv[c++] = PLUGIN_PATH;
 
     /* Add "nic-" to interface name */
-    snprintf(buffer, SMALLBUF, "nic-%s", session->ethif->name);
+    snprintf(buffer, SMALLBUF, "nic-%s", sessionInterfaceName(session));
     argv[c++] = strdup(buffer);
     if (!argv[c-1]) {
 	exit(EXIT_FAILURE);
@@ -2008,24 +2654,24 @@ startPPPDLinuxKernelMode(ClientSession *session)
 	exit(EXIT_FAILURE);
     }
     argv[c++] = "rp_pppoe_service";
-    argv[c++] = (char *) session->serviceName;
+    argv[c++] = (char *) info->serviceName;
     argv[c++] = "file";
     argv[c++] = pppoptfile;
 
     snprintf(buffer, SMALLBUF, "%d.%d.%d.%d:%d.%d.%d.%d",
-	    (int) session->myip[0], (int) session->myip[1],
-	    (int) session->myip[2], (int) session->myip[3],
-	    (int) session->peerip[0], (int) session->peerip[1],
-	    (int) session->peerip[2], (int) session->peerip[3]);
+	    (int) info->myip[0], (int) info->myip[1],
+	    (int) info->myip[2], (int) info->myip[3],
+	    (int) info->peerip[0], (int) info->peerip[1],
+	    (int) info->peerip[2], (int) info->peerip[3]);
     syslog(LOG_INFO,
 	   "Session %u created for client %02x:%02x:%02x:%02x:%02x:%02x (%d.%d.%d.%d) on %s using Service-Name '%s'",
 	   (unsigned int) ntohs(session->sess),
 	   session->eth[0], session->eth[1], session->eth[2],
 	   session->eth[3], session->eth[4], session->eth[5],
-	   (int) session->peerip[0], (int) session->peerip[1],
-	   (int) session->peerip[2], (int) session->peerip[3],
-	   session->ethif->name,
-	   session->serviceName);
+	   (int) info->peerip[0], (int) info->peerip[1],
+	   (int) info->peerip[2], (int) info->peerip[3],
+	   sessionInterfaceName(session),
+	   info->serviceName);
     argv[c++] = strdup(buffer);
     if (!argv[c-1]) {
 	/* TODO: Send a PADT */
@@ -2040,8 +2686,8 @@ startPPPDLinuxKernelMode(ClientSession *session)
 	sprintf(buffer, "%u", (unsigned int) (ntohs(session->sess) - 1 - SessOffset));
 	argv[c++] = buffer;
     }
-    if (session->requested_mtu > 1492) {
-	sprintf(buffer, "%u", (unsigned int) session->requested_mtu);
+    if (info->requested_mtu > 1492) {
+	sprintf(buffer, "%u", (unsigned int) info->requested_mtu);
 	argv[c++] = "mru";
 	argv[c++] = buffer;
 	argv[c++] = "mtu";
@@ -2117,6 +2763,7 @@ PppoeStopSession(ClientSession *ses,
     memcpy(conn.myEth, ses->ethif->mac, ETH_ALEN);
     conn.discoverySocket = ses->ethif->sock;
     conn.session = ses->sess;
+    conn.vlan = ses->vlan;
     memcpy(conn.peerEth, ses->eth, ETH_ALEN);
     sendPADT(&conn, reason);
     ses->flags |= FLAG_SENT_PADT;
@@ -2181,6 +2828,61 @@ getFreeMem(void)
     /* return memfree + buffers + cached; */
     return memfree;
 }
+
+/**********************************************************************
+* %FUNCTION: getMemPressure
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  The share of the last 10 seconds in which all non-idle tasks were
+*  stalled on memory, in hundredths of a percent, or -1 if the kernel
+*  does not provide pressure stall information (Linux 4.20+)
+***********************************************************************/
+static int
+getMemPressure(void)
+{
+    char buf[256];
+    int whole, frac;
+    int pressure = -1;
+    FILE *fp = fopen("/proc/pressure/memory", "r");
+    if (!fp) return -1;
+
+    while (fgets(buf, sizeof(buf), fp)) {
+	if (sscanf(buf, "full avg10=%d.%d", &whole, &frac) == 2) {
+	    pressure = whole * 100 + frac;
+	    break;
+	}
+    }
+    fclose(fp);
+    return pressure;
+}
+
+/**********************************************************************
+* %FUNCTION: memSampler
+* %ARGUMENTS:
+*  es -- event selector
+*  fd, flags -- ignored
+*  data -- ignored
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Refreshes CachedFreeMem and MemPressure and re-arms itself
+***********************************************************************/
+static void
+memSampler(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    struct timeval t;
+
+    CachedFreeMem = getFreeMem();
+    MemPressure = getMemPressure();
+
+    t.tv_sec = MEM_SAMPLE_INTERVAL;
+    t.tv_usec = 0;
+    if (!Event_AddTimerHandler(es, t, memSampler, NULL)) {
+	/* Keep the last values rather than refusing every session */
+	syslog(LOG_ERR, "Unable to re-arm free-memory sampler");
+    }
+}
 #endif
 
 /**********************************************************************
@@ -2197,7 +2899,9 @@ ClientSession *
 pppoe_alloc_session(void)
 {
     ClientSession *ses = FreeSessions;
+    ClientSessionInfo *info;
     if (!ses) return NULL;
+    info = SESSION_INFO(ses);
 
     /* Remove from free sessions list */
     if (ses == LastFreeSession) {
@@ -2213,18 +2917,29 @@ pppoe_alloc_session(void)
     ses->funcs = &DefaultSessionFunctionTable;
     ses->pid = 0;
     ses->ethif = NULL;
+    ses->vlan = 0;
     memset(ses->eth, 0, ETH_ALEN);
     ses->flags = 0;
-    ses->startTime = time(NULL);
-    ses->serviceName = "";
-    ses->requested_mtu = 0;
+    info->startTime = time(NULL);
+    info->serviceName = "";
+    info->requested_mtu = 0;
+    info->pppIfName[0] = 0;
+    info->rxBytes = info->rxPackets = 0;
+    info->txBytes = info->txPackets = 0;
+    info->lastActive = info->startTime;
+#ifdef __linux__
+    acctSessionStarted(ses);
+#endif
 #ifdef HAVE_LICENSE
-    memset(ses->user, 0, MAX_USERNAME_LEN+1);
-    memset(ses->realm, 0, MAX_USERNAME_LEN+1);
-    memset(ses->realpeerip, 0, IPV4ALEN);
+    memset(info->user, 0, MAX_USERNAME_LEN+1);
+    memset(info->realm, 0, MAX_USERNAME_LEN+1);
+    memset(info->realpeerip, 0, IPV4ALEN);
 #endif
 #ifdef HAVE_L2TP
-    ses->l2tp_ses = NULL;
+    info->l2tp_ses = NULL;
+#endif
+#ifdef HAVE_LINUX_IF_PPPOX_H
+    ses->ppp = NULL;
 #endif
     NumActiveSessions++;
     return ses;
@@ -2279,8 +2994,14 @@ pppoe_free_session(ClientSession *ses)
     ses->pid = 0;
     memset(ses->eth, 0, ETH_ALEN);
     ses->flags = 0;
+    if (SESSION_INFO(ses)->padrCache) {
+	dropPADRCache(SESSION_INFO(ses)->padrCache);
+    }
+#ifdef __linux__
+    acctSessionEnded(ses);
+#endif
 #ifdef HAVE_L2TP
-    ses->l2tp_ses = NULL;
+    SESSION_INFO(ses)->l2tp_ses = NULL;
 #endif
     NumActiveSessions--;
     return 0;
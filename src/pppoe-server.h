@@ -17,12 +17,33 @@
 
 #include "pppoe.h"
 #include "event.h"
+#include "hash.h"
 
 #ifdef HAVE_L2TP
 #include "l2tp/l2tp.h"
 #endif
 
 #define MAX_USERNAME_LEN 31
+
+/* A Service-Name we offer */
+typedef struct {
+    hash_bucket hash;		/* Link in catalogue's hash set */
+    char const *name;		/* The name */
+    UINT16_t len;		/* Cached strlen(name) */
+} ServiceName;
+
+/* A set of Service-Names offered on one or more interfaces */
+typedef struct ServiceCatalogStruct {
+    struct ServiceCatalogStruct *next; /* Next per-interface catalogue */
+    char ifname[IFNAMSIZ+1];	/* Interface name, if per-interface */
+    ServiceName *names;		/* In command-line order; first is default */
+    int num;			/* Number of names */
+    int alloc;			/* Allocated size of names */
+    hash_table set;		/* Names by contents */
+    unsigned char *padoTags;	/* Preformatted Service-Name tags for PADO */
+    size_t padoTagsLen;		/* Length of padoTags */
+} ServiceCatalog;
+
 /* An Ethernet interface */
 typedef struct {
     char name[IFNAMSIZ+1];	/* Interface name */
@@ -30,6 +51,8 @@ typedef struct {
     unsigned char mac[ETH_ALEN]; /* MAC address */
     EventHandler *eh;		/* Event handler for this interface */
     UINT16_t mtu;               /* MTU of interface */
+    ServiceCatalog *services;	/* Service-Names offered here */
+    int trunk;			/* Serve all VLANs on this interface */
 
     /* Next fields are used only if we're an L2TP LAC */
 #ifdef HAVE_L2TP
@@ -38,6 +61,21 @@ typedef struct {
 #endif
 } Interface;
 
+/* A discovery packet being processed.  Tags are referenced where they
+   lie in the packet (type 0 if absent), so nothing here is shared
+   between packets. */
+typedef struct {
+    Interface *ethif;		/* Interface it arrived on */
+    PPPoEPacket *packet;
+    int len;			/* Length received */
+    UINT16_t vlan;		/* VLAN it arrived on (trunks only) */
+    UINT16_t maxPayload;	/* PPP-Max-Payload asked for, or 0 */
+    PPPoETagRef service;	/* Service-Name */
+    PPPoETagRef hostUniq;	/* Host-Uniq */
+    PPPoETagRef relayId;	/* Relay-Session-Id */
+    PPPoETagRef cookie;		/* AC-Cookie */
+} DiscoveryContext;
+
 #define FLAG_RECVD_PADT      1
 #define FLAG_USER_SET        2
 #define FLAG_IP_SET          4
@@ -66,20 +104,41 @@ typedef struct PppoeSessionFunctionTable_t {
 
 extern PppoeSessionFunctionTable DefaultSessionFunctionTable;
 
-/* A client session */
+/* A client session.  Only what discovery and session-list scans touch
+   lives here; the rest is in the ClientSessionInfo side table so that
+   walking the lists does not drag cold data through the cache. */
 typedef struct ClientSessionStruct {
     struct ClientSessionStruct *next; /* In list of free or active sessions */
     PppoeSessionFunctionTable *funcs; /* Function table */
-    pid_t pid;			/* PID of child handling session */
     Interface *ethif;		/* Ethernet interface */
-    unsigned char myip[IPV4ALEN]; /* Local IP address */
-    unsigned char peerip[IPV4ALEN]; /* Desired IP address of peer */
+#ifdef HAVE_LINUX_IF_PPPOX_H
+    struct PPPEngineStruct *ppp; /* Built-in PPP state, if terminated here */
+#endif
+    pid_t pid;			/* PID of child handling session */
     UINT16_t sess;		/* Session number */
+    UINT16_t vlan;		/* VLAN ID if on a trunk interface; else 0 */
     unsigned char eth[ETH_ALEN]; /* Peer's Ethernet address */
-    unsigned int flags;		/* Various flags */
+    UINT16_t flags;		/* Various flags */
+} ClientSession;
+
+/* Rarely-used per-session data, indexed like Sessions */
+typedef struct ClientSessionInfoStruct {
     time_t startTime;		/* When session started */
     char const *serviceName;	/* Service name */
+    unsigned char myip[IPV4ALEN]; /* Local IP address */
+    unsigned char peerip[IPV4ALEN]; /* Desired IP address of peer */
     UINT16_t requested_mtu;     /* Requested PPP_MAX_PAYLOAD  per RFC 4638 */
+    struct PADRCacheEntryStruct *padrCache; /* Our PADS, while PADR may
+					       still be retransmitted */
+    char pppIfName[IFNAMSIZ+1];	/* ppp interface, once accounting finds it */
+    uint64_t rxBytes;		/* Interface counters at last accounting poll */
+    uint64_t rxPackets;
+    uint64_t txBytes;
+    uint64_t txPackets;
+    time_t lastActive;		/* When the peer was last seen to send */
+    int idleSlot;		/* Slot on the idle wheel, or -1 */
+    struct ClientSessionStruct *idleNext; /* Links in idle wheel slot */
+    struct ClientSessionStruct *idlePrev;
 #ifdef HAVE_LICENSE
     char user[MAX_USERNAME_LEN+1]; /* Authenticated user-name */
     char realm[MAX_USERNAME_LEN+1]; /* Realm */
@@ -91,7 +150,7 @@ typedef struct ClientSessionStruct {
     l2tp_session *l2tp_ses;	/* L2TP session */
     struct sockaddr_in tunnel_endpoint;	/* L2TP endpoint */
 #endif
-} ClientSession;
+} ClientSessionInfo;
 
 /* Hack for daemonizing */
 #define CLOSEFD 64
@@ -105,6 +164,10 @@ typedef struct ClientSessionStruct {
 /* An array of client sessions */
 extern ClientSession *Sessions;
 
+/* Cold data for each entry of Sessions */
+extern ClientSessionInfo *SessionInfo;
+#define SESSION_INFO(ses) (&SessionInfo[(ses) - Sessions])
+
 /* Interfaces we're listening on */
 extern Interface interfaces[MAX_INTERFACES];
 extern int NumInterfaces;
@@ -127,9 +190,25 @@ extern unsigned char RemoteIP[IPV4ALEN];
 /* Do not create new sessions if free RAM < 10MB (on Linux only!) */
 #define MIN_FREE_MEMORY 10000
 
+/* ...or if tasks spent more than 10% of the last 10s stalled on memory
+   (PSI, in hundredths of a percent) */
+#define MAX_MEM_PRESSURE 1000
+
+/* Seconds between free-memory samples */
+#define MEM_SAMPLE_INTERVAL 1
+
+/* Seconds to remember a PADS so a retransmitted PADR gets it again */
+#define PADR_CACHE_TIME 10
+
+/* Seconds between accounting polls if -E is given without -A */
+#define DEFAULT_ACCT_INTERVAL 10
+
 /* Do we increment local IP for each connection? */
 extern int IncrLocalIP;
 
+/* Do we pass the "unit" option to pppd? */
+extern int PassUnitOptionToPPPD;
+
 /* Free sessions */
 extern ClientSession *FreeSessions;
 
@@ -145,14 +224,36 @@ extern int GotAlarm;
 extern void setAlarm(unsigned int secs);
 extern void killAllSessions(void);
 extern void serverProcessPacket(Interface *i);
-extern void processPADT(Interface *ethif, PPPoEPacket *packet, int len);
-extern void processPADR(Interface *ethif, PPPoEPacket *packet, int len);
-extern void processPADI(Interface *ethif, PPPoEPacket *packet, int len);
+extern void initDiscoveryContext(DiscoveryContext *ctx, Interface *ethif,
+				 PPPoEPacket *packet, int len, UINT16_t vlan);
+extern void processPADT(DiscoveryContext *ctx);
+extern void processPADR(DiscoveryContext *ctx);
+extern void processPADI(DiscoveryContext *ctx);
 extern void usage(char const *msg);
 extern ClientSession *pppoe_alloc_session(void);
 extern int pppoe_free_session(ClientSession *ses);
+extern void pppoe_session_closed(ClientSession *ses, char const *reason);
+extern char const *sessionInterfaceName(ClientSession const *ses);
 extern void sendHURLorMOTM(PPPoEConnection *conn, char const *url, UINT16_t tag);
 
 #ifdef HAVE_LICENSE
 extern int getFreeMem(void);
 #endif
+
+#ifdef __linux__
+/* Session accounting (acct.c) */
+extern int acctInit(char const *arg);
+extern void acctStart(EventSelector *es);
+extern int acctSetIdleTimeout(char const *arg);
+extern void acctSessionStarted(ClientSession *ses);
+extern void acctSessionEnded(ClientSession *ses);
+#endif
+
+#ifdef HAVE_LINUX_IF_PPPOX_H
+/* In-process PPP engine (pppcp.c) */
+extern PppoeSessionFunctionTable BuiltinSessionFunctionTable;
+extern int pppEngineInit(char const *auth);
+extern int pppEngineStart(ClientSession *ses);
+extern void pppEngineOpen(ClientSession *ses);
+extern int pppEngineUnit(ClientSession *ses);
+#endif
@@ -253,6 +253,27 @@ typedef struct PPPoETagStruct {
 /* Header size of a PPPoE tag */
 #define TAG_HDR_SIZE 4
 
+/* Where indexTags found a tag: "offset" is from packet->payload to the
+   tag header */
+typedef struct PPPoETagRefStruct {
+    UINT16_t type;
+    UINT16_t length;
+    UINT16_t offset;
+} PPPoETagRef;
+
+/* Most tags a discovery packet can hold (all empty) */
+#define MAX_TAGS (MAX_PPPOE_PAYLOAD / TAG_HDR_SIZE)
+
+/* All the tags of one discovery packet, in order */
+typedef struct PPPoETagIndexStruct {
+    PPPoEPacket *packet;
+    int numTags;
+    PPPoETagRef tags[MAX_TAGS];
+} PPPoETagIndex;
+
+#define TAG_REF_HDR(idx, ref) ((idx)->packet->payload + (ref)->offset)
+#define TAG_REF_DATA(idx, ref) (TAG_REF_HDR(idx, ref) + TAG_HDR_SIZE)
+
 /* Chunk to read from stdin */
 #define READ_CHUNK 4096
 
@@ -279,6 +300,7 @@ typedef struct PPPoEConnectionStruct {
 #endif
 
     UINT16_t session;		/* Session ID */
+    UINT16_t vlan;		/* 802.1Q VLAN ID for discovery frames, or 0 */
     char *ifName;		/* Interface name */
     char *serviceName;		/* Desired service name, if any */
     char *acName;		/* Desired AC name, if any */
@@ -311,11 +333,33 @@ struct PacketCriteria {
     int gotError;
 };
 
+/* 802.1Q tag */
+#define ETH_VLAN_TPID 0x8100
+#define VLAN_TAG_LEN 4
+#define VLAN_VID_MASK 0x0FFF
+
+/* Control-message room packetVlan() needs: PACKET_AUXDATA carries a
+   20-byte struct tpacket_auxdata (fixed kernel ABI) */
+#define VLAN_CMSG_SPACE CMSG_SPACE(20)
+
 /* Function Prototypes */
 UINT16_t etherType(PPPoEPacket *packet);
 int openInterface(char const *ifname, UINT16_t type, unsigned char *hwaddr, UINT16_t *mtu);
 int sendPacket(PPPoEConnection *conn, int sock, PPPoEPacket *pkt, int size);
+int sendPacketVlan(PPPoEConnection *conn, int sock, PPPoEPacket *pkt, int size,
+		   UINT16_t vlan);
 int receivePacket(int sock, PPPoEPacket *pkt, int *size);
+unsigned int macPartition(unsigned char const *mac, unsigned int count);
+unsigned int sessionPartition(unsigned char const *mac, UINT16_t session,
+			      unsigned int count);
+#ifdef USE_LINUX_PACKET
+int openTrunkInterface(char const *ifname, UINT16_t type, unsigned char *hwaddr, UINT16_t *mtu);
+int receivePacketVlan(int sock, PPPoEPacket *pkt, int *size, UINT16_t *vlan);
+UINT16_t packetVlan(struct msghdr *msg);
+int setDiscoveryFilter(int fd, UINT16_t type, int trunk,
+		       unsigned int index, unsigned int count);
+int joinSessionFanout(int fd, int *group, unsigned int count);
+#endif
 void fatalSys(char const *str);
 void rp_fatal(char const *str);
 void printErr(char const *str);
@@ -325,6 +369,9 @@ void dumpPacket(FILE *fp, PPPoEPacket *packet, char const *dir);
 void dumpHex(FILE *fp, unsigned char const *buf, int len);
 #endif
 int parsePacket(PPPoEPacket *packet, ParseFunc *func, void *extra);
+int indexTags(PPPoEPacket *packet, PPPoETagIndex *idx);
+PPPoETagRef const *lookupTag(PPPoETagIndex const *idx, UINT16_t type);
+void walkTags(PPPoETagIndex const *idx, ParseFunc *func, void *extra);
 void parseLogErrs(UINT16_t typ, UINT16_t len, unsigned char *data, void *xtra);
 void pktLogErrs(char const *pkt, UINT16_t typ, UINT16_t len, unsigned char *data, void *xtra);
 void syncReadFromPPP(PPPoEConnection *conn, PPPoEPacket *packet);
@@ -0,0 +1,195 @@
+/***********************************************************************
+*
+* relay-bench.c
+*
+* Microbenchmarks for the pppoe-relay session table.  Built and run by
+* "make bench"; not installed.
+*
+* The relay code is compiled into this program (with its main()
+* renamed), as bench.c does for the server.
+*
+* Copyright (C) 2001-2006 Roaring Penguin Software Inc.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+* LIC: GPL
+*
+***********************************************************************/
+
+#define main pppoe_relay_main
+#include "relay.c"
+#undef main
+
+#include "bench.h"
+
+/* A session-frame key: peer MAC address and session number */
+typedef struct {
+    unsigned char mac[ETH_ALEN];
+    UINT16_t sesNum;
+} BenchKey;
+
+/* Keys of every hash entry in the table, in random order */
+static BenchKey *Keys;
+static int NumKeys;
+static int BenchSessions;
+
+static unsigned int BenchRandom = 1;
+
+/**********************************************************************
+*%FUNCTION: benchRand
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* A pseudo-random number; the same sequence every run
+***********************************************************************/
+static unsigned int
+benchRand(void)
+{
+    BenchRandom = BenchRandom * 1103515245U + 12345U;
+    return BenchRandom >> 8;
+}
+
+/**********************************************************************
+*%FUNCTION: resetRelay
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Throws away the relay's session table so initRelay can be run again
+***********************************************************************/
+static void
+resetRelay(void)
+{
+    free(AllSessions);
+    free(AllHashes);
+    hash_oa_free(&SessionTable);
+    free(IdleWheel);
+}
+
+/**********************************************************************
+*%FUNCTION: setupSessions
+*%ARGUMENTS:
+* n -- number of sessions
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Fills the relay's session table with n sessions between 16 access
+* concentrators and n clients with random MAC addresses, as
+* createSession would on PADS, and records their keys.
+***********************************************************************/
+static void
+setupSessions(int n)
+{
+    unsigned char acMac[ETH_ALEN] = {0x02, 0x00, 0x5e, 0x00, 0x00, 0x00};
+    unsigned char cliMac[ETH_ALEN];
+    PPPoESession *ses;
+    BenchKey tmp;
+    int i, j;
+
+    if (n == BenchSessions) return;
+    if (BenchSessions) resetRelay();
+    BenchSessions = n;
+
+    if (!Interfaces) {
+	Interfaces = calloc(2, sizeof(PPPoEInterface));
+	if (!Interfaces) rp_fatal("Out of memory");
+    }
+    NumInterfaces = 2;
+    strcpy(Interfaces[0].name, "ac0");
+    strcpy(Interfaces[1].name, "cli0");
+    initRelay(n);
+
+    free(Keys);
+    Keys = malloc(2 * n * sizeof(BenchKey));
+    if (!Keys) rp_fatal("Out of memory");
+    NumKeys = 0;
+    for (i=0; i<n; i++) {
+	acMac[5] = (unsigned char) (i % 16);
+	for (j=0; j<ETH_ALEN; j++) cliMac[j] = (unsigned char) benchRand();
+	cliMac[0] &= 0xFE;
+	ses = createSession(&Interfaces[0], &Interfaces[1], acMac, cliMac,
+			    htons((UINT16_t) (i / 16 + 1)), 0);
+	if (!ses) rp_fatal("createSession failed");
+	memcpy(Keys[NumKeys].mac, acMac, ETH_ALEN);
+	Keys[NumKeys++].sesNum = htons((UINT16_t) (i / 16 + 1));
+	memcpy(Keys[NumKeys].mac, cliMac, ETH_ALEN);
+	Keys[NumKeys++].sesNum = ses->sesNum;
+    }
+
+    /* Frames from different sessions arrive interleaved */
+    for (i=NumKeys-1; i>0; i--) {
+	j = benchRand() % (i + 1);
+	tmp = Keys[i];
+	Keys[i] = Keys[j];
+	Keys[j] = tmp;
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: lookups
+*%ARGUMENTS:
+* iters -- number of lookups
+* miss -- if true, look up keys that are not in the table
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Runs findSession over the keys in their random order
+***********************************************************************/
+static void
+lookups(unsigned long iters, int miss)
+{
+    unsigned long total = 0;
+    int i = 0;
+    UINT16_t flip = miss ? htons(0x8000) : 0;
+
+    while (iters--) {
+	if (findSession(Keys[i].mac, Keys[i].sesNum ^ flip)) total++;
+	if (++i == NumKeys) i = 0;
+    }
+    Sink = total;
+}
+
+static void
+benchFind5k(unsigned long iters)
+{
+    setupSessions(5000);
+    lookups(iters, 0);
+}
+
+static void
+benchFind30k(unsigned long iters)
+{
+    setupSessions(30000);
+    lookups(iters, 0);
+}
+
+static void
+benchFind65k(unsigned long iters)
+{
+    setupSessions(65534);
+    lookups(iters, 0);
+}
+
+static void
+benchMiss65k(unsigned long iters)
+{
+    setupSessions(65534);
+    lookups(iters, 1);
+}
+
+static Benchmark Benchmarks[] = {
+    { "findSession (5000 sessions)", benchFind5k },
+    { "findSession (30000 sessions)", benchFind30k },
+    { "findSession (65534 sessions)", benchFind65k },
+    { "findSession miss (65534)", benchMiss65k },
+    { NULL, NULL }
+};
+
+int
+main(int argc, char *argv[])
+{
+    openlog("pppoe-relay-bench", LOG_PID, LOG_DAEMON);
+    return runBenchmarks(Benchmarks, argc, argv);
+}
@@ -14,7 +14,7 @@
 * $Id$
 *
 ***********************************************************************/
-#define _GNU_SOURCE 1 /* For SA_RESTART */
+#define _GNU_SOURCE 1 /* For recvmmsg and sendmmsg */
 #include "config.h"
 
 #include <sys/socket.h>
@@ -25,6 +25,9 @@
 #endif
 #include <signal.h>
 #include "relay.h"
+#include "event.h"
+#include "event_tcp.h"
+#include <sys/un.h>
 
 #ifdef HAVE_SYSLOG_H
 #include <syslog.h>
@@ -50,38 +53,193 @@
 #include <unistd.h>
 #endif
 
+#if defined(HAVE_STRUCT_SOCKADDR_LL) && defined(HAVE_LINUX_IF_PACKET_H)
+#include <linux/if_packet.h>
+#include <sys/mman.h>
+#endif
+
+/* In-kernel fast path (-x): an XDP program on every relay interface
+   forwards session frames of known sessions itself.  It is assembled
+   here and loaded with the bpf() system call, so neither libbpf nor a
+   BPF compiler is needed. */
+#if defined(__linux__) && defined(HAVE_LINUX_IF_PACKET_H)
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <stddef.h>
+#include <time.h>
+#if defined(XDP_FLAGS_REPLACE) && defined(SYS_bpf)
+#define RELAY_XDP 1
+#endif
+#endif
+
+/* On Linux, Epoch is driven by a timerfd in the event loop, which also
+   counts any seconds the loop was too busy to see */
+#ifdef __linux__
+#include <sys/timerfd.h>
+#ifdef TFD_CLOEXEC
+#define USE_TIMERFD 1
+#endif
+#endif
+
+/* Memory-mapped (PACKET_MMAP) receive and transmit rings for session
+   frames.  Each ring is RELAY_RING_FRAMES frames of RELAY_RING_FRAME_SIZE
+   bytes, mapped in blocks of RELAY_RING_BLOCK_FRAMES frames. */
+#if defined(RELAY_BATCH_SIZE) && defined(PACKET_TX_RING) && defined(TPACKET2_HDRLEN)
+#define RELAY_RING 1
+#define RELAY_RING_FRAME_SIZE 2048
+#define RELAY_RING_BLOCK_FRAMES 8
+#define RELAY_RING_FRAMES 1024
+
+typedef struct {
+    unsigned char *rx;		/* Receive ring */
+    unsigned char *tx;		/* Transmit ring (follows rx) */
+    unsigned int rxNext;	/* Next receive frame to look at */
+    unsigned int txNext;	/* Next transmit frame to fill */
+    int txQueued;		/* Frames filled since last flush */
+} RelayRing;
+
+/* Rings for Interfaces[], if -m was given */
+static RelayRing *Rings;
+static int UseRings = 0;
+
+static void relaySetupRing(int idx);
+static void relayGotSessionRing(int idx);
+#endif
+
+/* Worker processes for session frames (-w).  Each worker has its own
+   session sockets in a PACKET_FANOUT group per interface, and holds in
+   its hash table only the entries whose key the group's filter steers
+   to it.  The discovery process owns the session table and sends
+   workers a WorkerMsg for every session created or freed.  The session
+   array itself is shared so that workers can record activity in it. */
+#if defined(RELAY_BATCH_SIZE) && defined(PACKET_FANOUT_DATA)
+#define RELAY_WORKERS 1
+#define MAX_WORKERS 64
+
+typedef struct {
+    unsigned char op;		/* WORKER_ADD or WORKER_DEL */
+    UINT16_t acIf;		/* Index in Interfaces[] of AC side */
+    UINT16_t cliIf;		/* Index in Interfaces[] of client side */
+    unsigned char acMac[ETH_ALEN]; /* AC's MAC address */
+    unsigned char cliMac[ETH_ALEN]; /* Client's MAC address */
+    UINT16_t acSes;		/* AC's session number */
+    UINT16_t sesNum;		/* Session number assigned by relay */
+    UINT16_t cliVlan;		/* Client's VLAN on a trunk; else 0 */
+} WorkerMsg;
+
+#define WORKER_ADD 1
+#define WORKER_DEL 2
+
+static int NumWorkers = 0;
+static int WorkerIndex = -1;	/* Our index if we are a worker */
+static int WorkerPipes[MAX_WORKERS]; /* Write ends, in the discovery
+					process; a worker has its
+					read end in WorkerPipes[0] */
+static volatile unsigned int *SharedEpoch; /* Epoch, as seen by workers */
+
+static void *sharedAlloc(size_t len);
+static void startWorkers(void);
+static void publishSession(int op, PPPoESession const *ses);
+static void workerReadable(EventSelector *es, int fd, unsigned int flags,
+			   void *data);
+#endif
+
+#ifdef RELAY_XDP
+/* Key of the XDP session map: as findSession's arguments */
+typedef struct {
+    unsigned char mac[ETH_ALEN]; /* Sender's MAC address */
+    UINT16_t sesNum;		/* Session number in the frame */
+} XdpKey;
+
+/* Value of the XDP session map.  The program copies the MAC addresses
+   in 4- and 2-byte pieces, and the offsets keep those aligned. */
+typedef struct {
+    unsigned char inMac[ETH_ALEN]; /* Our MAC; frame must be sent to it */
+    UINT16_t sesNum;		/* Session number for the other side */
+    unsigned char dstMac[ETH_ALEN]; /* Peer on the other side */
+    unsigned char srcMac[ETH_ALEN]; /* Our MAC on the other side */
+    uint32_t ifindex;		/* Interface on the other side */
+    uint64_t lastSeen;		/* CLOCK_MONOTONIC ns of last frame */
+    uint64_t packets;		/* Frames forwarded */
+    uint64_t bytes;		/* Bytes forwarded */
+} XdpValue;
+
+#define XDP_MODE_AUTO 0		/* Native, falling back to generic */
+#define XDP_MODE_NATIVE 1
+#define XDP_MODE_GENERIC 2
+
+static int UseXdp = 0;
+static int XdpMode = XDP_MODE_AUTO;
+static int XdpMap = -1;		/* Session map */
+static unsigned int *XdpIfindex; /* For Interfaces[] */
+
+static void xdpStart(void);
+static void xdpAddSession(PPPoESession const *ses);
+static void xdpDelSession(PPPoESession const *ses);
+static void xdpSeen(PPPoESession *ses);
+static void xdpCount(PPPoESession const *ses, RelayCount count[2]);
+#endif
 
-/* Interfaces (max MAX_INTERFACES) */
-PPPoEInterface Interfaces[MAX_INTERFACES];
+/* Interfaces, grown by addInterface.  Many VLANs are best served from
+   one trunk (-V): each interface costs two descriptors, and the event
+   loop's select() only watches FD_SETSIZE of them. */
+PPPoEInterface *Interfaces;
 int NumInterfaces;
+static int InterfaceSlots;
 
 /* Relay info */
 int NumSessions;
 int MaxSessions;
 PPPoESession *AllSessions;
 PPPoESession *FreeSessions;
-PPPoESession *ActiveSessions;
 
 SessionHash *AllHashes;
 SessionHash *FreeHashes;
-SessionHash *Buckets[HASHTAB_SIZE];
-
-volatile unsigned int Epoch = 0;
-volatile unsigned int CleanCounter = 0;
+hash_oa_table SessionTable;	/* sessionKey() -> SessionHash */
 
-/* How often to clean up stale sessions? */
-#define MIN_CLEAN_PERIOD 30  /* Minimum period to run cleaner */
-#define TIMEOUT_DIVISOR 20   /* How often to run cleaner per timeout period */
-unsigned int CleanPeriod = MIN_CLEAN_PERIOD;
+unsigned int Epoch = 0;		/* Seconds since startup */
 
 /* How long a session can be idle before it is cleaned up? */
-unsigned int IdleTimeout = MIN_CLEAN_PERIOD * TIMEOUT_DIVISOR;
-
-/* Pipe for breaking select() to initiate periodic cleaning */
-int CleanPipe[2];
-
-/* Our relay: if_index followed by peer_mac */
-#define MY_RELAY_TAG_LEN (sizeof(int) + ETH_ALEN)
+unsigned int IdleTimeout = 600;
+
+/* Idle sessions are found with a timing wheel with one slot per second
+   of Epoch.  A session sits in the slot of the second at which it would
+   have been idle for IdleTimeout; traffic only updates its epoch, and it
+   is re-filed when its slot comes up.  Timeouts longer than the wheel
+   just cost a session an extra visit per turn. */
+#define IDLE_WHEEL_MAX 3600
+PPPoESession **IdleWheel;
+unsigned int IdleWheelSize;
+unsigned int IdleTick = 0;	/* Last Epoch the cleaner has run for */
+
+static void relaySessionReadable(EventSelector *es, int fd,
+				 unsigned int flags, void *data);
+static void relayDiscoveryReadable(EventSelector *es, int fd,
+				   unsigned int flags, void *data);
+static void relayTick(EventSelector *es, int fd, unsigned int flags,
+		      void *data);
+
+/* Counters are reported on the control socket (-c) and to syslog on
+   SIGUSR1.  Reports list the REPORT_TOP busiest sessions unless asked
+   for another number. */
+#define REPORT_TOP 10
+static int ControlSock = -1;
+
+static void sessionCount(PPPoESession const *ses, RelayCount count[2]);
+static void closeCount(PPPoESession const *ses);
+static void controlOpen(char const *path);
+static void controlAccept(EventSelector *es, int fd);
+static void relayDumpStats(int sig);
+
+/* Our relay: if_index followed by peer_mac and the peer's VLAN */
+#define MY_RELAY_TAG_LEN (sizeof(int) + ETH_ALEN + sizeof(UINT16_t))
+#define MY_RELAY_TAG_VLAN (sizeof(int) + ETH_ALEN)
+
+/* Pieces of a relayed tag list: the tags before our relay tag, the
+   relay tag and the tags after it */
+#define RELAY_PIECES 3
 
 /* Hack for daemonizing */
 #define CLOSEFD 64
@@ -97,7 +255,7 @@ static int
 keepDescriptor(int fd)
 {
     int i;
-    if (fd == CleanPipe[0] || fd == CleanPipe[1]) return 1;
+    if (fd == ControlSock) return 1;
     for (i=0; i<NumInterfaces; i++) {
 	if (fd == Interfaces[i].discoverySock ||
 	    fd == Interfaces[i].sessionSock) return 1;
@@ -158,35 +316,130 @@ insertBytes(PPPoEPacket *packet,
 }
 
 /**********************************************************************
-*%FUNCTION: removeBytes
+*%FUNCTION: relayTag
 *%ARGUMENTS:
-* packet -- a PPPoE packet
-* loc -- location at which to remove bytes of data
-* len -- length of data to remove
+* tag -- set to our Relay-Session-Id tag
+* ifIndex -- index in Interfaces[] of the peer's interface
+* mac -- the peer's MAC address
+* vlan -- the peer's VLAN, if that interface is a trunk; else 0
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+relayTag(PPPoETag *tag, int ifIndex, unsigned char const *mac, UINT16_t vlan)
+{
+    tag->type = htons(TAG_RELAY_SESSION_ID);
+    tag->length = htons(MY_RELAY_TAG_LEN);
+    memcpy(tag->payload, &ifIndex, sizeof(ifIndex));
+    memcpy(tag->payload + sizeof(ifIndex), mac, ETH_ALEN);
+    memcpy(tag->payload + MY_RELAY_TAG_VLAN, &vlan, sizeof(vlan));
+}
+
+/**********************************************************************
+*%FUNCTION: relayPieces
+*%ARGUMENTS:
+* packet -- a discovery packet
+* loc -- our Relay-Session-Id tag in it
+* tag -- tag to put in its place, or NULL to drop it
+* pieces -- set to up to RELAY_PIECES pieces of the new tag list
 *%RETURNS:
-* -1 if there was a problem, len otherwise
+* Number of pieces
 *%DESCRIPTION:
-* Removes "len" bytes of data from location "loc" in "packet", moving all
-* other data down to close the gap
+* Describes packet's tags with the relay tag replaced or removed, for
+* relaySendPieces.  The packet itself is left alone.
 ***********************************************************************/
-int
-removeBytes(PPPoEPacket *packet,
-	    unsigned char *loc,
-	    int len)
+static int
+relayPieces(PPPoEPacket *packet, unsigned char *loc, PPPoETag *tag,
+	    struct iovec *pieces)
 {
-    int toMove;
-    int plen = ntohs(packet->length);
-    /* Sanity checks */
-    if (len < 0 || len > plen ||
-	loc < packet->payload ||
-	loc + len > packet->payload + plen) {
-	return -1;
-    }
+    unsigned char *rest = loc + TAG_HDR_SIZE + MY_RELAY_TAG_LEN;
+    int n = 0;
+
+    pieces[n].iov_base = packet->payload;
+    pieces[n++].iov_len = loc - packet->payload;
+    if (tag) {
+	pieces[n].iov_base = tag;
+	pieces[n++].iov_len = TAG_HDR_SIZE + MY_RELAY_TAG_LEN;
+    }
+    pieces[n].iov_base = rest;
+    pieces[n++].iov_len = packet->payload + ntohs(packet->length) - rest;
+    return n;
+}
 
-    toMove = ((packet->payload + plen) - loc) - len;
-    memmove(loc, loc+len, toMove);
-    packet->length = htons(plen - len);
-    return len;
+/**********************************************************************
+*%FUNCTION: relaySendPieces
+*%ARGUMENTS:
+* iface -- interface to send on
+* vlan -- VLAN to tag the frame with; 0 means send it untagged
+* dst -- destination MAC address
+* packet -- received packet whose Ethernet type, code and session
+*           number to use
+* pieces -- the tags to send, in order
+* n -- number of pieces (at most RELAY_PIECES)
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Sends a discovery frame from iface's MAC address to dst: a new
+* Ethernet and PPPoE header, then the pieces.  On Linux this is one
+* sendmsg, so a tag is spliced into or cut out of a frame without
+* moving the tags after it, and a frame sent out of several interfaces
+* is never rewritten.  Elsewhere the pieces are copied together for
+* sendPacket.
+***********************************************************************/
+static void
+relaySendPieces(PPPoEInterface const *iface, UINT16_t vlan,
+		unsigned char const *dst, PPPoEPacket const *packet,
+		struct iovec const *pieces, int n)
+{
+    unsigned char head[HDR_SIZE + VLAN_TAG_LEN];
+    UINT16_t tag[2];
+    UINT16_t len = 0;
+    int i, off = 2 * ETH_ALEN;
+#ifdef HAVE_STRUCT_SOCKADDR_LL
+    struct iovec iov[1 + RELAY_PIECES];
+    struct msghdr msg;
+#else
+    PPPoEPacket frame;
+#endif
+
+    memcpy(head, dst, ETH_ALEN);
+    memcpy(head + ETH_ALEN, iface->mac, ETH_ALEN);
+    if (vlan) {
+	tag[0] = htons(ETH_VLAN_TPID);
+	tag[1] = htons(vlan);
+	memcpy(head + off, tag, VLAN_TAG_LEN);
+	off += VLAN_TAG_LEN;
+    }
+
+    /* Ethernet type and PPPoE header as received, but for the length */
+    memcpy(head + off, (unsigned char const *) packet + 2 * ETH_ALEN,
+	   HDR_SIZE - 2 * ETH_ALEN);
+    off += HDR_SIZE - 2 * ETH_ALEN;
+    for (i=0; i<n; i++) {
+	len += pieces[i].iov_len;
+    }
+    len = htons(len);
+    memcpy(head + off - sizeof(len), &len, sizeof(len));
+
+#ifdef HAVE_STRUCT_SOCKADDR_LL
+    iov[0].iov_base = head;
+    iov[0].iov_len = off;
+    memcpy(iov + 1, pieces, n * sizeof(struct iovec));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n + 1;
+    if (sendmsg(iface->discoverySock, &msg, 0) < 0 && errno != ENOBUFS) {
+	sysErr("sendmsg (relaySendPieces)");
+    }
+#else
+    memcpy(&frame, head, off);
+    for (i=0; i<n; i++) {
+	memcpy((unsigned char *) &frame + off, pieces[i].iov_base,
+	       pieces[i].iov_len);
+	off += pieces[i].iov_len;
+    }
+    sendPacket(NULL, iface->discoverySock, &frame, off);
+#endif
 }
 
 /**********************************************************************
@@ -206,9 +459,23 @@ usage(char const *argv0)
     fprintf(stderr, "   -S if_name     -- Specify interface for PPPoE Server\n");
     fprintf(stderr, "   -C if_name     -- Specify interface for PPPoE Client\n");
     fprintf(stderr, "   -B if_name     -- Specify interface for both clients and server\n");
+#ifdef USE_LINUX_PACKET
+    fprintf(stderr, "   -V if_name     -- Specify VLAN trunk for clients on all its VLANs\n");
+#endif
     fprintf(stderr, "   -n nsess       -- Maxmimum number of sessions to relay\n");
     fprintf(stderr, "   -i timeout     -- Idle timeout in seconds (0 = no timeout)\n");
     fprintf(stderr, "   -F             -- Do not fork into background\n");
+    fprintf(stderr, "   -c path        -- Report counters on Unix-domain socket path\n");
+#ifdef RELAY_RING
+    fprintf(stderr, "   -m             -- Relay session frames through memory-mapped rings\n");
+#endif
+#ifdef RELAY_WORKERS
+    fprintf(stderr, "   -w nworkers    -- Relay session frames in nworkers processes\n");
+#endif
+#ifdef RELAY_XDP
+    fprintf(stderr, "   -x mode        -- Forward session frames in the kernel with XDP;\n");
+    fprintf(stderr, "                     mode is auto, native or generic\n");
+#endif
     fprintf(stderr, "   -h             -- Print this help message\n");
 
     fprintf(stderr, "\nPPPoE Version %s, Copyright (C) 2001-2006 Roaring Penguin Software Inc.\n", VERSION);
@@ -230,15 +497,17 @@ usage(char const *argv0)
 * -C ifname           -- Use interface for PPPoE clients
 * -S ifname           -- Use interface for PPPoE servers
 * -B ifname           -- Use interface for both clients and servers
+* -V ifname           -- Use VLAN trunk for clients on all its VLANs
 * -n sessions         -- Maximum of "n" sessions
+* -c path             -- Control socket for counter reports
 ***********************************************************************/
 int
 main(int argc, char *argv[])
 {
     int opt;
     int nsess = DEFAULT_SESSIONS;
-    struct sigaction sa;
     int beDaemon = 1;
+    char const *controlPath = NULL;
 
     if (getuid() != geteuid() ||
 	getgid() != getegid()) {
@@ -249,30 +518,78 @@ main(int argc, char *argv[])
 
     openlog("pppoe-relay", LOG_PID, LOG_DAEMON);
 
-    while((opt = getopt(argc, argv, "hC:S:B:n:i:F")) != -1) {
+    while((opt = getopt(argc, argv, "hC:S:B:V:n:i:Fmw:x:c:")) != -1) {
 	switch(opt) {
 	case 'h':
 	    usage(argv[0]);
 	    break;
+	case 'm':
+#ifdef RELAY_RING
+	    UseRings = 1;
+#else
+	    fprintf(stderr, "-m is not supported on this platform\n");
+	    exit(EXIT_FAILURE);
+#endif
+	    break;
+	case 'w':
+#ifdef RELAY_WORKERS
+	    if (sscanf(optarg, "%d", &NumWorkers) != 1 ||
+		NumWorkers < 0 || NumWorkers > MAX_WORKERS) {
+		fprintf(stderr, "Illegal argument to -w: must range from 0 to %d\n",
+			MAX_WORKERS);
+		exit(EXIT_FAILURE);
+	    }
+#else
+	    fprintf(stderr, "-w is not supported on this platform\n");
+	    exit(EXIT_FAILURE);
+#endif
+	    break;
+	case 'x':
+#ifdef RELAY_XDP
+	    UseXdp = 1;
+	    if (!strcmp(optarg, "auto")) {
+		XdpMode = XDP_MODE_AUTO;
+	    } else if (!strcmp(optarg, "native")) {
+		XdpMode = XDP_MODE_NATIVE;
+	    } else if (!strcmp(optarg, "generic")) {
+		XdpMode = XDP_MODE_GENERIC;
+	    } else {
+		fprintf(stderr, "Illegal argument to -x: should be auto, native or generic\n");
+		exit(EXIT_FAILURE);
+	    }
+#else
+	    fprintf(stderr, "-x is not supported on this platform\n");
+	    exit(EXIT_FAILURE);
+#endif
+	    break;
 	case 'F':
 	    beDaemon = 0;
 	    break;
+	case 'c':
+	    controlPath = optarg;
+	    break;
 	case 'C':
-	    addInterface(optarg, 1, 0);
+	    addInterface(optarg, 1, 0, 0);
 	    break;
 	case 'S':
-	    addInterface(optarg, 0, 1);
+	    addInterface(optarg, 0, 1, 0);
 	    break;
 	case 'B':
-	    addInterface(optarg, 1, 1);
+	    addInterface(optarg, 1, 1, 0);
+	    break;
+	case 'V':
+#ifdef USE_LINUX_PACKET
+	    addInterface(optarg, 1, 0, 1);
+#else
+	    fprintf(stderr, "-V is not supported on this platform\n");
+	    exit(EXIT_FAILURE);
+#endif
 	    break;
 	case 'i':
 	    if (sscanf(optarg, "%u", &IdleTimeout) != 1) {
 		fprintf(stderr, "Illegal argument to -i: should be -i timeout\n");
 		exit(EXIT_FAILURE);
 	    }
-	    CleanPeriod = IdleTimeout / TIMEOUT_DIVISOR;
-	    if (CleanPeriod < MIN_CLEAN_PERIOD) CleanPeriod = MIN_CLEAN_PERIOD;
 	    break;
 	case 'n':
 	    if (sscanf(optarg, "%d", &nsess) != 1) {
@@ -303,22 +620,34 @@ main(int argc, char *argv[])
 	exit(EXIT_FAILURE);
     }
 
-    /* Make a pipe for the cleaner */
-    if (pipe(CleanPipe) < 0) {
-	fatalSys("pipe");
+#ifdef RELAY_XDP
+    /* The XDP program knows nothing of VLAN tags */
+    if (UseXdp) {
+	int i;
+	for (i=0; i<NumInterfaces; i++) {
+	    if (Interfaces[i].trunk) {
+		fprintf(stderr, "-x cannot be used with -V\n");
+		exit(EXIT_FAILURE);
+	    }
+	}
     }
+#endif
 
-    /* Set up alarm handler */
-    sa.sa_handler = alarmHandler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGALRM, &sa, NULL) < 0) {
-	fatalSys("sigaction");
+#ifdef RELAY_RING
+    /* Workers set up rings on their own sockets */
+    if (UseRings && !NumWorkers) {
+	int i;
+	for (i=0; i<NumInterfaces; i++) {
+	    relaySetupRing(i);
+	}
     }
+#endif
 
     /* Allocate memory for sessions, etc. */
     initRelay(nsess);
 
+    if (controlPath) controlOpen(controlPath);
+
     /* Daemonize -- UNIX Network Programming, Vol. 1, Stevens */
     if (beDaemon) {
 	int i;
@@ -349,8 +678,13 @@ main(int argc, char *argv[])
 	openlog("pppoe-relay", LOG_PID, LOG_DAEMON);
     }
 
-    /* Kick off SIGALRM if there is an idle timeout */
-    if (IdleTimeout) alarm(1);
+#ifdef RELAY_XDP
+    if (UseXdp) xdpStart();
+#endif
+
+#ifdef RELAY_WORKERS
+    if (NumWorkers) startWorkers();
+#endif
 
     /* Enter the relay loop */
     relayLoop();
@@ -365,15 +699,18 @@ main(int argc, char *argv[])
 * ifname -- interface name
 * clientOK -- true if this interface should relay PADI, PADR packets.
 * acOK -- true if this interface should relay PADO, PADS packets.
+* trunk -- true if clients may be on any VLAN of this interface.
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Opens an interface; sets up discovery and session sockets.
+* Opens an interface; sets up discovery and session sockets.  A trunk's
+* sockets receive frames of every VLAN, with the VLAN alongside.
 ***********************************************************************/
 void
 addInterface(char const *ifname,
 	     int clientOK,
-	     int acOK)
+	     int acOK,
+	     int trunk)
 {
     PPPoEInterface *i;
     int j;
@@ -384,19 +721,37 @@ addInterface(char const *ifname,
 	}
     }
 
-    if (NumInterfaces >= MAX_INTERFACES) {
-	fprintf(stderr, "Too many interfaces (%d max)\n",
-		MAX_INTERFACES);
-	exit(EXIT_FAILURE);
+    if (NumInterfaces == InterfaceSlots) {
+	j = InterfaceSlots ? InterfaceSlots * 2 : 8;
+	i = realloc(Interfaces, j * sizeof(PPPoEInterface));
+	if (!i) {
+	    rp_fatal("Unable to allocate memory for interface table");
+	}
+	Interfaces = i;
+	InterfaceSlots = j;
     }
     i = &Interfaces[NumInterfaces++];
+    memset(i, 0, sizeof(PPPoEInterface));
     strncpy(i->name, ifname, IFNAMSIZ);
     i->name[IFNAMSIZ] = 0;
 
-    i->discoverySock = openInterface(ifname, Eth_PPPOE_Discovery, i->mac, NULL);
-    i->sessionSock   = openInterface(ifname, Eth_PPPOE_Session,   NULL, NULL);
+#ifdef USE_LINUX_PACKET
+    if (trunk) {
+	i->discoverySock = openTrunkInterface(ifname, Eth_PPPOE_Discovery, i->mac, NULL);
+	i->sessionSock   = openTrunkInterface(ifname, Eth_PPPOE_Session,   NULL, NULL);
+    } else
+#endif
+    {
+	i->discoverySock = openInterface(ifname, Eth_PPPOE_Discovery, i->mac, NULL);
+	i->sessionSock   = openInterface(ifname, Eth_PPPOE_Session,   NULL, NULL);
+    }
+    if (i->sessionSock >= FD_SETSIZE) {
+	fprintf(stderr, "Too many interfaces (use -V for VLANs on a trunk)\n");
+	exit(EXIT_FAILURE);
+    }
     i->clientOK = clientOK;
     i->acOK = acOK;
+    i->trunk = trunk;
 }
 
 /**********************************************************************
@@ -411,37 +766,48 @@ addInterface(char const *ifname,
 void
 initRelay(int nsess)
 {
+    void *mem = NULL;
     int i;
     NumSessions = 0;
     MaxSessions = nsess;
 
-    AllSessions = calloc(MaxSessions, sizeof(PPPoESession));
+    /* Sessions are cache-line aligned (mmap memory is page-aligned),
+       so that relaying a frame touches one line of the session array */
+#ifdef RELAY_WORKERS
+    if (NumWorkers) {
+	mem = sharedAlloc(MaxSessions * sizeof(PPPoESession));
+    } else
+#endif
+    if (posix_memalign(&mem, 64, MaxSessions * sizeof(PPPoESession)) == 0) {
+	memset(mem, 0, MaxSessions * sizeof(PPPoESession));
+    } else {
+	mem = NULL;
+    }
+    AllSessions = mem;
     if (!AllSessions) {
 	rp_fatal("Unable to allocate memory for PPPoE session table");
     }
     AllHashes = calloc(MaxSessions*2, sizeof(SessionHash));
-    if (!AllHashes) {
+    if (!AllHashes || hash_oa_init(&SessionTable, MaxSessions*2) < 0) {
 	rp_fatal("Unable to allocate memory for PPPoE hash table");
     }
+    if (IdleTimeout) {
+	IdleWheelSize = (IdleTimeout < IDLE_WHEEL_MAX ?
+			 IdleTimeout : IDLE_WHEEL_MAX) + 2;
+	IdleWheel = calloc(IdleWheelSize, sizeof(PPPoESession *));
+	if (!IdleWheel) {
+	    rp_fatal("Unable to allocate memory for idle timer wheel");
+	}
+	IdleTick = Epoch;
+    }
 
     /* Initialize sessions in a linked list */
-    AllSessions[0].prev = NULL;
-    if (MaxSessions > 1) {
-	AllSessions[0].next = &AllSessions[1];
-    } else {
-	AllSessions[0].next = NULL;
-    }
-    for (i=1; i<MaxSessions-1; i++) {
-	AllSessions[i].prev = &AllSessions[i-1];
+    for (i=0; i<MaxSessions-1; i++) {
 	AllSessions[i].next = &AllSessions[i+1];
     }
-    if (MaxSessions > 1) {
-	AllSessions[MaxSessions-1].prev = &AllSessions[MaxSessions-2];
-	AllSessions[MaxSessions-1].next = NULL;
-    }
+    AllSessions[MaxSessions-1].next = NULL;
 
     FreeSessions = AllSessions;
-    ActiveSessions = NULL;
 
     /* Initialize session numbers which we hand out */
     for (i=0; i<MaxSessions; i++) {
@@ -449,18 +815,36 @@ initRelay(int nsess)
     }
 
     /* Initialize hashes in a linked list */
-    AllHashes[0].prev = NULL;
-    AllHashes[0].next = &AllHashes[1];
-    for (i=1; i<2*MaxSessions-1; i++) {
-	AllHashes[i].prev = &AllHashes[i-1];
+    for (i=0; i<2*MaxSessions-1; i++) {
 	AllHashes[i].next = &AllHashes[i+1];
     }
-    AllHashes[2*MaxSessions-1].prev = &AllHashes[2*MaxSessions-2];
     AllHashes[2*MaxSessions-1].next = NULL;
 
     FreeHashes = AllHashes;
 }
 
+/**********************************************************************
+*%FUNCTION: hashIfName
+*%ARGUMENTS:
+* sh -- a session hash
+* buf -- buffer of HASH_IF_NAME_LEN bytes
+*%RETURNS:
+* buf, holding the name of sh's interface; "name.vid" for a VLAN on a
+* trunk, as pppoe-server names them
+***********************************************************************/
+#define HASH_IF_NAME_LEN (IFNAMSIZ + 8)
+static char const *
+hashIfName(SessionHash const *sh, char *buf)
+{
+    if (sh->vlan) {
+	snprintf(buf, HASH_IF_NAME_LEN, "%.*s.%u", IFNAMSIZ,
+		 sh->interface->name, (unsigned int) sh->vlan);
+    } else {
+	snprintf(buf, HASH_IF_NAME_LEN, "%.*s", IFNAMSIZ, sh->interface->name);
+    }
+    return buf;
+}
+
 /**********************************************************************
 *%FUNCTION: createSession
 *%ARGUMENTS:
@@ -469,6 +853,7 @@ initRelay(int nsess)
 * acMac -- Access concentrator's MAC address
 * cliMac -- Client's MAC address
 * acSess -- Access concentrator's session ID.
+* cliVlan -- Client's VLAN, if cli is a trunk; else 0
 *%RETURNS:
 * PPPoESession structure; NULL if one could not be allocated
 *%DESCRIPTION:
@@ -479,10 +864,12 @@ createSession(PPPoEInterface const *ac,
 	      PPPoEInterface const *cli,
 	      unsigned char const *acMac,
 	      unsigned char const *cliMac,
-	      UINT16_t acSes)
+	      UINT16_t acSes,
+	      UINT16_t cliVlan)
 {
     PPPoESession *sess;
     SessionHash *acHash, *cliHash;
+    char acName[HASH_IF_NAME_LEN], cliName[HASH_IF_NAME_LEN];
 
     if (NumSessions >= MaxSessions) {
 	printErr("Maximum number of sessions reached -- cannot create new session");
@@ -494,15 +881,10 @@ createSession(PPPoEInterface const *ac,
     FreeSessions = sess->next;
     NumSessions++;
 
-    /* Link it to the active list */
-    sess->next = ActiveSessions;
-    if (sess->next) {
-	sess->next->prev = sess;
-    }
-    ActiveSessions = sess;
-    sess->prev = NULL;
-
     sess->epoch = Epoch;
+    memset(sess->packets, 0, sizeof(sess->packets));
+    memset(sess->bytes, 0, sizeof(sess->bytes));
+    if (IdleTimeout) idleFile(sess);
 
     /* Get two hash entries */
     acHash = FreeHashes;
@@ -511,12 +893,15 @@ createSession(PPPoEInterface const *ac,
 
     acHash->peer = cliHash;
     cliHash->peer = acHash;
+    acHash->dir = FROM_AC;
+    cliHash->dir = FROM_CLIENT;
 
     sess->acHash = acHash;
-    sess->clientHash = cliHash;
 
     acHash->interface = ac;
     cliHash->interface = cli;
+    acHash->vlan = 0;
+    cliHash->vlan = cliVlan;
 
     memcpy(acHash->peerMac, acMac, ETH_ALEN);
     acHash->sesNum = acSes;
@@ -529,18 +914,27 @@ createSession(PPPoEInterface const *ac,
     addHash(acHash);
     addHash(cliHash);
 
+#ifdef RELAY_WORKERS
+    /* A frame or two may reach a worker before this does; they are
+       dropped like frames of an unknown session */
+    if (NumWorkers) publishSession(WORKER_ADD, sess);
+#endif
+#ifdef RELAY_XDP
+    if (UseXdp) xdpAddSession(sess);
+#endif
+
     /* Log */
     syslog(LOG_INFO,
 	   "Opened session: server=%02x:%02x:%02x:%02x:%02x:%02x(%s:%d), client=%02x:%02x:%02x:%02x:%02x:%02x(%s:%d)",
 	   acHash->peerMac[0], acHash->peerMac[1],
 	   acHash->peerMac[2], acHash->peerMac[3],
 	   acHash->peerMac[4], acHash->peerMac[5],
-	   acHash->interface->name,
+	   hashIfName(acHash, acName),
 	   ntohs(acHash->sesNum),
 	   cliHash->peerMac[0], cliHash->peerMac[1],
 	   cliHash->peerMac[2], cliHash->peerMac[3],
 	   cliHash->peerMac[4], cliHash->peerMac[5],
-	   cliHash->interface->name,
+	   hashIfName(cliHash, cliName),
 	   ntohs(cliHash->sesNum));
 
     return sess;
@@ -560,36 +954,41 @@ createSession(PPPoEInterface const *ac,
 void
 freeSession(PPPoESession *ses, char const *msg)
 {
+    char acName[HASH_IF_NAME_LEN], cliName[HASH_IF_NAME_LEN];
+
     syslog(LOG_INFO,
 	   "Closed session: server=%02x:%02x:%02x:%02x:%02x:%02x(%s:%d), client=%02x:%02x:%02x:%02x:%02x:%02x(%s:%d): %s",
 	   ses->acHash->peerMac[0], ses->acHash->peerMac[1],
 	   ses->acHash->peerMac[2], ses->acHash->peerMac[3],
 	   ses->acHash->peerMac[4], ses->acHash->peerMac[5],
-	   ses->acHash->interface->name,
+	   hashIfName(ses->acHash, acName),
 	   ntohs(ses->acHash->sesNum),
-	   ses->clientHash->peerMac[0], ses->clientHash->peerMac[1],
-	   ses->clientHash->peerMac[2], ses->clientHash->peerMac[3],
-	   ses->clientHash->peerMac[4], ses->clientHash->peerMac[5],
-	   ses->clientHash->interface->name,
-	   ntohs(ses->clientHash->sesNum), msg);
+	   ses->acHash->peer->peerMac[0], ses->acHash->peer->peerMac[1],
+	   ses->acHash->peer->peerMac[2], ses->acHash->peer->peerMac[3],
+	   ses->acHash->peer->peerMac[4], ses->acHash->peer->peerMac[5],
+	   hashIfName(ses->acHash->peer, cliName),
+	   ntohs(ses->acHash->peer->sesNum), msg);
 
-    /* Unlink from active sessions */
-    if (ses->prev) {
-	ses->prev->next = ses->next;
-    } else {
-	ActiveSessions = ses->next;
-    }
-    if (ses->next) {
-	ses->next->prev = ses->prev;
-    }
+    /* Must come before the XDP map entries go */
+    closeCount(ses);
+
+#ifdef RELAY_WORKERS
+    if (NumWorkers) publishSession(WORKER_DEL, ses);
+#endif
+#ifdef RELAY_XDP
+    if (UseXdp) xdpDelSession(ses);
+#endif
+
+    if (IdleTimeout) idleUnfile(ses);
 
     /* Link onto free list -- this is a singly-linked list, so
        we do not care about prev */
     ses->next = FreeSessions;
     FreeSessions = ses;
 
+    unhash(ses->acHash->peer);
     unhash(ses->acHash);
-    unhash(ses->clientHash);
+    ses->acHash = NULL;		/* Marks it free for reports */
     NumSessions--;
 }
 
@@ -606,344 +1005,1895 @@ freeSession(PPPoESession *ses, char const *msg)
 void
 unhash(SessionHash *sh)
 {
-    unsigned int b = hash(sh->peerMac, sh->sesNum) % HASHTAB_SIZE;
-    if (sh->prev) {
-	sh->prev->next = sh->next;
-    } else {
-	Buckets[b] = sh->next;
+    hash_oa_remove(&SessionTable, sessionKey(sh->peerMac, sh->sesNum));
+
+    /* Add to free list (singly-linked) */
+    sh->next = FreeHashes;
+    FreeHashes = sh;
+}
+
+/**********************************************************************
+*%FUNCTION: addHash
+*%ARGUMENTS:
+* sh -- a session hash
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Adds a SessionHash to the hash table
+***********************************************************************/
+void
+addHash(SessionHash *sh)
+{
+    /* The table was sized for every hash entry, so this cannot fail */
+    hash_oa_insert(&SessionTable, sessionKey(sh->peerMac, sh->sesNum), sh);
+}
+
+/**********************************************************************
+*%FUNCTION: sessionKey
+*%ARGUMENTS:
+* mac -- an Ethernet address
+* sesNum -- a session number
+*%RETURNS:
+* The Ethernet address and session number packed into one 64-bit key
+* for SessionTable.  hash_oa mixes the bits itself.
+***********************************************************************/
+uint64_t
+sessionKey(unsigned char const *mac, UINT16_t sesNum)
+{
+    return ((uint64_t) mac[0] << 56) | ((uint64_t) mac[1] << 48) |
+	((uint64_t) mac[2] << 40) | ((uint64_t) mac[3] << 32) |
+	((uint64_t) mac[4] << 24) | ((uint64_t) mac[5] << 16) |
+	(uint64_t) sesNum;
+}
+
+/**********************************************************************
+*%FUNCTION: findSession
+*%ARGUMENTS:
+* mac -- an Ethernet address
+* sesNum -- a session number
+*%RETURNS:
+* The session hash for peer address "mac", session number sesNum
+***********************************************************************/
+SessionHash *
+findSession(unsigned char const *mac, UINT16_t sesNum)
+{
+    return hash_oa_find(&SessionTable, sessionKey(mac, sesNum));
+}
+
+/**********************************************************************
+*%FUNCTION: fatalSys
+*%ARGUMENTS:
+* str -- error message
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Prints a message plus the errno value to stderr and syslog and exits.
+***********************************************************************/
+void
+fatalSys(char const *str)
+{
+    char buf[1024];
+    sprintf(buf, "%.256s: %.256s", str, strerror(errno));
+    printErr(buf);
+    exit(EXIT_FAILURE);
+}
+
+/**********************************************************************
+*%FUNCTION: sysErr
+*%ARGUMENTS:
+* str -- error message
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Prints a message plus the errno value to syslog.
+***********************************************************************/
+void
+sysErr(char const *str)
+{
+    char buf[1024];
+    sprintf(buf, "%.256s: %.256s", str, strerror(errno));
+    printErr(buf);
+}
+
+/**********************************************************************
+*%FUNCTION: rp_fatal
+*%ARGUMENTS:
+* str -- error message
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Prints a message to stderr and syslog and exits.
+***********************************************************************/
+void
+rp_fatal(char const *str)
+{
+    printErr(str);
+    exit(EXIT_FAILURE);
+}
+
+/**********************************************************************
+*%FUNCTION: relaySessionReadable
+*%ARGUMENTS:
+* es -- event selector
+* fd -- session socket
+* flags -- ignored
+* data -- the PPPoEInterface fd belongs to
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Relays the session frames waiting on an interface
+***********************************************************************/
+static void
+relaySessionReadable(EventSelector *es, int fd, unsigned int flags,
+		     void *data)
+{
+    PPPoEInterface const *iface = data;
+
+#ifdef RELAY_WORKERS
+    if (WorkerIndex >= 0) Epoch = *SharedEpoch;
+#endif
+#ifdef RELAY_RING
+    if (UseRings) {
+	relayGotSessionRing(iface - Interfaces);
+	return;
+    }
+#endif
+#ifdef RELAY_BATCH_SIZE
+    relayGotSessionBatch(iface);
+#else
+    relayGotSessionPacket(iface);
+#endif
+}
+
+/**********************************************************************
+*%FUNCTION: relayDiscoveryReadable
+*%ARGUMENTS:
+* es -- event selector
+* fd -- discovery socket
+* flags -- ignored
+* data -- the PPPoEInterface fd belongs to
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Handles a discovery frame waiting on an interface
+***********************************************************************/
+static void
+relayDiscoveryReadable(EventSelector *es, int fd, unsigned int flags,
+		       void *data)
+{
+    relayGotDiscoveryPacket(data);
+}
+
+/**********************************************************************
+*%FUNCTION: relayTick
+*%ARGUMENTS:
+* es -- event selector
+* fd -- the clock timerfd, or -1 if the clock is an event timer
+* flags -- ignored
+* data -- ignored
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Advances Epoch by the seconds that have passed and runs the
+* stale-session cleaner.  An event timer is re-armed for the next second.
+***********************************************************************/
+static void
+relayTick(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    struct timeval t;
+
+#ifdef USE_TIMERFD
+    if (fd >= 0) {
+	uint64_t ticks;
+	if (read(fd, &ticks, sizeof(ticks)) != sizeof(ticks)) return;
+	Epoch += (unsigned int) ticks;
+    } else
+#endif
+    {
+	Epoch++;
+	t.tv_sec = 1;
+	t.tv_usec = 0;
+	if (!Event_AddTimerHandler(es, t, relayTick, NULL)) {
+	    fatalSys("Event_AddTimerHandler");
+	}
+    }
+#ifdef RELAY_WORKERS
+    if (SharedEpoch) *SharedEpoch = Epoch;
+#endif
+    cleanSessions();
+}
+
+/**********************************************************************
+*%FUNCTION: startClock
+*%ARGUMENTS:
+* es -- event selector
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Arranges for relayTick to be called every second: from a timerfd if
+* the kernel has them, otherwise from an event timer.
+***********************************************************************/
+static void
+startClock(EventSelector *es)
+{
+    struct timeval t;
+
+#ifdef USE_TIMERFD
+    struct itimerspec its;
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd >= 0) {
+	its.it_interval.tv_sec = 1;
+	its.it_interval.tv_nsec = 0;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+	    fatalSys("timerfd_settime");
+	}
+	if (!Event_AddHandler(es, fd, EVENT_FLAG_READABLE, relayTick, NULL)) {
+	    fatalSys("Event_AddHandler");
+	}
+	return;
+    }
+#endif
+    t.tv_sec = 1;
+    t.tv_usec = 0;
+    if (!Event_AddTimerHandler(es, t, relayTick, NULL)) {
+	fatalSys("Event_AddTimerHandler");
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: relayLoop
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Runs the relay loop.  This function never returns
+***********************************************************************/
+void
+relayLoop(void)
+{
+    EventSelector *es;
+    int i;
+
+    es = Event_CreateSelector();
+    if (!es) {
+	rp_fatal("Could not create event selector");
+    }
+
+    /* Handlers added last are called first, so session frames are
+       handled before discovery frames.  With -w, the discovery process
+       has no session sockets and workers have only session sockets. */
+    for (i=0; i<NumInterfaces; i++) {
+	if (Interfaces[i].discoverySock >= 0 &&
+	    !Event_AddHandler(es, Interfaces[i].discoverySock,
+			      EVENT_FLAG_READABLE, relayDiscoveryReadable,
+			      &Interfaces[i])) {
+	    fatalSys("Event_AddHandler");
+	}
+    }
+#ifdef RELAY_WORKERS
+    if (WorkerIndex >= 0 &&
+	!Event_AddHandler(es, WorkerPipes[0], EVENT_FLAG_READABLE,
+			  workerReadable, NULL)) {
+	fatalSys("Event_AddHandler");
+    }
+#endif
+    for (i=0; i<NumInterfaces; i++) {
+	if (Interfaces[i].sessionSock >= 0 &&
+	    !Event_AddHandler(es, Interfaces[i].sessionSock,
+			      EVENT_FLAG_READABLE, relaySessionReadable,
+			      &Interfaces[i])) {
+	    fatalSys("Event_AddHandler");
+	}
+    }
+
+    /* Workers take the time from SharedEpoch */
+#ifdef RELAY_WORKERS
+    if (IdleTimeout && WorkerIndex < 0) startClock(es);
+#else
+    if (IdleTimeout) startClock(es);
+#endif
+
+    /* Workers have no control socket and ignore SIGUSR1 */
+    if (ControlSock >= 0 &&
+	!EventTcp_CreateAcceptor(es, ControlSock, controlAccept)) {
+	fatalSys("EventTcp_CreateAcceptor");
+    }
+#ifdef RELAY_WORKERS
+    if (WorkerIndex < 0 &&
+	Event_HandleSignal(es, SIGUSR1, relayDumpStats) < 0) {
+	fatalSys("Event_HandleSignal");
+    }
+#else
+    if (Event_HandleSignal(es, SIGUSR1, relayDumpStats) < 0) {
+	fatalSys("Event_HandleSignal");
+    }
+#endif
+
+    for(;;) {
+	if (Event_HandleEvent(es) < 0) {
+	    sysErr("Event_HandleEvent (relayLoop)");
+	}
+    }
+}
+
+/* A session and its counts, for sorting */
+typedef struct {
+    PPPoESession const *ses;
+    RelayCount count[2];
+} ReportEntry;
+
+/* Text of a report for the control socket */
+typedef struct {
+    char *buf;
+    int len;
+    int size;
+} ReportBuf;
+
+typedef void (*ReportLineFunc)(void *arg, char const *line);
+
+/**********************************************************************
+*%FUNCTION: addCount
+*%ARGUMENTS:
+* to -- counts to add to
+* from -- counts to add
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+addCount(RelayCount *to, RelayCount const *from)
+{
+    to->packets += from->packets;
+    to->bytes += from->bytes;
+}
+
+/**********************************************************************
+*%FUNCTION: sessionCount
+*%ARGUMENTS:
+* ses -- an open session
+* count -- filled in with ses's counts, indexed by FROM_AC/FROM_CLIENT
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Gets the frames and bytes relayed for ses, by the relay itself and,
+* with -x, by the kernel.
+***********************************************************************/
+static void
+sessionCount(PPPoESession const *ses, RelayCount count[2])
+{
+    int dir;
+
+    for (dir=FROM_AC; dir<=FROM_CLIENT; dir++) {
+	count[dir].packets = ses->packets[dir];
+	count[dir].bytes = ses->bytes[dir];
+    }
+#ifdef RELAY_XDP
+    if (UseXdp) xdpCount(ses, count);
+#endif
+}
+
+/**********************************************************************
+*%FUNCTION: closeCount
+*%ARGUMENTS:
+* ses -- a session being freed
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Adds ses's counts to its interfaces' totals of closed sessions, so
+* interface counters live on after the session.
+***********************************************************************/
+static void
+closeCount(PPPoESession const *ses)
+{
+    PPPoEInterface *ac = &Interfaces[ses->acHash->interface - Interfaces];
+    PPPoEInterface *cli =
+	&Interfaces[ses->acHash->peer->interface - Interfaces];
+    RelayCount count[2];
+
+    sessionCount(ses, count);
+    addCount(&ac->rxClosed, &count[FROM_AC]);
+    addCount(&cli->txClosed, &count[FROM_AC]);
+    addCount(&cli->rxClosed, &count[FROM_CLIENT]);
+    addCount(&ac->txClosed, &count[FROM_CLIENT]);
+}
+
+/**********************************************************************
+*%FUNCTION: reportCompare
+*%ARGUMENTS:
+* a, b -- ReportEntry pointers
+*%RETURNS:
+* qsort order for busiest session (most bytes both ways) first
+***********************************************************************/
+static int
+reportCompare(void const *a, void const *b)
+{
+    ReportEntry const *x = a;
+    ReportEntry const *y = b;
+    uint64_t bx = x->count[FROM_AC].bytes + x->count[FROM_CLIENT].bytes;
+    uint64_t by = y->count[FROM_AC].bytes + y->count[FROM_CLIENT].bytes;
+
+    if (bx > by) return -1;
+    if (bx < by) return 1;
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: relayReport
+*%ARGUMENTS:
+* top -- number of sessions to list; 0 lists all of them
+* out -- function to call with each line of the report
+* arg -- passed to out
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Reports frames and bytes relayed from (rx) and to (tx) each interface
+* since startup, then the busiest open sessions.  Counters are read
+* only here, by walking the session array, so relaying a frame just
+* bumps the counters in its session.
+***********************************************************************/
+static void
+relayReport(int top, ReportLineFunc out, void *arg)
+{
+    RelayCount *rx, *tx;
+    ReportEntry *entries;
+    PPPoESession const *ses;
+    SessionHash const *ac, *cli;
+    RelayCount count[2];
+    char line[512];
+    char acName[HASH_IF_NAME_LEN], cliName[HASH_IF_NAME_LEN];
+    int i, n = 0, a, c;
+
+    rx = calloc(2 * NumInterfaces, sizeof(RelayCount));
+    if (!rx) {
+	out(arg, "Out of memory");
+	return;
+    }
+    tx = rx + NumInterfaces;
+    for (i=0; i<NumInterfaces; i++) {
+	rx[i] = Interfaces[i].rxClosed;
+	tx[i] = Interfaces[i].txClosed;
+    }
+
+    /* Without memory for sorting, interface totals are still right */
+    entries = malloc((NumSessions + 1) * sizeof(ReportEntry));
+    for (i=0; i<MaxSessions; i++) {
+	ses = &AllSessions[i];
+	if (!ses->acHash) continue;
+	sessionCount(ses, count);
+	a = ses->acHash->interface - Interfaces;
+	c = ses->acHash->peer->interface - Interfaces;
+	addCount(&rx[a], &count[FROM_AC]);
+	addCount(&tx[c], &count[FROM_AC]);
+	addCount(&rx[c], &count[FROM_CLIENT]);
+	addCount(&tx[a], &count[FROM_CLIENT]);
+	if (entries && n < NumSessions) {
+	    entries[n].ses = ses;
+	    entries[n].count[FROM_AC] = count[FROM_AC];
+	    entries[n].count[FROM_CLIENT] = count[FROM_CLIENT];
+	    n++;
+	}
+    }
+
+    for (i=0; i<NumInterfaces; i++) {
+	snprintf(line, sizeof(line),
+		 "Interface %.*s: rx %llu frames %llu bytes, tx %llu frames %llu bytes",
+		 IFNAMSIZ, Interfaces[i].name,
+		 (unsigned long long) rx[i].packets,
+		 (unsigned long long) rx[i].bytes,
+		 (unsigned long long) tx[i].packets,
+		 (unsigned long long) tx[i].bytes);
+	out(arg, line);
+    }
+    free(rx);
+    snprintf(line, sizeof(line), "Sessions: %d of %d", NumSessions,
+	     MaxSessions);
+    out(arg, line);
+    if (!entries) return;
+
+    qsort(entries, n, sizeof(ReportEntry), reportCompare);
+    if (top <= 0 || top > n) top = n;
+    for (i=0; i<top; i++) {
+	ac = entries[i].ses->acHash;
+	cli = entries[i].ses->acHash->peer;
+	snprintf(line, sizeof(line),
+		 "Session %d: server=%02x:%02x:%02x:%02x:%02x:%02x(%s:%d), client=%02x:%02x:%02x:%02x:%02x:%02x(%s:%d): from server %llu frames %llu bytes, from client %llu frames %llu bytes",
+		 ntohs(entries[i].ses->sesNum),
+		 ac->peerMac[0], ac->peerMac[1], ac->peerMac[2],
+		 ac->peerMac[3], ac->peerMac[4], ac->peerMac[5],
+		 hashIfName(ac, acName), ntohs(ac->sesNum),
+		 cli->peerMac[0], cli->peerMac[1], cli->peerMac[2],
+		 cli->peerMac[3], cli->peerMac[4], cli->peerMac[5],
+		 hashIfName(cli, cliName), ntohs(cli->sesNum),
+		 (unsigned long long) entries[i].count[FROM_AC].packets,
+		 (unsigned long long) entries[i].count[FROM_AC].bytes,
+		 (unsigned long long) entries[i].count[FROM_CLIENT].packets,
+		 (unsigned long long) entries[i].count[FROM_CLIENT].bytes);
+	out(arg, line);
+    }
+    free(entries);
+}
+
+/**********************************************************************
+*%FUNCTION: reportToSyslog
+*%ARGUMENTS:
+* arg -- ignored
+* line -- a line of a report
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+reportToSyslog(void *arg, char const *line)
+{
+    syslog(LOG_INFO, "%s", line);
+}
+
+/**********************************************************************
+*%FUNCTION: relayDumpStats
+*%ARGUMENTS:
+* sig -- signal number (SIGUSR1)
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Logs a counter report.  Called synchronously from the event loop.
+***********************************************************************/
+static void
+relayDumpStats(int sig)
+{
+    relayReport(REPORT_TOP, reportToSyslog, NULL);
+}
+
+/**********************************************************************
+*%FUNCTION: reportToBuf
+*%ARGUMENTS:
+* arg -- a ReportBuf
+* line -- a line of a report
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Appends line and a newline to the buffer, growing it as needed.  A
+* line that does not fit in memory is left out.
+***********************************************************************/
+static void
+reportToBuf(void *arg, char const *line)
+{
+    ReportBuf *rb = arg;
+    int len = strlen(line);
+    char *buf;
+    int size;
+
+    if (rb->len + len + 1 > rb->size) {
+	size = rb->size ? rb->size * 2 : 4096;
+	while (size < rb->len + len + 1) size *= 2;
+	buf = realloc(rb->buf, size);
+	if (!buf) return;
+	rb->buf = buf;
+	rb->size = size;
+    }
+    memcpy(rb->buf + rb->len, line, len);
+    rb->buf[rb->len + len] = '\n';
+    rb->len += len + 1;
+}
+
+/**********************************************************************
+*%FUNCTION: controlOpen
+*%ARGUMENTS:
+* path -- file name for the control socket
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Creates the Unix-domain control socket, replacing any stale one.
+* Exits on failure, since -c was asked for.
+***********************************************************************/
+static void
+controlOpen(char const *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	rp_fatal("Control socket path is too long");
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    ControlSock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ControlSock < 0) {
+	fatalSys("socket(AF_UNIX)");
+    }
+    unlink(path);
+    if (bind(ControlSock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+	fatalSys("bind (control socket)");
+    }
+    if (listen(ControlSock, 5) < 0) {
+	fatalSys("listen (control socket)");
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: controlDone
+*%ARGUMENTS:
+* es -- event selector
+* fd -- control connection
+* buf, len, flag, data -- ignored
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Closes a control connection once its reply is written (or cannot be)
+***********************************************************************/
+static void
+controlDone(EventSelector *es, int fd, char *buf, int len, int flag,
+	    void *data)
+{
+    close(fd);
+}
+
+/**********************************************************************
+*%FUNCTION: controlCommand
+*%ARGUMENTS:
+* es -- event selector
+* fd -- control connection
+* buf -- the command line read
+* len -- its length
+* flag -- EVENT_TCP_FLAG_* status of the read
+* data -- ignored
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Carries out a control command and writes the reply, then closes the
+* connection.  Commands are:
+*   stats        -- interface counters and the REPORT_TOP busiest sessions
+*   stats N      -- the same with the N busiest sessions
+*   stats all    -- the same with every open session
+***********************************************************************/
+static void
+controlCommand(EventSelector *es, int fd, char *buf, int len, int flag,
+	       void *data)
+{
+    ReportBuf rb;
+    char cmd[64];
+    char word[64];
+    char arg[64] = "";
+    int top;
+
+    if (flag != EVENT_TCP_FLAG_COMPLETE && flag != EVENT_TCP_FLAG_EOF) {
+	close(fd);
+	return;
+    }
+    if (len >= (int) sizeof(cmd)) len = sizeof(cmd) - 1;
+    memcpy(cmd, buf, len);
+    cmd[len] = 0;
+
+    memset(&rb, 0, sizeof(rb));
+    if (sscanf(cmd, "%63s %63s", word, arg) < 1 || strcmp(word, "stats")) {
+	reportToBuf(&rb, "Unknown command: should be stats [count|all]");
+    } else if (!*arg || !strcmp(arg, "all")) {
+	relayReport(*arg ? 0 : REPORT_TOP, reportToBuf, &rb);
+    } else if (sscanf(arg, "%d", &top) == 1 && top > 0) {
+	relayReport(top, reportToBuf, &rb);
+    } else {
+	reportToBuf(&rb, "Illegal argument to stats: should be a count or all");
+    }
+
+    if (!rb.len ||
+	!EventTcp_WriteBuf(es, fd, rb.buf, rb.len, controlDone, 5, NULL)) {
+	close(fd);
+    }
+    free(rb.buf);
+}
+
+/**********************************************************************
+*%FUNCTION: controlAccept
+*%ARGUMENTS:
+* es -- event selector
+* fd -- a new control connection
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Waits up to 5 seconds for a command line on a control connection
+***********************************************************************/
+static void
+controlAccept(EventSelector *es, int fd)
+{
+    if (!EventTcp_ReadBuf(es, fd, 64, '\n', controlCommand, 5, NULL)) {
+	close(fd);
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: relayGotDiscoveryPacket
+*%ARGUMENTS:
+* iface -- interface on which packet is waiting
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Receives and processes a discovery packet.
+***********************************************************************/
+void
+relayGotDiscoveryPacket(PPPoEInterface const *iface)
+{
+    PPPoEPacket packet;
+    PPPoETagIndex tags;
+    UINT16_t vlan = 0;
+    int size;
+
+    if (iface->trunk) {
+	if (receivePacketVlan(iface->discoverySock, &packet, &size, &vlan) < 0) {
+	    return;
+	}
+    } else if (receivePacket(iface->discoverySock, &packet, &size) < 0) {
+	return;
+    }
+    /* Ignore unknown code/version */
+    if (packet.ver != 1 || packet.type != 1) {
+	return;
+    }
+
+    /* Validate length */
+    if (ntohs(packet.length) + HDR_SIZE > size) {
+	syslog(LOG_ERR, "Bogus PPPoE length field (%u)",
+	       (unsigned int) ntohs(packet.length));
+	return;
+    }
+
+    /* Drop Ethernet frame padding */
+    if (size > ntohs(packet.length) + HDR_SIZE) {
+	size = ntohs(packet.length) + HDR_SIZE;
+    }
+
+    /* Index the tags once for the handlers.  A PADT is relayed as is. */
+    if (indexTags(&packet, &tags) < 0 && packet.code != CODE_PADT) {
+	return;
+    }
+
+    switch(packet.code) {
+    case CODE_PADT:
+	relayHandlePADT(iface, vlan, &packet, size);
+	break;
+    case CODE_PADI:
+	relayHandlePADI(iface, vlan, &packet, &tags, size);
+	break;
+    case CODE_PADO:
+	relayHandlePADO(iface, &packet, &tags, size);
+	break;
+    case CODE_PADR:
+	relayHandlePADR(iface, vlan, &packet, &tags, size);
+	break;
+    case CODE_PADS:
+	relayHandlePADS(iface, &packet, &tags, size);
+	break;
+    default:
+	syslog(LOG_ERR, "Discovery packet on %s with unknown code %d",
+	       iface->name, (int) packet.code);
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: relaySessionPacket
+*%ARGUMENTS:
+* iface -- interface on which packet was received
+* vlan -- VLAN it arrived on, if iface is a trunk; else 0
+* packet -- a session packet (untagged)
+* size -- its length; trimmed to drop Ethernet padding
+*%RETURNS:
+* The hash entry of the peer to send the packet to, or NULL to drop it
+*%DESCRIPTION:
+* Checks a received session packet, finds its session and rewrites the
+* addresses and session number in place for the other side.  The
+* caller sends it out of the peer's interface, on the peer's VLAN.
+***********************************************************************/
+static SessionHash const *
+relaySessionPacket(PPPoEInterface const *iface, UINT16_t vlan,
+		   PPPoEPacket *packet, int *size)
+{
+    SessionHash *sh;
+    PPPoESession *ses;
+
+    /* Ignore unknown code/version */
+    if (packet->ver != 1 || packet->type != 1) {
+	return NULL;
+    }
+
+    /* Must be a session packet */
+    if (packet->code != CODE_SESS) {
+	syslog(LOG_ERR, "Session packet with code %d", (int) packet->code);
+	return NULL;
+    }
+
+    /* Ignore session packets whose destination address isn't ours */
+    if (memcmp(packet->ethHdr.h_dest, iface->mac, ETH_ALEN)) {
+	return NULL;
+    }
+
+    /* Validate length */
+    if (ntohs(packet->length) + HDR_SIZE > *size) {
+	syslog(LOG_ERR, "Bogus PPPoE length field (%u)",
+	       (unsigned int) ntohs(packet->length));
+	return NULL;
+    }
+
+    /* Drop Ethernet frame padding */
+    if (*size > ntohs(packet->length) + HDR_SIZE) {
+	*size = ntohs(packet->length) + HDR_SIZE;
+    }
+
+    /* We're in business!  Find the hash */
+    sh = findSession(packet->ethHdr.h_source, packet->session);
+    if (!sh) {
+	/* Don't log this.  Someone could be running the client and the
+	   relay on the same box. */
+	return NULL;
+    }
+
+    /* The same MAC and session number on another VLAN is someone else */
+    if (sh->vlan != vlan) {
+	return NULL;
+    }
+
+    /* Relay it */
+    ses = sh->ses;
+    ses->epoch = Epoch;
+    ses->packets[sh->dir]++;
+    ses->bytes[sh->dir] += *size;
+    sh = sh->peer;
+    packet->session = sh->sesNum;
+    memcpy(packet->ethHdr.h_source, sh->interface->mac, ETH_ALEN);
+    memcpy(packet->ethHdr.h_dest, sh->peerMac, ETH_ALEN);
+    return sh;
+}
+
+/**********************************************************************
+*%FUNCTION: relayGotSessionPacket
+*%ARGUMENTS:
+* iface -- interface on which packet is waiting
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Receives and processes a session packet.
+***********************************************************************/
+void
+relayGotSessionPacket(PPPoEInterface const *iface)
+{
+    PPPoEPacket packet;
+    SessionHash const *out;
+    UINT16_t vlan = 0;
+    int size;
+
+    if (iface->trunk) {
+	if (receivePacketVlan(iface->sessionSock, &packet, &size, &vlan) < 0) {
+	    return;
+	}
+    } else if (receivePacket(iface->sessionSock, &packet, &size) < 0) {
+	return;
+    }
+    out = relaySessionPacket(iface, vlan, &packet, &size);
+    if (out) {
+	sendPacketVlan(NULL, out->interface->sessionSock, &packet, size,
+		       out->vlan);
+    }
+}
+
+#ifdef RELAY_BATCH_SIZE
+/* Receive buffers for a batch, with room for each frame's VLAN on a
+   trunk, and the frames to send, grouped by egress interface.  Frames
+   are sent from where they were received; a frame for a VLAN is sent
+   as three pieces, with its 802.1Q tag between the MAC addresses and
+   the rest. */
+static PPPoEPacket BatchPackets[RELAY_BATCH_SIZE];
+static struct iovec BatchRxIov[RELAY_BATCH_SIZE];
+static struct mmsghdr BatchRx[RELAY_BATCH_SIZE];
+static union {
+    struct cmsghdr cmsg;
+    char buf[VLAN_CMSG_SPACE];
+} BatchRxControl[RELAY_BATCH_SIZE];
+static struct iovec BatchTxIov[RELAY_BATCH_SIZE][3];
+static UINT16_t BatchTxTag[RELAY_BATCH_SIZE][2];
+static struct mmsghdr BatchTx[RELAY_BATCH_SIZE];
+
+/**********************************************************************
+*%FUNCTION: relaySendBatch
+*%ARGUMENTS:
+* sock -- session socket of egress interface
+* msgs -- frames to send
+* n -- number of frames
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Sends frames with as few sendmmsg calls as the kernel allows.  A
+* frame the kernel refuses is dropped, like a failed send() in
+* sendPacket.
+***********************************************************************/
+static void
+relaySendBatch(int sock, struct mmsghdr *msgs, int n)
+{
+    int r;
+
+    while (n > 0) {
+	r = sendmmsg(sock, msgs, n, 0);
+	if (r < 0) {
+	    if (errno == EINTR) continue;
+	    if (errno != ENOBUFS && errno != EAGAIN) {
+		sysErr("sendmmsg (relaySendBatch)");
+	    }
+	    r = 1;		/* Skip the frame that failed */
+	}
+	msgs += r;
+	n -= r;
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: relayGotSessionBatch
+*%ARGUMENTS:
+* iface -- interface on which packets are waiting
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Receives up to RELAY_BATCH_SIZE session packets with one recvmmsg,
+* rewrites them in place and sends them with one sendmmsg per egress
+* interface.  Most wakeups find a single frame, and then recvmmsg costs
+* more than it saves; so unless the last recvmmsg found a queue, frames
+* are relayed singly and recvmmsg is only tried every RELAY_BATCH_PROBE
+* wakeups.
+***********************************************************************/
+void
+relayGotSessionBatch(PPPoEInterface const *iface)
+{
+    static int ready = 0;
+    PPPoEInterface *rx = &Interfaces[iface - Interfaces];
+    SessionHash const *out[RELAY_BATCH_SIZE];
+    PPPoEInterface const *egress;
+    struct mmsghdr *m;
+    struct iovec *iov;
+    UINT16_t vlan = 0;
+    int i, n, queued, sent, size;
+
+    if (!rx->rxBacklog && ++rx->rxProbe < RELAY_BATCH_PROBE) {
+	relayGotSessionPacket(iface);
+	return;
+    }
+    rx->rxProbe = 0;
+
+    /* recvmmsg only writes msg_len, msg_controllen and msg_flags */
+    if (!ready) {
+	for (i=0; i<RELAY_BATCH_SIZE; i++) {
+	    BatchRxIov[i].iov_base = &BatchPackets[i];
+	    BatchRxIov[i].iov_len = sizeof(PPPoEPacket);
+	    BatchRx[i].msg_hdr.msg_iov = &BatchRxIov[i];
+	    BatchRx[i].msg_hdr.msg_iovlen = 1;
+	    BatchRx[i].msg_hdr.msg_control = &BatchRxControl[i];
+	}
+	ready = 1;
+    }
+    for (i=0; i<RELAY_BATCH_SIZE; i++) {
+	BatchRx[i].msg_hdr.msg_controllen =
+	    iface->trunk ? sizeof(BatchRxControl[i]) : 0;
+    }
+    do {
+	n = recvmmsg(iface->sessionSock, BatchRx, RELAY_BATCH_SIZE,
+		     MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+	rx->rxBacklog = 0;
+	if (errno != EAGAIN) sysErr("recvmmsg (relayGotSessionBatch)");
+	return;
+    }
+    rx->rxBacklog = (n > 1);
+
+    for (i=0; i<n; i++) {
+	size = (int) BatchRx[i].msg_len;
+	if (iface->trunk) vlan = packetVlan(&BatchRx[i].msg_hdr);
+	out[i] = relaySessionPacket(iface, vlan, &BatchPackets[i], &size);
+	BatchRx[i].msg_len = size;
+    }
+
+    /* Queue frames for one egress interface at a time, in the order
+       the interfaces were first seen */
+    for (sent=0; sent<n; sent++) {
+	if (!out[sent]) continue;
+	egress = out[sent]->interface;
+	queued = 0;
+	for (i=sent; i<n; i++) {
+	    if (!out[i] || out[i]->interface != egress) continue;
+	    m = &BatchTx[queued];
+	    iov = BatchTxIov[queued];
+	    size = (int) BatchRx[i].msg_len;
+	    memset(&m->msg_hdr, 0, sizeof(struct msghdr));
+	    m->msg_hdr.msg_iov = iov;
+	    if (out[i]->vlan) {
+		BatchTxTag[queued][0] = htons(ETH_VLAN_TPID);
+		BatchTxTag[queued][1] = htons(out[i]->vlan);
+		iov[0].iov_base = &BatchPackets[i];
+		iov[0].iov_len = 2 * ETH_ALEN;
+		iov[1].iov_base = BatchTxTag[queued];
+		iov[1].iov_len = VLAN_TAG_LEN;
+		iov[2].iov_base = (unsigned char *) &BatchPackets[i] + 2 * ETH_ALEN;
+		iov[2].iov_len = size - 2 * ETH_ALEN;
+		m->msg_hdr.msg_iovlen = 3;
+	    } else {
+		iov[0].iov_base = &BatchPackets[i];
+		iov[0].iov_len = size;
+		m->msg_hdr.msg_iovlen = 1;
+	    }
+	    queued++;
+	    if (i > sent) out[i] = NULL;
+	}
+	relaySendBatch(egress->sessionSock, BatchTx, queued);
+    }
+}
+#endif
+
+#ifdef RELAY_RING
+/**********************************************************************
+*%FUNCTION: relaySetupRing
+*%ARGUMENTS:
+* idx -- index into Interfaces[]
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Switches the interface's session socket to TPACKET_V2 and maps
+* receive and transmit rings onto it.  Once this is done, frames no
+* longer arrive through recv() and send() on the socket only flushes
+* the transmit ring, so the socket is used for session frames only.
+***********************************************************************/
+static void
+relaySetupRing(int idx)
+{
+    int sock = Interfaces[idx].sessionSock;
+    int version = TPACKET_V2;
+    struct tpacket_req req;
+    size_t len;
+    unsigned char *map;
+
+    if (!Rings) {
+	Rings = calloc(NumInterfaces, sizeof(RelayRing));
+	if (!Rings) {
+	    rp_fatal("Unable to allocate memory for rings");
+	}
+    }
+    if (setsockopt(sock, SOL_PACKET, PACKET_VERSION,
+		   &version, sizeof(version)) < 0) {
+	fatalSys("setsockopt(PACKET_VERSION)");
+    }
+    req.tp_frame_size = RELAY_RING_FRAME_SIZE;
+    req.tp_block_size = RELAY_RING_FRAME_SIZE * RELAY_RING_BLOCK_FRAMES;
+    req.tp_frame_nr = RELAY_RING_FRAMES;
+    req.tp_block_nr = RELAY_RING_FRAMES / RELAY_RING_BLOCK_FRAMES;
+    if (setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+	fatalSys("setsockopt(PACKET_RX_RING)");
+    }
+    if (setsockopt(sock, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+	fatalSys("setsockopt(PACKET_TX_RING)");
+    }
+    len = (size_t) RELAY_RING_FRAMES * RELAY_RING_FRAME_SIZE;
+    map = mmap(NULL, 2 * len, PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0);
+    if (map == MAP_FAILED) {
+	fatalSys("mmap");
+    }
+    Rings[idx].rx = map;
+    Rings[idx].tx = map + len;
+    Rings[idx].rxNext = 0;
+    Rings[idx].txNext = 0;
+    Rings[idx].txQueued = 0;
+}
+
+/**********************************************************************
+*%FUNCTION: relayFlushRing
+*%ARGUMENTS:
+* idx -- index into Interfaces[]
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Asks the kernel to transmit the frames queued on the interface's
+* transmit ring.
+***********************************************************************/
+static void
+relayFlushRing(int idx)
+{
+    if (!Rings[idx].txQueued) return;
+    Rings[idx].txQueued = 0;
+    while (send(Interfaces[idx].sessionSock, NULL, 0, MSG_DONTWAIT) < 0) {
+	if (errno == EINTR) continue;
+	if (errno != ENOBUFS && errno != EAGAIN) {
+	    sysErr("send (relayFlushRing)");
+	}
+	break;
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: relayRingSend
+*%ARGUMENTS:
+* idx -- index into Interfaces[]
+* packet -- frame to send (untagged)
+* size -- its length
+* vlan -- VLAN ID to tag it with; 0 means send it untagged
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Copies a frame into the next slot of the interface's transmit ring,
+* inserting its 802.1Q tag on the way.  If the ring is full, flushes
+* it once; if it is still full, the frame is dropped, as when send()
+* fails with ENOBUFS.
+***********************************************************************/
+static void
+relayRingSend(int idx, PPPoEPacket const *packet, int size, UINT16_t vlan)
+{
+    RelayRing *r = &Rings[idx];
+    struct tpacket2_hdr *hdr;
+    unsigned char *data;
+    UINT16_t tag[2];
+
+    hdr = (struct tpacket2_hdr *) (r->tx + r->txNext * RELAY_RING_FRAME_SIZE);
+    if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+	relayFlushRing(idx);
+	__sync_synchronize();
+	if (hdr->tp_status != TP_STATUS_AVAILABLE) return;
+    }
+    data = (unsigned char *) hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+    if (vlan) {
+	tag[0] = htons(ETH_VLAN_TPID);
+	tag[1] = htons(vlan);
+	memcpy(data, packet, 2 * ETH_ALEN);
+	memcpy(data + 2 * ETH_ALEN, tag, VLAN_TAG_LEN);
+	memcpy(data + 2 * ETH_ALEN + VLAN_TAG_LEN,
+	       (unsigned char const *) packet + 2 * ETH_ALEN,
+	       size - 2 * ETH_ALEN);
+	size += VLAN_TAG_LEN;
+    } else {
+	memcpy(data, packet, size);
+    }
+    hdr->tp_len = size;
+    __sync_synchronize();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+    r->txNext = (r->txNext + 1) % RELAY_RING_FRAMES;
+    if (++r->txQueued >= RELAY_BATCH_SIZE) {
+	relayFlushRing(idx);
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: relayGotSessionRing
+*%ARGUMENTS:
+* idx -- index into Interfaces[] of interface with frames waiting
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Relays the session frames waiting in an interface's receive ring.
+* Each frame is rewritten where it lies and copied straight into the
+* egress interface's transmit ring; transmit rings are flushed every
+* RELAY_BATCH_SIZE frames and once the receive ring is drained.
+***********************************************************************/
+static void
+relayGotSessionRing(int idx)
+{
+    RelayRing *r = &Rings[idx];
+    struct tpacket2_hdr *hdr;
+    SessionHash const *out;
+    PPPoEPacket *packet;
+    UINT16_t vlan = 0;
+    int n, o, size;
+
+    for (n=0; n<RELAY_RING_FRAMES; n++) {
+	hdr = (struct tpacket2_hdr *) (r->rx + r->rxNext * RELAY_RING_FRAME_SIZE);
+	if (!(hdr->tp_status & TP_STATUS_USER)) break;
+	__sync_synchronize();
+
+	/* Truncated frames (larger than a ring slot) are dropped */
+	if (hdr->tp_snaplen == hdr->tp_len) {
+	    packet = (PPPoEPacket *) ((unsigned char *) hdr + hdr->tp_mac);
+	    size = hdr->tp_snaplen;
+	    /* As in packetVlan: old kernels don't set TP_STATUS_VLAN_VALID */
+	    if (Interfaces[idx].trunk &&
+		((hdr->tp_status & TP_STATUS_VLAN_VALID) || hdr->tp_vlan_tci)) {
+		vlan = hdr->tp_vlan_tci & VLAN_VID_MASK;
+	    } else {
+		vlan = 0;
+	    }
+	    out = relaySessionPacket(&Interfaces[idx], vlan, packet, &size);
+	    if (out) {
+		relayRingSend(out->interface - Interfaces, packet, size,
+			      out->vlan);
+	    }
+	}
+
+	__sync_synchronize();
+	hdr->tp_status = TP_STATUS_KERNEL;
+	r->rxNext = (r->rxNext + 1) % RELAY_RING_FRAMES;
+    }
+    for (o=0; o<NumInterfaces; o++) {
+	relayFlushRing(o);
+    }
+}
+#endif
+
+#ifdef RELAY_WORKERS
+/**********************************************************************
+*%FUNCTION: sharedAlloc
+*%ARGUMENTS:
+* len -- number of bytes
+*%RETURNS:
+* Zeroed memory that stays shared with processes forked later, or NULL
+***********************************************************************/
+static void *
+sharedAlloc(size_t len)
+{
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return (mem == MAP_FAILED) ? NULL : mem;
+}
+
+/**********************************************************************
+*%FUNCTION: startWorkers
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Forks NumWorkers worker processes, which relay session frames from
+* then on; the calling process keeps discovery.  All the workers'
+* session sockets are opened and joined to their fanout groups here,
+* in worker order, so that worker w is member w of every group.
+***********************************************************************/
+static void
+startWorkers(void)
+{
+    int *socks;			/* socks[w * NumInterfaces + i] */
+    int *groups;		/* Fanout group of each interface */
+    int pipes[MAX_WORKERS][2];
+    int w, v, i;
+    pid_t pid;
+
+    socks = malloc(NumWorkers * NumInterfaces * sizeof(int));
+    groups = malloc(NumInterfaces * sizeof(int));
+    if (!socks || !groups) {
+	rp_fatal("Unable to allocate memory for worker sockets");
+    }
+    for (i=0; i<NumInterfaces; i++) {
+	groups[i] = -1;
+    }
+
+    SharedEpoch = sharedAlloc(sizeof(*SharedEpoch));
+    if (!SharedEpoch) {
+	fatalSys("mmap");
+    }
+    *SharedEpoch = Epoch;
+
+    for (w=0; w<NumWorkers; w++) {
+	for (i=0; i<NumInterfaces; i++) {
+	    v = w * NumInterfaces + i;
+	    if (Interfaces[i].trunk) {
+		socks[v] = openTrunkInterface(Interfaces[i].name,
+					      Eth_PPPOE_Session, NULL, NULL);
+	    } else {
+		socks[v] = openInterface(Interfaces[i].name, Eth_PPPOE_Session,
+					 NULL, NULL);
+	    }
+	    if (socks[v] >= FD_SETSIZE) {
+		rp_fatal("Too many interfaces for -w (use -V for VLANs on a trunk)");
+	    }
+	    if (joinSessionFanout(socks[v], &groups[i], NumWorkers) < 0) {
+		fatalSys("setsockopt(PACKET_FANOUT)");
+	    }
+	}
+	if (pipe(pipes[w]) < 0) {
+	    fatalSys("pipe");
+	}
     }
+    free(groups);
 
-    if (sh->next) {
-	sh->next->prev = sh->prev;
+    for (w=0; w<NumWorkers; w++) {
+	pid = fork();
+	if (pid < 0) {
+	    fatalSys("fork");
+	}
+	if (pid == 0) {
+	    /* Keep only our own sockets and the read end of our pipe */
+	    for (v=0; v<NumWorkers; v++) {
+		close(pipes[v][1]);
+		if (v == w) continue;
+		close(pipes[v][0]);
+		for (i=0; i<NumInterfaces; i++) {
+		    close(socks[v * NumInterfaces + i]);
+		}
+	    }
+	    for (i=0; i<NumInterfaces; i++) {
+		close(Interfaces[i].discoverySock);
+		close(Interfaces[i].sessionSock);
+		Interfaces[i].discoverySock = -1;
+		Interfaces[i].sessionSock = socks[w * NumInterfaces + i];
+#ifdef RELAY_RING
+		if (UseRings) relaySetupRing(i);
+#endif
+	    }
+	    if (ControlSock >= 0) close(ControlSock);
+	    ControlSock = -1;
+	    signal(SIGUSR1, SIG_IGN);
+	    WorkerIndex = w;
+	    WorkerPipes[0] = pipes[w][0];
+	    relayLoop();
+	    exit(EXIT_FAILURE);
+	}
     }
 
-    /* Add to free list (singly-linked) */
-    sh->next = FreeHashes;
-    FreeHashes = sh;
+    /* Session frames are now the workers' business */
+    for (w=0; w<NumWorkers; w++) {
+	close(pipes[w][0]);
+	WorkerPipes[w] = pipes[w][1];
+	for (i=0; i<NumInterfaces; i++) {
+	    close(socks[w * NumInterfaces + i]);
+	}
+    }
+    free(socks);
+    for (i=0; i<NumInterfaces; i++) {
+	close(Interfaces[i].sessionSock);
+	Interfaces[i].sessionSock = -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
 }
 
 /**********************************************************************
-*%FUNCTION: addHash
+*%FUNCTION: publishSession
 *%ARGUMENTS:
-* sh -- a session hash
+* op -- WORKER_ADD or WORKER_DEL
+* ses -- session created or about to be freed
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Adds a SessionHash to the hash table
+* Tells every worker about a change to the session table.  Workers
+* cannot run without these, so a worker that has gone away is fatal.
 ***********************************************************************/
-void
-addHash(SessionHash *sh)
+static void
+publishSession(int op, PPPoESession const *ses)
 {
-    unsigned int b = hash(sh->peerMac, sh->sesNum) % HASHTAB_SIZE;
-    sh->next = Buckets[b];
-    sh->prev = NULL;
-    if (sh->next) {
-	sh->next->prev = sh;
+    WorkerMsg msg;
+    int w;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op = op;
+    msg.acIf = ses->acHash->interface - Interfaces;
+    msg.cliIf = ses->acHash->peer->interface - Interfaces;
+    memcpy(msg.acMac, ses->acHash->peerMac, ETH_ALEN);
+    memcpy(msg.cliMac, ses->acHash->peer->peerMac, ETH_ALEN);
+    msg.acSes = ses->acHash->sesNum;
+    msg.sesNum = ses->sesNum;
+    msg.cliVlan = ses->acHash->peer->vlan;
+
+    for (w=0; w<NumWorkers; w++) {
+	while (write(WorkerPipes[w], &msg, sizeof(msg)) < 0) {
+	    if (errno != EINTR) fatalSys("write (publishSession)");
+	}
     }
-    Buckets[b] = sh;
 }
 
 /**********************************************************************
-*%FUNCTION: hash
+*%FUNCTION: workerHashed
 *%ARGUMENTS:
-* mac -- an Ethernet address
-* sesNum -- a session number
+* sh -- a session hash
 *%RETURNS:
-* A hash value combining Ethernet address with session number.
-* Currently very simplistic; we may need to experiment with different
-* hash values.
+* True if this worker receives the frames sh matches
 ***********************************************************************/
-unsigned int
-hash(unsigned char const *mac, UINT16_t sesNum)
+static int
+workerHashed(SessionHash const *sh)
 {
-    unsigned int ans1 =
-	((unsigned int) mac[0]) |
-	(((unsigned int) mac[1]) << 8) |
-	(((unsigned int) mac[2]) << 16) |
-	(((unsigned int) mac[3]) << 24);
-    unsigned int ans2 =
-	((unsigned int) sesNum) |
-	(((unsigned int) mac[4]) << 16) |
-	(((unsigned int) mac[5]) << 24);
-    return ans1 ^ ans2;
+    return sessionPartition(sh->peerMac, sh->sesNum, NumWorkers) ==
+	(unsigned int) WorkerIndex;
 }
 
 /**********************************************************************
-*%FUNCTION: findSession
+*%FUNCTION: workerReadable
 *%ARGUMENTS:
-* mac -- an Ethernet address
-* sesNum -- a session number
+* es -- event selector
+* fd -- read end of our pipe from the discovery process
+* flags, data -- ignored
 *%RETURNS:
-* The session hash for peer address "mac", session number sesNum
+* Nothing
+*%DESCRIPTION:
+* In a worker, applies session-table changes from the discovery
+* process.  Session N always uses AllHashes[2N-2] and AllHashes[2N-1].
+* Exits if the discovery process has gone.
 ***********************************************************************/
-SessionHash *
-findSession(unsigned char const *mac, UINT16_t sesNum)
+static void
+workerReadable(EventSelector *es, int fd, unsigned int flags, void *data)
 {
-    unsigned int b = hash(mac, sesNum) % HASHTAB_SIZE;
-    SessionHash *sh = Buckets[b];
-    while(sh) {
-	if (!memcmp(mac, sh->peerMac, ETH_ALEN) && sesNum == sh->sesNum) {
-	    return sh;
+    WorkerMsg msgs[64];
+    WorkerMsg const *msg;
+    SessionHash *acHash, *cliHash;
+    int n, k, idx;
+
+    n = read(fd, msgs, sizeof(msgs));
+    if (n < 0) {
+	if (errno != EINTR) fatalSys("read (workerReadable)");
+	return;
+    }
+    if (n == 0) {
+	exit(EXIT_SUCCESS);
+    }
+
+    /* Pipe writes of under PIPE_BUF bytes are atomic, so we only ever
+       see whole messages */
+    for (k=0; k<n / (int) sizeof(WorkerMsg); k++) {
+	msg = &msgs[k];
+	idx = ntohs(msg->sesNum) - 1;
+	if (idx < 0 || idx >= MaxSessions ||
+	    msg->acIf >= NumInterfaces || msg->cliIf >= NumInterfaces) {
+	    continue;
 	}
-	sh = sh->next;
+	acHash = &AllHashes[2*idx];
+	cliHash = &AllHashes[2*idx+1];
+
+	if (acHash->ses) {
+	    if (workerHashed(acHash)) unhash(acHash);
+	    if (workerHashed(cliHash)) unhash(cliHash);
+	    acHash->ses = cliHash->ses = NULL;
+	}
+	if (msg->op != WORKER_ADD) continue;
+
+	acHash->peer = cliHash;
+	cliHash->peer = acHash;
+	acHash->dir = FROM_AC;
+	cliHash->dir = FROM_CLIENT;
+	acHash->interface = &Interfaces[msg->acIf];
+	cliHash->interface = &Interfaces[msg->cliIf];
+	memcpy(acHash->peerMac, msg->acMac, ETH_ALEN);
+	memcpy(cliHash->peerMac, msg->cliMac, ETH_ALEN);
+	acHash->sesNum = msg->acSes;
+	cliHash->sesNum = msg->sesNum;
+	acHash->vlan = 0;
+	cliHash->vlan = msg->cliVlan;
+	acHash->ses = cliHash->ses = &AllSessions[idx];
+	if (workerHashed(acHash)) addHash(acHash);
+	if (workerHashed(cliHash)) addHash(cliHash);
     }
-    return NULL;
 }
+#endif
+
+#ifdef RELAY_XDP
+/* eBPF instructions, in the style of the kernel's filter.h */
+#define XI(code, dst, src, off, imm) { (code), (dst), (src), (off), (imm) }
+#define X_MOV_REG(d, s) XI(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define X_MOV_IMM(d, i) XI(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define X_ADD_IMM(d, i) XI(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define X_SUB_REG(d, s) XI(BPF_ALU64 | BPF_SUB | BPF_X, d, s, 0, 0)
+#define X_NTOHS(d) XI(BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, 16)
+#define X_LDX(sz, d, s, off) XI(BPF_LDX | (sz) | BPF_MEM, d, s, off, 0)
+#define X_STX(sz, d, s, off) XI(BPF_STX | (sz) | BPF_MEM, d, s, off, 0)
+#define X_XADD(sz, d, s, off) XI(BPF_STX | (sz) | BPF_XADD, d, s, off, 0)
+#define X_JMP_IMM(op, d, i, off) XI(BPF_JMP | (op) | BPF_K, d, 0, off, i)
+#define X_JMP_REG(op, d, s, off) XI(BPF_JMP | (op) | BPF_X, d, s, off, 0)
+#define X_CALL(f) XI(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define X_EXIT() XI(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+#define X_LD_MAP(d) XI(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, 0), \
+	XI(0, 0, 0, 0, 0)
+
+/* Jump target meaning "give the frame to the normal stack" */
+#define X_PASS 0x7fff
+
+/* Registers: r6 = context, r2/r3 = packet start/end, r9 = map value */
+#define X_R0 BPF_REG_0
+#define X_R1 BPF_REG_1
+#define X_R2 BPF_REG_2
+#define X_R3 BPF_REG_3
+#define X_R4 BPF_REG_4
+#define X_R5 BPF_REG_5
+#define X_R6 BPF_REG_6
+#define X_R7 BPF_REG_7
+#define X_R8 BPF_REG_8
+#define X_R9 BPF_REG_9
+#define X_FP BPF_REG_10
+
+/* Offsets in struct xdp_md */
+#define XDP_MD_DATA 0
+#define XDP_MD_DATA_END 4
 
 /**********************************************************************
-*%FUNCTION: fatalSys
+*%FUNCTION: xdpSys
 *%ARGUMENTS:
-* str -- error message
+* cmd -- bpf() command
+* attr -- its attributes
 *%RETURNS:
-* Nothing
-*%DESCRIPTION:
-* Prints a message plus the errno value to stderr and syslog and exits.
+* Whatever the bpf() system call returns
 ***********************************************************************/
-void
-fatalSys(char const *str)
+static int
+xdpSys(int cmd, union bpf_attr *attr)
 {
-    char buf[1024];
-    sprintf(buf, "%.256s: %.256s", str, strerror(errno));
-    printErr(buf);
-    exit(EXIT_FAILURE);
+    return (int) syscall(SYS_bpf, cmd, attr, sizeof(*attr));
 }
 
 /**********************************************************************
-*%FUNCTION: sysErr
+*%FUNCTION: xdpLoad
 *%ARGUMENTS:
-* str -- error message
+* None
 *%RETURNS:
-* Nothing
+* A file descriptor for the XDP program
 *%DESCRIPTION:
-* Prints a message plus the errno value to syslog.
+* Assembles and loads the fast-path program.  It makes the same checks
+* as relaySessionPacket, looks the sender's MAC and session up in
+* XdpMap, rewrites the addresses and session number, counts the frame
+* in the entry, stamps it with the time and redirects the frame.
+* Frames it is unsure of are passed up to the relay's sockets.
 ***********************************************************************/
-void
-sysErr(char const *str)
+static int
+xdpLoad(void)
 {
-    char buf[1024];
-    sprintf(buf, "%.256s: %.256s", str, strerror(errno));
-    printErr(buf);
+    static char log[65536];
+    struct bpf_insn prog[] = {
+	X_MOV_REG(X_R6, X_R1),
+	X_LDX(BPF_W, X_R2, X_R6, XDP_MD_DATA),
+	X_LDX(BPF_W, X_R3, X_R6, XDP_MD_DATA_END),
+	X_MOV_REG(X_R4, X_R2),
+	X_ADD_IMM(X_R4, HDR_SIZE),
+	X_JMP_REG(BPF_JGT, X_R4, X_R3, X_PASS),
+
+	/* PPPoE session frame, version 1, type 1, code 0 */
+	X_LDX(BPF_H, X_R5, X_R2, 12),
+	X_JMP_IMM(BPF_JNE, X_R5, htons(Eth_PPPOE_Session), X_PASS),
+	X_LDX(BPF_B, X_R5, X_R2, 14),
+	X_JMP_IMM(BPF_JNE, X_R5, 0x11, X_PASS),
+	X_LDX(BPF_B, X_R5, X_R2, 15),
+	X_JMP_IMM(BPF_JNE, X_R5, CODE_SESS, X_PASS),
+
+	/* Bogus length fields are left to the relay to log.  Frames
+	   with padding beyond the Ethernet minimum are left to it to
+	   trim. */
+	X_LDX(BPF_H, X_R7, X_R2, 18),
+	X_NTOHS(X_R7),
+	X_ADD_IMM(X_R7, HDR_SIZE),
+	X_MOV_REG(X_R8, X_R3),
+	X_SUB_REG(X_R8, X_R2),
+	X_JMP_REG(BPF_JGT, X_R7, X_R8, X_PASS),
+	X_JMP_IMM(BPF_JLE, X_R8, ETH_ZLEN, 1),
+	X_JMP_REG(BPF_JNE, X_R7, X_R8, X_PASS),
+
+	/* Key: source MAC and session number */
+	X_LDX(BPF_W, X_R5, X_R2, 6),
+	X_STX(BPF_W, X_FP, X_R5, -8),
+	X_LDX(BPF_H, X_R5, X_R2, 10),
+	X_STX(BPF_H, X_FP, X_R5, -4),
+	X_LDX(BPF_H, X_R5, X_R2, 16),
+	X_STX(BPF_H, X_FP, X_R5, -2),
+	X_LD_MAP(X_R1),
+	X_MOV_REG(X_R2, X_FP),
+	X_ADD_IMM(X_R2, -8),
+	X_CALL(BPF_FUNC_map_lookup_elem),
+	X_JMP_IMM(BPF_JEQ, X_R0, 0, X_PASS),
+	X_MOV_REG(X_R9, X_R0),
+
+	/* The call clobbered the packet pointers */
+	X_LDX(BPF_W, X_R2, X_R6, XDP_MD_DATA),
+	X_LDX(BPF_W, X_R3, X_R6, XDP_MD_DATA_END),
+	X_MOV_REG(X_R4, X_R2),
+	X_ADD_IMM(X_R4, HDR_SIZE),
+	X_JMP_REG(BPF_JGT, X_R4, X_R3, X_PASS),
+
+	/* Must be addressed to us */
+	X_LDX(BPF_W, X_R4, X_R2, 0),
+	X_LDX(BPF_W, X_R5, X_R9, offsetof(XdpValue, inMac)),
+	X_JMP_REG(BPF_JNE, X_R4, X_R5, X_PASS),
+	X_LDX(BPF_H, X_R4, X_R2, 4),
+	X_LDX(BPF_H, X_R5, X_R9, offsetof(XdpValue, inMac) + 4),
+	X_JMP_REG(BPF_JNE, X_R4, X_R5, X_PASS),
+
+	/* Rewrite for the other side */
+	X_LDX(BPF_W, X_R4, X_R9, offsetof(XdpValue, dstMac)),
+	X_STX(BPF_W, X_R2, X_R4, 0),
+	X_LDX(BPF_H, X_R4, X_R9, offsetof(XdpValue, dstMac) + 4),
+	X_STX(BPF_H, X_R2, X_R4, 4),
+	X_LDX(BPF_H, X_R4, X_R9, offsetof(XdpValue, srcMac)),
+	X_STX(BPF_H, X_R2, X_R4, 6),
+	X_LDX(BPF_W, X_R4, X_R9, offsetof(XdpValue, srcMac) + 2),
+	X_STX(BPF_W, X_R2, X_R4, 8),
+	X_LDX(BPF_H, X_R4, X_R9, offsetof(XdpValue, sesNum)),
+	X_STX(BPF_H, X_R2, X_R4, 16),
+
+	/* Count it; r7 is still the frame length */
+	X_MOV_IMM(X_R4, 1),
+	X_XADD(BPF_DW, X_R9, X_R4, offsetof(XdpValue, packets)),
+	X_XADD(BPF_DW, X_R9, X_R7, offsetof(XdpValue, bytes)),
+
+	X_CALL(BPF_FUNC_ktime_get_ns),
+	X_STX(BPF_DW, X_R9, X_R0, offsetof(XdpValue, lastSeen)),
+
+	X_LDX(BPF_W, X_R1, X_R9, offsetof(XdpValue, ifindex)),
+	X_MOV_IMM(X_R2, 0),
+	X_CALL(BPF_FUNC_redirect),
+	X_EXIT(),
+
+	/* X_PASS lands here */
+	X_MOV_IMM(X_R0, XDP_PASS),
+	X_EXIT()
+    };
+    int n = sizeof(prog) / sizeof(prog[0]);
+    union bpf_attr attr;
+    int i, fd;
+
+    for (i=0; i<n; i++) {
+	if (prog[i].code == (BPF_LD | BPF_DW | BPF_IMM)) {
+	    prog[i].imm = XdpMap;
+	    i++;
+	} else if (BPF_CLASS(prog[i].code) == BPF_JMP &&
+		   prog[i].off == X_PASS) {
+	    prog[i].off = (n - 2) - (i + 1);
+	}
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t) prog;
+    attr.insn_cnt = n;
+    attr.license = (uintptr_t) "GPL";
+    attr.log_buf = (uintptr_t) log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    fd = xdpSys(BPF_PROG_LOAD, &attr);
+    if (fd < 0) {
+	syslog(LOG_ERR, "XDP program rejected: %s", log);
+	fatalSys("bpf(BPF_PROG_LOAD)");
+    }
+    return fd;
 }
 
 /**********************************************************************
-*%FUNCTION: rp_fatal
+*%FUNCTION: xdpAttach
 *%ARGUMENTS:
-* str -- error message
+* prog -- XDP program
+* idx -- index in Interfaces[]
+* flags -- XDP_FLAGS_DRV_MODE or XDP_FLAGS_SKB_MODE
 *%RETURNS:
-* Nothing
+* 0 on success, -1 on failure
 *%DESCRIPTION:
-* Prints a message to stderr and syslog and exits.
+* Attaches prog to an interface with a BPF link.  The link (and so the
+* program) goes away when the last relay process holding it exits.
 ***********************************************************************/
-void
-rp_fatal(char const *str)
+static int
+xdpAttach(int prog, int idx, unsigned int flags)
 {
-    printErr(str);
-    exit(EXIT_FAILURE);
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog;
+    attr.link_create.target_ifindex = XdpIfindex[idx];
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = flags;
+    return (xdpSys(BPF_LINK_CREATE, &attr) < 0) ? -1 : 0;
 }
 
 /**********************************************************************
-*%FUNCTION: relayLoop
+*%FUNCTION: xdpStart
 *%ARGUMENTS:
 * None
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Runs the relay loop.  This function never returns
+* Creates the session map, loads the fast-path program and attaches it
+* to every relay interface, natively or in generic (skb) mode as -x
+* asked.  Exits on failure, since -x was asked for.
 ***********************************************************************/
-void
-relayLoop()
+static void
+xdpStart(void)
 {
-    fd_set readable, readableCopy;
-    int maxFD;
-    int i, r;
-    int sock;
+    union bpf_attr attr;
+    struct ifreq ifr;
+    int prog, i;
 
-    /* Build the select set */
-    FD_ZERO(&readable);
-    maxFD = 0;
+    XdpIfindex = calloc(NumInterfaces, sizeof(unsigned int));
+    if (!XdpIfindex) {
+	rp_fatal("Unable to allocate memory for interface indexes");
+    }
     for (i=0; i<NumInterfaces; i++) {
-	sock = Interfaces[i].discoverySock;
-	if (sock > maxFD) maxFD = sock;
-	FD_SET(sock, &readable);
-	sock = Interfaces[i].sessionSock;
-	if (sock > maxFD) maxFD = sock;
-	FD_SET(sock, &readable);
-	if (CleanPipe[0] > maxFD) maxFD = CleanPipe[0];
-	FD_SET(CleanPipe[0], &readable);
-    }
-    maxFD++;
-    for(;;) {
-	readableCopy = readable;
-	for(;;) {
-	    r = select(maxFD, &readableCopy, NULL, NULL, NULL);
-	    if (r >= 0 || errno != EINTR) break;
-	}
-	if (r < 0) {
-	    sysErr("select (relayLoop)");
-	    continue;
+	memset(&ifr, 0, sizeof(ifr));
+	memcpy(ifr.ifr_name, Interfaces[i].name, IFNAMSIZ);
+	if (ioctl(Interfaces[i].discoverySock, SIOCGIFINDEX, &ifr) < 0) {
+	    fatalSys("ioctl(SIOCGIFINDEX)");
 	}
+	XdpIfindex[i] = ifr.ifr_ifindex;
+    }
 
-	/* Handle session packets first */
-	for (i=0; i<NumInterfaces; i++) {
-	    if (FD_ISSET(Interfaces[i].sessionSock, &readableCopy)) {
-		relayGotSessionPacket(&Interfaces[i]);
-	    }
-	}
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_HASH;
+    attr.key_size = sizeof(XdpKey);
+    attr.value_size = sizeof(XdpValue);
+    attr.max_entries = MaxSessions * 2;
+    XdpMap = xdpSys(BPF_MAP_CREATE, &attr);
+    if (XdpMap < 0) fatalSys("bpf(BPF_MAP_CREATE)");
 
-	/* Now handle discovery packets */
-	for (i=0; i<NumInterfaces; i++) {
-	    if (FD_ISSET(Interfaces[i].discoverySock, &readableCopy)) {
-		relayGotDiscoveryPacket(&Interfaces[i]);
-	    }
+    prog = xdpLoad();
+    for (i=0; i<NumInterfaces; i++) {
+	if (XdpMode != XDP_MODE_GENERIC &&
+	    xdpAttach(prog, i, XDP_FLAGS_DRV_MODE) == 0) {
+	    syslog(LOG_INFO, "XDP fast path on %s (native)",
+		   Interfaces[i].name);
+	    continue;
 	}
-
-	/* Handle the session-cleaning process */
-	if (FD_ISSET(CleanPipe[0], &readableCopy)) {
-	    char dummy;
-	    CleanCounter = 0;
-	    read(CleanPipe[0], &dummy, 1);
-	    if (IdleTimeout) cleanSessions();
+	if (XdpMode != XDP_MODE_NATIVE &&
+	    xdpAttach(prog, i, XDP_FLAGS_SKB_MODE) == 0) {
+	    syslog(LOG_INFO, "XDP fast path on %s (generic)",
+		   Interfaces[i].name);
+	    continue;
 	}
+	fatalSys("bpf(BPF_LINK_CREATE)");
     }
+    close(prog);
 }
 
 /**********************************************************************
-*%FUNCTION: relayGotDiscoveryPacket
+*%FUNCTION: xdpPut
 *%ARGUMENTS:
-* iface -- interface on which packet is waiting
+* from -- hash entry for frames arriving
+* to -- hash entry for the other side
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Receives and processes a discovery packet.
+* Adds the map entry forwarding from's frames to "to"
 ***********************************************************************/
-void
-relayGotDiscoveryPacket(PPPoEInterface const *iface)
+static void
+xdpPut(SessionHash const *from, SessionHash const *to)
 {
-    PPPoEPacket packet;
-    int size;
-
-    if (receivePacket(iface->discoverySock, &packet, &size) < 0) {
-	return;
-    }
-    /* Ignore unknown code/version */
-    if (packet.ver != 1 || packet.type != 1) {
-	return;
-    }
-
-    /* Validate length */
-    if (ntohs(packet.length) + HDR_SIZE > size) {
-	syslog(LOG_ERR, "Bogus PPPoE length field (%u)",
-	       (unsigned int) ntohs(packet.length));
-	return;
+    union bpf_attr attr;
+    XdpKey key;
+    XdpValue value;
+
+    memset(&key, 0, sizeof(key));
+    memcpy(key.mac, from->peerMac, ETH_ALEN);
+    key.sesNum = from->sesNum;
+
+    memset(&value, 0, sizeof(value));
+    memcpy(value.inMac, from->interface->mac, ETH_ALEN);
+    value.sesNum = to->sesNum;
+    memcpy(value.dstMac, to->peerMac, ETH_ALEN);
+    memcpy(value.srcMac, to->interface->mac, ETH_ALEN);
+    value.ifindex = XdpIfindex[to->interface - Interfaces];
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = XdpMap;
+    attr.key = (uintptr_t) &key;
+    attr.value = (uintptr_t) &value;
+    attr.flags = BPF_ANY;
+    if (xdpSys(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+	/* The relay still forwards the frames itself */
+	sysErr("bpf(BPF_MAP_UPDATE_ELEM)");
     }
+}
 
-    /* Drop Ethernet frame padding */
-    if (size > ntohs(packet.length) + HDR_SIZE) {
-	size = ntohs(packet.length) + HDR_SIZE;
-    }
+/**********************************************************************
+*%FUNCTION: xdpAddSession
+*%ARGUMENTS:
+* ses -- a new session
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Lets the kernel forward ses's frames in both directions
+***********************************************************************/
+static void
+xdpAddSession(PPPoESession const *ses)
+{
+    xdpPut(ses->acHash, ses->acHash->peer);
+    xdpPut(ses->acHash->peer, ses->acHash);
+}
 
-    switch(packet.code) {
-    case CODE_PADT:
-	relayHandlePADT(iface, &packet, size);
-	break;
-    case CODE_PADI:
-	relayHandlePADI(iface, &packet, size);
-	break;
-    case CODE_PADO:
-	relayHandlePADO(iface, &packet, size);
-	break;
-    case CODE_PADR:
-	relayHandlePADR(iface, &packet, size);
-	break;
-    case CODE_PADS:
-	relayHandlePADS(iface, &packet, size);
-	break;
-    default:
-	syslog(LOG_ERR, "Discovery packet on %s with unknown code %d",
-	       iface->name, (int) packet.code);
-    }
+/**********************************************************************
+*%FUNCTION: xdpEntry
+*%ARGUMENTS:
+* cmd -- BPF_MAP_LOOKUP_ELEM or BPF_MAP_DELETE_ELEM
+* sh -- a session hash entry
+* value -- for a lookup, filled in with sh's map entry
+*%RETURNS:
+* 0 if the entry was found, -1 otherwise
+***********************************************************************/
+static int
+xdpEntry(int cmd, SessionHash const *sh, XdpValue *value)
+{
+    union bpf_attr attr;
+    XdpKey key;
+
+    memset(&key, 0, sizeof(key));
+    memcpy(key.mac, sh->peerMac, ETH_ALEN);
+    key.sesNum = sh->sesNum;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = XdpMap;
+    attr.key = (uintptr_t) &key;
+    attr.value = (uintptr_t) value;
+    return (xdpSys(cmd, &attr) < 0) ? -1 : 0;
 }
 
 /**********************************************************************
-*%FUNCTION: relayGotSessionPacket
+*%FUNCTION: xdpDelSession
 *%ARGUMENTS:
-* iface -- interface on which packet is waiting
+* ses -- a session being freed
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Receives and processes a session packet.
+* Stops the kernel forwarding ses's frames
 ***********************************************************************/
-void
-relayGotSessionPacket(PPPoEInterface const *iface)
+static void
+xdpDelSession(PPPoESession const *ses)
 {
-    PPPoEPacket packet;
-    int size;
-    SessionHash *sh;
-    PPPoESession *ses;
+    xdpEntry(BPF_MAP_DELETE_ELEM, ses->acHash, NULL);
+    xdpEntry(BPF_MAP_DELETE_ELEM, ses->acHash->peer, NULL);
+}
 
-    if (receivePacket(iface->sessionSock, &packet, &size) < 0) {
-	return;
-    }
+/**********************************************************************
+*%FUNCTION: xdpSeen
+*%ARGUMENTS:
+* ses -- a session that looks idle
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Brings ses->epoch up to date with the last frame the kernel forwarded
+* for it in either direction.  Called only when the idle wheel finds a
+* session that looks idle, so busy sessions cost one lookup pair per
+* IdleTimeout.
+***********************************************************************/
+static void
+xdpSeen(PPPoESession *ses)
+{
+    XdpValue ac, cli;
+    uint64_t last = 0;
+    struct timespec now;
+    unsigned int ago;
 
-    /* Ignore unknown code/version */
-    if (packet.ver != 1 || packet.type != 1) {
-	return;
+    if (xdpEntry(BPF_MAP_LOOKUP_ELEM, ses->acHash, &ac) == 0) {
+	last = ac.lastSeen;
     }
-
-    /* Must be a session packet */
-    if (packet.code != CODE_SESS) {
-	syslog(LOG_ERR, "Session packet with code %d", (int) packet.code);
-	return;
+    if (xdpEntry(BPF_MAP_LOOKUP_ELEM, ses->acHash->peer, &cli) == 0 &&
+	cli.lastSeen > last) {
+	last = cli.lastSeen;
     }
+    if (!last || clock_gettime(CLOCK_MONOTONIC, &now) < 0) return;
 
-    /* Ignore session packets whose destination address isn't ours */
-    if (memcmp(packet.ethHdr.h_dest, iface->mac, ETH_ALEN)) {
-	return;
-    }
+    ago = (unsigned int)
+	(((uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec - last) /
+	 1000000000ULL);
+    if (ago < Epoch - ses->epoch) ses->epoch = Epoch - ago;
+}
 
-    /* Validate length */
-    if (ntohs(packet.length) + HDR_SIZE > size) {
-	syslog(LOG_ERR, "Bogus PPPoE length field (%u)",
-	       (unsigned int) ntohs(packet.length));
-	return;
-    }
+/**********************************************************************
+*%FUNCTION: xdpCount
+*%ARGUMENTS:
+* ses -- an open session
+* count -- counts to add the kernel's to, indexed by direction
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Adds the frames and bytes the kernel has forwarded for ses
+***********************************************************************/
+static void
+xdpCount(PPPoESession const *ses, RelayCount count[2])
+{
+    XdpValue value;
 
-    /* Drop Ethernet frame padding */
-    if (size > ntohs(packet.length) + HDR_SIZE) {
-	size = ntohs(packet.length) + HDR_SIZE;
+    if (xdpEntry(BPF_MAP_LOOKUP_ELEM, ses->acHash, &value) == 0) {
+	count[FROM_AC].packets += value.packets;
+	count[FROM_AC].bytes += value.bytes;
     }
-
-    /* We're in business!  Find the hash */
-    sh = findSession(packet.ethHdr.h_source, packet.session);
-    if (!sh) {
-	/* Don't log this.  Someone could be running the client and the
-	   relay on the same box. */
-	return;
+    if (xdpEntry(BPF_MAP_LOOKUP_ELEM, ses->acHash->peer, &value) == 0) {
+	count[FROM_CLIENT].packets += value.packets;
+	count[FROM_CLIENT].bytes += value.bytes;
     }
-
-    /* Relay it */
-    ses = sh->ses;
-    ses->epoch = Epoch;
-    sh = sh->peer;
-    packet.session = sh->sesNum;
-    memcpy(packet.ethHdr.h_source, sh->interface->mac, ETH_ALEN);
-    memcpy(packet.ethHdr.h_dest, sh->peerMac, ETH_ALEN);
-#if 0
-    fprintf(stderr, "Relaying %02x:%02x:%02x:%02x:%02x:%02x(%s:%d) to %02x:%02x:%02x:%02x:%02x:%02x(%s:%d)\n",
-	    sh->peer->peerMac[0], sh->peer->peerMac[1], sh->peer->peerMac[2],
-	    sh->peer->peerMac[3], sh->peer->peerMac[4], sh->peer->peerMac[5],
-	    sh->peer->interface->name, ntohs(sh->peer->sesNum),
-	    sh->peerMac[0], sh->peerMac[1], sh->peerMac[2],
-	    sh->peerMac[3], sh->peerMac[4], sh->peerMac[5],
-	    sh->interface->name, ntohs(sh->sesNum));
+}
 #endif
-    sendPacket(NULL, sh->interface->sessionSock, &packet, size);
+
+/**********************************************************************
+*%FUNCTION: relayVlanOK
+*%ARGUMENTS:
+* iface -- interface named in a Relay-Session-Id tag
+* vlan -- VLAN named with it
+*%RETURNS:
+* True if the peer can be on that VLAN of iface
+***********************************************************************/
+static int
+relayVlanOK(PPPoEInterface const *iface, UINT16_t vlan)
+{
+    return !vlan || (iface->trunk && !(vlan & ~VLAN_VID_MASK));
 }
 
 /**********************************************************************
 *%FUNCTION: relayHandlePADT
 *%ARGUMENTS:
 * iface -- interface on which packet was received
+* vlan -- VLAN it arrived on, if iface is a trunk; else 0
 * packet -- the PADT packet
 *%RETURNS:
 * Nothing
@@ -952,6 +2902,7 @@ relayGotSessionPacket(PPPoEInterface const *iface)
 ***********************************************************************/
 void
 relayHandlePADT(PPPoEInterface const *iface,
+		UINT16_t vlan,
 		PPPoEPacket *packet,
 		int size)
 {
@@ -964,7 +2915,7 @@ relayHandlePADT(PPPoEInterface const *iface,
     }
 
     sh = findSession(packet->ethHdr.h_source, packet->session);
-    if (!sh) {
+    if (!sh || sh->vlan != vlan) {
 	return;
     }
     /* Relay the PADT to the peer */
@@ -973,7 +2924,7 @@ relayHandlePADT(PPPoEInterface const *iface,
     packet->session = sh->sesNum;
     memcpy(packet->ethHdr.h_source, sh->interface->mac, ETH_ALEN);
     memcpy(packet->ethHdr.h_dest, sh->peerMac, ETH_ALEN);
-    sendPacket(NULL, sh->interface->sessionSock, packet, size);
+    sendPacketVlan(NULL, sh->interface->discoverySock, packet, size, sh->vlan);
 
     /* Destroy the session */
     freeSession(ses, "Received PADT");
@@ -983,7 +2934,10 @@ relayHandlePADT(PPPoEInterface const *iface,
 *%FUNCTION: relayHandlePADI
 *%ARGUMENTS:
 * iface -- interface on which packet was received
+* vlan -- VLAN it arrived on, if iface is a trunk; else 0
 * packet -- the PADI packet
+* tags -- index of the packet's tags
+* size -- size of the packet
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
@@ -991,12 +2945,14 @@ relayHandlePADT(PPPoEInterface const *iface,
 ***********************************************************************/
 void
 relayHandlePADI(PPPoEInterface const *iface,
+		UINT16_t vlan,
 		PPPoEPacket *packet,
+		PPPoETagIndex const *tags,
 		int size)
 {
     PPPoETag tag;
-    unsigned char *loc;
-    int i, r;
+    struct iovec pieces[2];
+    int i;
 
     int ifIndex;
 
@@ -1045,16 +3001,17 @@ relayHandlePADI(PPPoEInterface const *iface,
     /* Get array index of interface */
     ifIndex = iface - Interfaces;
 
-    loc = findTag(packet, TAG_RELAY_SESSION_ID, &tag);
-    if (!loc) {
-	tag.type = htons(TAG_RELAY_SESSION_ID);
-	tag.length = htons(MY_RELAY_TAG_LEN);
-	memcpy(tag.payload, &ifIndex, sizeof(ifIndex));
-	memcpy(tag.payload+sizeof(ifIndex), packet->ethHdr.h_source, ETH_ALEN);
-	/* Add a relay tag if there's room */
-	r = addTag(packet, &tag);
-	if (r < 0) return;
-	size += r;
+    if (!lookupTag(tags, TAG_RELAY_SESSION_ID)) {
+	/* Add a relay tag, as the first tag, if there's room */
+	if (ntohs(packet->length) + TAG_HDR_SIZE + MY_RELAY_TAG_LEN >
+	    MAX_PPPOE_PAYLOAD) {
+	    return;
+	}
+	relayTag(&tag, ifIndex, packet->ethHdr.h_source, vlan);
+	pieces[0].iov_base = &tag;
+	pieces[0].iov_len = TAG_HDR_SIZE + MY_RELAY_TAG_LEN;
+	pieces[1].iov_base = packet->payload;
+	pieces[1].iov_len = ntohs(packet->length);
     } else {
 	/* We do not re-use relay-id tags.  Drop the frame.  The RFC says the
 	   relay agent SHOULD return a Generic-Error tag, but this does not
@@ -1067,8 +3024,8 @@ relayHandlePADI(PPPoEInterface const *iface,
     for (i=0; i < NumInterfaces; i++) {
 	if (iface == &Interfaces[i]) continue;
 	if (!Interfaces[i].acOK) continue;
-	memcpy(packet->ethHdr.h_source, Interfaces[i].mac, ETH_ALEN);
-	sendPacket(NULL, Interfaces[i].discoverySock, packet, size);
+	relaySendPieces(&Interfaces[i], 0, packet->ethHdr.h_dest, packet,
+			pieces, 2);
     }
 
 }
@@ -1078,6 +3035,8 @@ relayHandlePADI(PPPoEInterface const *iface,
 *%ARGUMENTS:
 * iface -- interface on which packet was received
 * packet -- the PADO packet
+* tags -- index of the packet's tags
+* size -- size of the packet
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
@@ -1086,12 +3045,16 @@ relayHandlePADI(PPPoEInterface const *iface,
 void
 relayHandlePADO(PPPoEInterface const *iface,
 		PPPoEPacket *packet,
+		PPPoETagIndex const *tags,
 		int size)
 {
+    PPPoETagRef const *ref;
     PPPoETag tag;
+    struct iovec pieces[RELAY_PIECES];
     unsigned char *loc;
     int ifIndex;
     int acIndex;
+    UINT16_t vlan;
 
     /* Can a server legally be behind this interface? */
     if (!iface->acOK) {
@@ -1129,8 +3092,8 @@ relayHandlePADO(PPPoEInterface const *iface,
     }
 
     /* Find relay tag */
-    loc = findTag(packet, TAG_RELAY_SESSION_ID, &tag);
-    if (!loc) {
+    ref = lookupTag(tags, TAG_RELAY_SESSION_ID);
+    if (!ref) {
 	syslog(LOG_ERR,
 	       "PADO packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s does not have Relay-Session-Id tag",
 	       packet->ethHdr.h_source[0],
@@ -1144,7 +3107,7 @@ relayHandlePADO(PPPoEInterface const *iface,
     }
 
     /* If it's the wrong length, ignore it */
-    if (ntohs(tag.length) != MY_RELAY_TAG_LEN) {
+    if (ref->length != MY_RELAY_TAG_LEN) {
 	syslog(LOG_ERR,
 	       "PADO packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s does not have correct length Relay-Session-Id tag",
 	       packet->ethHdr.h_source[0],
@@ -1157,12 +3120,15 @@ relayHandlePADO(PPPoEInterface const *iface,
 	return;
     }
 
-    /* Extract interface index */
-    memcpy(&ifIndex, tag.payload, sizeof(ifIndex));
+    /* Extract interface index and VLAN */
+    loc = TAG_REF_HDR(tags, ref);
+    memcpy(&ifIndex, loc + TAG_HDR_SIZE, sizeof(ifIndex));
+    memcpy(&vlan, loc + TAG_HDR_SIZE + MY_RELAY_TAG_VLAN, sizeof(vlan));
 
     if (ifIndex < 0 || ifIndex >= NumInterfaces ||
 	!Interfaces[ifIndex].clientOK ||
-	iface == &Interfaces[ifIndex]) {
+	iface == &Interfaces[ifIndex] ||
+	!relayVlanOK(&Interfaces[ifIndex], vlan)) {
 	syslog(LOG_ERR,
 	       "PADO packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s has invalid interface in Relay-Session-Id tag",
 	       packet->ethHdr.h_source[0],
@@ -1175,25 +3141,22 @@ relayHandlePADO(PPPoEInterface const *iface,
 	return;
     }
 
-    /* Replace Relay-ID tag with opposite-direction tag */
-    memcpy(loc+TAG_HDR_SIZE, &acIndex, sizeof(acIndex));
-    memcpy(loc+TAG_HDR_SIZE+sizeof(ifIndex), packet->ethHdr.h_source, ETH_ALEN);
-
-    /* Set destination address to MAC address in relay ID */
-    memcpy(packet->ethHdr.h_dest, tag.payload + sizeof(ifIndex), ETH_ALEN);
-
-    /* Set source address to MAC address of interface */
-    memcpy(packet->ethHdr.h_source, Interfaces[ifIndex].mac, ETH_ALEN);
-
-    /* Send the PADO to the proper client */
-    sendPacket(NULL, Interfaces[ifIndex].discoverySock, packet, size);
+    /* Replace Relay-ID tag with opposite-direction tag and send the
+       PADO to the proper client, at the MAC address in the relay ID */
+    relayTag(&tag, acIndex, packet->ethHdr.h_source, 0);
+    relaySendPieces(&Interfaces[ifIndex], vlan,
+		    loc + TAG_HDR_SIZE + sizeof(ifIndex), packet,
+		    pieces, relayPieces(packet, loc, &tag, pieces));
 }
 
 /**********************************************************************
 *%FUNCTION: relayHandlePADR
 *%ARGUMENTS:
 * iface -- interface on which packet was received
+* vlan -- VLAN it arrived on, if iface is a trunk; else 0
 * packet -- the PADR packet
+* tags -- index of the packet's tags
+* size -- size of the packet
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
@@ -1201,13 +3164,18 @@ relayHandlePADO(PPPoEInterface const *iface,
 ***********************************************************************/
 void
 relayHandlePADR(PPPoEInterface const *iface,
+		UINT16_t vlan,
 		PPPoEPacket *packet,
+		PPPoETagIndex const *tags,
 		int size)
 {
+    PPPoETagRef const *ref;
     PPPoETag tag;
+    struct iovec pieces[RELAY_PIECES];
     unsigned char *loc;
     int ifIndex;
     int cliIndex;
+    UINT16_t acVlan;
 
     /* Can a client legally be behind this interface? */
     if (!iface->clientOK) {
@@ -1245,8 +3213,8 @@ relayHandlePADR(PPPoEInterface const *iface,
     }
 
     /* Find relay tag */
-    loc = findTag(packet, TAG_RELAY_SESSION_ID, &tag);
-    if (!loc) {
+    ref = lookupTag(tags, TAG_RELAY_SESSION_ID);
+    if (!ref) {
 	syslog(LOG_ERR,
 	       "PADR packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s does not have Relay-Session-Id tag",
 	       packet->ethHdr.h_source[0],
@@ -1260,7 +3228,7 @@ relayHandlePADR(PPPoEInterface const *iface,
     }
 
     /* If it's the wrong length, ignore it */
-    if (ntohs(tag.length) != MY_RELAY_TAG_LEN) {
+    if (ref->length != MY_RELAY_TAG_LEN) {
 	syslog(LOG_ERR,
 	       "PADR packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s does not have correct length Relay-Session-Id tag",
 	       packet->ethHdr.h_source[0],
@@ -1273,12 +3241,15 @@ relayHandlePADR(PPPoEInterface const *iface,
 	return;
     }
 
-    /* Extract interface index */
-    memcpy(&ifIndex, tag.payload, sizeof(ifIndex));
+    /* Extract interface index and VLAN */
+    loc = TAG_REF_HDR(tags, ref);
+    memcpy(&ifIndex, loc + TAG_HDR_SIZE, sizeof(ifIndex));
+    memcpy(&acVlan, loc + TAG_HDR_SIZE + MY_RELAY_TAG_VLAN, sizeof(acVlan));
 
     if (ifIndex < 0 || ifIndex >= NumInterfaces ||
 	!Interfaces[ifIndex].acOK ||
-	iface == &Interfaces[ifIndex]) {
+	iface == &Interfaces[ifIndex] ||
+	!relayVlanOK(&Interfaces[ifIndex], acVlan)) {
 	syslog(LOG_ERR,
 	       "PADR packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s has invalid interface in Relay-Session-Id tag",
 	       packet->ethHdr.h_source[0],
@@ -1291,18 +3262,13 @@ relayHandlePADR(PPPoEInterface const *iface,
 	return;
     }
 
-    /* Replace Relay-ID tag with opposite-direction tag */
-    memcpy(loc+TAG_HDR_SIZE, &cliIndex, sizeof(cliIndex));
-    memcpy(loc+TAG_HDR_SIZE+sizeof(ifIndex), packet->ethHdr.h_source, ETH_ALEN);
-
-    /* Set destination address to MAC address in relay ID */
-    memcpy(packet->ethHdr.h_dest, tag.payload + sizeof(ifIndex), ETH_ALEN);
-
-    /* Set source address to MAC address of interface */
-    memcpy(packet->ethHdr.h_source, Interfaces[ifIndex].mac, ETH_ALEN);
-
-    /* Send the PADR to the proper access concentrator */
-    sendPacket(NULL, Interfaces[ifIndex].discoverySock, packet, size);
+    /* Replace Relay-ID tag with opposite-direction tag and send the
+       PADR to the proper access concentrator, at the MAC address in the
+       relay ID */
+    relayTag(&tag, cliIndex, packet->ethHdr.h_source, vlan);
+    relaySendPieces(&Interfaces[ifIndex], acVlan,
+		    loc + TAG_HDR_SIZE + sizeof(ifIndex), packet,
+		    pieces, relayPieces(packet, loc, &tag, pieces));
 }
 
 /**********************************************************************
@@ -1310,6 +3276,8 @@ relayHandlePADR(PPPoEInterface const *iface,
 *%ARGUMENTS:
 * iface -- interface on which packet was received
 * packet -- the PADS packet
+* tags -- index of the packet's tags
+* size -- size of the packet
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
@@ -1318,11 +3286,14 @@ relayHandlePADR(PPPoEInterface const *iface,
 void
 relayHandlePADS(PPPoEInterface const *iface,
 		PPPoEPacket *packet,
+		PPPoETagIndex const *tags,
 		int size)
 {
-    PPPoETag tag;
+    PPPoETagRef const *ref;
+    struct iovec pieces[RELAY_PIECES];
     unsigned char *loc;
     int ifIndex;
+    UINT16_t vlan;
 
     PPPoESession *ses = NULL;
     SessionHash *sh;
@@ -1361,8 +3332,8 @@ relayHandlePADS(PPPoEInterface const *iface,
     }
 
     /* Find relay tag */
-    loc = findTag(packet, TAG_RELAY_SESSION_ID, &tag);
-    if (!loc) {
+    ref = lookupTag(tags, TAG_RELAY_SESSION_ID);
+    if (!ref) {
 	syslog(LOG_ERR,
 	       "PADS packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s does not have Relay-Session-Id tag",
 	       packet->ethHdr.h_source[0],
@@ -1376,7 +3347,7 @@ relayHandlePADS(PPPoEInterface const *iface,
     }
 
     /* If it's the wrong length, ignore it */
-    if (ntohs(tag.length) != MY_RELAY_TAG_LEN) {
+    if (ref->length != MY_RELAY_TAG_LEN) {
 	syslog(LOG_ERR,
 	       "PADS packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s does not have correct length Relay-Session-Id tag",
 	       packet->ethHdr.h_source[0],
@@ -1389,12 +3360,15 @@ relayHandlePADS(PPPoEInterface const *iface,
 	return;
     }
 
-    /* Extract interface index */
-    memcpy(&ifIndex, tag.payload, sizeof(ifIndex));
+    /* Extract interface index and VLAN */
+    loc = TAG_REF_HDR(tags, ref);
+    memcpy(&ifIndex, loc + TAG_HDR_SIZE, sizeof(ifIndex));
+    memcpy(&vlan, loc + TAG_HDR_SIZE + MY_RELAY_TAG_VLAN, sizeof(vlan));
 
     if (ifIndex < 0 || ifIndex >= NumInterfaces ||
 	!Interfaces[ifIndex].clientOK ||
-	iface == &Interfaces[ifIndex]) {
+	iface == &Interfaces[ifIndex] ||
+	!relayVlanOK(&Interfaces[ifIndex], vlan)) {
 	syslog(LOG_ERR,
 	       "PADS packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s has invalid interface in Relay-Session-Id tag",
 	       packet->ethHdr.h_source[0],
@@ -1424,21 +3398,19 @@ relayHandlePADS(PPPoEInterface const *iface,
 	    /* Create a new session */
 	    ses = createSession(iface, &Interfaces[ifIndex],
 				packet->ethHdr.h_source,
-				loc + TAG_HDR_SIZE + sizeof(ifIndex), packet->session);
+				loc + TAG_HDR_SIZE + sizeof(ifIndex), packet->session,
+				vlan);
 	    if (!ses) {
 		/* Can't allocate session -- send error PADS to client and
 		   PADT to server */
-		PPPoETag hostUniq, *hu;
-		if (findTag(packet, TAG_HOST_UNIQ, &hostUniq)) {
-		    hu = &hostUniq;
-		} else {
-		    hu = NULL;
-		}
-		relaySendError(CODE_PADS, htons(0), &Interfaces[ifIndex],
+		PPPoETagRef const *hu = lookupTag(tags, TAG_HOST_UNIQ);
+		relaySendError(CODE_PADS, htons(0), &Interfaces[ifIndex], vlan,
 			       loc + TAG_HDR_SIZE + sizeof(ifIndex),
-			       hu, "RP-PPPoE: Relay: Unable to allocate session");
-		relaySendError(CODE_PADT, packet->session, iface,
-			       packet->ethHdr.h_source, NULL,
+			       hu ? TAG_REF_HDR(tags, hu) : NULL,
+			       hu ? hu->length + TAG_HDR_SIZE : 0,
+			       "RP-PPPoE: Relay: Unable to allocate session");
+		relaySendError(CODE_PADT, packet->session, iface, 0,
+			       packet->ethHdr.h_source, NULL, 0,
 			       "RP-PPPoE: Relay: Unable to allocate session");
 		return;
 	    }
@@ -1447,18 +3419,11 @@ relayHandlePADS(PPPoEInterface const *iface,
 	packet->session = ses->sesNum;
     }
 
-    /* Remove relay-ID tag */
-    removeBytes(packet, loc, MY_RELAY_TAG_LEN + TAG_HDR_SIZE);
-    size -= (MY_RELAY_TAG_LEN + TAG_HDR_SIZE);
-
-    /* Set destination address to MAC address in relay ID */
-    memcpy(packet->ethHdr.h_dest, tag.payload + sizeof(ifIndex), ETH_ALEN);
-
-    /* Set source address to MAC address of interface */
-    memcpy(packet->ethHdr.h_source, Interfaces[ifIndex].mac, ETH_ALEN);
-
-    /* Send the PADS to the proper client */
-    sendPacket(NULL, Interfaces[ifIndex].discoverySock, packet, size);
+    /* Remove relay-ID tag and send the PADS to the proper client, at the
+       MAC address in the relay ID */
+    relaySendPieces(&Interfaces[ifIndex], vlan,
+		    loc + TAG_HDR_SIZE + sizeof(ifIndex), packet,
+		    pieces, relayPieces(packet, loc, NULL, pieces));
 }
 
 /**********************************************************************
@@ -1467,8 +3432,11 @@ relayHandlePADS(PPPoEInterface const *iface,
 * code -- PPPoE packet code (PADS or PADT, typically)
 * session -- PPPoE session number
 * iface -- interface on which to send frame
+* vlan -- VLAN to send it on, if iface is a trunk; else 0
 * mac -- Ethernet address to which frame should be sent
-* hostUniq -- if non-NULL, a hostUniq tag to add to error frame
+* hostUniq -- if non-NULL, a Host-Uniq tag (header included) to add to
+*             error frame
+* hostUniqLen -- length of that tag
 * errMsg -- error message to insert into Generic-Error tag.
 *%RETURNS:
 * Nothing
@@ -1480,8 +3448,10 @@ void
 relaySendError(unsigned char code,
 	       UINT16_t session,
 	       PPPoEInterface const *iface,
+	       UINT16_t vlan,
 	       unsigned char const *mac,
-	       PPPoETag const *hostUniq,
+	       unsigned char const *hostUniq,
+	       int hostUniqLen,
 	       char const *errMsg)
 {
     PPPoEPacket packet;
@@ -1497,38 +3467,66 @@ relaySendError(unsigned char code,
     packet.session = session;
     packet.length = htons(0);
     if (hostUniq) {
-	if (addTag(&packet, hostUniq) < 0) return;
+	if (insertBytes(&packet, packet.payload, hostUniq, hostUniqLen) < 0) return;
     }
     errTag.type = htons(TAG_GENERIC_ERROR);
     errTag.length = htons(strlen(errMsg));
     strcpy((char *) errTag.payload, errMsg);
     if (addTag(&packet, &errTag) < 0) return;
     size = ntohs(packet.length) + HDR_SIZE;
-    if (code == CODE_PADT) {
-	sendPacket(NULL, iface->discoverySock, &packet, size);
-    } else {
-	sendPacket(NULL, iface->sessionSock, &packet, size);
+    sendPacketVlan(NULL, iface->discoverySock, &packet, size, vlan);
+}
+
+/**********************************************************************
+*%FUNCTION: idleFile
+*%ARGUMENTS:
+* ses -- a session not on the idle wheel
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Puts ses in the wheel slot of the second at which it will have been
+* idle for more than IdleTimeout, judging by its epoch now.  The slot is
+* always one the cleaner has yet to reach.
+***********************************************************************/
+void
+idleFile(PPPoESession *ses)
+{
+    unsigned int deadline = ses->epoch + IdleTimeout + 1;
+    unsigned int slot;
+
+    if ((int) (deadline - IdleTick) <= 0) {
+	deadline = IdleTick + 1;
+    } else if (deadline - IdleTick >= IdleWheelSize) {
+	deadline = IdleTick + IdleWheelSize - 1;
     }
+    slot = deadline % IdleWheelSize;
+
+    ses->idleSlot = (UINT16_t) slot;
+    ses->prev = NULL;
+    ses->next = IdleWheel[slot];
+    if (ses->next) ses->next->prev = ses;
+    IdleWheel[slot] = ses;
 }
 
 /**********************************************************************
-*%FUNCTION: alarmHandler
+*%FUNCTION: idleUnfile
 *%ARGUMENTS:
-* sig -- signal number
+* ses -- a session on the idle wheel
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* SIGALRM handler.  Increments Epoch; if necessary, writes a byte of
-* data to the alarm pipe to trigger the stale-session cleaner.
+* Takes ses off the idle wheel
 ***********************************************************************/
 void
-alarmHandler(int sig)
+idleUnfile(PPPoESession *ses)
 {
-    alarm(1);
-    Epoch++;
-    CleanCounter++;
-    if (CleanCounter == CleanPeriod) {
-	write(CleanPipe[1], "", 1);
+    if (ses->prev) {
+	ses->prev->next = ses->next;
+    } else {
+	IdleWheel[ses->idleSlot] = ses->next;
+    }
+    if (ses->next) {
+	ses->next->prev = ses->prev;
     }
 }
 
@@ -1539,27 +3537,42 @@ alarmHandler(int sig)
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Goes through active sessions and cleans sessions idle for longer
-* than IdleTimeout seconds.
+* Advances the idle wheel up to Epoch.  Sessions in the slots passed
+* that have been idle for longer than IdleTimeout seconds are cleaned;
+* the rest are re-filed.  Sessions whose slot has not come up are not
+* looked at.
 ***********************************************************************/
 void cleanSessions(void)
 {
-    PPPoESession *cur, *next;
-    cur = ActiveSessions;
-    while(cur) {
-	next = cur->next;
-	if (Epoch - cur->epoch > IdleTimeout) {
-	    /* Send PADT to each peer */
-	    relaySendError(CODE_PADT, cur->acHash->sesNum,
-			   cur->acHash->interface,
-			   cur->acHash->peerMac, NULL,
-			   "RP-PPPoE: Relay: Session exceeded idle timeout");
-	    relaySendError(CODE_PADT, cur->clientHash->sesNum,
-			   cur->clientHash->interface,
-			   cur->clientHash->peerMac, NULL,
-			   "RP-PPPoE: Relay: Session exceeded idle timeout");
-	    freeSession(cur, "Idle Timeout");
+    PPPoESession *cur;
+    unsigned int slot;
+
+    while (IdleTick != Epoch) {
+	IdleTick++;
+	slot = IdleTick % IdleWheelSize;
+
+	/* Sessions are never re-filed in the slot being emptied */
+	while((cur = IdleWheel[slot]) != NULL) {
+#ifdef RELAY_XDP
+	    /* Frames forwarded in the kernel leave their mark in the map */
+	    if (UseXdp && Epoch - cur->epoch > IdleTimeout) xdpSeen(cur);
+#endif
+	    if (Epoch - cur->epoch > IdleTimeout) {
+		/* Send PADT to each peer */
+		relaySendError(CODE_PADT, cur->acHash->sesNum,
+			       cur->acHash->interface, cur->acHash->vlan,
+			       cur->acHash->peerMac, NULL, 0,
+			       "RP-PPPoE: Relay: Session exceeded idle timeout");
+		relaySendError(CODE_PADT, cur->acHash->peer->sesNum,
+			       cur->acHash->peer->interface,
+			       cur->acHash->peer->vlan,
+			       cur->acHash->peer->peerMac, NULL, 0,
+			       "RP-PPPoE: Relay: Session exceeded idle timeout");
+		freeSession(cur, "Idle Timeout");
+	    } else {
+		idleUnfile(cur);
+		idleFile(cur);
+	    }
 	}
-	cur = next;
     }
 }
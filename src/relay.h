@@ -16,6 +16,22 @@
 ***********************************************************************/
 
 #include "pppoe.h"
+#include "hash.h"
+
+/* Session frames are relayed in batches of up to this many per
+   recvmmsg/sendmmsg where those exist (Linux), while they are queueing
+   up.  Otherwise they are relayed one per wakeup, with a recvmmsg every
+   RELAY_BATCH_PROBE wakeups to notice a queue building. */
+#if defined(HAVE_STRUCT_SOCKADDR_LL) && defined(MSG_WAITFORONE)
+#define RELAY_BATCH_SIZE 32
+#define RELAY_BATCH_PROBE 16
+#endif
+
+/* Frames and bytes relayed */
+typedef struct {
+    uint64_t packets;
+    uint64_t bytes;
+} RelayCount;
 
 /* Description for each active Ethernet interface */
 typedef struct InterfaceStruct {
@@ -24,76 +40,97 @@ typedef struct InterfaceStruct {
     int sessionSock;		/* Socket for session frames */
     int clientOK;		/* Client requests allowed (PADI, PADR) */
     int acOK;			/* AC replies allowed (PADO, PADS) */
+    int trunk;			/* Clients on every VLAN of it (-V) */
     unsigned char mac[ETH_ALEN]; /* MAC address */
+    int rxBacklog;		/* Last recvmmsg got more than one frame */
+    int rxProbe;		/* Single-frame wakeups since last recvmmsg */
+    RelayCount rxClosed;	/* Relayed from here by closed sessions */
+    RelayCount txClosed;	/* Relayed to here by closed sessions */
 } PPPoEInterface;
 
-/* Session state for relay */
+/* Directions of a session, indexing its counters */
+#define FROM_AC 0
+#define FROM_CLIENT 1
+
+/* Session state for relay.  The counters share a cache line with
+   epoch, which relaying a frame writes anyway; on 64-bit hosts the
+   structure is exactly one line.  The client's hash bucket is not kept
+   here, as it is always acHash->peer. */
 struct SessionHashStruct;
 typedef struct SessionStruct {
-    struct SessionStruct *next;	/* Free list link */
-    struct SessionStruct *prev;	/* Free list link */
+    struct SessionStruct *next;	/* Free list or idle wheel link */
+    struct SessionStruct *prev;	/* Idle wheel link */
     struct SessionHashStruct *acHash; /* Hash bucket for AC MAC/Session */
-    struct SessionHashStruct *clientHash; /* Hash bucket for client MAC/Session */
     unsigned int epoch;		/* Epoch when last activity was seen */
     UINT16_t sesNum;		/* Session number assigned by relay */
+    UINT16_t idleSlot;		/* Slot on the idle wheel */
+    uint64_t packets[2];	/* Frames relayed, by direction */
+    uint64_t bytes[2];		/* Bytes relayed, by direction */
 } PPPoESession;
 
 /* Hash table entry to find sessions */
 typedef struct SessionHashStruct {
-    struct SessionHashStruct *next; /* Link in hash chain */
-    struct SessionHashStruct *prev; /* Link in hash chain */
+    struct SessionHashStruct *next; /* Free list link */
     struct SessionHashStruct *peer; /* Peer for this session */
     PPPoEInterface const *interface;	/* Interface */
     unsigned char peerMac[ETH_ALEN]; /* Peer's MAC address */
     UINT16_t sesNum;		/* Session number */
     PPPoESession *ses;		/* Session data */
+    int dir;			/* FROM_AC or FROM_CLIENT, for frames
+				   from this peer */
+    UINT16_t vlan;		/* Peer's VLAN on a trunk; else 0 */
 } SessionHash;
 
 /* Function prototypes */
 
 void relayGotSessionPacket(PPPoEInterface const *i);
+#ifdef RELAY_BATCH_SIZE
+void relayGotSessionBatch(PPPoEInterface const *i);
+#endif
 void relayGotDiscoveryPacket(PPPoEInterface const *i);
 PPPoEInterface *findInterface(int sock);
-unsigned int hash(unsigned char const *mac, UINT16_t sesNum);
+uint64_t sessionKey(unsigned char const *mac, UINT16_t sesNum);
 SessionHash *findSession(unsigned char const *mac, UINT16_t sesNum);
 void deleteHash(SessionHash *hash);
 PPPoESession *createSession(PPPoEInterface const *ac,
 			    PPPoEInterface const *cli,
 			    unsigned char const *acMac,
 			    unsigned char const *cliMac,
-			    UINT16_t acSes);
+			    UINT16_t acSes,
+			    UINT16_t cliVlan);
 void freeSession(PPPoESession *ses, char const *msg);
-void addInterface(char const *ifname, int clientOK, int acOK);
+void addInterface(char const *ifname, int clientOK, int acOK, int trunk);
 void usage(char const *progname);
 void initRelay(int nsess);
 void relayLoop(void);
 void addHash(SessionHash *sh);
 void unhash(SessionHash *sh);
 
-void relayHandlePADT(PPPoEInterface const *iface, PPPoEPacket *packet, int size);
-void relayHandlePADI(PPPoEInterface const *iface, PPPoEPacket *packet, int size);
-void relayHandlePADO(PPPoEInterface const *iface, PPPoEPacket *packet, int size);
-void relayHandlePADR(PPPoEInterface const *iface, PPPoEPacket *packet, int size);
-void relayHandlePADS(PPPoEInterface const *iface, PPPoEPacket *packet, int size);
+void relayHandlePADT(PPPoEInterface const *iface, UINT16_t vlan,
+		     PPPoEPacket *packet, int size);
+void relayHandlePADI(PPPoEInterface const *iface, UINT16_t vlan,
+		     PPPoEPacket *packet, PPPoETagIndex const *tags, int size);
+void relayHandlePADO(PPPoEInterface const *iface, PPPoEPacket *packet,
+		     PPPoETagIndex const *tags, int size);
+void relayHandlePADR(PPPoEInterface const *iface, UINT16_t vlan,
+		     PPPoEPacket *packet, PPPoETagIndex const *tags, int size);
+void relayHandlePADS(PPPoEInterface const *iface, PPPoEPacket *packet,
+		     PPPoETagIndex const *tags, int size);
 
 int addTag(PPPoEPacket *packet, PPPoETag const *tag);
 int insertBytes(PPPoEPacket *packet, unsigned char *loc,
 		void const *bytes, int length);
-int removeBytes(PPPoEPacket *packet, unsigned char *loc,
-		int length);
 void relaySendError(unsigned char code,
 		    UINT16_t session,
 		    PPPoEInterface const *iface,
+		    UINT16_t vlan,
 		    unsigned char const *mac,
-		    PPPoETag const *hostUniq,
+		    unsigned char const *hostUniq,
+		    int hostUniqLen,
 		    char const *errMsg);
 
-void alarmHandler(int sig);
 void cleanSessions(void);
+void idleFile(PPPoESession *ses);
+void idleUnfile(PPPoESession *ses);
 
-#define MAX_INTERFACES 8
 #define DEFAULT_SESSIONS 5000
-
-/* Hash table size -- a prime number; gives load factor of around 6
-   for 65534 sessions */
-#define HASHTAB_SIZE 18917